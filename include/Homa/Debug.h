@@ -128,6 +128,22 @@ FILE* setLogFile(FILE* newFile);
 std::function<void(DebugMessage)> setLogHandler(
     std::function<void(DebugMessage)> newHandler);
 
+/**
+ * Enable or disable asynchronous logging.
+ *
+ * While enabled, threads that emit log messages only deposit the message's
+ * format string and arguments in a per-thread ring; a background thread
+ * formats and writes them.  This keeps logging off the latency-critical
+ * paths (a burst of NOTICEs in a packet handler no longer stalls the poll
+ * loop on formatting and a flushed write), at the cost of messages being
+ * written a little later and being dropped (with an accounting message) if
+ * a burst overruns a ring.
+ *
+ * Disabling asynchronous logging writes out any queued messages and stops
+ * the background thread.  Asynchronous logging is disabled by default.
+ */
+void setAsyncLogging(bool enabled);
+
 /**
  * Return the current log policy (as set by a previous call to setLogPolicy).
  * Note that this may be empty, indicating that the default level of NOTICE is
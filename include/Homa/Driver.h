@@ -83,6 +83,18 @@ struct PacketSpec {
 
     /// Number of bytes in the payload.
     int32_t length;
+
+    /// Optional pointer to an externally-owned buffer whose contents logically
+    /// follow the first _length_ bytes of _payload_ on the wire; nullptr if
+    /// this Packet carries no external data.  The buffer is owned by whoever
+    /// set this field and must remain valid and unmodified until the Packet is
+    /// released back to the Driver.  Drivers that support gather transmission
+    /// (e.g. external mbuf segments) can DMA directly from this buffer;
+    /// others copy it into the outgoing frame during sendPacket().
+    const void* extData;
+
+    /// Number of bytes in the external buffer; 0 if extData is nullptr.
+    int32_t extLength;
 } __attribute__((packed));
 static_assert(std::is_trivial<PacketSpec>());
 
@@ -109,6 +121,26 @@ class Driver {
      */
     virtual Packet* allocPacket() = 0;
 
+    /**
+     * Allocate multiple Packet objects from the Driver's pool of resources.
+     * Equivalent to numPackets calls to allocPacket() but allows Drivers
+     * with bulk pool support to amortize the per-packet allocation cost.
+     * The caller must eventually release every returned packet; see
+     * releasePackets().
+     *
+     * @param numPackets
+     *      Number of Packet objects to allocate.
+     * @param[out] packets
+     *      The allocated Packet objects are stored in this array, which must
+     *      have room for numPackets entries.
+     */
+    virtual void allocPackets(uint16_t numPackets, Packet* packets[])
+    {
+        for (uint16_t i = 0; i < numPackets; ++i) {
+            packets[i] = allocPacket();
+        }
+    }
+
     /**
      * Send a packet over the network.
      *
@@ -142,6 +174,35 @@ class Driver {
     virtual void sendPacket(Packet* packet, IpAddress destination,
                             int priority) = 0;
 
+    /**
+     * Send a burst of packets to a single destination over the network.
+     *
+     * Logically equivalent to calling sendPacket() once per packet, but lets
+     * the Driver hand the whole burst to the NIC in one batch instead of
+     * paying the per-packet transmit bookkeeping for each packet; Drivers
+     * with no batching support inherit the per-packet loop.
+     *
+     * The notes on sendPacket() about asynchrony, immutability, resends, and
+     * ownership apply to each packet in the burst.
+     *
+     * @param numPackets
+     *      Number of packets to be sent.
+     * @param packets
+     *      Array of the packets to be sent; must hold numPackets entries.
+     * @param destination
+     *      IP address of the destination of every packet in the burst.
+     * @param priority
+     *      Network priority at which every packet in the burst should be
+     *      sent (see sendPacket()).
+     */
+    virtual void sendPackets(uint16_t numPackets, Packet* packets[],
+                             IpAddress destination, int priority)
+    {
+        for (uint16_t i = 0; i < numPackets; ++i) {
+            sendPacket(packets[i], destination, priority);
+        }
+    }
+
     /**
      * Request that the Driver enter the "corked" mode where outbound packets
      * are queued instead of immediately sent so that they can be more
@@ -186,6 +247,78 @@ class Driver {
                                     Packet* receivedPackets[],
                                     IpAddress sourceAddresses[]) = 0;
 
+    /**
+     * Check to see if any packets have arrived on a particular receive
+     * queue.
+     *
+     * Behaves like receivePackets() but only checks the given receive queue
+     * for Drivers that provide more than one (see getRxQueueCount()).  Used
+     * by callers that each poll their own queue so that receive processing
+     * scales across cores without shared state.  The default implementation
+     * ignores the queue id and checks the Driver's only queue.
+     *
+     * @param maxPackets
+     *      The maximum number of Packet objects that should be returned by
+     *      this method.
+     * @param[out] receivedPackets
+     *      Received packets are appended to this array in order of arrival.
+     * @param[out] sourceAddresses
+     *      Source IP addresses of the received packets are appended to this
+     *      array in order of arrival.
+     * @param rxQueueId
+     *      The receive queue to check; must be in the range
+     *      [0, getRxQueueCount()).
+     *
+     * @return
+     *      Number of Packet objects being returned.
+     *
+     * @sa Driver::releasePackets()
+     */
+    virtual uint32_t receivePackets(uint32_t maxPackets,
+                                    Packet* receivedPackets[],
+                                    IpAddress sourceAddresses[], int rxQueueId)
+    {
+        (void)rxQueueId;
+        return receivePackets(maxPackets, receivedPackets, sourceAddresses);
+    }
+
+    /**
+     * Return the number of independent receive queues this Driver provides.
+     * Queue ids [0, getRxQueueCount()) may be passed to receivePackets().
+     */
+    virtual int getRxQueueCount()
+    {
+        return 1;
+    }
+
+    /**
+     * Block the calling thread until a packet may be available on the given
+     * receive queue or until roughly maxWaitMicros have elapsed.
+     *
+     * Used by transports that back off from busy polling when idle.  Drivers
+     * that can sleep on a hardware receive event (e.g. RX interrupts) should
+     * override this method.  The default implementation does not wait and
+     * reports no support, in which case the caller simply keeps polling.
+     *
+     * This method may wake up spuriously; the caller must recheck for
+     * packets with receivePackets() after every return.
+     *
+     * @param rxQueueId
+     *      The receive queue to wait on; must be in the range
+     *      [0, getRxQueueCount()).
+     * @param maxWaitMicros
+     *      Upper bound on the time to wait, in microseconds.
+     * @return
+     *      True if the Driver waited for a receive event (or one was already
+     *      pending); false if the Driver does not support waiting.
+     */
+    virtual bool waitForPackets(int rxQueueId, uint64_t maxWaitMicros)
+    {
+        (void)rxQueueId;
+        (void)maxWaitMicros;
+        return false;
+    }
+
     /**
      * Release a collection of Packet objects back to the Driver. Every
      * Packet allocated using allocPacket() or received using
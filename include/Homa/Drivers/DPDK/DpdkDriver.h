@@ -30,9 +30,13 @@ namespace DPDK {
  *
  * This class is thread-safe.
  *
+ * Declared final so the compiler can devirtualize and inline packet
+ * operations into the transport's hot loops when the concrete driver type is
+ * known (e.g. under link-time optimization; see HOMA_ENABLE_IPO).
+ *
  * @sa Driver
  */
-class DpdkDriver : public Driver {
+class DpdkDriver final : public Driver {
   public:
     /**
      * Provides optional configuration information for the DpdkDriver instance.
@@ -44,6 +48,50 @@ class DpdkDriver : public Driver {
         ///   -1 indicates that no override should occur and Driver's default
         ///   value should be used.
         int HIGHEST_PACKET_PRIORITY_OVERRIDE = -1;
+
+        /// Do not enable NIC IPv4 checksum offloads even when the hardware
+        /// supports them; checksums are then computed and verified in
+        /// software.  Intended for debugging NICs with broken offload
+        /// implementations.
+        ///
+        /// Default:
+        ///   false; offloads are used whenever the NIC advertises them.
+        bool DISABLE_CHECKSUM_OFFLOADS = false;
+
+        /// Allocate the driver's DPDK memory (the packet buffer mempool and
+        /// the loopback ring) on this NUMA socket.  On multi-socket hosts
+        /// this should be the socket of the cores that will poll the
+        /// transport, so packet buffers are never accessed across the
+        /// interconnect.
+        ///
+        /// Default:
+        ///   -1 indicates that the socket of the thread constructing the
+        ///   driver should be used.
+        int NUMA_SOCKET_ID = -1;
+
+        /// Configure the NIC's receive queues to raise interrupts so that
+        /// waitForPackets() can put an idle polling thread to sleep until
+        /// traffic resumes (see Transport::setAdaptivePolling()).  Not all
+        /// PMDs support receive interrupts; if the NIC rejects the
+        /// configuration, driver construction fails.
+        ///
+        /// Default:
+        ///   false; receive queues are poll-only and waitForPackets()
+        ///   reports no support.
+        bool ENABLE_RX_INTERRUPTS = false;
+
+        /// Reconcile the driver's NIC queue estimate against the NIC's
+        /// per-queue transmit counters.  The estimate normally drains at
+        /// the configured link bandwidth, which overestimates drain (and
+        /// lets the transport overfill the NIC) whenever the link runs
+        /// slower than configured, e.g. under Ethernet pause frames.
+        /// Requires a PMD that maintains per-queue transmit stats; if the
+        /// counters turn out not to advance, the driver falls back to the
+        /// purely bandwidth-based estimate.
+        ///
+        /// Default:
+        ///   false; the queue estimate is purely bandwidth-based.
+        bool RECONCILE_TX_COMPLETIONS = false;
     };
 
     /**
@@ -121,10 +169,17 @@ class DpdkDriver : public Driver {
     /// See Driver::allocPacket()
     virtual Packet* allocPacket();
 
+    /// See Driver::allocPackets()
+    virtual void allocPackets(uint16_t numPackets, Packet* packets[]);
+
     /// See Driver::sendPacket()
     virtual void sendPacket(Packet* packet, IpAddress destination,
                             int priority);
 
+    /// See Driver::sendPackets()
+    virtual void sendPackets(uint16_t numPackets, Packet* packets[],
+                             IpAddress destination, int priority);
+
     /// See Driver::cork()
     virtual void cork();
 
@@ -136,6 +191,18 @@ class DpdkDriver : public Driver {
                                     Packet* receivedPackets[],
                                     IpAddress sourceAddresses[]);
 
+    /// See Driver::receivePackets()
+    virtual uint32_t receivePackets(uint32_t maxPackets,
+                                    Packet* receivedPackets[],
+                                    IpAddress sourceAddresses[],
+                                    int rxQueueId);
+
+    /// See Driver::getRxQueueCount()
+    virtual int getRxQueueCount();
+
+    /// See Driver::waitForPackets()
+    virtual bool waitForPackets(int rxQueueId, uint64_t maxWaitMicros);
+
     /// See Driver::releasePackets()
     virtual void releasePackets(Packet* packets[], uint16_t numPackets);
 
@@ -19,10 +19,9 @@
 #include <Homa/Driver.h>
 #include <Homa/Drivers/Util/QueueEstimator.h>
 
-#include <array>
+#include <cassert>
 #include <chrono>
-#include <deque>
-#include <mutex>
+#include <cstring>
 
 namespace Homa {
 namespace Drivers {
@@ -43,6 +42,37 @@ namespace FakeNetworkConfig {
  * of 0.5 will drop the packets half the time.
  */
 void setPacketLossRate(double lossRate);
+
+/**
+ * Configure the bandwidth of every link in the FakeNetwork.
+ *
+ * Packets arriving at an endpoint faster than its inbound link can carry
+ * them queue behind one another (and are dropped once the endpoint's queue
+ * overflows), so incast and scheduling behavior can be simulated.
+ *
+ * @param bandwidthMbps
+ *      Link bandwidth in Mbits/second.
+ */
+void setLinkBandwidth(uint32_t bandwidthMbps);
+
+/**
+ * Configure the one-way propagation delay of the FakeNetwork.
+ *
+ * @param delayUs
+ *      Time a packet spends in flight, in microseconds, in addition to any
+ *      serialization delay on the destination's inbound link.
+ */
+void setPropagationDelay(uint32_t delayUs);
+
+/**
+ * Configure the FakeNetwork to reorder packets at the specified rate.
+ *
+ * A reordered packet is held back and delivered after the next packet sent
+ * to the same endpoint at the same priority, transposing the two on the
+ * wire.  E.g. setting a rate of 0.1 will transpose roughly every tenth
+ * packet with its successor.
+ */
+void setPacketReorderRate(double reorderRate);
 }  // namespace FakeNetworkConfig
 
 /**
@@ -61,38 +91,49 @@ struct FakePacket {
     /// Source IpAddress of the packet.
     IpAddress sourceIp;
 
+    /// Time at which this packet finishes traversing the fake network and
+    /// becomes visible to the receiving driver (in nanoseconds on the
+    /// steady_clock timeline); set by the FakeNetwork when the packet is
+    /// sent.
+    uint64_t arrivalTimeNs;
+
     /**
      * FakePacket constructor.
      */
     explicit FakePacket()
-        : base{.payload = buf, .length = 0}
+        : base{.payload = buf, .length = 0, .extData = nullptr, .extLength = 0}
         , buf()
         , sourceIp()
+        , arrivalTimeNs(0)
     {}
 
     /**
-     * Copy constructor.
+     * Copy constructor.  Materializes any external data region of the source
+     * packet into this packet's own buffer, as a NIC's gather DMA would.
      */
     FakePacket(const FakePacket& other)
-        : base{.payload = buf, .length = other.base.length}
+        : base{.payload = buf,
+               .length = other.base.length,
+               .extData = nullptr,
+               .extLength = 0}
         , buf()
         , sourceIp()
+        , arrivalTimeNs(0)
     {
         memcpy(base.payload, other.base.payload, MAX_PAYLOAD_SIZE);
+        if (other.base.extData != nullptr) {
+            assert(other.base.length + other.base.extLength <=
+                   static_cast<int32_t>(MAX_PAYLOAD_SIZE));
+            memcpy(buf + other.base.length, other.base.extData,
+                   other.base.extLength);
+            base.length += other.base.extLength;
+        }
     }
 };
 
-/// Holds the incoming packets for a particular driver.
-struct FakeNIC {
-    /// Monitor lock for the FakeNIC structure.
-    std::mutex mutex;
-
-    /// A set of incoming packets queued by priority.
-    std::array<std::deque<FakePacket*>, NUM_PRIORITIES> priorityQueue;
-
-    FakeNIC();
-    ~FakeNIC();
-};
+/// Holds the incoming packets for a particular driver; defined in
+/// FakeDriver.cc so that the lock-free queue implementation stays internal.
+struct FakeNIC;
 
 /**
  * A fake driver that sends and receives datagrams using a fake network.
@@ -100,8 +141,18 @@ struct FakeNIC {
  * Used in tests to allow multiple instances of Homa::Transport to send and
  * receive datagrams without actually using the network.  Instances of
  * Homa::Transport must be as part of a single process for FakeDriver to work.
+ *
+ * The fake network is lock-free on the packet path and models per-endpoint
+ * link bandwidth, propagation delay, packet loss, and packet reordering (see
+ * FakeNetworkConfig),
+ * so hundreds of simulated transports can exchange packets at high rates
+ * within one process.
+ *
+ * Declared final so the compiler can devirtualize and inline packet
+ * operations into the transport's hot loops when the concrete driver type is
+ * known (e.g. under link-time optimization; see HOMA_ENABLE_IPO).
  */
-class FakeDriver : public Driver {
+class FakeDriver final : public Driver {
   public:
     FakeDriver();
     /**
@@ -126,8 +177,10 @@ class FakeDriver : public Driver {
     /// Identifier for this driver on the fake network.
     uint32_t localAddressId;
 
-    /// Holds the incoming packets for this driver.
-    FakeNIC nic;
+    /// Holds the incoming packets for this driver; owned by the fake
+    /// network, which keeps endpoint state alive across re-registration so
+    /// that in-flight senders never touch freed memory.
+    FakeNIC* nic;
 
     /// Tracks the size of the NIC's transmit queue.
     Util::QueueEstimator<std::chrono::steady_clock> queueEstimator;
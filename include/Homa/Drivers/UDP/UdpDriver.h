@@ -0,0 +1,142 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_INCLUDE_HOMA_DRIVERS_UDP_UDPDRIVER_H
+#define HOMA_INCLUDE_HOMA_DRIVERS_UDP_UDPDRIVER_H
+
+#include <Homa/Driver.h>
+
+#include <memory>
+
+namespace Homa {
+namespace Drivers {
+namespace UDP {
+
+/**
+ * A Driver that carries Homa packets in plain UDP datagrams through the
+ * kernel network stack.
+ *
+ * UdpDriver exists so that Homa can run in environments without DPDK (lab
+ * machines, CI, developer laptops); it trades throughput for portability,
+ * needing nothing beyond a POSIX socket.  To keep the syscall cost from
+ * dominating, sends and receives go through sendmmsg()/recvmmsg() in
+ * driver-level batches, the socket is configured for busy polling, and
+ * packet buffers come from a pre-sized pool.
+ *
+ * All Homa traffic uses a single well-known UDP port (see Config::PORT), so
+ * peers are identified by IP address alone, matching the Driver address
+ * model.
+ *
+ * This class is thread-safe.
+ *
+ * Declared final so the compiler can devirtualize and inline packet
+ * operations into the transport's hot loops when the concrete driver type is
+ * known (e.g. under link-time optimization; see HOMA_ENABLE_IPO).
+ *
+ * @sa Driver
+ */
+class UdpDriver final : public Driver {
+  public:
+    /**
+     * Provides optional configuration information for the UdpDriver instance.
+     */
+    struct Config {
+        /// Override and set the Driver's maximum packet priority to this
+        /// value.
+        ///
+        /// Default:
+        ///   -1 indicates that no override should occur and Driver's default
+        ///   value should be used.
+        int HIGHEST_PACKET_PRIORITY_OVERRIDE = -1;
+
+        /// The UDP port on which Homa traffic is sent and received; every
+        /// driver instance in the cluster must use the same port.
+        ///
+        /// Default:
+        ///   0 indicates that the driver's default port should be used.
+        uint16_t PORT = 0;
+    };
+
+    /**
+     * Construct a UdpDriver.
+     *
+     * @param ifname
+     *      Selects which network interface to use for communication.
+     * @param config
+     *      Optional configuration parameters (see Config).
+     * @throw DriverInitFailure
+     *      Thrown if UdpDriver fails to initialize for any reason.
+     */
+    explicit UdpDriver(const char* ifname, const Config* const config = nullptr);
+
+    /**
+     * UdpDriver Destructor.
+     */
+    virtual ~UdpDriver();
+
+    /// See Driver::allocPacket()
+    virtual Packet* allocPacket();
+
+    /// See Driver::sendPacket()
+    virtual void sendPacket(Packet* packet, IpAddress destination,
+                            int priority);
+
+    /// See Driver::cork()
+    virtual void cork();
+
+    /// See Driver::uncork()
+    virtual void uncork();
+
+    /// See Driver::receivePackets()
+    virtual uint32_t receivePackets(uint32_t maxPackets,
+                                    Packet* receivedPackets[],
+                                    IpAddress sourceAddresses[]);
+
+    /// See Driver::releasePackets()
+    virtual void releasePackets(Packet* packets[], uint16_t numPackets);
+
+    /// See Driver::getHighestPacketPriority()
+    virtual int getHighestPacketPriority();
+
+    /// See Driver::getMaxPayloadSize()
+    virtual uint32_t getMaxPayloadSize();
+
+    /// See Driver::getBandwidth()
+    virtual uint32_t getBandwidth();
+
+    /// See Driver::getLocalAddress()
+    virtual IpAddress getLocalAddress();
+
+    /// See Driver::getQueuedBytes();
+    virtual uint32_t getQueuedBytes();
+
+  private:
+    // Forward declaration of implementation class.
+    class Impl;
+
+    /// The actual implementation of the UdpDriver.  Hides the socket and
+    /// batching details from users of libUdpDriver.
+    std::unique_ptr<Impl> pImpl;
+
+    // Disable copy and assign
+    UdpDriver(const UdpDriver&) = delete;
+    UdpDriver& operator=(const UdpDriver&) = delete;
+};
+
+}  // namespace UDP
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_INCLUDE_HOMA_DRIVERS_UDP_UDPDRIVER_H
@@ -46,11 +46,21 @@ class QueueEstimator {
      *
      * @param bandwidth
      *      Bandwidth of the network, in Megabits per second.
+     * @param reconcileCompletions
+     *      If true, the estimator also tracks how many queued bytes the NIC
+     *      has confirmed transmitted (see signalBytesCompleted()) and never
+     *      estimates the queue below the unconfirmed remainder.  The
+     *      bandwidth-based model alone drains the estimate even when the
+     *      link has slowed down (e.g. under pause frames), which lets the
+     *      sender overfill the NIC.
      */
-    explicit QueueEstimator(uint32_t bandwidth)
+    explicit QueueEstimator(uint32_t bandwidth,
+                            bool reconcileCompletions = false)
         : bandwidth(static_cast<double>(bandwidth) * 1e06 / 8.0)
         , queuedBytes(0)
         , lastUpdateTime(Clock::now())
+        , reconcileCompletions(reconcileCompletions)
+        , unacknowledgedBytes(0)
     {}
 
     /**
@@ -60,6 +70,14 @@ class QueueEstimator {
     uint32_t getQueuedBytes()
     {
         refreshQueuedBytesEstimate();
+        if (reconcileCompletions && queuedBytes < unacknowledgedBytes) {
+            // The model has drained bytes whose transmission the NIC has
+            // not confirmed; the link must be running below the modeled
+            // bandwidth.  Hold the estimate at the unconfirmed remainder so
+            // the sender does not overfill the NIC.  (Lazily reported
+            // completions can make this bound conservative, never unsafe.)
+            return static_cast<uint32_t>(unacknowledgedBytes);
+        }
         return queuedBytes;
     }
 
@@ -74,6 +92,40 @@ class QueueEstimator {
     {
         refreshQueuedBytesEstimate();
         queuedBytes += sentBytes;
+        if (reconcileCompletions) {
+            unacknowledgedBytes += sentBytes;
+        }
+    }
+
+    /**
+     * Called when the NIC has confirmed transmission of previously queued
+     * bytes (e.g. by freeing their TX descriptors) so that this
+     * QueueEstimator can reconcile its estimate against ground truth.  Only
+     * meaningful when completion reconciliation is enabled.
+     *
+     * @param completedBytes
+     *      The number of queued bytes the NIC has confirmed transmitted.
+     */
+    void signalBytesCompleted(uint64_t completedBytes)
+    {
+        assert(reconcileCompletions);
+        unacknowledgedBytes -= (completedBytes < unacknowledgedBytes)
+                                   ? completedBytes
+                                   : unacknowledgedBytes;
+    }
+
+    /**
+     * Enable or disable completion reconciliation; see the constructor.
+     * Disabling discards any unconfirmed byte count, reverting to the purely
+     * bandwidth-based model (e.g. when the NIC turns out not to report
+     * completions).
+     */
+    void setReconcileCompletions(bool enabled)
+    {
+        reconcileCompletions = enabled;
+        if (!enabled) {
+            unacknowledgedBytes = 0;
+        }
     }
 
   private:
@@ -106,6 +158,15 @@ class QueueEstimator {
     /// The timestamp when the queuedBytes was last updated.
     std::chrono::time_point<Clock> lastUpdateTime;
 
+    /// True if the estimate is reconciled against NIC-confirmed
+    /// transmissions; see the constructor.
+    bool reconcileCompletions;
+
+    /// The number of bytes handed to the NIC whose transmission the NIC has
+    /// not yet confirmed.  Only maintained while reconcileCompletions is
+    /// set; serves as a floor for queuedBytes.
+    uint64_t unacknowledgedBytes;
+
     // DISALLOW_COPY_AND_ASSIGN
     QueueEstimator(const QueueEstimator&) = delete;
     QueueEstimator& operator=(const QueueEstimator&) = delete;
@@ -0,0 +1,140 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_INCLUDE_HOMA_DRIVERS_XDP_XDPDRIVER_H
+#define HOMA_INCLUDE_HOMA_DRIVERS_XDP_XDPDRIVER_H
+
+#include <Homa/Driver.h>
+
+#include <memory>
+
+namespace Homa {
+namespace Drivers {
+namespace XDP {
+
+/**
+ * A Driver that sends and receives packets through an AF_XDP socket bound to
+ * a regular kernel network interface.
+ *
+ * Unlike DpdkDriver, XdpDriver coexists with the kernel network stack: only
+ * traffic steered to the driver's interface queue is consumed, so the NIC
+ * does not have to be dedicated to Homa.  Packet buffers live in a
+ * pre-registered UMEM region which the kernel maps zero-copy where the NIC
+ * supports it (falling back to copy mode otherwise), and the socket is
+ * configured for busy polling so that receive latency does not depend on
+ * interrupts.
+ *
+ * This class is thread-safe.
+ *
+ * Declared final so the compiler can devirtualize and inline packet
+ * operations into the transport's hot loops when the concrete driver type is
+ * known (e.g. under link-time optimization; see HOMA_ENABLE_IPO).
+ *
+ * @sa Driver
+ */
+class XdpDriver final : public Driver {
+  public:
+    /**
+     * Provides optional configuration information for the XdpDriver instance.
+     */
+    struct Config {
+        /// Override and set the Driver's maximum packet priority to this
+        /// value.
+        ///
+        /// Default:
+        ///   -1 indicates that no override should occur and Driver's default
+        ///   value should be used.
+        int HIGHEST_PACKET_PRIORITY_OVERRIDE = -1;
+
+        /// The interface receive queue to which the AF_XDP socket is bound;
+        /// traffic must be steered to this queue (e.g. with ethtool flow
+        /// rules) for the driver to receive it.
+        ///
+        /// Default:
+        ///   Queue 0.
+        int QUEUE_ID = 0;
+    };
+
+    /**
+     * Construct an XdpDriver.
+     *
+     * @param ifname
+     *      Selects which network interface to use for communication.
+     * @param config
+     *      Optional configuration parameters (see Config).
+     * @throw DriverInitFailure
+     *      Thrown if XdpDriver fails to initialize for any reason.
+     */
+    explicit XdpDriver(const char* ifname, const Config* const config = nullptr);
+
+    /**
+     * XdpDriver Destructor.
+     */
+    virtual ~XdpDriver();
+
+    /// See Driver::allocPacket()
+    virtual Packet* allocPacket();
+
+    /// See Driver::sendPacket()
+    virtual void sendPacket(Packet* packet, IpAddress destination,
+                            int priority);
+
+    /// See Driver::cork()
+    virtual void cork();
+
+    /// See Driver::uncork()
+    virtual void uncork();
+
+    /// See Driver::receivePackets()
+    virtual uint32_t receivePackets(uint32_t maxPackets,
+                                    Packet* receivedPackets[],
+                                    IpAddress sourceAddresses[]);
+
+    /// See Driver::releasePackets()
+    virtual void releasePackets(Packet* packets[], uint16_t numPackets);
+
+    /// See Driver::getHighestPacketPriority()
+    virtual int getHighestPacketPriority();
+
+    /// See Driver::getMaxPayloadSize()
+    virtual uint32_t getMaxPayloadSize();
+
+    /// See Driver::getBandwidth()
+    virtual uint32_t getBandwidth();
+
+    /// See Driver::getLocalAddress()
+    virtual IpAddress getLocalAddress();
+
+    /// See Driver::getQueuedBytes();
+    virtual uint32_t getQueuedBytes();
+
+  private:
+    // Forward declaration of implementation class.
+    class Impl;
+
+    /// The actual implementation of the XdpDriver.  Hides the AF_XDP socket
+    /// and UMEM details from users of libXdpDriver.
+    std::unique_ptr<Impl> pImpl;
+
+    // Disable copy and assign
+    XdpDriver(const XdpDriver&) = delete;
+    XdpDriver& operator=(const XdpDriver&) = delete;
+};
+
+}  // namespace XDP
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_INCLUDE_HOMA_DRIVERS_XDP_XDPDRIVER_H
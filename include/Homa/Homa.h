@@ -28,6 +28,7 @@
 #include <atomic>
 #include <bitset>
 #include <cstdint>
+#include <functional>
 
 namespace Homa {
 
@@ -103,11 +104,83 @@ class InMessage {
     virtual size_t get(size_t offset, void* destination,
                        size_t count) const = 0;
 
+    /**
+     * A contiguous region of message payload that resides in a single
+     * underlying packet buffer.  The memory is owned by the message and
+     * remains valid until the message is released.
+     */
+    struct Iovec {
+        /// First byte of the region.
+        const void* base;
+
+        /// Number of bytes in the region.
+        size_t length;
+    };
+
+    /**
+     * Get the locations of a specified range of bytes in the Message without
+     * copying them; the requested range is described as a sequence of
+     * contiguous payload regions.
+     *
+     * @param offset
+     *      The number of bytes in the Message preceding the range of bytes
+     *      being requested.
+     * @param count
+     *      The number of bytes being requested.  The range is truncated if it
+     *      exceeds the range of bytes in the Message.
+     * @param[out] iov
+     *      Array to which the payload regions covering the requested range
+     *      are appended in order.
+     * @param maxIov
+     *      Maximum number of entries that can be stored in _iov_; if the
+     *      requested range spans more regions, only the first _maxIov_ are
+     *      returned.
+     *
+     * @return
+     *      The number of entries stored in _iov_.
+     */
+    virtual size_t getIov(size_t offset, size_t count, Iovec iov[],
+                          size_t maxIov) const = 0;
+
+    /**
+     * Return a pointer to the requested range of bytes if the entire range
+     * resides in a single underlying packet buffer; nullptr otherwise (the
+     * caller should fall back to get() or getIov()).  The memory is owned by
+     * the message and remains valid until the message is released.
+     *
+     * @param offset
+     *      The number of bytes in the Message preceding the range of bytes
+     *      being requested.
+     * @param count
+     *      The number of bytes being requested.
+     */
+    const void* borrowContiguous(size_t offset, size_t count) const
+    {
+        Iovec iov;
+        if (getIov(offset, count, &iov, 1) == 1 && iov.length == count) {
+            return iov.base;
+        }
+        return nullptr;
+    }
+
     /**
      * Return the number of bytes this Message contains.
      */
     virtual size_t length() const = 0;
 
+    /**
+     * Return the number of contiguous bytes at the beginning of the Message
+     * that have arrived and can be read.
+     *
+     * For messages delivered after being completely received this is always
+     * equal to length().  For messages delivered early in streaming mode (see
+     * Transport::setStreamingThreshold()) this watermark advances as
+     * contiguous packets land; the caller must not read past it.  The message
+     * has been completely received once readableBytes() == length(); if the
+     * transfer fails instead, dropped() will return true.
+     */
+    virtual size_t readableBytes() const = 0;
+
     /**
      * Remove a number of bytes from the beginning of the Message.
      *
@@ -158,6 +231,22 @@ class OutMessage {
         /// Message's receiver to ensure the receiver is still alive and the
         /// Message will not "timeout" due to receiver inactivity.
         NO_KEEP_ALIVE = 1 << 1,
+
+        /// The transport stops tracking the Message as soon as the last DATA
+        /// packet has been handed to the driver: the Message transitions to
+        /// SENT and no DONE confirmation, pings, or timeouts follow (implies
+        /// NO_KEEP_ALIVE).  The Message will never reach COMPLETED or FAILED;
+        /// intended for one-way traffic (e.g. telemetry) that does not need
+        /// completion notification.
+        NO_COMPLETION = 1 << 2,
+
+        /// The application is still producing this Message when send() is
+        /// called: transmission starts with the bytes appended so far and
+        /// overlaps with further append() calls, and the Message's length is
+        /// finalized by close().  Intended for large responses generated
+        /// incrementally (e.g. streamed from disk) so the first byte does not
+        /// wait for the last byte to be produced.
+        STREAM = 1 << 3,
     };
 
     /**
@@ -173,6 +262,9 @@ class OutMessage {
     /**
      * Copy an array of bytes to the end of the Message.
      *
+     * May also be called after send() for a message sent with
+     * Options::STREAM, until the message is closed (see close()).
+     *
      * @param source
      *      Address of the first byte of data to be copied to the end of the
      *      Message.
@@ -181,11 +273,48 @@ class OutMessage {
      */
     virtual void append(const void* source, size_t count) = 0;
 
+    /**
+     * Add an externally-owned array of bytes to the end of the Message without
+     * copying it; the transport will transmit directly from the provided
+     * buffer.
+     *
+     * The caller must keep the buffer valid and unmodified until the done
+     * callback is invoked; the callback is invoked exactly once, when the
+     * transport no longer needs the buffer (e.g. the Message completed, was
+     * canceled, or was released).
+     *
+     * Bytes added (by any method) after a call to this method must start on a
+     * packet boundary; in practice, external buffers should be appended last.
+     *
+     * @param source
+     *      Address of the first byte of the externally-owned buffer.
+     * @param count
+     *      Number of bytes in the buffer.
+     * @param done
+     *      Callback invoked when the transport is finished with the buffer;
+     *      nullptr if no notification is needed.
+     * @param arg
+     *      Argument passed verbatim to the done callback.
+     */
+    virtual void appendExternal(const void* source, size_t count,
+                                void (*done)(void* arg), void* arg) = 0;
+
     /**
      * Stop sending this message.
      */
     virtual void cancel() = 0;
 
+    /**
+     * Finalize the length of a message that was sent with Options::STREAM.
+     *
+     * After this call no more data may be appended; the message completes
+     * (or fails) like any other message once the receiver has the final
+     * length and all of its bytes.  Calling close() on a message that was
+     * not sent with Options::STREAM, or that is no longer IN_PROGRESS, has
+     * no effect.
+     */
+    virtual void close() = 0;
+
     /**
      * Return the current state of this message.
      */
@@ -212,6 +341,21 @@ class OutMessage {
      */
     virtual void prepend(const void* source, size_t count) = 0;
 
+    /**
+     * Return this message to the empty NOT_STARTED state so it can be filled
+     * and sent again, keeping the packet buffers it has already accumulated.
+     *
+     * Resetting avoids the release/alloc round trip when an application sends
+     * many messages of similar size back to back: the recycled message's
+     * buffers are reused in place by subsequent append() calls.  The message
+     * remains owned by the caller and must still be released eventually.
+     *
+     * A message may only be reset while it is quiescent; calling reset() on a
+     * message that is IN_PROGRESS, or that is SENT and still awaiting
+     * acknowledgment, has no effect.
+     */
+    virtual void reset() = 0;
+
     /**
      * Reserve a number of bytes at the beginning of the Message.
      *
@@ -232,6 +376,10 @@ class OutMessage {
     /**
      * Send this message to the destination.
      *
+     * Unless Options::STREAM is requested, the message's content must be
+     * complete before this call; appending to a message after a non-streamed
+     * send results in undefined behavior.
+     *
      * @param destination
      *      Network address to which this message will be sent.
      * @param options
@@ -248,6 +396,129 @@ class OutMessage {
     virtual void release() = 0;
 };
 
+/**
+ * A communication endpoint bound to a single port of a Transport.
+ *
+ * Inbound messages sent to the socket's port are routed to the socket as
+ * they complete, so each socket can poll for its own messages without
+ * filtering a queue it shares with the transport's other ports.  Sockets are
+ * created with Transport::open(); destroying the socket closes its port.
+ *
+ * This class is thread-safe, but see the Transport::open() note on
+ * destruction.
+ */
+class Socket {
+  public:
+    /**
+     * Socket destructor.  Closes the socket's port; messages sent to the
+     * port that have not been received through this socket become
+     * retrievable through Transport::receive().
+     */
+    virtual ~Socket() = default;
+
+    /**
+     * Allocate a Message that will be sent from this socket's port.
+     *
+     * @return
+     *      A pointer to the allocated message.
+     *
+     * @sa Transport::alloc()
+     */
+    virtual Homa::unique_ptr<Homa::OutMessage> alloc() = 0;
+
+    /**
+     * Check for and return a Message sent to this socket's port if available.
+     *
+     * @return
+     *      Pointer to the received message, if any.  Otherwise, nullptr is
+     *      returned if no message has been delivered.
+     */
+    virtual Homa::unique_ptr<Homa::InMessage> receive() = 0;
+
+    /**
+     * Return the port to which this socket is bound.
+     */
+    virtual uint16_t getPort() const = 0;
+};
+
+/**
+ * Coordinates the inbound grant budget across multiple Transport instances
+ * sharing a single NIC.
+ *
+ * Each transport's receiver independently grants up to a full scheduled
+ * window of inbound data per sender, so several transports on one host can
+ * oversubscribe the downlink by the sum of their windows.  Create one
+ * GrantCoordinator, attach it to every transport on the host (see
+ * Transport::setGrantCoordinator()), and the receivers will keep the
+ * host-wide sum of granted-but-unreceived scheduled bytes within the given
+ * budget, deferring grants while the budget is exhausted.
+ *
+ * The budget is a soft cap: a grant may overshoot it by up to one scheduled
+ * window, so progress never stalls when the budget is smaller than a single
+ * grant.
+ *
+ * This class is thread-safe.
+ */
+class GrantCoordinator {
+  public:
+    /**
+     * Construct a GrantCoordinator.
+     *
+     * @param budgetBytes
+     *      Host-wide bound on the aggregate number of granted-but-unreceived
+     *      scheduled bytes across all attached transports.
+     */
+    explicit GrantCoordinator(int64_t budgetBytes)
+        : budgetBytes(budgetBytes)
+        , outstandingBytes(0)
+    {}
+
+    /**
+     * Debit bytes from the budget if any budget remains.
+     *
+     * @param bytes
+     *      Number of additional bytes about to be granted.
+     * @return
+     *      True if the bytes were debited and the grant may proceed; false
+     *      if the budget is exhausted and the grant should be deferred.
+     */
+    bool tryAcquire(int64_t bytes)
+    {
+        int64_t outstanding = outstandingBytes.load(std::memory_order_relaxed);
+        do {
+            if (outstanding >= budgetBytes) {
+                return false;
+            }
+        } while (!outstandingBytes.compare_exchange_weak(
+            outstanding, outstanding + bytes, std::memory_order_relaxed));
+        return true;
+    }
+
+    /**
+     * Return bytes to the budget once previously granted bytes have been
+     * received (or their message has left the schedule).
+     *
+     * @param bytes
+     *      Number of previously acquired bytes no longer outstanding.
+     */
+    void release(int64_t bytes)
+    {
+        outstandingBytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+  private:
+    /// Bound on the aggregate granted-but-unreceived bytes; see constructor.
+    const int64_t budgetBytes;
+
+    /// Current aggregate number of granted-but-unreceived bytes across all
+    /// attached transports.
+    std::atomic<int64_t> outstandingBytes;
+
+    // Disable copy and assign
+    GrantCoordinator(const GrantCoordinator&) = delete;
+    GrantCoordinator& operator=(const GrantCoordinator&) = delete;
+};
+
 /**
  * Provides a means of communicating across the network using the Homa protocol.
  *
@@ -260,6 +531,21 @@ class OutMessage {
  */
 class Transport {
   public:
+    /**
+     * Execution modes for a transport instance.
+     */
+    enum class Mode {
+        /// The application drives the transport by calling poll() repeatedly
+        /// from a thread of its choosing; the transport creates no threads of
+        /// its own.  This is the default.
+        POLLED,
+        /// The transport spawns dedicated threads that pipeline its work: RX
+        /// dispatch, sender progress, receiver progress, and timeout checking
+        /// each run as a separate stage.  The application does not need to
+        /// call poll().
+        PIPELINED,
+    };
+
     /**
      * Return a new instance of a Homa-based transport.
      *
@@ -275,6 +561,89 @@ class Transport {
      */
     static Transport* create(Driver* driver, uint64_t transportId);
 
+    /**
+     * Return a new instance of a Homa-based transport bound to a particular
+     * receive queue of the Driver.
+     *
+     * Used to scale receive processing across cores: each core runs its own
+     * transport instance whose poll() loop drains only the bound queue (see
+     * Driver::getRxQueueCount()), so instances share no receive state.  The
+     * Driver is responsible for spreading inbound flows across its queues
+     * (e.g. with RSS).
+     *
+     * The caller is responsible for calling free() on the returned pointer.
+     *
+     * @param driver
+     *      Driver with which this transport should send and receive packets.
+     * @param transportId
+     *      This transport's unique identifier in the group of transports among
+     *      which this transport will communicate.
+     * @param rxQueueId
+     *      The Driver receive queue this transport should poll; must be in
+     *      the range [0, Driver::getRxQueueCount()).
+     * @return
+     *      Pointer to the new transport instance.
+     */
+    static Transport* create(Driver* driver, uint64_t transportId,
+                             int rxQueueId);
+
+    /**
+     * Return a new instance of a Homa-based transport running in a particular
+     * execution mode.
+     *
+     * The caller is responsible for calling free() on the returned pointer.
+     *
+     * @param driver
+     *      Driver with which this transport should send and receive packets.
+     * @param transportId
+     *      This transport's unique identifier in the group of transports among
+     *      which this transport will communicate.
+     * @param rxQueueId
+     *      The Driver receive queue this transport should poll; must be in
+     *      the range [0, Driver::getRxQueueCount()).
+     * @param mode
+     *      The execution mode in which the transport should run (see Mode).
+     * @return
+     *      Pointer to the new transport instance.
+     */
+    static Transport* create(Driver* driver, uint64_t transportId,
+                             int rxQueueId, Mode mode);
+
+    /**
+     * Return a new instance of a Homa-based transport placed on a particular
+     * NUMA node.
+     *
+     * On multi-socket hosts, cross-node memory accesses cost substantially
+     * more per cacheline; this overload lets the transport's threads and
+     * memory be kept on the node closest to the NIC.  In PIPELINED mode the
+     * pipeline stage threads are pinned to the CPUs of the given node, so
+     * the per-thread message pool caches and packet bookkeeping they touch
+     * are first-touch allocated there.  In POLLED mode thread placement is
+     * the application's responsibility and the node is only advisory.  See
+     * also Drivers::DPDK::DpdkDriver::Config::NUMA_SOCKET_ID for placing the
+     * driver's packet buffers.
+     *
+     * The caller is responsible for calling free() on the returned pointer.
+     *
+     * @param driver
+     *      Driver with which this transport should send and receive packets.
+     * @param transportId
+     *      This transport's unique identifier in the group of transports among
+     *      which this transport will communicate.
+     * @param rxQueueId
+     *      The Driver receive queue this transport should poll; must be in
+     *      the range [0, Driver::getRxQueueCount()).
+     * @param mode
+     *      The execution mode in which the transport should run (see Mode).
+     * @param numaNode
+     *      The NUMA node on which this transport should run; -1 disables
+     *      NUMA placement.
+     * @return
+     *      Pointer to the new transport instance.
+     */
+    static Transport* create(Driver* driver, uint64_t transportId,
+                             int rxQueueId, Mode mode, int numaNode);
+
     /**
      * Allocate Message that can be sent with this Transport.
      *
@@ -285,6 +654,25 @@ class Transport {
      */
     virtual Homa::unique_ptr<Homa::OutMessage> alloc(uint16_t sourcePort) = 0;
 
+    /**
+     * Open a Socket bound to the given port of this Transport.
+     *
+     * While the socket exists, inbound messages sent to the port are
+     * delivered only through Socket::receive(); messages sent to ports with
+     * no open socket continue to be delivered through receive().  The caller
+     * must ensure no Socket::receive() call is in progress when the socket
+     * is destroyed.
+     *
+     * The socket must not outlive this Transport.
+     *
+     * @param port
+     *      The port to which the new socket should be bound.
+     * @return
+     *      Pointer to the new socket, or an empty pointer if the port
+     *      already has a socket open.
+     */
+    virtual std::unique_ptr<Homa::Socket> open(uint16_t port) = 0;
+
     /**
      * Check for and return a Message sent to this Transport if available.
      *
@@ -294,6 +682,192 @@ class Transport {
      */
     virtual Homa::unique_ptr<Homa::InMessage> receive() = 0;
 
+    /**
+     * Check for and return a batch of Messages sent to this Transport.
+     *
+     * Applications that expect many small messages can use this method to
+     * amortize the per-call overhead of receive() across several messages.
+     *
+     * @param[out] messages
+     *      Array to be filled with the received messages; must hold at least
+     *      maxMessages entries.
+     * @param maxMessages
+     *      The maximum number of messages that should be returned.
+     * @return
+     *      The number of messages actually returned; may be zero if no
+     *      messages have been delivered.
+     */
+    virtual uint32_t receiveBatch(Homa::unique_ptr<Homa::InMessage> messages[],
+                                  uint32_t maxMessages)
+    {
+        uint32_t numMessages = 0;
+        while (numMessages < maxMessages) {
+            Homa::unique_ptr<Homa::InMessage> message = receive();
+            if (!message) {
+                break;
+            }
+            messages[numMessages++] = std::move(message);
+        }
+        return numMessages;
+    }
+
+    /**
+     * Enable streaming delivery of large inbound messages.
+     *
+     * Inbound messages at least lengthBytes long are returned by receive() as
+     * soon as their first packet arrives, rather than after the last packet.
+     * The application can then process the message's prefix while the rest is
+     * still in flight, using InMessage::readableBytes() to track how much has
+     * arrived.  Messages shorter than the threshold are delivered only once
+     * completely received, as usual.
+     *
+     * @param lengthBytes
+     *      Minimum message length, in bytes, for early delivery; 0 (the
+     *      default) disables streaming delivery entirely.
+     */
+    virtual void setStreamingThreshold(size_t lengthBytes) = 0;
+
+    /**
+     * Enable compact-on-arrival storage of small inbound messages.
+     *
+     * Inbound messages at most lengthBytes long have their packet contents
+     * copied into a pooled arena as each packet arrives, so the driver's
+     * packet buffers can be returned immediately instead of being pinned
+     * until the application releases the message.  This keeps a slow
+     * application from exhausting the driver's packet buffer pool at the
+     * cost of one copy per packet.  Messages longer than the threshold keep
+     * the driver's buffers, as usual.
+     *
+     * @param lengthBytes
+     *      Maximum message length, in bytes, for compaction; 0 (the default)
+     *      disables compaction entirely.
+     */
+    virtual void setCompactionThreshold(size_t lengthBytes) = 0;
+
+    /**
+     * Enable or disable adaptive poll backoff.
+     *
+     * With backoff enabled, poll() stays hot while traffic is flowing but
+     * progressively pauses the calling thread after a run of consecutive
+     * poll() calls that found no incoming packets, so an idle transport no
+     * longer burns a full core.  Once deeply idle, poll() also asks the
+     * Driver to sleep until a receive event arrives if the Driver supports
+     * it (see Driver::waitForPackets()).  The cost is added latency on the
+     * first packets that arrive while backed off; the pollBackoffPause
+     * micro-benchmark measures the worst-case pause of the backoff ladder.
+     *
+     * Disabled by default: poll() always runs hot unless this is called.
+     *
+     * @param enabled
+     *      True to back off while idle; false to always poll hot.
+     */
+    virtual void setAdaptivePolling(bool enabled) = 0;
+
+    /**
+     * Move timeout processing off the polling thread and onto a dedicated
+     * low-priority background thread.
+     *
+     * With background timeouts enabled, poll() only receives packets and
+     * makes incremental send and grant progress; the periodic sweeps for
+     * message timeouts, pings, and retransmission requests (along with the
+     * deferred reclamation of released messages) run on a housekeeping
+     * thread that the transport spawns.  The sweeps synchronize with the
+     * data path only through the transport's existing internal locks, so
+     * enabling this removes the latency spike a sweep across the message
+     * buckets would otherwise inject into an unlucky poll() call.  The
+     * housekeeping thread runs at the lowest scheduling priority and sleeps
+     * between sweeps, so it steals virtually no cycles from the data-path
+     * threads.
+     *
+     * Has no effect on a transport created in Mode::PIPELINED, whose
+     * timeout pipeline stage already owns this work.  Disabled by default:
+     * timeouts are processed inside poll() unless this is called.
+     *
+     * @param enabled
+     *      True to process timeouts on a background thread; false to
+     *      process them inside poll().
+     */
+    virtual void setBackgroundTimeouts(bool enabled) = 0;
+
+    /**
+     * Set the minimum number of additional bytes a GRANT must convey before
+     * the Transport will send one.
+     *
+     * Each incoming data packet of a scheduled message makes a sliver of
+     * additional grantable bytes available; sending a GRANT for every such
+     * sliver wastes control packet bandwidth and receiver CPU.  With a
+     * quantum of N, a GRANT is only sent once it would advance the sender's
+     * limit by at least N bytes (the final GRANT of a message is always sent
+     * regardless).  Larger quanta reduce the GRANT rate but delay senders
+     * slightly; quanta larger than the scheduled byte window would stall
+     * senders and should be avoided.
+     *
+     * The default is a few full packets' worth of bytes.
+     *
+     * @param bytes
+     *      Minimum grant advancement, in bytes, per GRANT packet; 0 sends a
+     *      GRANT for every advancement.
+     */
+    virtual void setGrantQuantum(size_t bytes) = 0;
+
+    /**
+     * Attach this transport to a host-wide grant coordinator (see
+     * GrantCoordinator); nullptr (the default) detaches it, removing any
+     * host-wide bound on this transport's grants.
+     *
+     * All transports sharing the NIC should be attached to the same
+     * coordinator.  The coordinator must outlive every transport attached to
+     * it.
+     *
+     * @param coordinator
+     *      The coordinator from which this transport's receiver will acquire
+     *      its grant budget.
+     */
+    virtual void setGrantCoordinator(GrantCoordinator* coordinator) = 0;
+
+    /**
+     * Set the number of outstanding inbound messages beyond which the
+     * transport considers itself overloaded and starts pushing back on new
+     * scheduled messages.
+     *
+     * A message is outstanding from the arrival of its first packet until
+     * the application releases it, so this bound covers both messages still
+     * being assembled and completed messages the application has not yet
+     * consumed.  While the bound is exceeded, the first packet of a new
+     * scheduled message is dropped and answered with an empty grant, which
+     * keeps the sender patient (it backs off and retries later) instead of
+     * letting its message time out after the receiver's resources are
+     * already exhausted.  Unscheduled messages and messages already being
+     * received are not affected.
+     *
+     * The default is several thousand messages.
+     *
+     * @param messages
+     *      Maximum number of outstanding inbound messages before pushback
+     *      starts; 0 disables the overload check.
+     */
+    virtual void setOverloadThreshold(size_t messages) = 0;
+
+    /**
+     * Register a callback invoked whenever the transport makes progress an
+     * application thread may be sleeping on: an outbound message reaching
+     * OutMessage::Status::COMPLETED, or an inbound message becoming
+     * available through receive() (on any socket).  An application can use
+     * it to signal an eventfd, condition variable, or fiber scheduler
+     * instead of spinning on getStatus()/receive().
+     *
+     * The callback runs on whichever thread is driving the transport (a
+     * poll() caller or a pipeline stage thread), possibly concurrently with
+     * itself, and while the transport is mid-operation; it must be fast,
+     * thread-safe, and must not call back into the transport.  Register the
+     * callback before the transport starts processing packets; no callback
+     * is registered by default.
+     *
+     * @param callback
+     *      Function to invoke on completion and delivery events.
+     */
+    virtual void setWakeupCallback(std::function<void()> callback) = 0;
+
     /**
      * Make incremental progress performing all Transport functionality.
      *
@@ -302,6 +876,26 @@ class Transport {
      */
     virtual void poll() = 0;
 
+    /**
+     * Make incremental progress performing all Transport functionality,
+     * bounded by a caller-supplied work budget.
+     *
+     * Intended for event loops that co-schedule application work on the
+     * polling core: the budget bounds how many incoming packets a single
+     * call will process, and the return value lets the caller detect an
+     * idle transport and back off.  Outbound and grant progress are made
+     * once per call regardless of the budget; they are internally bounded.
+     *
+     * @param budget
+     *      Maximum number of incoming packets to process in this call; 0
+     *      returns immediately without doing any work.
+     * @return
+     *      Total number of work items handled: incoming packets processed,
+     *      data packets sent, and grants issued.  0 means the transport
+     *      found no work to do.
+     */
+    virtual uint32_t poll(uint32_t budget) = 0;
+
     /**
      * Return the driver that this transport uses to send and receive packets.
      */
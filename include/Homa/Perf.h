@@ -16,12 +16,68 @@
 #ifndef HOMA_INCLUDE_HOMA_PERF_H
 #define HOMA_INCLUDE_HOMA_PERF_H
 
+#include <Homa/Driver.h>
+
 #include <atomic>
 #include <cstdint>
+#include <utility>
+#include <vector>
 
 namespace Homa {
 namespace Perf {
 
+/// Number of size classes used to bucket per-message latency distributions;
+/// see messageSizeClass().
+const uint32_t NUM_MESSAGE_SIZE_CLASSES = 4;
+
+/**
+ * Return the size class of a message with the given length: 0 for messages
+ * that fit in a single packet (<= 1500 bytes), 1 for messages up to 10 KB,
+ * 2 for messages up to 100 KB, and 3 for everything larger.
+ */
+uint32_t messageSizeClass(uint32_t messageLength);
+
+/**
+ * A log-bucketed distribution of recorded values (e.g. latencies in cycles).
+ *
+ * Values are assigned to buckets whose width doubles every SUB_BUCKET_COUNT
+ * buckets, so the full 64-bit range is covered with a bounded relative error
+ * of 1/SUB_BUCKET_COUNT per recorded value.
+ */
+struct Histogram {
+    /// log2 of the number of sub-buckets per power-of-two range.
+    static const uint32_t SUB_BUCKET_BITS = 4;
+
+    /// Number of sub-buckets per power-of-two range; bounds the relative
+    /// error of a recorded value.
+    static const uint32_t SUB_BUCKET_COUNT = 1u << SUB_BUCKET_BITS;
+
+    /// Total number of buckets needed to cover the full 64-bit value range.
+    static const uint32_t NUM_BUCKETS = 1024;
+
+    /// Total number of values recorded in this histogram.
+    uint64_t sample_count;
+
+    /// Number of recorded values that fell into each bucket.
+    uint64_t buckets[NUM_BUCKETS];
+
+    /**
+     * Return the index of the bucket that holds the given value.
+     */
+    static uint32_t bucketIndex(uint64_t value);
+
+    /**
+     * Return the smallest value assigned to the bucket with the given index.
+     */
+    static uint64_t bucketFloor(uint32_t index);
+
+    /**
+     * Return an estimate of the given percentile (e.g. 99.9) over the
+     * recorded values; returns 0 if the histogram is empty.
+     */
+    uint64_t getPercentile(double percentile) const;
+};
+
 /**
  * Performance statistics
  */
@@ -112,6 +168,71 @@ struct Stats {
 
     /// Number of error packets received.
     uint64_t rx_error_pkts;
+
+    /// Number of new scheduled messages pushed back (dropped and throttled
+    /// with an empty grant) because the Receiver was overloaded.
+    uint64_t rx_overload_pushbacks;
+
+    /// Number of inbound DATA packets whose contents were copied into a
+    /// pooled arena so the driver's buffer could be released on arrival.
+    uint64_t rx_compacted_pkts;
+
+    /// Number of packet buffers backed by driver-level OverflowBuffers
+    /// because the driver's packet buffer pool was exhausted.
+    uint64_t mbuf_overflow_allocs;
+
+    /// Number of transmit packet buffer allocations refused because the
+    /// driver was holding buffers in reserve for packet reception.
+    uint64_t tx_mbuf_alloc_denials;
+
+    /// Number of packet buffer allocations served from a driver-level
+    /// recycle cache instead of the packet buffer pool.
+    uint64_t mbuf_recycles;
+
+    /// Distribution of the time, in cycles, from OutMessage::send() until
+    /// the message reached Status::SENT; indexed by message size class.
+    Histogram tx_sent_latency[NUM_MESSAGE_SIZE_CLASSES];
+
+    /// Distribution of the time, in cycles, from OutMessage::send() until
+    /// the message reached Status::COMPLETED; indexed by message size class.
+    Histogram tx_completed_latency[NUM_MESSAGE_SIZE_CLASSES];
+
+    /// Distribution of the time, in cycles, from the arrival of an incoming
+    /// message's first DATA packet until the message was delivered to the
+    /// application; indexed by message size class.
+    Histogram rx_delivery_latency[NUM_MESSAGE_SIZE_CLASSES];
+};
+
+/**
+ * Performance statistics attributed to a single remote peer.
+ *
+ * Only collected while per-peer statistics collection is enabled; see
+ * setPerPeerStatsEnabled().
+ */
+struct PeerStats {
+    /// Number of bytes sent to the peer.
+    uint64_t tx_bytes;
+
+    /// Number of bytes received from the peer.
+    uint64_t rx_bytes;
+
+    /// Number of data packets sent to the peer.
+    uint64_t tx_data_pkts;
+
+    /// Number of data packets received from the peer.
+    uint64_t rx_data_pkts;
+
+    /// Number of data packets retransmitted to the peer in response to its
+    /// resend requests.
+    uint64_t tx_retransmit_pkts;
+
+    /// Number of resend requests sent to the peer (i.e. gaps detected in the
+    /// peer's transmissions).
+    uint64_t tx_resend_pkts;
+
+    /// Number of times an outgoing message to the peer had sent every granted
+    /// packet and had to stall waiting for the peer to issue more grants.
+    uint64_t grant_stalls;
 };
 
 /**
@@ -119,6 +240,181 @@ struct Stats {
  */
 void getStats(Stats* stats);
 
+/// Version number identifying the layout of StatsSnapshot and of its binary
+/// serialization; bumped whenever a counter is added, removed, or reordered.
+const uint32_t STATS_SNAPSHOT_VERSION = 1;
+
+/**
+ * A point-in-time view of the performance statistics together with the
+ * change in every counter since the previous snapshot taken by the same
+ * StatsMonitor.
+ */
+struct StatsSnapshot {
+    /// Layout version of this snapshot; see STATS_SNAPSHOT_VERSION.
+    uint32_t version;
+
+    /// Identifier of the transport these statistics cover; 0 means the
+    /// snapshot covers every transport in the process.
+    uint64_t transportId;
+
+    /// Relative time when these statistics were gathered in cycles.
+    uint64_t timestamp;
+
+    /// Conversion factor from cycles to seconds.
+    double cycles_per_second;
+
+    /// Time since the previous snapshot taken by the same StatsMonitor in
+    /// cycles; 0 for a monitor's first snapshot.
+    uint64_t interval_cycles;
+
+    /// Absolute counter values at the time of the snapshot.
+    Stats total;
+
+    /// Change in every counter since the previous snapshot taken by the same
+    /// StatsMonitor; equal to total for a monitor's first snapshot.
+    Stats delta;
+};
+
+/**
+ * Collects versioned snapshots of the performance statistics with
+ * per-counter deltas between consecutive snapshots, suitable for periodic
+ * (e.g. 1 Hz) export to a monitoring system.
+ *
+ * Collection performs one relaxed atomic read per counter per transport
+ * thread and takes no locks, so sampling costs microseconds even with many
+ * transport threads.  Each StatsMonitor remembers the last snapshot it took
+ * in order to compute deltas; use one monitor per collector.
+ *
+ * This class is not thread-safe; a monitor should be owned by a single
+ * sampling thread.
+ */
+class StatsMonitor {
+  public:
+    /**
+     * Construct a StatsMonitor covering every transport in the process.
+     */
+    StatsMonitor();
+
+    /**
+     * Construct a StatsMonitor covering a single transport.
+     *
+     * Statistics are attributed to the transport a thread was most recently
+     * polling for, so scoping is exact in the common deployment where each
+     * transport has dedicated polling threads.
+     *
+     * @param transportId
+     *      Identifier of the transport whose statistics should be collected
+     *      (as passed to Transport::create()).
+     */
+    explicit StatsMonitor(uint64_t transportId);
+
+    /**
+     * Fill the provided snapshot with the current statistics and the change
+     * in every counter since this monitor's previous snapshot.
+     */
+    void snapshot(StatsSnapshot* snapshot);
+
+    /**
+     * Serialize the snapshot into a compact binary representation suitable
+     * for shipping to a monitoring system.
+     *
+     * Scalar counters carry both their absolute value and their delta;
+     * histograms carry their sample counts and only the delta of the buckets
+     * that changed during the interval, keeping the common (mostly idle)
+     * snapshot small.
+     *
+     * @param snapshot
+     *      Snapshot to be serialized.
+     * @param buffer
+     *      Buffer into which the serialized snapshot should be written.
+     * @param length
+     *      Number of bytes available in the buffer.
+     * @return
+     *      Number of bytes the serialized snapshot occupies; nothing is
+     *      written unless length is at least this size (call with a zero
+     *      length to size a buffer).
+     */
+    static size_t serialize(const StatsSnapshot& snapshot, void* buffer,
+                            size_t length);
+
+    /**
+     * Reconstruct a snapshot from its binary representation.
+     *
+     * The total histograms' bucket contents are not carried on the wire
+     * (only their sample counts and the delta buckets are); the
+     * corresponding buckets of the deserialized snapshot are left zero.
+     *
+     * @param buffer
+     *      Buffer holding a serialized snapshot.
+     * @param length
+     *      Number of bytes in the buffer.
+     * @param[out] snapshot
+     *      Filled with the deserialized snapshot contents on success.
+     * @return
+     *      True if the buffer held a complete snapshot of a compatible
+     *      version; false otherwise (snapshot contents are undefined).
+     */
+    static bool deserialize(const void* buffer, size_t length,
+                            StatsSnapshot* snapshot);
+
+  private:
+    /// Identifier of the transport this monitor covers; 0 for all.
+    const uint64_t transportId;
+
+    /// Counter values at this monitor's previous snapshot.
+    Stats prev;
+
+    /// True once this monitor has taken at least one snapshot.
+    bool hasPrev;
+};
+
+/**
+ * Enable or disable the collection of per-peer statistics.
+ *
+ * Collection is disabled by default; while disabled, the only cost on the
+ * packet hot path is a single flag check.  Statistics accumulated before
+ * collection is disabled are retained and will continue to accumulate if
+ * collection is re-enabled.
+ */
+void setPerPeerStatsEnabled(bool enabled);
+
+/**
+ * Fill the provided vector with the current per-peer statistics; one entry
+ * for every peer this process has exchanged packets with while collection
+ * was enabled.  Any previous contents of the vector are discarded.
+ */
+void getPerPeerStats(std::vector<std::pair<IpAddress, PeerStats>>* stats);
+
+/**
+ * Contention statistics for one named lock site (e.g. all of the Receiver's
+ * message bucket mutexes).
+ */
+struct LockStats {
+    /// Name of the lock site.
+    const char* name;
+
+    /// Number of lock acquisitions that found the lock already held and had
+    /// to spin.
+    uint64_t contended_acquisitions;
+
+    /// Total number of failed acquisition attempts (individual spins) across
+    /// all contended acquisitions.
+    uint64_t failed_spins;
+
+    /// Total CPU time, in cycles, spent spinning for locks at this site.
+    uint64_t wait_cycles;
+};
+
+/**
+ * Fill the provided vector with contention statistics for every named lock
+ * site, ranked by accumulated wait cycles.  Any previous contents of the
+ * vector are discarded.
+ *
+ * Contention is only tracked in builds configured with
+ * HOMA_ENABLE_LOCK_STATS; otherwise the vector is left empty.
+ */
+void getLockStats(std::vector<LockStats>* stats);
+
 }  // namespace Perf
 }  // namespace Homa
 
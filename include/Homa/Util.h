@@ -70,6 +70,23 @@ isPowerOfTwo(num_type n)
     return (n > 0) && ((n & (n - 1)) == 0);
 }
 
+/**
+ * Hint to the processor that the cache line holding the given address will
+ * be read soon.  A no-op on compilers without prefetch support.
+ *
+ * @param address
+ *      Address of the memory that is about to be read.
+ */
+inline void
+prefetch(const void* address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address, 0);
+#else
+    (void)address;
+#endif
+}
+
 /**
  * This class is used to temporarily release lock in a safe fashion. Creating
  * an object of this class will unlock its associated mutex; when the object
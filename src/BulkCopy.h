@@ -0,0 +1,127 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_BULKCOPY_H
+#define HOMA_CORE_BULKCOPY_H
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace Homa {
+namespace Core {
+namespace BulkCopy {
+
+/// Total transfer size, in bytes, at or above which copies use non-temporal
+/// stores.  A transfer this large would evict most of a poll thread's LLC
+/// working set if copied through the caches, while the copied bytes
+/// themselves are unlikely to be touched again before being written to (or
+/// read from) the NIC.
+static const size_t NON_TEMPORAL_THRESHOLD = 256 * 1024;
+
+/**
+ * Copy a block of memory using non-temporal stores so that the destination
+ * bytes bypass the caches.
+ *
+ * Uses the widest store width the compilation target supports (AVX or
+ * SSE2); falls back to std::memcpy on other targets.
+ *
+ * @param destination
+ *      First byte of the region to copy to; must not overlap the source.
+ * @param source
+ *      First byte of the region to copy from.
+ * @param count
+ *      Number of bytes to copy.
+ */
+inline void
+copyNonTemporal(void* destination, const void* source, size_t count)
+{
+#if defined(__AVX__) || defined(__SSE2__)
+#if defined(__AVX__)
+    const size_t STORE_WIDTH = 32;
+#else
+    const size_t STORE_WIDTH = 16;
+#endif
+    char* dst = static_cast<char*>(destination);
+    const char* src = static_cast<const char*>(source);
+    // Non-temporal stores require an aligned destination; copy the unaligned
+    // head (and, below, the tail) with a plain memcpy.
+    size_t headBytes =
+        (STORE_WIDTH - (reinterpret_cast<uintptr_t>(dst) % STORE_WIDTH)) %
+        STORE_WIDTH;
+    if (headBytes > count) {
+        headBytes = count;
+    }
+    std::memcpy(dst, src, headBytes);
+    dst += headBytes;
+    src += headBytes;
+    count -= headBytes;
+    while (count >= STORE_WIDTH) {
+#if defined(__AVX__)
+        __m256i data =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        _mm256_stream_si256(reinterpret_cast<__m256i*>(dst), data);
+#else
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        _mm_stream_si128(reinterpret_cast<__m128i*>(dst), data);
+#endif
+        dst += STORE_WIDTH;
+        src += STORE_WIDTH;
+        count -= STORE_WIDTH;
+    }
+    // Make the non-temporal stores visible before any subsequent store.
+    _mm_sfence();
+    std::memcpy(dst, src, count);
+#else
+    std::memcpy(destination, source, count);
+#endif
+}
+
+/**
+ * Copy one chunk of a larger transfer, bypassing the caches when the
+ * transfer as a whole is large enough that caching its bytes would do more
+ * harm than good (see NON_TEMPORAL_THRESHOLD).
+ *
+ * The message data paths copy packet-sized chunks, so the caching decision
+ * is made on the size of the whole transfer rather than the size of the
+ * chunk at hand.
+ *
+ * @param destination
+ *      First byte of the region to copy to; must not overlap the source.
+ * @param source
+ *      First byte of the region to copy from.
+ * @param count
+ *      Number of bytes to copy.
+ * @param transferBytes
+ *      Total number of bytes of the transfer this chunk belongs to.
+ */
+inline void
+copy(void* destination, const void* source, size_t count, size_t transferBytes)
+{
+    if (transferBytes >= NON_TEMPORAL_THRESHOLD) {
+        copyNonTemporal(destination, source, count);
+    } else {
+        std::memcpy(destination, source, count);
+    }
+}
+
+}  // namespace BulkCopy
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_BULKCOPY_H
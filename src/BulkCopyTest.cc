@@ -0,0 +1,72 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <vector>
+
+#include "BulkCopy.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+TEST(BulkCopyTest, copyNonTemporal)
+{
+    // Exercise every head/tail alignment combination against the store
+    // width.
+    std::vector<char> source(4096);
+    std::vector<char> destination(4096);
+    for (size_t i = 0; i < source.size(); ++i) {
+        source[i] = static_cast<char>(i * 31 + 7);
+    }
+    for (size_t offset = 0; offset < 33; ++offset) {
+        for (size_t count : {size_t(0), size_t(1), size_t(33), size_t(256),
+                             size_t(1000)}) {
+            std::fill(destination.begin(), destination.end(), 0);
+            BulkCopy::copyNonTemporal(destination.data() + offset,
+                                      source.data() + offset, count);
+            EXPECT_EQ(0, std::memcmp(destination.data() + offset,
+                                     source.data() + offset, count));
+            // Bytes outside the copied range are untouched.
+            EXPECT_EQ(0, destination[offset + count]);
+        }
+    }
+}
+
+TEST(BulkCopyTest, copy)
+{
+    char source[128];
+    char destination[128];
+    for (size_t i = 0; i < sizeof(source); ++i) {
+        source[i] = static_cast<char>(i);
+    }
+
+    // Small transfer; copied through the caches.
+    std::memset(destination, 0, sizeof(destination));
+    BulkCopy::copy(destination, source, sizeof(source), sizeof(source));
+    EXPECT_EQ(0, std::memcmp(destination, source, sizeof(source)));
+
+    // Chunk of a large transfer; copied with non-temporal stores.
+    std::memset(destination, 0, sizeof(destination));
+    BulkCopy::copy(destination, source, sizeof(source),
+                   BulkCopy::NON_TEMPORAL_THRESHOLD);
+    EXPECT_EQ(0, std::memcmp(destination, source, sizeof(source)));
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
@@ -24,6 +24,48 @@ namespace Homa {
 namespace Core {
 namespace ControlPacket {
 
+/**
+ * RAII guard that corks a Driver for the duration of a scope.
+ *
+ * Used around code that may emit a burst of control packets during a single
+ * poll iteration (e.g. sending GRANTs to every scheduled peer) so that the
+ * Driver can flush them to the NIC in one TX burst when the guard is
+ * destroyed.  The Driver's cork is reference counted, so guards may nest.
+ *
+ * @sa Driver::cork(), Driver::uncork()
+ */
+class Corked {
+  public:
+    /**
+     * Corked constructor; corks the driver.
+     *
+     * @param driver
+     *      Driver that should buffer outbound packets while this guard is in
+     *      scope.
+     */
+    explicit Corked(Driver* driver)
+        : driver(driver)
+    {
+        driver->cork();
+    }
+
+    /**
+     * Corked destructor; uncorks the driver, flushing any buffered packets.
+     */
+    ~Corked()
+    {
+        driver->uncork();
+    }
+
+    // Guards cannot be copied.
+    Corked(const Corked&) = delete;
+    Corked& operator=(const Corked&) = delete;
+
+  private:
+    /// Driver corked by this guard.
+    Driver* const driver;
+};
+
 /**
  * Send a packet of the given type.  Helper function used to other modules to
  * send various control packets.
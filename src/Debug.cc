@@ -27,8 +27,13 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <chrono>
 #include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
+
+#include "MpmcRing.h"
 
 namespace Homa {
 namespace Debug {
@@ -413,6 +418,28 @@ isLogging(LogLevel level, const char* fileName)
 void
 log(LogLevel level, const char* fileName, uint32_t lineNum,
     const char* functionName, const char* message)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    Internal::logAtTime(level, fileName, lineNum, functionName, message, now);
+}
+
+namespace Internal {
+
+/**
+ * Write out a log message with an explicitly provided timestamp; factored
+ * out of log() so that asynchronously queued messages keep the time at
+ * which they were emitted rather than the time at which the logger thread
+ * got around to writing them.
+ *
+ * @copydetails log
+ * @param now
+ *      Wall-clock time at which the message was emitted.
+ */
+void
+logAtTime(LogLevel level, const char* fileName, uint32_t lineNum,
+          const char* functionName, const char* message,
+          const struct timespec& now)
 {
     if (logHandler) {
         DebugMessage d;
@@ -428,9 +455,6 @@ log(LogLevel level, const char* fileName, uint32_t lineNum,
         return;
     }
 
-    struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
-
     // Failures are a little annoying here, since we can't exactly log
     // errors that come up.
     char formattedSeconds[64];  // a human-readable string now.tv_sec
@@ -456,5 +480,228 @@ log(LogLevel level, const char* fileName, uint32_t lineNum,
     fflush(stream);
 }
 
+/// See Debug.h.
+std::atomic<bool> asyncLoggingEnabled(false);
+
+/// Number of messages each thread's async log ring can hold; must be a
+/// power of two.  Messages beyond this are dropped (and accounted for)
+/// rather than stalling the emitting thread.
+const uint32_t ASYNC_LOG_RING_SIZE = 1024;
+
+/**
+ * One queued log message awaiting the logger thread.
+ */
+struct AsyncLogEntry {
+    /// The level of importance of the message.
+    LogLevel level;
+    /// The output of __FILE__ at the emitting site.
+    const char* fileName;
+    /// The output of __LINE__ at the emitting site.
+    uint32_t lineNum;
+    /// The output of __FUNCTION__ at the emitting site.
+    const char* functionName;
+    /// Wall-clock time at which the message was emitted.
+    struct timespec when;
+    /// Produces the formatted message text.
+    std::function<std::string()> formatter;
+};
+
+/**
+ * Per-thread ring of queued log messages.
+ */
+struct AsyncLogBuffer {
+    AsyncLogBuffer();
+    ~AsyncLogBuffer();
+
+    /// Queued messages; pushed by the owning thread, popped by the logger
+    /// thread (or by the destructor when the owning thread exits).
+    Core::MpmcRing<AsyncLogEntry*, ASYNC_LOG_RING_SIZE> ring;
+
+    /// Number of messages dropped because the ring was full; reported and
+    /// reset by the logger thread.
+    std::atomic<uint64_t> dropped;
+};
+
+/**
+ * Protects #asyncBuffers and the logger thread handle.
+ */
+std::mutex asyncMutex;
+
+/**
+ * Set of all async log buffers for all live threads.  Protected by
+ * #asyncMutex.
+ */
+std::unordered_set<AsyncLogBuffer*> asyncBuffers;
+
+/**
+ * Format and write out the given queued message, then destroy it.
+ */
+void
+writeAsyncLogEntry(AsyncLogEntry* entry)
+{
+    logAtTime(entry->level, entry->fileName, entry->lineNum,
+              entry->functionName, entry->formatter().c_str(), entry->when);
+    delete entry;
+}
+
+/**
+ * Drain and write out every message queued in the given buffer.  Returns
+ * true if any messages were written.
+ */
+bool
+drainAsyncLogBuffer(AsyncLogBuffer* buffer)
+{
+    bool busy = false;
+    AsyncLogEntry* entry;
+    while (buffer->ring.tryPop(&entry)) {
+        writeAsyncLogEntry(entry);
+        busy = true;
+    }
+    uint64_t numDropped = buffer->dropped.exchange(0);
+    if (numDropped > 0) {
+        // Log synchronously; going through LOG() here would re-enter
+        // enqueueLog() while asyncMutex is held.
+        log(LogLevel::WARNING, __FILE__, __LINE__, __FUNCTION__,
+            StringUtil::format(
+                "Dropped %lu log messages (async log ring overflowed)",
+                numDropped)
+                .c_str());
+        busy = true;
+    }
+    return busy;
+}
+
+/**
+ * Main loop of the background logger thread; runs while asynchronous
+ * logging is enabled and exits once the mode is disabled and all queued
+ * messages have been written.
+ */
+void
+asyncLoggerMain()
+{
+    while (true) {
+        bool busy = false;
+        bool enabled = asyncLoggingEnabled.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(asyncMutex);
+            for (AsyncLogBuffer* buffer : asyncBuffers) {
+                busy |= drainAsyncLogBuffer(buffer);
+            }
+        }
+        if (!enabled && !busy) {
+            return;
+        }
+        if (!busy) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+}
+
+/**
+ * Owns the background logger thread; a function-local static so that its
+ * destructor runs (and joins the thread) before this translation unit's
+ * other static objects are destroyed at process exit.
+ */
+struct AsyncLogger {
+    AsyncLogger()
+        : thread()
+    {}
+
+    ~AsyncLogger()
+    {
+        // The process is exiting; disable async logging so the logger thread
+        // drains its queues and exits even if the application never called
+        // setAsyncLogging(false).  The thread polls the flag, so no further
+        // notification is needed.
+        asyncLoggingEnabled.store(false, std::memory_order_relaxed);
+        stop();
+    }
+
+    /// Start the logger thread if it is not already running.
+    void start()
+    {
+        if (!thread.joinable()) {
+            thread = std::thread(asyncLoggerMain);
+        }
+    }
+
+    /// Wait for the logger thread to write out all queued messages and
+    /// exit.  Caller must have cleared #asyncLoggingEnabled.
+    void stop()
+    {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    /// Handle for the background logger thread.
+    std::thread thread;
+};
+
+/**
+ * Return the singleton AsyncLogger.
+ */
+AsyncLogger&
+getAsyncLogger()
+{
+    static AsyncLogger logger;
+    return logger;
+}
+
+/**
+ * Construct and register a new per thread async log buffer.
+ */
+AsyncLogBuffer::AsyncLogBuffer()
+    : ring()
+    , dropped(0)
+{
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    asyncBuffers.insert(this);
+}
+
+/**
+ * Deregister and destruct a per thread async log buffer, writing out any
+ * messages the logger thread has not gotten to yet.
+ */
+AsyncLogBuffer::~AsyncLogBuffer()
+{
+    std::lock_guard<std::mutex> lock(asyncMutex);
+    drainAsyncLogBuffer(this);
+    asyncBuffers.erase(this);
+}
+
+// See Debug.h.
+void
+enqueueLog(LogLevel level, const char* fileName, uint32_t lineNum,
+           const char* functionName, std::function<std::string()> formatter)
+{
+    thread_local AsyncLogBuffer buffer;
+    AsyncLogEntry* entry = new AsyncLogEntry{
+        level, fileName, lineNum, functionName, {}, std::move(formatter)};
+    clock_gettime(CLOCK_REALTIME, &entry->when);
+    if (!buffer.ring.tryPush(entry)) {
+        delete entry;
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+}  // namespace Internal
+
+// See <Homa/Debug.h>
+void
+setAsyncLogging(bool enabled)
+{
+    // Serializes concurrent mode changes.
+    static std::mutex modeMutex;
+    std::lock_guard<std::mutex> lock(modeMutex);
+    if (enabled) {
+        Internal::asyncLoggingEnabled.store(true, std::memory_order_relaxed);
+        Internal::getAsyncLogger().start();
+    } else {
+        Internal::asyncLoggingEnabled.store(false, std::memory_order_relaxed);
+        Internal::getAsyncLogger().stop();
+    }
+}
+
 }  // namespace Debug
 }  // namespace Homa
@@ -16,9 +16,13 @@
 
 #include "StringUtil.h"
 
+#include <atomic>
 #include <cinttypes>
 #include <cstdlib>
+#include <ctime>
+#include <functional>
 #include <string>
+#include <utility>
 
 #include "Homa/Debug.h"
 
@@ -44,6 +48,123 @@ void log(LogLevel level, const char* fileName, uint32_t lineNum,
  */
 extern std::string processName;
 
+namespace Internal {
+
+/// True while asynchronous logging is enabled (see setAsyncLogging());
+/// checked by every LOG() invocation so it is exposed here for inlining.
+extern std::atomic<bool> asyncLoggingEnabled;
+
+/**
+ * Deposit a log message in the calling thread's ring for the background
+ * logger thread to format and write.  This is normally called by LOG() via
+ * dispatchLog() when asynchronous logging is enabled.
+ *
+ * @param level
+ *      The level of importance of the message.
+ * @param fileName
+ *      The output of __FILE__.
+ * @param lineNum
+ *      The output of __LINE__.
+ * @param functionName
+ *      The output of __FUNCTION__.
+ * @param formatter
+ *      Callable that produces the formatted message text; invoked by the
+ *      logger thread (or synchronously if the message has to be flushed).
+ */
+void enqueueLog(LogLevel level, const char* fileName, uint32_t lineNum,
+                const char* functionName,
+                std::function<std::string()> formatter);
+
+/**
+ * Write out a log message with an explicitly provided timestamp.
+ *
+ * @sa log()
+ */
+void logAtTime(LogLevel level, const char* fileName, uint32_t lineNum,
+               const char* functionName, const char* message,
+               const struct timespec& now);
+
+/**
+ * Pass a log argument through for deferred formatting; trivial values are
+ * simply copied into the deferred formatter.
+ */
+template <typename T>
+inline T
+captureLogArg(T arg)
+{
+    return arg;
+}
+
+/**
+ * C-string log arguments may point at temporaries (e.g. the result of
+ * c_str() on a local std::string), so their contents are copied when the
+ * message is deposited.
+ */
+inline std::string
+captureLogArg(const char* arg)
+{
+    return std::string(arg == nullptr ? "(null)" : arg);
+}
+
+/// @sa captureLogArg(const char*)
+inline std::string
+captureLogArg(char* arg)
+{
+    return captureLogArg(static_cast<const char*>(arg));
+}
+
+/**
+ * Inverse of captureLogArg(); unwrap a captured argument into the form
+ * expected by the printf-style format string.
+ */
+template <typename T>
+inline T
+unwrapLogArg(T arg)
+{
+    return arg;
+}
+
+/// @sa unwrapLogArg()
+inline const char*
+unwrapLogArg(const std::string& arg)
+{
+    return arg.c_str();
+}
+
+/**
+ * Build the deferred formatter for an asynchronously logged message.  The
+ * format string must be a string literal (guaranteed by LOG()); arguments
+ * are captured by value.
+ */
+template <typename... Args>
+std::function<std::string()>
+makeLogFormatter(const char* format, Args... args)
+{
+    return [format, args...]() {
+        return StringUtil::format(format, unwrapLogArg(args)...);
+    };
+}
+
+/**
+ * Route a log message to the synchronous or asynchronous path depending on
+ * the current logging mode.  This is normally called by LOG().
+ */
+template <typename... Args>
+inline void
+dispatchLog(LogLevel level, const char* fileName, uint32_t lineNum,
+            const char* functionName, const char* format, Args... args)
+{
+    if (asyncLoggingEnabled.load(std::memory_order_relaxed)) {
+        enqueueLog(level, fileName, lineNum, functionName,
+                   makeLogFormatter(format, captureLogArg(args)...));
+    } else {
+        log(level, fileName, lineNum, functionName,
+            StringUtil::format(format, args...).c_str());
+    }
+}
+
+}  // namespace Internal
+
 }  // namespace Debug
 }  // namespace Homa
 
@@ -61,9 +182,14 @@ extern std::string processName;
 #define LOG(level, _format, ...)                                             \
     do {                                                                     \
         if (::Homa::Debug::isLogging(level, __FILE__)) {                     \
-            ::Homa::Debug::log(                                              \
-                level, __FILE__, __LINE__, __FUNCTION__,                     \
-                ::Homa::StringUtil::format(_format, ##__VA_ARGS__).c_str()); \
+            if (false) {                                                     \
+                /* Never executed; retains compile-time printf-style format  \
+                 * checking, which dispatchLog() cannot provide. */          \
+                ::Homa::StringUtil::format(_format, ##__VA_ARGS__);          \
+            }                                                                \
+            ::Homa::Debug::Internal::dispatchLog(level, __FILE__, __LINE__,  \
+                                                 __FUNCTION__, _format,      \
+                                                 ##__VA_ARGS__);             \
         }                                                                    \
     } while (0)
 
@@ -132,6 +132,23 @@ TEST_F(DebugTest, setLogHandler)
     EXPECT_EQ("Hello, world! 9", m.message);
 }
 
+TEST_F(DebugTest, setAsyncLogging)
+{
+    VectorHandler handler;
+    setLogHandler(std::ref(handler));
+    setAsyncLogging(true);
+    std::string transient("transient");
+    ERROR("Hello, world! %d %s", 9, transient.c_str());
+    // Messages are written by the logger thread; disabling the mode waits
+    // for it to drain.
+    setAsyncLogging(false);
+    EXPECT_EQ(1U, handler.messages.size());
+    const DebugMessage& m = handler.messages.at(0);
+    EXPECT_STREQ("src/DebugTest.cc", m.filename);
+    EXPECT_EQ(int(LogLevel::ERROR), m.logLevel);
+    EXPECT_EQ("Hello, world! 9 transient", m.message);
+}
+
 TEST_F(DebugTest, setLogPolicy)
 {
     setLogPolicy({{"prefix", "VERBOSE"}, {"suffix", "ERROR"}, {"", "WARNING"}});
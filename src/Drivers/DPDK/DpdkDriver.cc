@@ -44,6 +44,13 @@ DpdkDriver::allocPacket()
     return pImpl->allocPacket();
 }
 
+/// See Driver::allocPackets()
+void
+DpdkDriver::allocPackets(uint16_t numPackets, Packet* packets[])
+{
+    pImpl->allocPackets(numPackets, packets);
+}
+
 /// See Driver::sendPacket()
 void
 DpdkDriver::sendPacket(Packet* packet, IpAddress destination, int priority)
@@ -51,6 +58,14 @@ DpdkDriver::sendPacket(Packet* packet, IpAddress destination, int priority)
     return pImpl->sendPacket(packet, destination, priority);
 }
 
+/// See Driver::sendPackets()
+void
+DpdkDriver::sendPackets(uint16_t numPackets, Packet* packets[],
+                        IpAddress destination, int priority)
+{
+    pImpl->sendPackets(numPackets, packets, destination, priority);
+}
+
 /// See Driver::cork()
 void
 DpdkDriver::cork()
@@ -70,8 +85,33 @@ uint32_t
 DpdkDriver::receivePackets(uint32_t maxPackets, Packet* receivedPackets[],
                            IpAddress sourceAddresses[])
 {
-    return pImpl->receivePackets(maxPackets, receivedPackets, sourceAddresses);
+    return pImpl->receivePackets(maxPackets, receivedPackets, sourceAddresses,
+                                 0);
+}
+
+/// See Driver::receivePackets()
+uint32_t
+DpdkDriver::receivePackets(uint32_t maxPackets, Packet* receivedPackets[],
+                           IpAddress sourceAddresses[], int rxQueueId)
+{
+    return pImpl->receivePackets(maxPackets, receivedPackets, sourceAddresses,
+                                 rxQueueId);
 }
+
+/// See Driver::getRxQueueCount()
+int
+DpdkDriver::getRxQueueCount()
+{
+    return pImpl->getRxQueueCount();
+}
+
+/// See Driver::waitForPackets()
+bool
+DpdkDriver::waitForPackets(int rxQueueId, uint64_t maxWaitMicros)
+{
+    return pImpl->waitForPackets(rxQueueId, maxWaitMicros);
+}
+
 /// See Driver::releasePackets()
 void
 DpdkDriver::releasePackets(Packet* packets[], uint16_t numPackets)
@@ -25,11 +25,14 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <fstream>
 
 #include "CodeLocation.h"
 #include "Homa/Util.h"
+#include "Perf.h"
 #include "StringUtil.h"
+#include "ThreadId.h"
 
 #define IP_DN_FRAGMENT_FLAG 0x0040
 
@@ -53,9 +56,10 @@ const char* default_eal_argv[] = {"homa", NULL};
  *      Memory location in the mbuf where the packet data should be stored.
  */
 DpdkDriver::Impl::Packet::Packet(struct rte_mbuf* mbuf, void* data)
-    : base{.payload = data, .length = 0}
+    : base{.payload = data, .length = 0, .extData = nullptr, .extLength = 0}
     , bufType(MBUF)
     , bufRef()
+    , rxRetained(false)
 {
     bufRef.mbuf = mbuf;
 }
@@ -67,9 +71,13 @@ DpdkDriver::Impl::Packet::Packet(struct rte_mbuf* mbuf, void* data)
  *      Overflow buffer that holds this packet.
  */
 DpdkDriver::Impl::Packet::Packet(OverflowBuffer* overflowBuf)
-    : base{.payload = overflowBuf->data, .length = 0}
+    : base{.payload = overflowBuf->data,
+           .length = 0,
+           .extData = nullptr,
+           .extLength = 0}
     , bufType(OVERFLOW_BUF)
     , bufRef()
+    , rxRetained(false)
 {
     bufRef.overflowBuf = overflowBuf;
 }
@@ -96,17 +104,37 @@ DpdkDriver::Impl::Impl(const char* ifname, int argc, char* argv[],
           (config == nullptr || config->HIGHEST_PACKET_PRIORITY_OVERRIDE < 0)
               ? Homa::Util::arrayLength(PRIORITY_TO_PCP) - 1
               : config->HIGHEST_PACKET_PRIORITY_OVERRIDE)
+    , DISABLE_CHECKSUM_OFFLOADS(config == nullptr
+                                    ? false
+                                    : config->DISABLE_CHECKSUM_OFFLOADS)
+    , NUMA_SOCKET_ID(config == nullptr ? -1 : config->NUMA_SOCKET_ID)
+    , ENABLE_RX_INTERRUPTS(config == nullptr ? false
+                                            : config->ENABLE_RX_INTERRUPTS)
+    , RECONCILE_TX_COMPLETIONS(config == nullptr
+                                   ? false
+                                   : config->RECONCILE_TX_COMPLETIONS)
+    , lastTxHarvestNs(0)
     , packetLock()
     , packetPool()
     , overflowBufferPool()
     , mbufsOutstanding(0)
+    , rxMbufsOutstanding(0)
+    , mbufReserve(NB_MBUF_RESERVED)
+    , rxOccupancyPeak(0)
+    , allocsSinceReserveUpdate(0)
     , mbufPool(nullptr)
     , loopbackRing(nullptr)
     , rx()
     , tx()
+    , recycle()
+    , numTxQueues(1)
+    , numRxQueues(1)
     , hasHardwareFilter(true)  // Cleared later if not applicable
+    , hasTxIpv4CksumOffload(false)  // Set during _init() if supported
+    , hasRxIpv4CksumOffload(false)  // Set during _init() if supported
     , corked(0)
     , bandwidthMbps(10000)  // Default bandwidth = 10 gbs
+    , maxPayloadSize(MAX_PAYLOAD_SIZE)
 {
     // DPDK during initialization (rte_eal_init()) the running thread is pinned
     // to a single processor which may be not be what the applications wants.
@@ -149,16 +177,37 @@ DpdkDriver::Impl::Impl(const char* ifname,
           (config == nullptr || config->HIGHEST_PACKET_PRIORITY_OVERRIDE < 0)
               ? Homa::Util::arrayLength(PRIORITY_TO_PCP) - 1
               : config->HIGHEST_PACKET_PRIORITY_OVERRIDE)
+    , DISABLE_CHECKSUM_OFFLOADS(config == nullptr
+                                    ? false
+                                    : config->DISABLE_CHECKSUM_OFFLOADS)
+    , NUMA_SOCKET_ID(config == nullptr ? -1 : config->NUMA_SOCKET_ID)
+    , ENABLE_RX_INTERRUPTS(config == nullptr ? false
+                                            : config->ENABLE_RX_INTERRUPTS)
+    , RECONCILE_TX_COMPLETIONS(config == nullptr
+                                   ? false
+                                   : config->RECONCILE_TX_COMPLETIONS)
+    , lastTxHarvestNs(0)
     , packetLock()
     , packetPool()
     , overflowBufferPool()
+    , mbufsOutstanding(0)
+    , rxMbufsOutstanding(0)
+    , mbufReserve(NB_MBUF_RESERVED)
+    , rxOccupancyPeak(0)
+    , allocsSinceReserveUpdate(0)
     , mbufPool(nullptr)
     , loopbackRing(nullptr)
     , rx()
     , tx()
+    , recycle()
+    , numTxQueues(1)
+    , numRxQueues(1)
     , hasHardwareFilter(true)  // Cleared later if not applicable
+    , hasTxIpv4CksumOffload(false)  // Set during _init() if supported
+    , hasRxIpv4CksumOffload(false)  // Set during _init() if supported
     , corked(0)
     , bandwidthMbps(10000)  // Default bandwidth = 10 gbs
+    , maxPayloadSize(MAX_PAYLOAD_SIZE)
 {
     _init();
 }
@@ -168,6 +217,14 @@ DpdkDriver::Impl::Impl(const char* ifname,
  */
 DpdkDriver::Impl::~Impl()
 {
+    // Return any recycled mbufs to the mempool before it is torn down.
+    for (uint16_t i = 0; i < NB_RECYCLE_CACHES; ++i) {
+        Recycle::Cache* cache = &recycle.caches[i];
+        while (cache->count > 0) {
+            rte_pktmbuf_free(cache->mbufs[--cache->count]);
+        }
+    }
+
     // Free the various allocated resources (e.g. ring, mempool) and close
     // the NIC.
     rte_ring_free(loopbackRing);
@@ -182,9 +239,16 @@ DpdkDriver::Impl::allocPacket()
 {
     DpdkDriver::Impl::Packet* packet = nullptr;
     SpinLock::Lock lock(packetLock);
-    static const int MBUF_ALLOC_LIMIT = NB_MBUF - NB_MBUF_RESERVED;
-    if (mbufsOutstanding < MBUF_ALLOC_LIMIT) {
-        struct rte_mbuf* mbuf = rte_pktmbuf_alloc(mbufPool);
+    if (++allocsSinceReserveUpdate >= MBUF_RESERVE_UPDATE_INTERVAL) {
+        updateMbufReserve();
+    }
+    if (mbufsOutstanding - rxMbufsOutstanding < NB_MBUF - mbufReserve) {
+        // Reuse a warm buffer from this thread's recycle cache when one is
+        // available; the mempool is only touched when the cache is empty.
+        struct rte_mbuf* mbuf = recycleGet();
+        if (mbuf == nullptr) {
+            mbuf = rte_pktmbuf_alloc(mbufPool);
+        }
         if (unlikely(NULL == mbuf)) {
             uint32_t numMbufsAvail = rte_mempool_avail_count(mbufPool);
             uint32_t numMbufsInUse = rte_mempool_in_use_count(mbufPool);
@@ -195,7 +259,7 @@ DpdkDriver::Impl::allocPacket()
         } else {
             char* buf = rte_pktmbuf_append(
                 mbuf, Homa::Util::downCast<uint16_t>(PACKET_HDR_LEN +
-                                                     MAX_PAYLOAD_SIZE));
+                                                     maxPayloadSize));
             if (unlikely(NULL == buf)) {
                 NOTICE("rte_pktmbuf_append call failed; dropping packet");
                 rte_pktmbuf_free(mbuf);
@@ -204,15 +268,96 @@ DpdkDriver::Impl::allocPacket()
                 mbufsOutstanding++;
             }
         }
+    } else {
+        Perf::counters.tx_mbuf_alloc_denials.add(1);
     }
     if (packet == nullptr) {
         OverflowBuffer* buf = overflowBufferPool.construct();
         packet = packetPool.construct(buf);
+        Perf::counters.mbuf_overflow_allocs.add(1);
         NOTICE("OverflowBuffer used.");
     }
     return &packet->base;
 }
 
+// See Driver::allocPackets()
+void
+DpdkDriver::Impl::allocPackets(uint16_t numPackets, Driver::Packet* packets[])
+{
+    SpinLock::Lock lock(packetLock);
+    allocsSinceReserveUpdate += numPackets;
+    if (allocsSinceReserveUpdate >= MBUF_RESERVE_UPDATE_INTERVAL) {
+        updateMbufReserve();
+    }
+    const uint32_t MBUF_ALLOC_LIMIT = NB_MBUF - mbufReserve;
+    uint16_t allocated = 0;
+    // Pull mbufs from the mempool in bulk; a bulk get is far cheaper than
+    // the equivalent number of single allocations.
+    while (allocated < numPackets) {
+        static const uint16_t ALLOC_BURST = 32;
+        uint16_t chunk = Homa::Util::downCast<uint16_t>(
+            std::min<uint32_t>(numPackets - allocated, ALLOC_BURST));
+        if (mbufsOutstanding - rxMbufsOutstanding + chunk > MBUF_ALLOC_LIMIT) {
+            Perf::counters.tx_mbuf_alloc_denials.add(numPackets - allocated);
+            break;
+        }
+        struct rte_mbuf* mbufs[ALLOC_BURST];
+        // Drain this thread's recycle cache first; the mempool only
+        // supplies the remainder of the chunk.
+        uint16_t cached = 0;
+        while (cached < chunk) {
+            struct rte_mbuf* mbuf = recycleGet();
+            if (mbuf == nullptr) {
+                break;
+            }
+            mbufs[cached++] = mbuf;
+        }
+        bool mempoolExhausted = false;
+        if (cached < chunk &&
+            unlikely(rte_pktmbuf_alloc_bulk(mbufPool, mbufs + cached,
+                                            chunk - cached) != 0)) {
+            uint32_t numMbufsAvail = rte_mempool_avail_count(mbufPool);
+            uint32_t numMbufsInUse = rte_mempool_in_use_count(mbufPool);
+            NOTICE(
+                "Failed to bulk allocate %u mbuf packet buffers; "
+                "%u mbufs available, %u mbufs in use, %u mbufs held by app",
+                chunk - cached, numMbufsAvail, numMbufsInUse,
+                mbufsOutstanding);
+            chunk = cached;
+            mempoolExhausted = true;
+        }
+        if (mempoolExhausted && chunk == 0) {
+            break;
+        }
+        for (uint16_t i = 0; i < chunk; ++i) {
+            char* buf = rte_pktmbuf_append(
+                mbufs[i], Homa::Util::downCast<uint16_t>(PACKET_HDR_LEN +
+                                                         maxPayloadSize));
+            if (unlikely(NULL == buf)) {
+                NOTICE("rte_pktmbuf_append call failed; dropping packet");
+                rte_pktmbuf_free(mbufs[i]);
+                continue;
+            }
+            DpdkDriver::Impl::Packet* packet =
+                packetPool.construct(mbufs[i], buf + PACKET_HDR_LEN);
+            mbufsOutstanding++;
+            packets[allocated++] = &packet->base;
+        }
+        if (mempoolExhausted) {
+            break;
+        }
+    }
+    // Fall back to overflow buffers for any packets the mempool could not
+    // supply, mirroring allocPacket().
+    while (allocated < numPackets) {
+        OverflowBuffer* buf = overflowBufferPool.construct();
+        DpdkDriver::Impl::Packet* packet = packetPool.construct(buf);
+        Perf::counters.mbuf_overflow_allocs.add(1);
+        NOTICE("OverflowBuffer used.");
+        packets[allocated++] = &packet->base;
+    }
+}
+
 // See Driver::sendPacket()
 void
 DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
@@ -256,6 +401,85 @@ DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
             NOTICE("Packet still sending; dropping resend request");
             return;
         }
+
+        // A previous send of this packet may have chained an external buffer
+        // segment that has since been freed by the NIC; restore the mbuf to a
+        // single segment before reusing it.
+        if (unlikely(mbuf->nb_segs > 1)) {
+            mbuf->next = NULL;
+            mbuf->nb_segs = 1;
+            mbuf->pkt_len = mbuf->data_len;
+        }
+    }
+
+    // Fast loopback path: packets destined to the local address never touch
+    // the wire, so Ethernet/IP header construction, checksums, and the ARP
+    // lookup can be elided entirely; the receive path reads the payload of a
+    // marked loopback mbuf in place (see receivePackets()).
+    if (destination == localIp) {
+        struct rte_mbuf* loopMbuf;
+        if (unlikely(pkt->bufType == DpdkDriver::Impl::Packet::OVERFLOW_BUF)) {
+            // The payload was just copied into a fresh mbuf that this call
+            // owns exclusively; hand it across directly, adding any external
+            // bytes first.
+            if (unlikely(pkt->base.extLength > 0)) {
+                char* extBuf = rte_pktmbuf_append(
+                    mbuf, Homa::Util::downCast<uint16_t>(pkt->base.extLength));
+                if (unlikely(NULL == extBuf)) {
+                    WARNING("rte_pktmbuf_append call failed; dropping packet");
+                    rte_pktmbuf_free(mbuf);
+                    return;
+                }
+                rte_memcpy(extBuf, pkt->base.extData, pkt->base.extLength);
+            }
+            loopMbuf = mbuf;
+        } else if (likely(pkt->base.extLength == 0)) {
+            // Share the sender's buffer with the receive path; only the
+            // clone's metadata is copied.
+            loopMbuf = rte_pktmbuf_clone(mbuf, mbufPool);
+            if (unlikely(loopMbuf == NULL)) {
+                WARNING("Failed to clone packet for loopback; dropping packet");
+                return;
+            }
+            uint32_t actualLength = PACKET_HDR_LEN + pkt->base.length;
+            uint32_t mbufDataLength = rte_pktmbuf_pkt_len(loopMbuf);
+            if (actualLength < mbufDataLength) {
+                rte_pktmbuf_trim(loopMbuf, mbufDataLength - actualLength);
+            }
+        } else {
+            // The receive path cannot read a multi-segment packet in place;
+            // gather the inline and external regions into one fresh mbuf.
+            loopMbuf = rte_pktmbuf_alloc(mbufPool);
+            if (unlikely(loopMbuf == NULL)) {
+                WARNING(
+                    "Failed to allocate loopback packet buffer; "
+                    "dropping packet");
+                return;
+            }
+            char* buf = rte_pktmbuf_append(
+                loopMbuf, Homa::Util::downCast<uint16_t>(
+                              PACKET_HDR_LEN + pkt->base.length +
+                              pkt->base.extLength));
+            if (unlikely(NULL == buf)) {
+                WARNING("rte_pktmbuf_append call failed; dropping packet");
+                rte_pktmbuf_free(loopMbuf);
+                return;
+            }
+            rte_memcpy(buf + PACKET_HDR_LEN, pkt->base.payload,
+                       pkt->base.length);
+            rte_memcpy(buf + PACKET_HDR_LEN + pkt->base.length,
+                       pkt->base.extData, pkt->base.extLength);
+        }
+        loopMbuf->udata64 = LOOPBACK_ELIDED_HEADERS;
+        int ret = rte_ring_enqueue(loopbackRing, loopMbuf);
+        if (unlikely(ret != 0)) {
+            WARNING(
+                "rte_ring_enqueue returned %d with %u packets queued; "
+                "packet may be lost?",
+                ret, rte_ring_count(loopbackRing));
+            rte_pktmbuf_free(loopMbuf);
+        }
+        return;
     }
 
     // Fill out the destination and source MAC addresses plus the Ethernet
@@ -289,9 +513,17 @@ DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
 
     ipv4_hdr->src_addr = rte_be_to_cpu_32((uint32_t)localIp);
     ipv4_hdr->dst_addr = rte_be_to_cpu_32((uint32_t)destination);
-    ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(ipv4_hdr) + pkt->base.length);
+    ipv4_hdr->total_length = rte_cpu_to_be_16(sizeof(ipv4_hdr) + pkt->base.length + pkt->base.extLength);
     ipv4_hdr->hdr_checksum = 0;
-    ipv4_hdr->hdr_checksum = rte_ipv4_cksum(ipv4_hdr);
+    if (hasTxIpv4CksumOffload) {
+        // Leave the checksum field zero and let the NIC fill it in during
+        // transmission.
+        mbuf->l2_len = sizeof(struct ether_hdr);
+        mbuf->l3_len = sizeof(struct ipv4_hdr);
+        mbuf->ol_flags |= PKT_TX_IPV4 | PKT_TX_IP_CKSUM;
+    } else {
+        ipv4_hdr->hdr_checksum = rte_ipv4_cksum(ipv4_hdr);
+    }
     // *rte_pktmbuf_mtod_offset(mbuf, uint32_t*, PACKET_HDR_LEN - 4) =
     //     (uint32_t)localIp;
 
@@ -309,6 +541,20 @@ DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
         }
     }
 
+    // Attach the packet's external data region (if any) as an additional mbuf
+    // segment so that the NIC can gather the bytes directly from application
+    // memory.
+    if (unlikely(pkt->base.extLength > 0)) {
+        if (!attachExternalBuffer(mbuf, pkt->base.extData,
+                                  pkt->base.extLength)) {
+            if (unlikely(pkt->bufType ==
+                         DpdkDriver::Impl::Packet::OVERFLOW_BUF)) {
+                rte_pktmbuf_free(mbuf);
+            }
+            return;
+        }
+    }
+
     // loopback if src mac == dst mac
     if (localMac == destMac) {
         struct rte_mbuf* mbuf_clone = rte_pktmbuf_clone(mbuf, mbufPool);
@@ -317,6 +563,9 @@ DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
             WARNING("Failed to clone packet for loopback; dropping packet");
             return;
         }
+        // Full headers were built (e.g. a local IP alias); make sure the
+        // clone is not mistaken for a header-elided fast-path packet.
+        mbuf_clone->udata64 = 0;
         int ret = rte_ring_enqueue(loopbackRing, mbuf_clone);
         if (unlikely(ret != 0)) {
             WARNING(
@@ -334,21 +583,134 @@ DpdkDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
         rte_pktmbuf_refcnt_update(mbuf, 1);
     }
 
-    // Add the packet to the burst.
-    SpinLock::Lock txLock(tx.mutex);
+    // Add the packet to the burst on the calling thread's TX queue.  Each
+    // thread maps to its own queue, so the queue lock is uncontended unless
+    // there are more threads than TX queues.
+    uint16_t queueId = getTxQueueId();
+    Tx::Queue* txQueue = &tx.queues[queueId];
+    SpinLock::Lock txLock(txQueue->mutex);
     {
-        SpinLock::Lock statsLock(tx.stats.mutex);
-        tx.stats.bufferedBytes += rte_pktmbuf_pkt_len(mbuf);
+        SpinLock::Lock statsLock(txQueue->stats.mutex);
+        txQueue->stats.bufferedBytes += rte_pktmbuf_pkt_len(mbuf);
+    }
+    // Highest-priority packets (control packets and the smallest unscheduled
+    // messages; see ControlPacket::send() and Policy::Manager) travel in
+    // their own lane so that a corked burst of bulk DATA cannot head-of-line
+    // block them; the lanes are flushed in priority order.
+    if (priority >= HIGHEST_PACKET_PRIORITY) {
+        rte_eth_tx_buffer(port, queueId, txQueue->priorityBuffer, mbuf);
+    } else {
+        rte_eth_tx_buffer(port, queueId, txQueue->buffer, mbuf);
     }
-    rte_eth_tx_buffer(port, 0, tx.buffer, mbuf);
-    // rte_pktmbuf_dump(stdout, mbuf, rte_pktmbuf_pkt_len(mbuf));
-    // printf("port:%d\n", port);
     // Flush packets now if the driver is not corked.
     if (corked.load() < 1) {
-        rte_eth_tx_buffer_flush(port, 0, tx.buffer);
-        // printf("flush:%d pkts\n", pkts);
+        rte_eth_tx_buffer_flush(port, queueId, txQueue->priorityBuffer);
+        rte_eth_tx_buffer_flush(port, queueId, txQueue->buffer);
+    }
+}
+
+// See Driver::sendPackets()
+void
+DpdkDriver::Impl::sendPackets(uint16_t numPackets, Driver::Packet* packets[],
+                              IpAddress destination, int priority)
+{
+    // Cork for the duration of the burst so that the packets accumulate in
+    // the TX buffer and leave in MAX_PKT_BURST-sized hardware bursts instead
+    // of one rte_eth_tx_burst() call each.
+    cork();
+    for (uint16_t i = 0; i < numPackets; ++i) {
+        sendPacket(packets[i], destination, priority);
+    }
+    uncork();
+}
+
+/**
+ * Return the id of the NIC TX queue that the calling thread should use.
+ * Threads are spread across the configured queues by thread id.
+ */
+uint16_t
+DpdkDriver::Impl::getTxQueueId()
+{
+    return Homa::Util::downCast<uint16_t>(ThreadId::getId() % numTxQueues);
+}
+
+/**
+ * Take an mbuf from the calling thread's recycle cache.
+ *
+ * @return
+ *      A reset, ready-to-append mbuf, or nullptr if the cache is empty.
+ */
+struct rte_mbuf*
+DpdkDriver::Impl::recycleGet()
+{
+    Recycle::Cache* cache =
+        &recycle.caches[ThreadId::getId() % NB_RECYCLE_CACHES];
+    SpinLock::Lock lock(cache->mutex);
+    if (cache->count == 0) {
+        return nullptr;
+    }
+    Perf::counters.mbuf_recycles.add(1);
+    return cache->mbufs[--cache->count];
+}
 
+/**
+ * Try to stash a released mbuf in the calling thread's recycle cache.
+ *
+ * Only pristine, exclusively owned buffers from the driver's mempool can be
+ * reused directly; anything else (still referenced by the NIC, cloned for
+ * loopback, carrying an attached external buffer, or multi-segment) must
+ * take the normal free path.
+ *
+ * @param mbuf
+ *      The mbuf being released.
+ * @return
+ *      True if the cache took ownership of the mbuf; false if the caller
+ *      should free it normally.
+ */
+bool
+DpdkDriver::Impl::recyclePut(struct rte_mbuf* mbuf)
+{
+    if (mbuf->pool != mbufPool || !RTE_MBUF_DIRECT(mbuf) ||
+        mbuf->nb_segs != 1 || rte_mbuf_refcnt_read(mbuf) != 1) {
+        return false;
+    }
+    Recycle::Cache* cache =
+        &recycle.caches[ThreadId::getId() % NB_RECYCLE_CACHES];
+    SpinLock::Lock lock(cache->mutex);
+    if (cache->count >= RECYCLE_CACHE_SIZE) {
+        return false;
     }
+    rte_pktmbuf_reset(mbuf);
+    cache->mbufs[cache->count++] = mbuf;
+    return true;
+}
+
+/**
+ * Recompute the number of mbufs held back from transmit allocations based on
+ * the RX occupancy observed since the last update.
+ *
+ * The reserve tracks a slowly decaying peak of the number of mbufs retained
+ * by received packets, plus headroom for the next burst; RX-heavy workloads
+ * therefore grow the reserve while TX-heavy workloads reclaim it, keeping
+ * both sides off the slow OverflowBuffer path.
+ *
+ * The caller must hold packetLock.
+ */
+void
+DpdkDriver::Impl::updateMbufReserve()
+{
+    allocsSinceReserveUpdate = 0;
+    // Decay the remembered peak so that the reserve can shrink once an
+    // RX-heavy phase passes, then fold in the current occupancy.
+    rxOccupancyPeak -= rxOccupancyPeak / 16;
+    if (rxMbufsOutstanding > rxOccupancyPeak) {
+        rxOccupancyPeak = rxMbufsOutstanding;
+    }
+    // Reserve the peak plus 50% headroom, bounded so that the RX rings can
+    // always be refilled and the transmit side keeps at least half the pool.
+    uint32_t target = rxOccupancyPeak + rxOccupancyPeak / 2;
+    mbufReserve = std::max(MIN_MBUF_RESERVED,
+                           std::min(MAX_MBUF_RESERVED, target));
 }
 
 // See Driver::cork()
@@ -358,13 +720,78 @@ DpdkDriver::Impl::cork()
     corked.fetch_add(1);
 }
 
+/**
+ * Chain an externally-owned buffer to the given mbuf as an additional
+ * segment so that the NIC can DMA the bytes directly from application
+ * memory.
+ *
+ * @param mbuf
+ *      The mbuf holding the packet's header and inline data.
+ * @param data
+ *      First byte of the externally-owned buffer; must remain valid until
+ *      the NIC has finished transmitting the packet.
+ * @param length
+ *      Number of bytes in the externally-owned buffer.
+ * @return
+ *      True if the buffer was attached; false if the attach failed (the
+ *      packet should be dropped).
+ */
+bool
+DpdkDriver::Impl::attachExternalBuffer(struct rte_mbuf* mbuf, const void* data,
+                                       int32_t length)
+{
+    struct rte_mbuf* extMbuf = rte_pktmbuf_alloc(mbufPool);
+    if (unlikely(NULL == extMbuf)) {
+        WARNING(
+            "Failed to allocate an mbuf for an external buffer segment; "
+            "dropping packet");
+        return false;
+    }
+    struct rte_mbuf_ext_shared_info* shinfo =
+        new struct rte_mbuf_ext_shared_info();
+    shinfo->free_cb = extBufferFreeCallback;
+    shinfo->fcb_opaque = shinfo;
+    rte_mbuf_ext_refcnt_set(shinfo, 1);
+    rte_pktmbuf_attach_extbuf(extMbuf, const_cast<void*>(data),
+                              rte_mem_virt2iova(data),
+                              Homa::Util::downCast<uint16_t>(length), shinfo);
+    extMbuf->data_len = Homa::Util::downCast<uint16_t>(length);
+    extMbuf->pkt_len = length;
+    if (unlikely(rte_pktmbuf_chain(mbuf, extMbuf) != 0)) {
+        WARNING(
+            "Failed to chain external buffer segment; "
+            "dropping packet");
+        rte_pktmbuf_free(extMbuf);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Invoked by DPDK once the NIC has finished transmitting from an external
+ * buffer segment.  The buffer itself is owned by the application (see
+ * Homa::OutMessage::appendExternal()); only the shared info block allocated
+ * in attachExternalBuffer() needs to be freed here.
+ */
+void
+DpdkDriver::Impl::extBufferFreeCallback(void* addr, void* opaque)
+{
+    (void)addr;
+    delete static_cast<struct rte_mbuf_ext_shared_info*>(opaque);
+}
+
 // See Driver::uncork()
 void
 DpdkDriver::Impl::uncork()
 {
     if (corked.fetch_sub(1) == 1) {
-        SpinLock::Lock txLock(tx.mutex);
-        rte_eth_tx_buffer_flush(port, 0, tx.buffer);
+        // Packets buffered while corked were added on the calling thread's
+        // queue; flush that queue, high-priority lane first.
+        uint16_t queueId = getTxQueueId();
+        Tx::Queue* txQueue = &tx.queues[queueId];
+        SpinLock::Lock txLock(txQueue->mutex);
+        rte_eth_tx_buffer_flush(port, queueId, txQueue->priorityBuffer);
+        rte_eth_tx_buffer_flush(port, queueId, txQueue->buffer);
     }
 }
 
@@ -372,8 +799,9 @@ DpdkDriver::Impl::uncork()
 uint32_t
 DpdkDriver::Impl::receivePackets(uint32_t maxPackets,
                                  Driver::Packet* receivedPackets[],
-                                 IpAddress sourceAddresses[])
+                                 IpAddress sourceAddresses[], int rxQueueId)
 {
+    assert(rxQueueId >= 0 && rxQueueId < numRxQueues);
     uint32_t numPacketsReceived = 0;
 
     constexpr uint32_t MAX_PACKETS_AT_ONCE = 32;
@@ -385,20 +813,25 @@ DpdkDriver::Impl::receivePackets(uint32_t maxPackets,
     struct rte_mbuf* mPkts[MAX_PACKETS_AT_ONCE];
 
     // attempt to dequeue a batch of received packets from the NIC
-    // as well as from the loopback ring.
+    // as well as from the loopback ring.  Loopback packets bypass RSS so
+    // they are delivered through queue 0 only.
     uint32_t loopbackPkts = 0;
     uint32_t incomingPkts = 0;
     {
-        SpinLock::Lock lock(rx.mutex);
-
-        loopbackPkts = rte_ring_count(loopbackRing);
-        loopbackPkts = std::min(loopbackPkts, maxLoopbackPkts);
-        for (uint32_t i = 0; i < loopbackPkts; i++) {
-            rte_ring_dequeue(loopbackRing, reinterpret_cast<void**>(&mPkts[i]));
+        SpinLock::Lock lock(rx.queues[rxQueueId].mutex);
+
+        if (rxQueueId == 0) {
+            loopbackPkts = rte_ring_count(loopbackRing);
+            loopbackPkts = std::min(loopbackPkts, maxLoopbackPkts);
+            for (uint32_t i = 0; i < loopbackPkts; i++) {
+                rte_ring_dequeue(loopbackRing,
+                                 reinterpret_cast<void**>(&mPkts[i]));
+            }
         }
 
         incomingPkts = rte_eth_rx_burst(
-            port, 0, &(mPkts[loopbackPkts]),
+            port, Homa::Util::downCast<uint16_t>(rxQueueId),
+            &(mPkts[loopbackPkts]),
             Homa::Util::downCast<uint16_t>(maxPackets - loopbackPkts));
     }
     uint32_t totalPkts = incomingPkts + loopbackPkts;
@@ -414,54 +847,88 @@ DpdkDriver::Impl::receivePackets(uint32_t maxPackets,
             continue;
         }
 
-        struct ether_hdr* ethHdr = rte_pktmbuf_mtod(m, struct ether_hdr*);
-        uint16_t ether_type = ethHdr->ether_type;
-        uint32_t headerLength = ETHER_HDR_LEN;
-        char* payload = reinterpret_cast<char*>(ethHdr + 1);
-        if (ether_type == rte_cpu_to_be_16(ETHER_TYPE_VLAN)) {
-            struct vlan_hdr* vlanHdr =
-                reinterpret_cast<struct vlan_hdr*>(payload);
-            ether_type = vlanHdr->eth_proto;
-            headerLength += VLAN_TAG_LEN;
-            payload += VLAN_TAG_LEN;
-        } 
-        struct ipv4_hdr *ipv4_hdr = rte_pktmbuf_mtod_offset(m, struct ipv4_hdr*, headerLength);
-        if (!hasHardwareFilter) {
-            // Perform packet filtering by software to skip irrelevant
-            // packets such as ipmi or kernel TCP/IP traffic.
-            // if (ether_type != rte_cpu_to_be_16(EthPayloadType::HOMA)) {
-            //     VERBOSE("packet filtered; ether_type = %x", ether_type);
-            //     rte_pktmbuf_free(m);
-            //     continue;
-            // }
-            if (ipv4_hdr->next_proto_id != 6) {
-                VERBOSE("packet filtered; ether_type = %x", ether_type);
+        uint32_t headerLength;
+        char* payload;
+        uint32_t srcIp;
+        if (i < loopbackPkts && m->udata64 == LOOPBACK_ELIDED_HEADERS) {
+            // Fast-path loopback packet (see sendPacket()): no Ethernet/IP
+            // headers were built, the payload sits at its usual offset, and
+            // the source is by definition the local address.
+            m->udata64 = 0;
+            headerLength = PACKET_HDR_LEN;
+            payload = rte_pktmbuf_mtod_offset(m, char*, PACKET_HDR_LEN);
+            srcIp = (uint32_t)localIp;
+        } else {
+            struct ether_hdr* ethHdr = rte_pktmbuf_mtod(m, struct ether_hdr*);
+            uint16_t ether_type = ethHdr->ether_type;
+            headerLength = ETHER_HDR_LEN;
+            payload = reinterpret_cast<char*>(ethHdr + 1);
+            if (ether_type == rte_cpu_to_be_16(ETHER_TYPE_VLAN)) {
+                struct vlan_hdr* vlanHdr =
+                    reinterpret_cast<struct vlan_hdr*>(payload);
+                ether_type = vlanHdr->eth_proto;
+                headerLength += VLAN_TAG_LEN;
+                payload += VLAN_TAG_LEN;
+            }
+            struct ipv4_hdr* ipv4_hdr = rte_pktmbuf_mtod_offset(
+                m, struct ipv4_hdr*, headerLength);
+            if (!hasHardwareFilter) {
+                // Perform packet filtering by software to skip irrelevant
+                // packets such as ipmi or kernel TCP/IP traffic.
+                // if (ether_type != rte_cpu_to_be_16(EthPayloadType::HOMA)) {
+                //     VERBOSE("packet filtered; ether_type = %x", ether_type);
+                //     rte_pktmbuf_free(m);
+                //     continue;
+                // }
+                if (ipv4_hdr->next_proto_id != 6) {
+                    VERBOSE("packet filtered; ether_type = %x", ether_type);
+                    rte_pktmbuf_free(m);
+                    continue;
+                }
+            }
+
+            // Trust the NIC's checksum verdict instead of recomputing the
+            // checksum in software; loopback mbufs never carry RX offload
+            // flags and pass through unharmed.
+            if (hasRxIpv4CksumOffload &&
+                unlikely((m->ol_flags & PKT_RX_IP_CKSUM_MASK) ==
+                         PKT_RX_IP_CKSUM_BAD)) {
+                WARNING("IPv4 header checksum error; discarding packet");
                 rte_pktmbuf_free(m);
                 continue;
             }
-        }
 
-        // uint32_t srcIp = *rte_pktmbuf_mtod_offset(m, uint32_t*, headerLength);
-        // headerLength += sizeof(srcIp);
-        // payload += sizeof(srcIp);
-        uint32_t srcIp = rte_be_to_cpu_32(ipv4_hdr->src_addr);
-        headerLength += sizeof(struct ipv4_hdr);
-        payload += sizeof(struct ipv4_hdr);
+            srcIp = rte_be_to_cpu_32(ipv4_hdr->src_addr);
+            headerLength += sizeof(struct ipv4_hdr);
+            payload += sizeof(struct ipv4_hdr);
+        }
         assert(rte_pktmbuf_pkt_len(m) >= headerLength);
         uint32_t length = rte_pktmbuf_pkt_len(m) - headerLength;
-        assert(length <= MAX_PAYLOAD_SIZE);
+        assert(length <= maxPayloadSize);
 
         DpdkDriver::Impl::Packet* packet = nullptr;
         {
             SpinLock::Lock lock(packetLock);
-            static const int MBUF_ALLOC_LIMIT = NB_MBUF - NB_MBUF_RESERVED;
-            if (mbufsOutstanding < MBUF_ALLOC_LIMIT) {
+            if (++allocsSinceReserveUpdate >= MBUF_RESERVE_UPDATE_INTERVAL) {
+                updateMbufReserve();
+            }
+            // Received packets may retain mbufs all the way down to the
+            // floor that keeps the RX descriptor rings refillable; the
+            // adaptive reserve only throttles the transmit side.
+            if (mbufsOutstanding < NB_MBUF - MIN_MBUF_RESERVED) {
                 packet = packetPool.construct(m, payload);
+                packet->rxRetained = true;
                 mbufsOutstanding++;
+                rxMbufsOutstanding++;
+                if (rxMbufsOutstanding > rxOccupancyPeak) {
+                    rxOccupancyPeak = rxMbufsOutstanding;
+                }
             } else {
                 OverflowBuffer* buf = overflowBufferPool.construct();
-                rte_memcpy(payload, buf->data, length);
+                rte_memcpy(buf->data, payload, length);
+                rte_pktmbuf_free(m);
                 packet = packetPool.construct(buf);
+                Perf::counters.mbuf_overflow_allocs.add(1);
             }
         }
         packet->base.length = length;
@@ -483,8 +950,16 @@ DpdkDriver::Impl::releasePackets(Driver::Packet* packets[], uint16_t numPackets)
         DpdkDriver::Impl::Packet* packet =
             container_of(packets[i], DpdkDriver::Impl::Packet, base);
         if (likely(packet->bufType == DpdkDriver::Impl::Packet::MBUF)) {
-            rte_pktmbuf_free(packet->bufRef.mbuf);
+            // Stash the buffer in this thread's recycle cache so an upcoming
+            // allocation can reuse it without a round trip through the
+            // mempool; buffers the cache can't take go back the normal way.
+            if (!recyclePut(packet->bufRef.mbuf)) {
+                rte_pktmbuf_free(packet->bufRef.mbuf);
+            }
             mbufsOutstanding--;
+            if (packet->rxRetained) {
+                rxMbufsOutstanding--;
+            }
         } else {
             overflowBufferPool.destroy(packet->bufRef.overflowBuf);
         }
@@ -499,11 +974,49 @@ DpdkDriver::Impl::getHighestPacketPriority()
     return HIGHEST_PACKET_PRIORITY;
 }
 
+// See Driver::getRxQueueCount()
+int
+DpdkDriver::Impl::getRxQueueCount()
+{
+    return numRxQueues;
+}
+
+// See Driver::waitForPackets()
+bool
+DpdkDriver::Impl::waitForPackets(int rxQueueId, uint64_t maxWaitMicros)
+{
+    if (!ENABLE_RX_INTERRUPTS) {
+        return false;
+    }
+    uint16_t queueId = Homa::Util::downCast<uint16_t>(rxQueueId);
+
+    // Register this queue's interrupt with the calling thread's epoll
+    // instance.  Registrations after a thread's first are rejected by DPDK
+    // and harmlessly ignored here.
+    rte_eth_dev_rx_intr_ctl_q(port, queueId, RTE_EPOLL_PER_THREAD,
+                              RTE_INTR_EVENT_ADD, NULL);
+
+    // Arm the interrupt before checking the queue one last time; a packet
+    // that arrived after the caller's last poll but before arming would
+    // otherwise be stranded until the timeout.
+    if (rte_eth_dev_rx_intr_enable(port, queueId) != 0) {
+        return false;
+    }
+    if (rte_eth_rx_queue_count(port, queueId) == 0) {
+        struct rte_epoll_event event;
+        int timeoutMs = Homa::Util::downCast<int>(
+            std::max(maxWaitMicros / 1000, uint64_t(1)));
+        rte_epoll_wait(RTE_EPOLL_PER_THREAD, &event, 1, timeoutMs);
+    }
+    rte_eth_dev_rx_intr_disable(port, queueId);
+    return true;
+}
+
 // See Driver::getMaxPayloadSize()
 uint32_t
 DpdkDriver::Impl::getMaxPayloadSize()
 {
-    return MAX_PAYLOAD_SIZE;
+    return maxPayloadSize;
 }
 
 // See Driver::getBandwidth()
@@ -524,8 +1037,71 @@ DpdkDriver::Impl::getLocalAddress()
 uint32_t
 DpdkDriver::Impl::getQueuedBytes()
 {
-    SpinLock::Lock lock(tx.stats.mutex);
-    return tx.stats.bufferedBytes + tx.stats.queueEstimator.getQueuedBytes();
+    if (RECONCILE_TX_COMPLETIONS) {
+        harvestTxCompletions();
+    }
+    uint32_t queuedBytes = 0;
+    for (uint16_t q = 0; q < numTxQueues; ++q) {
+        Tx::Stats* stats = &tx.queues[q].stats;
+        SpinLock::Lock lock(stats->mutex);
+        queuedBytes +=
+            stats->bufferedBytes + stats->queueEstimator.getQueuedBytes();
+    }
+    return queuedBytes;
+}
+
+/**
+ * Reconcile the per-queue QueueEstimators against the NIC's per-queue
+ * transmit counters (see Config::RECONCILE_TX_COMPLETIONS).
+ *
+ * Reading the counters involves a PCIe round-trip on most NICs, so this
+ * method rate-limits itself; callers can invoke it freely from the hot
+ * path.  Thread-safe.
+ */
+void
+DpdkDriver::Impl::harvestTxCompletions()
+{
+    // Let only one caller through per harvest interval.
+    const uint64_t HARVEST_INTERVAL_NS = 50000;
+    uint64_t nowNs = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+    uint64_t lastNs = lastTxHarvestNs.load(std::memory_order_relaxed);
+    if (nowNs - lastNs < HARVEST_INTERVAL_NS ||
+        !lastTxHarvestNs.compare_exchange_strong(lastNs, nowNs)) {
+        return;
+    }
+
+    struct rte_eth_stats ethStats;
+    if (rte_eth_stats_get(port, &ethStats) != 0) {
+        return;
+    }
+    for (uint16_t q = 0; q < numTxQueues; ++q) {
+        Tx::Stats* stats = &tx.queues[q].stats;
+        SpinLock::Lock lock(stats->mutex);
+        if (!stats->trackCompletions) {
+            continue;
+        }
+        uint64_t completed =
+            ethStats.q_opackets[q] - stats->lastCompletedPackets;
+        stats->lastCompletedPackets = ethStats.q_opackets[q];
+        // Loopback and other out-of-band traffic could in principle make
+        // the counter run ahead of the lengths we recorded; never pop more
+        // than we have.
+        if (completed > stats->pendingCount) {
+            completed = stats->pendingCount;
+        }
+        uint64_t completedBytes = 0;
+        for (uint64_t i = 0; i < completed; ++i) {
+            completedBytes += stats->pendingLengths[stats->pendingHead];
+            stats->pendingHead = (stats->pendingHead + 1) % TX_TRACK_RING_SIZE;
+        }
+        stats->pendingCount -= completed;
+        if (completedBytes > 0) {
+            stats->queueEstimator.signalBytesCompleted(completedBytes);
+        }
+    }
 }
 
 /**
@@ -633,28 +1209,111 @@ DpdkDriver::Impl::_init()
 
     NOTICE("Using DPDK version %s", rte_version());
 
-    // create an memory pool for accommodating packet buffers
+    // ensure that DPDK was able to detect a compatible and available NIC
+    if (!rte_eth_dev_is_valid_port(port)) {
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Ethernet port %u doesn't exist", port));
+    }
+
+    // Determine how many TX and RX queues the NIC can provide.
+    struct rte_eth_dev_info devInfo;
+    rte_eth_dev_info_get(port, &devInfo);
+
+    // Determine the largest payload the port can carry; try for jumbo
+    // frames but don't exceed the largest frame the device can receive.
+    maxPayloadSize = MAX_JUMBO_PAYLOAD_SIZE;
+    if (devInfo.max_rx_pktlen < maxPayloadSize + PACKET_HDR_LEN) {
+        maxPayloadSize = devInfo.max_rx_pktlen - PACKET_HDR_LEN;
+        NOTICE("Port %u limits frames to %u bytes; using payload size %u",
+               port, devInfo.max_rx_pktlen, maxPayloadSize);
+    }
+
+    // Pre-size the overflow buffer pool so that the mbuf-exhaustion
+    // fallback path never reaches malloc while under pressure.
+    {
+        SpinLock::Lock lock(packetLock);
+        overflowBufferPool.reserve(NB_OVERFLOW_BUFFERS);
+        packetPool.reserve(NB_OVERFLOW_BUFFERS);
+    }
+
+    // create an memory pool for accommodating packet buffers; each mbuf
+    // must be able to hold a full (possibly jumbo) frame contiguously.
+    uint16_t mbufDataRoomSize = Homa::Util::downCast<uint16_t>(std::max(
+        static_cast<uint32_t>(RTE_MBUF_DEFAULT_BUF_SIZE),
+        RTE_PKTMBUF_HEADROOM + PACKET_HDR_LEN + maxPayloadSize));
+    // Allocate DPDK memory on the configured NUMA socket; fall back to the
+    // socket of this thread when no override was given.
+    int socketId = (NUMA_SOCKET_ID < 0)
+                       ? Homa::Util::downCast<int>(rte_socket_id())
+                       : NUMA_SOCKET_ID;
     mbufPool =
         rte_pktmbuf_pool_create(poolName.c_str(), NB_MBUF, MEMPOOL_CACHE_SIZE,
-                                0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+                                0, mbufDataRoomSize, socketId);
     if (!mbufPool) {
         throw DriverInitFailure(
             HERE_STR, StringUtil::format(
                           "Failed to allocate memory for packet buffers: %s",
                           rte_strerror(rte_errno)));
     }
-
-    // ensure that DPDK was able to detect a compatible and available NIC
-    if (!rte_eth_dev_is_valid_port(port)) {
-        throw DriverInitFailure(
-            HERE_STR,
-            StringUtil::format("Ethernet port %u doesn't exist", port));
+    numTxQueues = std::min(MAX_TX_QUEUES, devInfo.max_tx_queues);
+    if (numTxQueues < MAX_TX_QUEUES) {
+        NOTICE("Port %u supports only %u TX queues (wanted %u)", port,
+               numTxQueues, MAX_TX_QUEUES);
+    }
+    numRxQueues = std::min(MAX_RX_QUEUES, devInfo.max_rx_queues);
+    if (numRxQueues < MAX_RX_QUEUES) {
+        NOTICE("Port %u supports only %u RX queues (wanted %u)", port,
+               numRxQueues, MAX_RX_QUEUES);
     }
 
     // configure some default NIC port parameters
     memset(&portConf, 0, sizeof(portConf));
-    portConf.rxmode.max_rx_pkt_len = ETHER_MAX_VLAN_FRAME_LEN;
-    rte_eth_dev_configure(port, 1, 1, &portConf);
+    portConf.rxmode.max_rx_pkt_len =
+        maxPayloadSize + (ETHER_MAX_VLAN_FRAME_LEN - ETHER_MTU);
+    if (maxPayloadSize > ETHER_MTU) {
+        portConf.rxmode.offloads |= DEV_RX_OFFLOAD_JUMBO_FRAME;
+    }
+    // Offload IPv4 header checksum work to the NIC where supported;
+    // computing checksums in software is a visible slice of per-packet cost
+    // at high line rates.
+    if (!DISABLE_CHECKSUM_OFFLOADS &&
+        (devInfo.tx_offload_capa & DEV_TX_OFFLOAD_IPV4_CKSUM)) {
+        portConf.txmode.offloads |= DEV_TX_OFFLOAD_IPV4_CKSUM;
+        hasTxIpv4CksumOffload = true;
+    } else {
+        NOTICE("Port %u does not support IPv4 TX checksum offload; "
+               "computing checksums in software",
+               port);
+    }
+    if (!DISABLE_CHECKSUM_OFFLOADS &&
+        (devInfo.rx_offload_capa & DEV_RX_OFFLOAD_IPV4_CKSUM)) {
+        portConf.rxmode.offloads |= DEV_RX_OFFLOAD_IPV4_CKSUM;
+        hasRxIpv4CksumOffload = true;
+    }
+    if (numRxQueues > 1) {
+        // Use RSS to spread inbound flows across the RX queues; each flow
+        // consistently hashes to one queue so per-queue pollers see stable
+        // subsets of the traffic.
+        portConf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+        portConf.rx_adv_conf.rss_conf.rss_key = NULL;
+        portConf.rx_adv_conf.rss_conf.rss_hf =
+            ETH_RSS_IP & devInfo.flow_type_rss_offloads;
+    }
+    if (ENABLE_RX_INTERRUPTS) {
+        // Raise an interrupt when a packet arrives on an armed RX queue so
+        // that waitForPackets() can put an idle polling thread to sleep.
+        portConf.intr_conf.rxq = 1;
+    }
+    ret = rte_eth_dev_configure(port, numRxQueues, numTxQueues, &portConf);
+    if (ret < 0 && ENABLE_RX_INTERRUPTS) {
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Failed to configure port %u with RX "
+                               "interrupts enabled: %s; the PMD may not "
+                               "support receive interrupts",
+                               port, rte_strerror(-ret)));
+    }
 
     // Set up a NIC/HW-based filter on the ethernet type so that only
     // traffic to a particular port is received by this driver.
@@ -675,27 +1334,51 @@ DpdkDriver::Impl::_init()
 
     // setup and initialize the receive and transmit NIC queues,
     // and activate the port.
-    rte_eth_rx_queue_setup(port, 0, NDESC, rte_eth_dev_socket_id(port), NULL,
-                           mbufPool);
-    rte_eth_tx_queue_setup(port, 0, NDESC, rte_eth_dev_socket_id(port), NULL);
-
-    // Install tx callback to track NIC queue length.
-    if (rte_eth_add_tx_callback(port, 0, txBurstCallback, &tx.stats) == NULL) {
-        throw DriverInitFailure(
-            HERE_STR,
-            StringUtil::format("Cannot set tx callback on port %u", port));
+    for (uint16_t q = 0; q < numRxQueues; ++q) {
+        rte_eth_rx_queue_setup(port, q, NDESC, rte_eth_dev_socket_id(port),
+                               NULL, mbufPool);
     }
+    for (uint16_t q = 0; q < numTxQueues; ++q) {
+        rte_eth_tx_queue_setup(port, q, NDESC, rte_eth_dev_socket_id(port),
+                               NULL);
 
-    // Initialize TX buffers
-    tx.buffer = static_cast<rte_eth_dev_tx_buffer*>(
-        rte_zmalloc_socket("tx_buffer", RTE_ETH_TX_BUFFER_SIZE(MAX_PKT_BURST),
-                           0, rte_eth_dev_socket_id(port)));
-    if (tx.buffer == NULL) {
-        throw DriverInitFailure(
-            HERE_STR, StringUtil::format(
-                          "Cannot allocate buffer for tx on port %u", port));
+        // Install tx callback to track the queue's length.
+        if (rte_eth_add_tx_callback(port, q, txBurstCallback,
+                                    &tx.queues[q].stats) == NULL) {
+            throw DriverInitFailure(
+                HERE_STR,
+                StringUtil::format("Cannot set tx callback on port %u queue %u",
+                                   port, q));
+        }
+
+        // Initialize the queue's TX buffers; highest-priority packets travel
+        // in their own lane (see sendPacket()).
+        tx.queues[q].buffer = static_cast<rte_eth_dev_tx_buffer*>(
+            rte_zmalloc_socket("tx_buffer",
+                               RTE_ETH_TX_BUFFER_SIZE(MAX_PKT_BURST), 0,
+                               rte_eth_dev_socket_id(port)));
+        if (tx.queues[q].buffer == NULL) {
+            throw DriverInitFailure(
+                HERE_STR,
+                StringUtil::format(
+                    "Cannot allocate buffer for tx on port %u queue %u", port,
+                    q));
+        }
+        rte_eth_tx_buffer_init(tx.queues[q].buffer, MAX_PKT_BURST);
+        tx.queues[q].priorityBuffer = static_cast<rte_eth_dev_tx_buffer*>(
+            rte_zmalloc_socket("tx_priority_buffer",
+                               RTE_ETH_TX_BUFFER_SIZE(MAX_PKT_BURST), 0,
+                               rte_eth_dev_socket_id(port)));
+        if (tx.queues[q].priorityBuffer == NULL) {
+            throw DriverInitFailure(
+                HERE_STR,
+                StringUtil::format(
+                    "Cannot allocate priority buffer for tx on port %u "
+                    "queue %u",
+                    port, q));
+        }
+        rte_eth_tx_buffer_init(tx.queues[q].priorityBuffer, MAX_PKT_BURST);
     }
-    rte_eth_tx_buffer_init(tx.buffer, MAX_PKT_BURST);
 
     // get the current MTU.
     ret = rte_eth_dev_get_mtu(port, &mtu);
@@ -707,8 +1390,20 @@ DpdkDriver::Impl::_init()
                                port));
     }
     // set the MTU that the NIC port should support
-    if (mtu != MAX_PAYLOAD_SIZE) {
-        ret = rte_eth_dev_set_mtu(port, MAX_PAYLOAD_SIZE);
+    if (mtu != maxPayloadSize) {
+        ret = rte_eth_dev_set_mtu(
+            port, Homa::Util::downCast<uint16_t>(maxPayloadSize));
+        if (ret != 0 && maxPayloadSize > MAX_PAYLOAD_SIZE) {
+            // The port refused the jumbo MTU; fall back to the standard
+            // Ethernet MTU.
+            NOTICE(
+                "Port %u rejected jumbo MTU %u: %s; "
+                "falling back to MTU %u",
+                port, maxPayloadSize, strerror(ret), MAX_PAYLOAD_SIZE);
+            maxPayloadSize = MAX_PAYLOAD_SIZE;
+            ret = rte_eth_dev_set_mtu(
+                port, Homa::Util::downCast<uint16_t>(maxPayloadSize));
+        }
         if (ret != 0) {
             throw DriverInitFailure(
                 HERE_STR,
@@ -716,7 +1411,7 @@ DpdkDriver::Impl::_init()
                                    "%s; current MTU is %u",
                                    port, strerror(ret), mtu));
         }
-        mtu = MAX_PAYLOAD_SIZE;
+        mtu = Homa::Util::downCast<uint16_t>(maxPayloadSize);
     }
 
     ret = rte_eth_dev_start(port);
@@ -748,14 +1443,29 @@ DpdkDriver::Impl::_init()
             "using default of %d Mbps",
             bandwidthMbps.load());
     }
-    // Reset the queueEstimator with the updated bandwidth.
-    new (&tx.stats.queueEstimator)
-        Util::QueueEstimator<std::chrono::steady_clock>(bandwidthMbps);
+    // Reset the queueEstimators with the updated bandwidth.
+    struct rte_eth_stats ethStats;
+    bool haveEthStats =
+        RECONCILE_TX_COMPLETIONS && (rte_eth_stats_get(port, &ethStats) == 0);
+    for (uint16_t q = 0; q < numTxQueues; ++q) {
+        Tx::Stats* stats = &tx.queues[q].stats;
+        new (&stats->queueEstimator)
+            Util::QueueEstimator<std::chrono::steady_clock>(
+                bandwidthMbps, RECONCILE_TX_COMPLETIONS);
+        if (haveEthStats && q < RTE_ETHDEV_QUEUE_STAT_CNTRS) {
+            // Baseline the per-queue transmit counter so that only packets
+            // sent from here on count as completions.
+            stats->trackCompletions = true;
+            stats->lastCompletedPackets = ethStats.q_opackets[q];
+        } else if (RECONCILE_TX_COMPLETIONS) {
+            stats->queueEstimator.setReconcileCompletions(false);
+        }
+    }
 
     // create an in-memory ring, used as a software loopback in order to
     // handle packets that are addressed to the localhost.
     loopbackRing =
-        rte_ring_create(ringName.c_str(), NB_LOOPBACK_SLOTS, SOCKET_ID_ANY, 0);
+        rte_ring_create(ringName.c_str(), NB_LOOPBACK_SLOTS, socketId, 0);
     if (NULL == loopbackRing) {
         throw DriverInitFailure(
             HERE_STR, StringUtil::format("Failed to allocate loopback ring: %s",
@@ -802,6 +1512,29 @@ DpdkDriver::Impl::txBurstCallback(uint16_t port_id, uint16_t queue,
     assert(bytesToSend <= stats->bufferedBytes);
     stats->bufferedBytes -= bytesToSend;
     stats->queueEstimator.signalBytesSent(bytesToSend);
+    if (stats->trackCompletions) {
+        for (uint16_t i = 0; i < nb_pkts; ++i) {
+            if (stats->pendingCount >= TX_TRACK_RING_SIZE) {
+                // The ring only fills up if the NIC's per-queue transmit
+                // counter has stopped advancing (e.g. the PMD doesn't
+                // actually maintain it); fall back to the purely
+                // bandwidth-based queue estimate.
+                stats->trackCompletions = false;
+                stats->pendingHead = 0;
+                stats->pendingCount = 0;
+                stats->queueEstimator.setReconcileCompletions(false);
+                WARNING(
+                    "NIC per-queue transmit counter for queue %u is not "
+                    "advancing; disabling TX completion reconciliation",
+                    queue);
+                break;
+            }
+            uint32_t slot =
+                (stats->pendingHead + stats->pendingCount) % TX_TRACK_RING_SIZE;
+            stats->pendingLengths[slot] = rte_pktmbuf_pkt_len(pkts[i]);
+            stats->pendingCount++;
+        }
+    }
     return nb_pkts;
 }
 
@@ -43,6 +43,13 @@ namespace DPDK {
 // Number of descriptors to allocate for the tx/rx rings
 const int NDESC = 256;
 
+// Capacity of the per-queue ring tracking the lengths of packets handed to
+// the NIC but not yet confirmed transmitted (see
+// Config::RECONCILE_TX_COMPLETIONS).  Must exceed the number of packets the
+// NIC can hold (NDESC); if the ring nonetheless fills, the NIC's per-queue
+// counters are not advancing and completion tracking is abandoned.
+const uint32_t TX_TRACK_RING_SIZE = 1024;
+
 // Maximum number of packet buffers that the memory pool can hold. The
 // documentation of `rte_mempool_create` suggests that the optimum value
 // (in terms of memory usage) of this number is a power of two minus one.
@@ -55,17 +62,65 @@ const int NB_MBUF = 16383;
 // and will never be used. See DPDK rte_mempool_create()
 const int MEMPOOL_CACHE_SIZE = 32;
 
-// The number of mbufs the driver should try to reserve for receiving packets.
+// The initial number of mbufs the driver holds back for receiving packets.
 // Prevents applications from claiming more mbufs once the number of available
-// mbufs reaches this level.
+// mbufs reaches this level.  The reserve adapts at runtime to the observed
+// RX occupancy (see Impl::updateMbufReserve()); this is only the starting
+// point.
 const uint32_t NB_MBUF_RESERVED = 4096;
 
+// Lower bound on the adaptive RX mbuf reserve; large enough to refill the
+// NIC's RX descriptor rings even when no received packets are being retained.
+const uint32_t MIN_MBUF_RESERVED = 1024;
+
+// Upper bound on the adaptive RX mbuf reserve; leaves at least half of the
+// mbuf pool available for transmission no matter how RX-heavy the workload.
+const uint32_t MAX_MBUF_RESERVED = NB_MBUF / 2;
+
+// The number of mbuf allocations (TX or RX) between recomputations of the
+// adaptive RX mbuf reserve; amortizes the bookkeeping over the fast path.
+const uint32_t MBUF_RESERVE_UPDATE_INTERVAL = 256;
+
+// The number of OverflowBuffer objects to pre-allocate at initialization.
+// Overflow buffers absorb packets when mbufs run out (e.g. during incast
+// bursts), which is exactly when the datapath can least afford to reach
+// malloc; pre-sizing the pool keeps the degraded path allocation-free.
+const uint32_t NB_OVERFLOW_BUFFERS = 1024;
+
 // The number of packets that can be held in loopback before they get dropped
 const uint32_t NB_LOOPBACK_SLOTS = 4096;
 
+/// Value stored in an mbuf's udata64 field to mark a loopback packet whose
+/// Ethernet/IP headers were elided by the fast loopback path in sendPacket();
+/// such packets carry their payload at the usual header offset with the bytes
+/// before it uninitialized, and their source is the local address.
+const uint64_t LOOPBACK_ELIDED_HEADERS = 0x484F4D414C4F4F50ull;  // "HOMALOOP"
+
 // The number of packets that the driver can buffer while corked.
 const uint16_t MAX_PKT_BURST = 32;
 
+// The number of mbuf recycle caches the driver maintains.  Each calling
+// thread is mapped to one of the caches (by ThreadId, like TX queues) so
+// that a poll thread that both frees received packets and allocates
+// transmit packets keeps reusing its own warm buffers instead of crossing
+// the mempool's per-lcore cache on every transition.
+const uint16_t NB_RECYCLE_CACHES = 8;
+
+// Capacity of each mbuf recycle cache, in mbufs; sized for a burst or two
+// so the release-then-alloc pattern within one poll iteration stays inside
+// the cache without hoarding a meaningful share of the mempool.
+const uint16_t RECYCLE_CACHE_SIZE = 2 * MAX_PKT_BURST;
+
+// The maximum number of NIC TX queues the driver will configure.  Each
+// calling thread is mapped to one of the queues (by ThreadId) so that
+// threads can transmit in parallel without contending on a single queue.
+const uint16_t MAX_TX_QUEUES = 8;
+
+// The maximum number of NIC RX queues the driver will configure.  When more
+// than one queue is available, the NIC spreads inbound flows across the
+// queues with RSS so that each queue can be polled independently.
+const uint16_t MAX_RX_QUEUES = 8;
+
 /// Size of VLAN tag, in bytes. We are using the PCP (Priority Code Point)
 /// field defined in the VLAN tag to specify the packet priority.
 const uint32_t VLAN_TAG_LEN = 4;
@@ -85,6 +140,13 @@ const uint32_t PACKET_HDR_LEN = ETHER_HDR_LEN + IP_HDR_LEN;
 // is normally 1500 bytes.
 const uint32_t MAX_PAYLOAD_SIZE = ETHER_MTU;
 
+// The largest MTU the driver will try to negotiate with the NIC.  Jumbo
+// frames reduce the per-packet protocol overhead (fewer traversals of
+// Sender::trySend and Receiver::handleDataPacket per message) on fabrics
+// that support them; the driver falls back to MAX_PAYLOAD_SIZE if the
+// port can't accommodate frames this large.
+const uint32_t MAX_JUMBO_PAYLOAD_SIZE = 9000;
+
 /// Map from priority levels to values of the PCP field. Note that PCP = 1
 /// is actually the lowest priority, while PCP = 0 is the second lowest.
 constexpr uint16_t PRIORITY_TO_PCP[8] = {1 << 13, 0 << 13, 2 << 13, 3 << 13,
@@ -105,8 +167,9 @@ enum EthPayloadType {
  * Allocated to store packet data when mbufs are not available.
  */
 struct OverflowBuffer {
-    /// Array of bytes used to store a packet's payload.
-    char* data[MAX_PAYLOAD_SIZE];
+    /// Array of bytes used to store a packet's payload; sized for the
+    /// largest payload the driver might negotiate.
+    char data[MAX_JUMBO_PAYLOAD_SIZE];
 };
 
 /**
@@ -139,6 +202,11 @@ class DpdkDriver::Impl {
         /// The memory location of this packet's header. The header should be
         /// PACKET_HDR_LEN in length.
         void* header;
+
+        /// True if this packet's mbuf was retained from the NIC by
+        /// receivePackets(); used to attribute the mbuf to the RX side of
+        /// the pool accounting when the packet is released.
+        bool rxRetained;
     };
 
     Impl(const char* ifname, const Config* const config = nullptr);
@@ -149,15 +217,20 @@ class DpdkDriver::Impl {
 
     // Interface Methods
     Driver::Packet* allocPacket();
+    void allocPackets(uint16_t numPackets, Driver::Packet* packets[]);
     void sendPacket(Driver::Packet* packet, IpAddress destination,
                     int priority);
+    void sendPackets(uint16_t numPackets, Driver::Packet* packets[],
+                     IpAddress destination, int priority);
     void cork();
     void uncork();
     uint32_t receivePackets(uint32_t maxPackets,
                             Driver::Packet* receivedPackets[],
-                            IpAddress sourceAddresses[]);
+                            IpAddress sourceAddresses[], int rxQueueId);
     void releasePackets(Driver::Packet* packets[], uint16_t numPackets);
     int getHighestPacketPriority();
+    int getRxQueueCount();
+    bool waitForPackets(int rxQueueId, uint64_t maxWaitMicros);
     uint32_t getMaxPayloadSize();
     uint32_t getBandwidth();
     IpAddress getLocalAddress();
@@ -166,6 +239,14 @@ class DpdkDriver::Impl {
   private:
     void _eal_init(int argc, char* argv[]);
     void _init();
+    uint16_t getTxQueueId();
+    struct rte_mbuf* recycleGet();
+    bool recyclePut(struct rte_mbuf* mbuf);
+    void updateMbufReserve();
+    void harvestTxCompletions();
+    bool attachExternalBuffer(struct rte_mbuf* mbuf, const void* data,
+                              int32_t length);
+    static void extBufferFreeCallback(void* addr, void* opaque);
     static uint16_t txBurstCallback(uint16_t port_id, uint16_t queue,
                                     struct rte_mbuf* pkts[], uint16_t nb_pkts,
                                     void* user_param);
@@ -190,6 +271,30 @@ class DpdkDriver::Impl {
     /// set by override).
     const int HIGHEST_PACKET_PRIORITY;
 
+    /// True if NIC IPv4 checksum offloads should not be used even when the
+    /// hardware supports them (see Config::DISABLE_CHECKSUM_OFFLOADS).
+    const bool DISABLE_CHECKSUM_OFFLOADS;
+
+    /// The NUMA socket on which the driver's DPDK memory should be allocated
+    /// (see Config::NUMA_SOCKET_ID); -1 means the socket of the constructing
+    /// thread, resolved once the EAL has been initialized.
+    const int NUMA_SOCKET_ID;
+
+    /// True if the NIC's receive queues raise interrupts so that
+    /// waitForPackets() can sleep until traffic arrives (see
+    /// Config::ENABLE_RX_INTERRUPTS).
+    const bool ENABLE_RX_INTERRUPTS;
+
+    /// True if the NIC queue estimates should be reconciled against the
+    /// NIC's per-queue transmit counters (see
+    /// Config::RECONCILE_TX_COMPLETIONS).
+    const bool RECONCILE_TX_COMPLETIONS;
+
+    /// Time (in nanoseconds since the steady_clock epoch) when TX
+    /// completions were last harvested; used to rate-limit reads of the
+    /// NIC's statistics registers.
+    std::atomic<uint64_t> lastTxHarvestNs;
+
     /// Protects access to the packetPool.
     SpinLock packetLock;
 
@@ -203,6 +308,26 @@ class DpdkDriver::Impl {
     /// The number of mbufs that have been given out to callers in Packets.
     uint32_t mbufsOutstanding;
 
+    /// The subset of mbufsOutstanding that holds received packets (mbufs
+    /// retained by receivePackets() and not yet released); the remainder
+    /// backs packets allocated for transmission.
+    uint32_t rxMbufsOutstanding;
+
+    /// The number of mbufs currently held back from transmit allocations so
+    /// that packet reception does not starve; recomputed periodically from
+    /// rxOccupancyPeak (see updateMbufReserve()).
+    uint32_t mbufReserve;
+
+    /// Decaying peak of rxMbufsOutstanding; tracks how many mbufs recent
+    /// bursts of received traffic have needed so that the reserve can follow
+    /// the workload up and (slowly) back down.
+    uint32_t rxOccupancyPeak;
+
+    /// The number of mbuf allocations since the reserve was last recomputed;
+    /// triggers updateMbufReserve() every MBUF_RESERVE_UPDATE_INTERVAL
+    /// allocations.
+    uint32_t allocsSinceReserveUpdate;
+
     /// Holds packet buffers that are dequeued from the NIC's HW queues
     /// via DPDK.
     struct rte_mempool* mbufPool;
@@ -213,33 +338,27 @@ class DpdkDriver::Impl {
 
     /// Members involved with receive (rx) operations.
     struct Rx {
-        /**
-         * Basic Constructor.
-         */
-        Rx()
-            : mutex()
-        {}
-
-        /// Provides thread safety for receive (rx) operations.
-        SpinLock mutex;
+        /// State associated with a single NIC RX queue.
+        struct Queue {
+            /**
+             * Basic Constructor.
+             */
+            Queue()
+                : mutex()
+            {}
+
+            /// Provides thread safety for receive operations on this queue.
+            SpinLock mutex;
+        };
+
+        /// Per-queue receive state; only the first numRxQueues entries are
+        /// used.
+        Queue queues[MAX_RX_QUEUES];
     } rx;
 
     /// Members involved with transmit (tx) operations.
     struct Tx {
-        /**
-         * Basic Constructor.
-         */
-        Tx()
-            : mutex()
-            , buffer(nullptr)
-            , stats()
-        {}
-
-        /// Provides thread safety for transmit (tx) operations.
-        SpinLock mutex;
-        /// Contains the packets buffered for sending when the driver is corked.
-        struct rte_eth_dev_tx_buffer* buffer;
-        /// Contains the transmit statistics.
+        /// Contains the transmit statistics of a single TX queue.
         struct Stats {
             /**
              * Basic Constructor.
@@ -248,6 +367,11 @@ class DpdkDriver::Impl {
                 : mutex()
                 , bufferedBytes(0)
                 , queueEstimator(0)
+                , trackCompletions(false)
+                , lastCompletedPackets(0)
+                , pendingLengths()
+                , pendingHead(0)
+                , pendingCount(0)
             {}
 
             /// Provides thread safe access to the stats block.
@@ -257,18 +381,116 @@ class DpdkDriver::Impl {
             /// Estimates the number of bytes waiting to be transmitted in the
             /// NICs transmit queue.
             Util::QueueEstimator<std::chrono::steady_clock> queueEstimator;
-        } stats;
+            /// True if this queue's estimate is reconciled against the NIC's
+            /// transmit counters (see Config::RECONCILE_TX_COMPLETIONS);
+            /// cleared if the counters turn out not to advance.
+            bool trackCompletions;
+            /// The NIC's transmitted-packet count for this queue when
+            /// completions were last harvested.
+            uint64_t lastCompletedPackets;
+            /// Ring holding the on-wire lengths of packets handed to the NIC
+            /// but not yet confirmed transmitted, in descriptor order.
+            uint32_t pendingLengths[TX_TRACK_RING_SIZE];
+            /// Index of the oldest entry in pendingLengths.
+            uint32_t pendingHead;
+            /// Number of valid entries in pendingLengths.
+            uint32_t pendingCount;
+        };
+
+        /// State associated with a single NIC TX queue.
+        struct Queue {
+            /**
+             * Basic Constructor.
+             */
+            Queue()
+                : mutex()
+                , buffer(nullptr)
+                , priorityBuffer(nullptr)
+                , stats()
+            {}
+
+            /// Provides thread safety for this queue.  Each thread maps to
+            /// its own queue, so the lock is uncontended unless there are
+            /// more threads than TX queues.
+            SpinLock mutex;
+            /// Contains the packets buffered for sending when the driver is
+            /// corked.
+            struct rte_eth_dev_tx_buffer* buffer;
+            /// Separate lane for packets sent at the driver's highest
+            /// priority (control packets and the smallest unscheduled
+            /// messages); always flushed ahead of _buffer_ so a corked burst
+            /// of bulk DATA cannot head-of-line block them.
+            struct rte_eth_dev_tx_buffer* priorityBuffer;
+            /// Contains this queue's transmit statistics.
+            Stats stats;
+        };
+
+        /// Per-queue transmit state; only the first numTxQueues entries are
+        /// initialized.
+        Queue queues[MAX_TX_QUEUES];
     } tx;
 
+    /// Members involved with mbuf recycling between releasePackets() and
+    /// allocPacket()/allocPackets().
+    struct Recycle {
+        /// A single thread's cache of reset, ready-to-reuse mbufs.
+        struct Cache {
+            /**
+             * Basic Constructor.
+             */
+            Cache()
+                : mutex()
+                , count(0)
+                , mbufs()
+            {}
+
+            /// Provides thread safety for this cache.  Each thread maps to
+            /// its own cache, so the lock is uncontended unless there are
+            /// more threads than caches.
+            SpinLock mutex;
+            /// Number of valid entries in mbufs.
+            uint16_t count;
+            /// The cached mbufs; treated as a stack so the most recently
+            /// released (warmest) buffer is reused first.
+            struct rte_mbuf* mbufs[RECYCLE_CACHE_SIZE];
+        };
+
+        /// Per-thread recycle caches; threads map onto the caches by
+        /// ThreadId.
+        Cache caches[NB_RECYCLE_CACHES];
+    } recycle;
+
+    /// The number of NIC TX queues actually configured; the lesser of
+    /// MAX_TX_QUEUES and the number of queues the NIC supports.
+    uint16_t numTxQueues;
+
+    /// The number of NIC RX queues actually configured; the lesser of
+    /// MAX_RX_QUEUES and the number of queues the NIC supports.
+    uint16_t numRxQueues;
+
     /// Hardware packet filter is provided by the NIC
     std::atomic<bool> hasHardwareFilter;
 
+    /// True if the NIC computes outbound IPv4 header checksums; when set,
+    /// sendPacket() leaves the checksum field zero and marks the mbuf for
+    /// offload instead of computing the checksum in software.
+    bool hasTxIpv4CksumOffload;
+
+    /// True if the NIC verifies inbound IPv4 header checksums; when set,
+    /// receivePackets() drops packets the NIC flagged as corrupted.
+    bool hasRxIpv4CksumOffload;
+
     /// True if the Driver should buffer sends for batched transmission. False,
     /// if the Driver should
     std::atomic<int> corked;
 
     /// Effective network bandwidth, in Mbits/second.
     std::atomic<uint32_t> bandwidthMbps;
+
+    /// The largest payload the NIC port will carry in a single packet;
+    /// negotiated during _init() (up to MAX_JUMBO_PAYLOAD_SIZE) and
+    /// constant thereafter.
+    uint32_t maxPayloadSize;
 };
 
 }  // namespace DPDK
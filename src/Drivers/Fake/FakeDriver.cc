@@ -15,118 +15,322 @@
 
 #include <Homa/Drivers/Fake/FakeDriver.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cstring>
+#include <mutex>
 #include <random>
-#include <unordered_map>
 
 #include "CodeLocation.h"
+#include "Debug.h"
+#include "MpmcRing.h"
 #include "StringUtil.h"
 
 namespace Homa {
 namespace Drivers {
 namespace Fake {
 
-// Used to generate random numbers;
-std::random_device rd;
-std::mt19937 gen(rd());
+/// The number of packets a FakeNIC can queue at each priority level before
+/// further arrivals are dropped; models a finite switch/NIC buffer.
+const uint32_t NIC_QUEUE_CAPACITY = 1024;
+
+/// The maximum number of endpoints the FakeNetwork can address.
+const uint32_t MAX_FAKE_NICS = 4096;
+
+/**
+ * Return the current time on the steady_clock timeline, in nanoseconds.
+ */
+static uint64_t
+nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/**
+ * Holds the incoming packets for a particular driver.
+ *
+ * Producers (senders anywhere in the process) push packets through the
+ * lock-free rings; the single consumer is the driver that owns this NIC.
+ */
+struct FakeNIC {
+    /// A set of incoming packets queued by priority.  Lock-free so that
+    /// many senders can deliver packets concurrently without serializing on
+    /// a NIC mutex.
+    std::array<Core::MpmcRing<FakePacket*, NIC_QUEUE_CAPACITY>,
+               NUM_PRIORITIES>
+        priorityQueue;
+
+    /// Consumer-side holding slot per priority for a packet popped from the
+    /// ring before its network arrival time; only touched by the owning
+    /// driver.
+    std::array<FakePacket*, NUM_PRIORITIES> staged;
+
+    /// Sender-side parking slot per priority used to inject reordering: a
+    /// parked packet is enqueued behind the next packet sent to this
+    /// endpoint at the same priority (see
+    /// FakeNetworkConfig::setPacketReorderRate()).
+    std::array<std::atomic<FakePacket*>, NUM_PRIORITIES> reorderSlot;
+
+    /// Time (in nanoseconds on the steady_clock timeline) at which this
+    /// endpoint's inbound link finishes serializing the packets already
+    /// sent to it; used to model link bandwidth.
+    std::atomic<uint64_t> linkIdleTimeNs;
+
+    FakeNIC()
+        : priorityQueue()
+        , staged()
+        , reorderSlot()
+        , linkIdleTimeNs(0)
+    {
+        staged.fill(nullptr);
+        for (int i = 0; i < NUM_PRIORITIES; ++i) {
+            reorderSlot.at(i).store(nullptr);
+        }
+    }
+
+    /// Drop any queued packets.
+    void drain()
+    {
+        for (int i = 0; i < NUM_PRIORITIES; ++i) {
+            if (staged.at(i) != nullptr) {
+                delete staged.at(i);
+                staged.at(i) = nullptr;
+            }
+            FakePacket* parked = reorderSlot.at(i).exchange(nullptr);
+            if (parked != nullptr) {
+                delete parked;
+            }
+            FakePacket* packet;
+            while (priorityQueue.at(i).tryPop(&packet)) {
+                delete packet;
+            }
+        }
+    }
+
+    ~FakeNIC()
+    {
+        drain();
+    }
+};
 
 /**
  * A fake network that allows a FakeDriver instances to pass around datagrams.
+ *
+ * The packet path (sendPacket/receive) is lock-free; a mutex is taken only
+ * when endpoints register and deregister.  Every packet is charged a
+ * serialization delay on the destination's inbound link (link bandwidth), a
+ * fixed propagation delay, a loss probability, and a reorder probability,
+ * all configurable through FakeNetworkConfig.
  */
 static class FakeNetwork {
   public:
     /// Constructor.
     FakeNetwork()
         : mutex()
-        , network()
+        , slots()
+        , freeAddressIds()
         , nextAddressId(1)
-        , packetLossRate(0)
-        , packetLossDistribution(0.0, 1.0)
+        , packetLossRate(0.0)
+        , bandwidthMbps(10000)
+        , propagationDelayNs(0)
+        , packetReorderRate(0.0)
     {}
 
     /// Destructor;
     ~FakeNetwork()
     {
-        std::lock_guard<std::mutex> lock_network(mutex);
-        for (auto it = network.begin(); it != network.end(); ++it) {
-            delete it->second;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint32_t i = 0; i < MAX_FAKE_NICS; ++i) {
+            FakeNIC* nic = slots[i].load();
+            if (nic != nullptr) {
+                delete nic;
+            }
         }
     }
 
-    /// Register the FakeNIC so it can receive packets.  Returns the newly
-    /// registered FakeNIC's addressId.
-    uint32_t registerNIC(FakeNIC* nic)
+    /// Attach a new endpoint to the network.  Returns its FakeNIC and sets
+    /// *addressId to the newly assigned address.  Endpoint state is reused
+    /// across re-registration so that a sender holding a stale address can
+    /// never touch freed memory.
+    FakeNIC* registerNIC(uint32_t* addressId)
     {
         std::lock_guard<std::mutex> lock(mutex);
-        uint32_t addressId = nextAddressId.fetch_add(1);
-        IpAddress ipAddress{addressId};
-        network.insert({ipAddress, nic});
-        return addressId;
+        uint32_t id;
+        if (!freeAddressIds.tryPop(&id)) {
+            id = nextAddressId.fetch_add(1);
+            if (id >= MAX_FAKE_NICS) {
+                ERROR("FakeNetwork endpoint limit (%u) exceeded", MAX_FAKE_NICS);
+                id = 0;  // Blackhole address; sends to it are dropped.
+            }
+        }
+        *addressId = id;
+        if (id == 0) {
+            return nullptr;
+        }
+        FakeNIC* nic = slots[id].load();
+        if (nic == nullptr) {
+            nic = new FakeNIC();
+            slots[id].store(nic);
+        } else {
+            // Reused endpoint; drop packets sent to the previous owner.
+            nic->drain();
+        }
+        return nic;
     }
 
-    /// Remove the FakeNIC from the network.
+    /// Detach the endpoint from the network.  Its queues are drained and its
+    /// address becomes available for reuse, but the FakeNIC itself stays
+    /// allocated in case a racing sender still holds a pointer to it.
     void deregisterNIC(uint32_t addressId)
     {
         std::lock_guard<std::mutex> lock(mutex);
-        IpAddress ipAddress{addressId};
-        network.erase(ipAddress);
+        if (addressId == 0 || addressId >= MAX_FAKE_NICS) {
+            return;
+        }
+        FakeNIC* nic = slots[addressId].load();
+        if (nic != nullptr) {
+            nic->drain();
+        }
+        freeAddressIds.tryPush(addressId);
     }
 
     /// Deliver the provide packet to the specified destination.
     void sendPacket(FakePacket* packet, int priority, IpAddress src,
                     IpAddress dst)
     {
-        FakeNIC* nic = nullptr;
-        {
-            std::lock_guard<std::mutex> lock(mutex);
-            if (packetLossDistribution(gen) < packetLossRate) {
-                return;
-            }
-            auto search = network.find(dst);
-            if (search == network.end()) {
+        assert(priority < NUM_PRIORITIES);
+        assert(priority >= 0);
+
+        // Loss model.
+        double lossRate = packetLossRate.load(std::memory_order_relaxed);
+        if (lossRate > 0.0) {
+            thread_local std::mt19937 gen(std::random_device{}());
+            std::uniform_real_distribution<> dis(0.0, 1.0);
+            if (dis(gen) < lossRate) {
                 return;
-            } else {
-                nic = search->second;
-                nic->mutex.lock();
             }
         }
-        assert(nic != nullptr);
-        std::lock_guard<std::mutex> lock_nic(nic->mutex, std::adopt_lock);
+
+        uint32_t dstId = (uint32_t)dst;
+        if (dstId == 0 || dstId >= MAX_FAKE_NICS) {
+            return;
+        }
+        FakeNIC* nic = slots[dstId].load(std::memory_order_acquire);
+        if (nic == nullptr) {
+            return;
+        }
+
         FakePacket* dstPacket = new FakePacket(*packet);
         dstPacket->sourceIp = src;
-        assert(priority < NUM_PRIORITIES);
-        assert(priority >= 0);
-        nic->priorityQueue.at(priority).push_back(dstPacket);
+
+        // Bandwidth and delay models: the packet starts serializing onto
+        // the destination's inbound link once the packets ahead of it have
+        // finished (cut-through, so its own serialization delays the *next*
+        // packet), then spends the propagation delay in flight.
+        uint64_t now = nowNs();
+        uint64_t serializationNs =
+            static_cast<uint64_t>(dstPacket->base.length) * 8000 /
+            bandwidthMbps.load(std::memory_order_relaxed);
+        uint64_t startNs;
+        uint64_t idle = nic->linkIdleTimeNs.load(std::memory_order_relaxed);
+        do {
+            startNs = std::max(now, idle);
+        } while (!nic->linkIdleTimeNs.compare_exchange_weak(
+            idle, startNs + serializationNs, std::memory_order_relaxed));
+        dstPacket->arrivalTimeNs =
+            startNs + propagationDelayNs.load(std::memory_order_relaxed);
+
+        // Reorder model: any previously parked packet is released behind the
+        // current one, transposing the two on the wire; the current packet
+        // may in turn be parked to await its successor.
+        FakePacket* parked = nullptr;
+        if (nic->reorderSlot.at(priority).load(std::memory_order_relaxed) !=
+            nullptr) {
+            parked = nic->reorderSlot.at(priority).exchange(
+                nullptr, std::memory_order_relaxed);
+        }
+        double reorderRate = packetReorderRate.load(std::memory_order_relaxed);
+        if (reorderRate > 0.0 && parked == nullptr) {
+            thread_local std::mt19937 gen(std::random_device{}());
+            std::uniform_real_distribution<> dis(0.0, 1.0);
+            if (dis(gen) < reorderRate) {
+                dstPacket = nic->reorderSlot.at(priority).exchange(
+                    dstPacket, std::memory_order_relaxed);
+            }
+        }
+        enqueue(nic, priority, dstPacket);
+        enqueue(nic, priority, parked);
     }
 
     void setPacketLossRate(double lossRate)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        if (lossRate > 1.0) {
-            packetLossRate = 1.0;
-        } else if (lossRate < 0.0) {
-            packetLossRate = 0.0;
-        } else {
-            packetLossRate = lossRate;
-        }
+        packetLossRate.store(std::min(std::max(lossRate, 0.0), 1.0));
+    }
+
+    void setLinkBandwidth(uint32_t newBandwidthMbps)
+    {
+        bandwidthMbps.store(std::max(newBandwidthMbps, 1U));
+    }
+
+    void setPropagationDelay(uint32_t delayUs)
+    {
+        propagationDelayNs.store(static_cast<uint64_t>(delayUs) * 1000);
+    }
+
+    void setPacketReorderRate(double reorderRate)
+    {
+        packetReorderRate.store(std::min(std::max(reorderRate, 0.0), 1.0));
+    }
+
+    uint32_t getLinkBandwidth()
+    {
+        return bandwidthMbps.load(std::memory_order_relaxed);
     }
 
   private:
-    /// Monitor lock for the entire FakeNetwork structure.
+    /// Add the packet to the destination NIC's queue (private helper
+    /// method).  A full queue models NIC buffer overflow: the packet is
+    /// dropped.  A null packet is ignored.
+    static void enqueue(FakeNIC* nic, int priority, FakePacket* packet)
+    {
+        if (packet == nullptr) {
+            return;
+        }
+        if (!nic->priorityQueue.at(priority).tryPush(packet)) {
+            delete packet;
+        }
+    }
+
+    /// Protects endpoint registration and deregistration; not taken on the
+    /// packet path.
     std::mutex mutex;
 
-    /// Holds all the packets being sent through the fake network.
-    std::unordered_map<IpAddress, FakeNIC*, IpAddress::Hasher> network;
+    /// Endpoint lookup table indexed by address; lock-free on the packet
+    /// path.  Slot 0 is reserved as a blackhole address.
+    std::atomic<FakeNIC*> slots[MAX_FAKE_NICS];
+
+    /// Addresses of deregistered endpoints available for reuse.
+    Core::MpmcRing<uint32_t, MAX_FAKE_NICS> freeAddressIds;
 
-    /// Identifier for the next FakeDriver that "connects" to the FakeNetwork.
+    /// Identifier for the next FakeDriver that "connects" to the FakeNetwork
+    /// when no previously used address is free.
     std::atomic<uint32_t> nextAddressId;
 
     /// Rate at which packets should be dropped when sent over this network.
-    double packetLossRate;
+    std::atomic<double> packetLossRate;
 
-    /// Distribution from which we will determine if a packet is dropped.
-    std::uniform_real_distribution<> packetLossDistribution;
+    /// Bandwidth of each endpoint's inbound link, in Mbits/second.
+    std::atomic<uint32_t> bandwidthMbps;
+
+    /// One-way propagation delay, in nanoseconds.
+    std::atomic<uint64_t> propagationDelayNs;
+
+    /// Rate at which packets should be transposed with their successor when
+    /// sent over this network.
+    std::atomic<double> packetReorderRate;
 
 } fakeNetwork;
 
@@ -136,27 +340,22 @@ FakeNetworkConfig::setPacketLossRate(double lossRate)
     fakeNetwork.setPacketLossRate(lossRate);
 }
 
-/**
- * FakeNIC constructor.
- */
-FakeNIC::FakeNIC()
-    : mutex()
-    , priorityQueue()
-{}
+void
+FakeNetworkConfig::setLinkBandwidth(uint32_t bandwidthMbps)
+{
+    fakeNetwork.setLinkBandwidth(bandwidthMbps);
+}
 
-/**
- * FakeNIC destructor.
- */
-FakeNIC::~FakeNIC()
+void
+FakeNetworkConfig::setPropagationDelay(uint32_t delayUs)
 {
-    std::lock_guard<std::mutex> lock_nic(mutex);
-    for (int i = 0; i < NUM_PRIORITIES; ++i) {
-        while (!priorityQueue.at(i).empty()) {
-            FakePacket* fakePacket = priorityQueue.at(i).front();
-            delete fakePacket;
-            priorityQueue.at(i).pop_front();
-        }
-    }
+    fakeNetwork.setPropagationDelay(delayUs);
+}
+
+void
+FakeNetworkConfig::setPacketReorderRate(double reorderRate)
+{
+    fakeNetwork.setPacketReorderRate(reorderRate);
 }
 
 /**
@@ -167,7 +366,7 @@ FakeDriver::FakeDriver()
     , nic()
     , queueEstimator(getBandwidth())
 {
-    localAddressId = fakeNetwork.registerNIC(&nic);
+    nic = fakeNetwork.registerNIC(&localAddressId);
 }
 
 /**
@@ -198,7 +397,7 @@ FakeDriver::sendPacket(Packet* packet, IpAddress destination, int priority)
     IpAddress srcAddress = getLocalAddress();
     IpAddress dstAddress = destination;
     fakeNetwork.sendPacket(srcPacket, priority, srcAddress, dstAddress);
-    queueEstimator.signalBytesSent(packet->length);
+    queueEstimator.signalBytesSent(packet->length + packet->extLength);
 }
 
 /**
@@ -208,12 +407,23 @@ uint32_t
 FakeDriver::receivePackets(uint32_t maxPackets, Packet* receivedPackets[],
                            IpAddress sourceAddresses[])
 {
-    std::lock_guard<std::mutex> lock_nic(nic.mutex);
+    if (nic == nullptr) {
+        return 0;
+    }
     uint32_t numReceived = 0;
+    uint64_t now = nowNs();
     for (int i = NUM_PRIORITIES - 1; i >= 0; --i) {
-        while (numReceived < maxPackets && !nic.priorityQueue.at(i).empty()) {
-            FakePacket* fakePacket = nic.priorityQueue.at(i).front();
-            nic.priorityQueue.at(i).pop_front();
+        while (numReceived < maxPackets) {
+            if (nic->staged.at(i) == nullptr &&
+                !nic->priorityQueue.at(i).tryPop(&nic->staged.at(i))) {
+                break;
+            }
+            FakePacket* fakePacket = nic->staged.at(i);
+            if (fakePacket->arrivalTimeNs > now) {
+                // Still traversing the fake network; hold it back.
+                break;
+            }
+            nic->staged.at(i) = nullptr;
             receivedPackets[numReceived] = &fakePacket->base;
             sourceAddresses[numReceived] = fakePacket->sourceIp;
             numReceived++;
@@ -257,8 +467,7 @@ FakeDriver::getMaxPayloadSize()
 uint32_t
 FakeDriver::getBandwidth()
 {
-    // 10 Gbps
-    return 10000;
+    return fakeNetwork.getLinkBandwidth();
 }
 
 /**
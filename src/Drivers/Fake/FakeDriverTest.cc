@@ -16,7 +16,11 @@
 #include <Homa/Drivers/Fake/FakeDriver.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "StringUtil.h"
 
@@ -27,10 +31,32 @@ namespace {
 
 TEST(FakeDriverTest, constructor)
 {
-    uint32_t nextAddressId = FakeDriver().localAddressId + 1;
+    FakeDriver driver1;
+    FakeDriver driver2;
+    // Live drivers must have distinct addresses.
+    EXPECT_NE(driver1.localAddressId, driver2.localAddressId);
+    EXPECT_NE(nullptr, driver1.nic);
+    EXPECT_NE(nullptr, driver2.nic);
+}
 
-    FakeDriver driver;
-    EXPECT_EQ(nextAddressId, driver.localAddressId);
+TEST(FakeDriverTest, constructor_addressReuse)
+{
+    uint32_t oldAddressId;
+    {
+        FakeDriver driver;
+        oldAddressId = driver.localAddressId;
+    }
+    // Deregistered addresses are recycled rather than leaked.  The recycle
+    // pool may already hold ids freed by drivers in other tests, so cycle
+    // through it (keeping each driver live so its id stays claimed) until the
+    // freed id comes back around.
+    std::vector<std::unique_ptr<FakeDriver>> drivers;
+    bool reused = false;
+    for (int i = 0; i < 100 && !reused; ++i) {
+        drivers.emplace_back(new FakeDriver());
+        reused = (drivers.back()->localAddressId == oldAddressId);
+    }
+    EXPECT_TRUE(reused);
 }
 
 TEST(FakeDriverTest, allocPacket)
@@ -54,125 +80,90 @@ TEST(FakeDriverTest, sendPackets)
         destinations[i] = driver2.getLocalAddress();
         prio[i] = i;
     }
-    destinations[2] = IpAddress{42};
-
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(7).size());
-
-    driver1.sendPacket(packets[0], destinations[0], prio[0]);
-
-    EXPECT_EQ(1U, driver2.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(7).size());
-    {
-        FakePacket* packet = driver2.nic.priorityQueue.at(0).front();
-        EXPECT_EQ(driver1.getLocalAddress(), packet->sourceIp);
-    }
+    // Packets sent to an address that was never registered are dropped.
+    destinations[2] = IpAddress{0};
 
     for (int i = 0; i < 4; ++i) {
         driver1.sendPacket(packets[i], destinations[i], prio[i]);
     }
 
-    EXPECT_EQ(2U, driver2.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(1U, driver2.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(1U, driver2.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver2.nic.priorityQueue.at(7).size());
-
-    delete container_of(packets[2], &FakePacket::base);
+    // Only the packets addressed to driver2 are delivered, highest priority
+    // first.
+    Driver::Packet* received[4];
+    IpAddress srcAddrs[4];
+    EXPECT_EQ(3U, driver2.receivePackets(4, received, srcAddrs));
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(driver1.getLocalAddress(), srcAddrs[i]);
+    }
+    driver2.releasePackets(received, 3);
+    driver1.releasePackets(packets, 4);
 }
 
 TEST(FakeDriverTest, receivePackets)
 {
-    std::string addressStr("42");
-    FakeDriver driver;
+    FakeDriver driver1;
+    FakeDriver driver2;
 
-    Driver::Packet* packets[4];
-    IpAddress srcAddrs[4];
+    Driver::Packet* packets[8];
+    IpAddress srcAddrs[8];
+
+    auto sendAtPriority = [&driver1, &driver2](int priority) {
+        Driver::Packet* packet = driver1.allocPacket();
+        driver1.sendPacket(packet, driver2.getLocalAddress(), priority);
+        driver1.releasePackets(&packet, 1);
+    };
 
     // 3 packets at priority 7
     for (int i = 0; i < 3; ++i)
-        driver.nic.priorityQueue.at(7).push_back(new FakePacket);
+        sendAtPriority(7);
     // 3 packets at priority 5
     for (int i = 0; i < 3; ++i)
-        driver.nic.priorityQueue.at(5).push_back(new FakePacket);
+        sendAtPriority(5);
     // 1 packet at priority 4
-    driver.nic.priorityQueue.at(4).push_back(new FakePacket);
+    sendAtPriority(4);
     // 1 packet at priority 2
-    driver.nic.priorityQueue.at(2).push_back(new FakePacket);
-
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(3U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(3U, driver.nic.priorityQueue.at(7).size());
-
-    EXPECT_EQ(4U, driver.receivePackets(4, packets, srcAddrs));
-    driver.releasePackets(packets, 4);
-
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(2U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(7).size());
-
-    EXPECT_EQ(1U, driver.receivePackets(1, packets, srcAddrs));
-    driver.releasePackets(packets, 1);
-
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(7).size());
-
-    driver.nic.priorityQueue.at(7).push_back(new FakePacket);
-
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(7).size());
-
-    EXPECT_EQ(1U, driver.receivePackets(1, packets, srcAddrs));
-    driver.releasePackets(packets, 1);
-
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(0).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(1).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(2).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(3).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(4).size());
-    EXPECT_EQ(1U, driver.nic.priorityQueue.at(5).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(6).size());
-    EXPECT_EQ(0U, driver.nic.priorityQueue.at(7).size());
-
-    EXPECT_EQ(3U, driver.receivePackets(4, packets, srcAddrs));
-    driver.releasePackets(packets, 3);
+    sendAtPriority(2);
+
+    // The first batch drains priority 7 and starts on priority 5.
+    EXPECT_EQ(4U, driver2.receivePackets(4, packets, srcAddrs));
+    driver2.releasePackets(packets, 4);
+
+    EXPECT_EQ(1U, driver2.receivePackets(1, packets, srcAddrs));
+    driver2.releasePackets(packets, 1);
+
+    sendAtPriority(7);
+
+    EXPECT_EQ(1U, driver2.receivePackets(1, packets, srcAddrs));
+    driver2.releasePackets(packets, 1);
+
+    EXPECT_EQ(3U, driver2.receivePackets(4, packets, srcAddrs));
+    driver2.releasePackets(packets, 3);
+
+    EXPECT_EQ(0U, driver2.receivePackets(4, packets, srcAddrs));
+}
+
+TEST(FakeDriverTest, receivePackets_propagationDelay)
+{
+    FakeDriver driver1;
+    FakeDriver driver2;
+
+    FakeNetworkConfig::setPropagationDelay(2000);  // 2 ms
+
+    Driver::Packet* packet = driver1.allocPacket();
+    driver1.sendPacket(packet, driver2.getLocalAddress(), 0);
+    driver1.releasePackets(&packet, 1);
+
+    Driver::Packet* received[1];
+    IpAddress srcAddrs[1];
+
+    // The packet is still "in flight".
+    EXPECT_EQ(0U, driver2.receivePackets(1, received, srcAddrs));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(4));
+    EXPECT_EQ(1U, driver2.receivePackets(1, received, srcAddrs));
+    driver2.releasePackets(received, 1);
+
+    FakeNetworkConfig::setPropagationDelay(0);
 }
 
 TEST(FakeDriverTest, releasePackets)
@@ -200,12 +191,13 @@ TEST(FakeDriverTest, getBandwidth)
 
 TEST(FakeDriverTest, getLocalAddress)
 {
-    uint32_t nextAddressId = FakeDriver().localAddressId + 1;
-    FakeDriver driver;
-    EXPECT_EQ(nextAddressId, (uint32_t)driver.getLocalAddress());
+    FakeDriver driver1;
+    FakeDriver driver2;
+    EXPECT_NE((uint32_t)driver1.getLocalAddress(),
+              (uint32_t)driver2.getLocalAddress());
 }
 
 }  // namespace
 }  // namespace Fake
 }  // namespace Drivers
-}  // namespace Homa
\ No newline at end of file
+}  // namespace Homa
@@ -0,0 +1,411 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "UdpDriverImpl.h"
+
+#include <fcntl.h>
+#include <net/if.h>
+#include <netinet/ip.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#include "CodeLocation.h"
+#include "Homa/Util.h"
+#include "StringUtil.h"
+
+namespace Homa {
+namespace Drivers {
+namespace UDP {
+
+/**
+ * Construct a UDP Packet.
+ */
+UdpDriver::Impl::Packet::Packet()
+    : base{.payload = buffer, .length = 0, .extData = nullptr, .extLength = 0}
+    , buffer()
+{}
+
+/**
+ * Construct a UdpDriver::Impl.
+ *
+ * @param ifname
+ *      Selects which network interface to use for communication.
+ * @param config
+ *      Optional configuration parameters (see Config).
+ *
+ * @throw DriverInitFailure
+ *      Thrown if the UdpDriver fails to initialize for any reason.
+ */
+UdpDriver::Impl::Impl(const char* ifname, const Config* const config)
+    : ifname(ifname)
+    , localIp()
+    , port((config == nullptr || config->PORT == 0) ? DEFAULT_PORT
+                                                    : config->PORT)
+    , fd(-1)
+    , HIGHEST_PACKET_PRIORITY(
+          (config == nullptr || config->HIGHEST_PACKET_PRIORITY_OVERRIDE < 0)
+              ? Homa::Util::arrayLength(PRIORITY_TO_TOS) - 1
+              : config->HIGHEST_PACKET_PRIORITY_OVERRIDE)
+    , packetLock()
+    , packetPool()
+    , txBufferPool()
+    , tx()
+    , corked(0)
+    , bandwidthMbps(10000)  // Default bandwidth = 10 gbs
+{
+    _init(config);
+}
+
+/**
+ * UdpDriver::Impl destructor.
+ */
+UdpDriver::Impl::~Impl()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// See Driver::allocPacket()
+Driver::Packet*
+UdpDriver::Impl::allocPacket()
+{
+    SpinLock::Lock lock(packetLock);
+    Packet* packet = packetPool.construct();
+    return &packet->base;
+}
+
+// See Driver::sendPacket()
+void
+UdpDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
+                            int priority)
+{
+    Packet* pkt = container_of(packet, &Packet::base);
+    uint32_t length = pkt->base.length + pkt->base.extLength;
+
+    // The kernel may not consume a staged datagram until a later flush,
+    // while the caller is free to modify or release its packet as soon as
+    // this method returns; stage a driver-owned copy.
+    TxBuffer* buf;
+    {
+        SpinLock::Lock lock(packetLock);
+        buf = txBufferPool.construct();
+    }
+    memcpy(buf->data, pkt->base.payload, pkt->base.length);
+    if (pkt->base.extLength > 0) {
+        memcpy(buf->data + pkt->base.length, pkt->base.extData,
+               pkt->base.extLength);
+    }
+
+    SpinLock::Lock txLock(tx.mutex);
+    uint16_t i = tx.count;
+    tx.buffers[i] = buf;
+    tx.iovecs[i].iov_base = buf->data;
+    tx.iovecs[i].iov_len = length;
+    tx.destinations[i].sin_family = AF_INET;
+    tx.destinations[i].sin_port = htobe16(port);
+    tx.destinations[i].sin_addr.s_addr = htobe32((uint32_t)destination);
+
+    struct msghdr* hdr = &tx.messages[i].msg_hdr;
+    memset(&tx.messages[i], 0, sizeof(tx.messages[i]));
+    hdr->msg_name = &tx.destinations[i];
+    hdr->msg_namelen = sizeof(tx.destinations[i]);
+    hdr->msg_iov = &tx.iovecs[i];
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = tx.control[i];
+    hdr->msg_controllen = CMSG_SPACE(sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = IPPROTO_IP;
+    cmsg->cmsg_type = IP_TOS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    int tos = PRIORITY_TO_TOS[priority];
+    memcpy(CMSG_DATA(cmsg), &tos, sizeof(int));
+
+    tx.count++;
+    tx.bufferedBytes += length;
+
+    // Flush packets now if the batch is full or the driver is not corked.
+    if (tx.count >= MAX_PKT_BURST || corked.load() < 1) {
+        flushTxBatch(txLock);
+    }
+}
+
+// See Driver::cork()
+void
+UdpDriver::Impl::cork()
+{
+    corked.fetch_add(1);
+}
+
+// See Driver::uncork()
+void
+UdpDriver::Impl::uncork()
+{
+    if (corked.fetch_sub(1) == 1) {
+        SpinLock::Lock txLock(tx.mutex);
+        flushTxBatch(txLock);
+    }
+}
+
+// See Driver::receivePackets()
+uint32_t
+UdpDriver::Impl::receivePackets(uint32_t maxPackets,
+                                Driver::Packet* receivedPackets[],
+                                IpAddress sourceAddresses[])
+{
+    uint32_t numToReceive = std::min(maxPackets, (uint32_t)MAX_PKT_BURST);
+    Packet* packets[MAX_PKT_BURST];
+    struct mmsghdr messages[MAX_PKT_BURST];
+    struct iovec iovecs[MAX_PKT_BURST];
+    struct sockaddr_in sources[MAX_PKT_BURST];
+    memset(messages, 0, numToReceive * sizeof(messages[0]));
+
+    {
+        SpinLock::Lock lock(packetLock);
+        for (uint32_t i = 0; i < numToReceive; ++i) {
+            packets[i] = packetPool.construct();
+        }
+    }
+    for (uint32_t i = 0; i < numToReceive; ++i) {
+        iovecs[i].iov_base = packets[i]->buffer;
+        iovecs[i].iov_len = MAX_PAYLOAD_SIZE;
+        messages[i].msg_hdr.msg_name = &sources[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received = recvmmsg(fd, messages, numToReceive, MSG_DONTWAIT, nullptr);
+    if (received < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            WARNING("recvmmsg failed: %s", strerror(errno));
+        }
+        received = 0;
+    }
+
+    for (int i = 0; i < received; ++i) {
+        packets[i]->base.length = messages[i].msg_len;
+        receivedPackets[i] = &packets[i]->base;
+        sourceAddresses[i] = IpAddress{be32toh(sources[i].sin_addr.s_addr)};
+    }
+
+    // Return the packets that were allocated but not filled.
+    if ((uint32_t)received < numToReceive) {
+        SpinLock::Lock lock(packetLock);
+        for (uint32_t i = received; i < numToReceive; ++i) {
+            packetPool.destroy(packets[i]);
+        }
+    }
+
+    return Homa::Util::downCast<uint32_t>(received);
+}
+
+// See Driver::releasePackets()
+void
+UdpDriver::Impl::releasePackets(Driver::Packet* packets[], uint16_t numPackets)
+{
+    SpinLock::Lock lock(packetLock);
+    for (uint16_t i = 0; i < numPackets; ++i) {
+        Packet* packet = container_of(packets[i], &Packet::base);
+        packetPool.destroy(packet);
+    }
+}
+
+// See Driver::getHighestPacketPriority()
+int
+UdpDriver::Impl::getHighestPacketPriority()
+{
+    return HIGHEST_PACKET_PRIORITY;
+}
+
+// See Driver::getMaxPayloadSize()
+uint32_t
+UdpDriver::Impl::getMaxPayloadSize()
+{
+    return MAX_PAYLOAD_SIZE;
+}
+
+// See Driver::getBandwidth()
+uint32_t
+UdpDriver::Impl::getBandwidth()
+{
+    return bandwidthMbps.load();
+}
+
+// See Driver::getLocalAddress()
+IpAddress
+UdpDriver::Impl::getLocalAddress()
+{
+    return localIp;
+}
+
+// See Driver::getQueuedBytes()
+uint32_t
+UdpDriver::Impl::getQueuedBytes()
+{
+    SpinLock::Lock txLock(tx.mutex);
+    return Homa::Util::downCast<uint32_t>(tx.bufferedBytes) +
+           tx.queueEstimator.getQueuedBytes();
+}
+
+/**
+ * Hand the staged transmit batch to the kernel in a single sendmmsg()
+ * syscall and recycle the staging buffers.
+ *
+ * @param txLock
+ *      Reminder that tx.mutex must be held when calling this method.
+ */
+void
+UdpDriver::Impl::flushTxBatch(const SpinLock::Lock& txLock)
+{
+    (void)txLock;
+    uint16_t sent = 0;
+    while (sent < tx.count) {
+        int ret = sendmmsg(fd, &tx.messages[sent], tx.count - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            WARNING("sendmmsg failed with %u packets staged: %s",
+                    tx.count - sent, strerror(errno));
+            break;
+        }
+        for (int i = 0; i < ret; ++i) {
+            tx.queueEstimator.signalBytesSent(
+                Homa::Util::downCast<uint32_t>(
+                    tx.iovecs[sent + i].iov_len));
+        }
+        sent = Homa::Util::downCast<uint16_t>(sent + ret);
+    }
+
+    SpinLock::Lock lock(packetLock);
+    for (uint16_t i = 0; i < tx.count; ++i) {
+        txBufferPool.destroy(tx.buffers[i]);
+    }
+    tx.count = 0;
+    tx.bufferedBytes = 0;
+}
+
+/**
+ * Helper function to create and configure the UDP socket and initialize the
+ * driver's data structures.
+ *
+ * @param config
+ *      Optional configuration parameters (see Config).
+ *
+ * @throw DriverInitFailure
+ *      Thrown if the driver fails to initialize for any reason.
+ */
+void
+UdpDriver::Impl::_init(const Config* const config)
+{
+    (void)config;
+
+    // Use ioctl to obtain the IP address of the network interface.
+    struct ifreq ifr;
+    if (ifname.length() >= sizeof(ifr.ifr_name)) {
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Interface name %s too long", ifname.c_str()));
+    }
+    ifname.copy(ifr.ifr_name, ifname.length());
+    ifr.ifr_name[ifname.length()] = 0;
+
+    int ioctlFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ioctlFd == -1) {
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Failed to create socket: %s", strerror(errno)));
+    }
+    if (ioctl(ioctlFd, SIOCGIFADDR, &ifr) == -1) {
+        char* error = strerror(errno);
+        close(ioctlFd);
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Failed to obtain IP address: %s", error));
+    }
+    close(ioctlFd);
+    localIp = {be32toh(((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr.s_addr)};
+
+    // Read the link speed from sysfs; fall back to the default if the
+    // interface doesn't report one (e.g. virtual devices).
+    std::ifstream speedFile("/sys/class/net/" + ifname + "/speed");
+    int speedMbps = 0;
+    if (speedFile >> speedMbps && speedMbps > 0) {
+        bandwidthMbps.store(Homa::Util::downCast<uint32_t>(speedMbps));
+    } else {
+        NOTICE("Interface %s does not report a link speed; assuming %u Mbps",
+               ifname.c_str(), bandwidthMbps.load());
+    }
+
+    // Create and bind the UDP socket.
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Failed to create UDP socket: %s",
+                               strerror(errno)));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htobe16(port);
+    addr.sin_addr.s_addr = htobe32((uint32_t)localIp);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        throw DriverInitFailure(
+            HERE_STR, StringUtil::format("Failed to bind to port %u: %s", port,
+                                         strerror(errno)));
+    }
+
+    // Large socket buffers absorb bursts that the transport has already
+    // paced; without them the kernel drops packets the transport believes
+    // are in flight.
+    int bufferSize = SOCKET_BUFFER_SIZE;
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufferSize,
+                   sizeof(bufferSize)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize,
+                   sizeof(bufferSize)) != 0) {
+        NOTICE("Failed to resize socket buffers: %s", strerror(errno));
+    }
+
+    // Ask the kernel to busy poll the socket's receive queue so that
+    // receive latency does not depend on interrupts.
+#ifdef SO_BUSY_POLL
+    int busyPollUsecs = BUSY_POLL_USECS;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busyPollUsecs,
+                   sizeof(busyPollUsecs)) != 0) {
+        NOTICE("Failed to enable busy polling: %s", strerror(errno));
+    }
+#endif
+
+    // Pre-size the pools so that the datapath never reaches malloc.
+    {
+        SpinLock::Lock lock(packetLock);
+        packetPool.reserve(NB_PACKET_BUFFERS);
+        txBufferPool.reserve(MAX_PKT_BURST);
+    }
+
+    NOTICE("Using interface %s, ip %s, udp port %u", ifname.c_str(),
+           IpAddress::toString(localIp).c_str(), port);
+}
+
+}  // namespace UDP
+}  // namespace Drivers
+}  // namespace Homa
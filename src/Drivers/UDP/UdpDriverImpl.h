@@ -0,0 +1,189 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_DRIVERS_UDP_UDPDRIVERIMPL_H
+#define HOMA_DRIVERS_UDP_UDPDRIVERIMPL_H
+
+#include <Homa/Drivers/UDP/UdpDriver.h>
+#include <Homa/Drivers/Util/QueueEstimator.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "ObjectPool.h"
+#include "SpinLock.h"
+
+namespace Homa {
+namespace Drivers {
+namespace UDP {
+
+/// The UDP port used for Homa traffic when none is configured.
+const uint16_t DEFAULT_PORT = 15221;
+
+// The number of packets sent or received in a single sendmmsg()/recvmmsg()
+// syscall while the driver is corked; matches the burst size used by the
+// other Homa drivers.
+const uint16_t MAX_PKT_BURST = 32;
+
+// The maximum payload a UDP datagram can carry without fragmenting a
+// standard Ethernet frame (MTU minus the IPv4 and UDP headers).
+const uint32_t MAX_PAYLOAD_SIZE = 1472;
+
+// The number of packet buffers to pre-allocate at initialization so that
+// the datapath does not reach malloc.
+const uint32_t NB_PACKET_BUFFERS = 8192;
+
+// Number of microseconds the kernel should busy poll the socket's receive
+// queue on the application's behalf (see SO_BUSY_POLL).
+const int BUSY_POLL_USECS = 20;
+
+// Size of the kernel send and receive socket buffers, in bytes.  Large
+// buffers absorb bursts that the transport has already paced.
+const int SOCKET_BUFFER_SIZE = 1 << 22;
+
+/// Map from priority levels to values of the IP TOS field; matches the
+/// encoding used by the other Homa drivers so that mixed deployments agree
+/// on packet priorities.
+constexpr uint8_t PRIORITY_TO_TOS[8] = {0x20, 0x00, 0x40, 0x60,
+                                        0x80, 0xA0, 0xC0, 0xE0};
+
+/**
+ * Holds the private members of the UdpDriver so that they are not exposed in
+ * the API header.
+ */
+class UdpDriver::Impl {
+  public:
+    /**
+     * UDP specific Packet object used to track its lifetime and contents.
+     */
+    struct Packet {
+        Packet();
+
+        /// C-style "inheritance"
+        Driver::Packet base;
+
+        /// Array of bytes that backs the packet's payload.
+        char buffer[MAX_PAYLOAD_SIZE];
+    };
+
+    Impl(const char* ifname, const Config* const config = nullptr);
+    virtual ~Impl();
+
+    // Interface Methods
+    Driver::Packet* allocPacket();
+    void sendPacket(Driver::Packet* packet, IpAddress destination,
+                    int priority);
+    void cork();
+    void uncork();
+    uint32_t receivePackets(uint32_t maxPackets,
+                            Driver::Packet* receivedPackets[],
+                            IpAddress sourceAddresses[]);
+    void releasePackets(Driver::Packet* packets[], uint16_t numPackets);
+    int getHighestPacketPriority();
+    uint32_t getMaxPayloadSize();
+    uint32_t getBandwidth();
+    IpAddress getLocalAddress();
+    uint32_t getQueuedBytes();
+
+  private:
+    /**
+     * Driver-owned copy of an outbound packet staged for the next
+     * sendmmsg() batch; lets the caller reuse or release its packet as soon
+     * as sendPacket() returns.
+     */
+    struct TxBuffer {
+        /// Bytes to be transmitted.
+        char data[MAX_PAYLOAD_SIZE];
+    };
+
+    void _init(const Config* const config);
+    void flushTxBatch(const SpinLock::Lock& txLock);
+
+    /// Name of the Linux network interface used for communication.
+    std::string ifname;
+
+    /// Stores the IpAddress of the driver.
+    IpAddress localIp;
+
+    /// The UDP port on which Homa traffic is sent and received.
+    uint16_t port;
+
+    /// File descriptor of the UDP socket.
+    int fd;
+
+    /// Stores the driver's maximum network packet priority (either default or
+    /// set by override).
+    const int HIGHEST_PACKET_PRIORITY;
+
+    /// Protects access to the packetPool and txBufferPool.
+    SpinLock packetLock;
+
+    /// Provides memory allocation for the UDP specific implementation of a
+    /// Driver Packet.
+    ObjectPool<Packet> packetPool;
+
+    /// Provides memory allocation for staged transmit copies.
+    ObjectPool<TxBuffer> txBufferPool;
+
+    /// Members involved with transmit (tx) operations.
+    struct Tx {
+        /**
+         * Basic Constructor.
+         */
+        Tx()
+            : mutex()
+            , count(0)
+            , bufferedBytes(0)
+            , queueEstimator(10000)
+        {}
+
+        /// Provides thread safety for transmit operations.
+        SpinLock mutex;
+        /// Per-datagram headers for the staged batch; entry i transmits
+        /// buffers[i] through iovecs[i] to destinations[i].
+        struct mmsghdr messages[MAX_PKT_BURST];
+        /// Scatter/gather descriptors for the staged batch.
+        struct iovec iovecs[MAX_PKT_BURST];
+        /// Destination addresses for the staged batch.
+        struct sockaddr_in destinations[MAX_PKT_BURST];
+        /// Ancillary data carrying each datagram's IP_TOS (packet priority).
+        char control[MAX_PKT_BURST][CMSG_SPACE(sizeof(int))];
+        /// Driver-owned payload copies for the staged batch.
+        TxBuffer* buffers[MAX_PKT_BURST];
+        /// Number of staged datagrams.
+        uint16_t count;
+        /// Number of bytes staged but not yet handed to the kernel.
+        uint64_t bufferedBytes;
+        /// Estimates the number of bytes waiting to be transmitted in the
+        /// kernel's and NIC's output queues.
+        Util::QueueEstimator<std::chrono::steady_clock> queueEstimator;
+    } tx;
+
+    /// True if the Driver should buffer sends for batched transmission.
+    std::atomic<int> corked;
+
+    /// Effective network bandwidth, in Mbits/second.
+    std::atomic<uint32_t> bandwidthMbps;
+};
+
+}  // namespace UDP
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_DRIVERS_UDP_UDPDRIVERIMPL_H
@@ -85,6 +85,53 @@ TEST_F(QueueEstimatorTest, signalBytesSent)
     // Nothing to test; tested by QueueEstimatorTest_getQueuedBytes.
 }
 
+TEST_F(QueueEstimatorTest, getQueuedBytes_reconcileCompletions)
+{
+    QueueEstimator<MockClock> estimator(8, true);
+
+    // 1000B queued.
+    MockClock::mockTimeNS = 31000000;
+    estimator.signalBytesSent(1000);
+    EXPECT_EQ(1000U, estimator.unacknowledgedBytes);
+
+    // The model would have drained the queue after +2000 us, but the NIC
+    // has confirmed nothing; the estimate holds at the unconfirmed bytes.
+    MockClock::mockTimeNS = 33000000;
+    EXPECT_EQ(1000, estimator.getQueuedBytes());
+
+    // Confirming 600 bytes lowers the floor.
+    estimator.signalBytesCompleted(600);
+    EXPECT_EQ(400, estimator.getQueuedBytes());
+
+    // Confirming the rest releases the estimate entirely.
+    estimator.signalBytesCompleted(400);
+    EXPECT_EQ(0, estimator.getQueuedBytes());
+    EXPECT_EQ(0U, estimator.unacknowledgedBytes);
+
+    // While the model still holds bytes queued, completions don't lower
+    // the model's estimate.
+    MockClock::mockTimeNS = 34000000;
+    estimator.signalBytesSent(1000);
+    MockClock::mockTimeNS = 34100000;
+    estimator.signalBytesCompleted(1000);
+    EXPECT_EQ(900, estimator.getQueuedBytes());
+}
+
+TEST_F(QueueEstimatorTest, setReconcileCompletions)
+{
+    QueueEstimator<MockClock> estimator(8, true);
+
+    MockClock::mockTimeNS = 40000000;
+    estimator.signalBytesSent(1000);
+
+    // Disabling reconciliation discards the unconfirmed bytes; the model
+    // drains the queue on its own.
+    estimator.setReconcileCompletions(false);
+    EXPECT_EQ(0U, estimator.unacknowledgedBytes);
+    MockClock::mockTimeNS = 43000000;
+    EXPECT_EQ(0, estimator.getQueuedBytes());
+}
+
 TEST_F(QueueEstimatorTest, refreshQueuedBytesEstimate)
 {
     // Nothing to test; tested by QueueEstimatorTest_getQueuedBytes.
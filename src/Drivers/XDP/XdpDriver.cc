@@ -0,0 +1,110 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Homa/Drivers/XDP/XdpDriver.h>
+
+#include "XdpDriverImpl.h"
+
+namespace Homa {
+namespace Drivers {
+namespace XDP {
+
+XdpDriver::XdpDriver(const char* ifname, const Config* const config)
+    : pImpl(new Impl(ifname, config))
+{}
+
+XdpDriver::~XdpDriver() = default;
+
+/// See Driver::allocPacket()
+Driver::Packet*
+XdpDriver::allocPacket()
+{
+    return pImpl->allocPacket();
+}
+
+/// See Driver::sendPacket()
+void
+XdpDriver::sendPacket(Packet* packet, IpAddress destination, int priority)
+{
+    return pImpl->sendPacket(packet, destination, priority);
+}
+
+/// See Driver::cork()
+void
+XdpDriver::cork()
+{
+    pImpl->cork();
+}
+
+/// See Driver::uncork()
+void
+XdpDriver::uncork()
+{
+    pImpl->uncork();
+}
+
+/// See Driver::receivePackets()
+uint32_t
+XdpDriver::receivePackets(uint32_t maxPackets, Packet* receivedPackets[],
+                          IpAddress sourceAddresses[])
+{
+    return pImpl->receivePackets(maxPackets, receivedPackets, sourceAddresses);
+}
+
+/// See Driver::releasePackets()
+void
+XdpDriver::releasePackets(Packet* packets[], uint16_t numPackets)
+{
+    pImpl->releasePackets(packets, numPackets);
+}
+
+/// See Driver::getHighestPacketPriority()
+int
+XdpDriver::getHighestPacketPriority()
+{
+    return pImpl->getHighestPacketPriority();
+}
+
+/// See Driver::getMaxPayloadSize()
+uint32_t
+XdpDriver::getMaxPayloadSize()
+{
+    return pImpl->getMaxPayloadSize();
+}
+
+/// See Driver::getBandwidth()
+uint32_t
+XdpDriver::getBandwidth()
+{
+    return pImpl->getBandwidth();
+}
+
+/// See Driver::getLocalAddress()
+IpAddress
+XdpDriver::getLocalAddress()
+{
+    return pImpl->getLocalAddress();
+}
+
+/// See Driver::getQueuedBytes();
+uint32_t
+XdpDriver::getQueuedBytes()
+{
+    return pImpl->getQueuedBytes();
+}
+
+}  // namespace XDP
+}  // namespace Drivers
+}  // namespace Homa
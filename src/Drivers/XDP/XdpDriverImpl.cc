@@ -0,0 +1,729 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "XdpDriverImpl.h"
+
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#include "CodeLocation.h"
+#include "Homa/Util.h"
+#include "StringUtil.h"
+
+#define IP_DN_FRAGMENT_FLAG 0x0040
+
+namespace Homa {
+namespace Drivers {
+namespace XDP {
+
+/**
+ * Construct a MacAddress from a string representation.
+ *
+ * @param macStr
+ *      MAC address given as a colon-separated hex string (e.g. as found in
+ *      /proc/net/arp).
+ */
+MacAddress::MacAddress(const char* macStr)
+    : address()
+{
+    sscanf(macStr,  // NOLINT
+           "%02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx", &address[0],
+           &address[1], &address[2], &address[3], &address[4], &address[5]);
+}
+
+/**
+ * Compute the IPv4 header checksum over the given header.
+ *
+ * @param hdr
+ *      The IPv4 header whose checksum field should be computed; the field
+ *      itself must be zero.
+ * @return
+ *      The checksum in network byte order.
+ */
+static uint16_t
+ipv4Checksum(const struct iphdr* hdr)
+{
+    const uint16_t* data = reinterpret_cast<const uint16_t*>(hdr);
+    uint32_t sum = 0;
+    for (size_t i = 0; i < IP_HDR_LEN / 2; ++i) {
+        sum += data[i];
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+    return Homa::Util::downCast<uint16_t>(~sum & 0xFFFF);
+}
+
+/**
+ * Construct an XDP Packet backed by a UMEM frame.
+ *
+ * @param frameAddr
+ *      Byte offset of the backing frame within the UMEM region.
+ * @param data
+ *      Memory location in the frame where the packet data should be stored.
+ */
+XdpDriver::Impl::Packet::Packet(uint64_t frameAddr, void* data)
+    : base{.payload = data, .length = 0, .extData = nullptr, .extLength = 0}
+    , bufType(FRAME)
+    , bufRef()
+{
+    bufRef.frameAddr = frameAddr;
+}
+
+/**
+ * Construct an XDP Packet backed by an OverflowBuffer.
+ *
+ * @param overflowBuf
+ *      OverflowBuffer that holds this packet.
+ */
+XdpDriver::Impl::Packet::Packet(OverflowBuffer* overflowBuf)
+    : base{.payload = overflowBuf->data,
+           .length = 0,
+           .extData = nullptr,
+           .extLength = 0}
+    , bufType(OVERFLOW_BUF)
+    , bufRef()
+{
+    bufRef.overflowBuf = overflowBuf;
+}
+
+/**
+ * Construct an XdpDriver::Impl.
+ *
+ * @param ifname
+ *      Selects which network interface to use for communication.
+ * @param config
+ *      Optional configuration parameters (see Config).
+ *
+ * @throw DriverInitFailure
+ *      Thrown if the XdpDriver fails to initialize for any reason.
+ */
+XdpDriver::Impl::Impl(const char* ifname, const Config* const config)
+    : ifname(ifname)
+    , queueId(config == nullptr ? 0 : config->QUEUE_ID)
+    , arpTable()
+    , localIp()
+    , localMac()
+    , HIGHEST_PACKET_PRIORITY(
+          (config == nullptr || config->HIGHEST_PACKET_PRIORITY_OVERRIDE < 0)
+              ? Homa::Util::arrayLength(PRIORITY_TO_TOS) - 1
+              : config->HIGHEST_PACKET_PRIORITY_OVERRIDE)
+    , packetLock()
+    , packetPool()
+    , overflowBufferPool()
+    , freeFrames()
+    , umemArea(nullptr)
+    , umem(nullptr)
+    , xsk(nullptr)
+    , fillRing()
+    , compRing()
+    , rxRing()
+    , txRing()
+    , rxLock()
+    , txLock()
+    , inflightTxBytes()
+    , loopbackLock()
+    , loopback()
+    , corked(0)
+    , queuedBytes(0)
+    , bandwidthMbps(10000)  // Default bandwidth = 10 gbs
+    , zeroCopy(false)
+{
+    _init(config);
+}
+
+/**
+ * XdpDriver::Impl destructor.
+ */
+XdpDriver::Impl::~Impl()
+{
+    if (xsk != nullptr) {
+        xsk_socket__delete(xsk);
+    }
+    if (umem != nullptr) {
+        xsk_umem__delete(umem);
+    }
+    if (umemArea != nullptr) {
+        munmap(umemArea, static_cast<size_t>(NUM_FRAMES) * FRAME_SIZE);
+    }
+}
+
+// See Driver::allocPacket()
+Driver::Packet*
+XdpDriver::Impl::allocPacket()
+{
+    XdpDriver::Impl::Packet* packet = nullptr;
+    {
+        SpinLock::Lock lock(packetLock);
+        if (freeFrames.size() > NB_FRAMES_RESERVED) {
+            uint64_t frameAddr = freeFrames.back();
+            freeFrames.pop_back();
+            packet = packetPool.construct(frameAddr,
+                                          frame(frameAddr) + PACKET_HDR_LEN);
+            return &packet->base;
+        }
+    }
+
+    // Running low on frames; recover any the kernel has finished
+    // transmitting and retry before falling back to overflow memory.
+    reclaimTxCompletions();
+
+    SpinLock::Lock lock(packetLock);
+    if (freeFrames.size() > NB_FRAMES_RESERVED) {
+        uint64_t frameAddr = freeFrames.back();
+        freeFrames.pop_back();
+        packet = packetPool.construct(frameAddr,
+                                      frame(frameAddr) + PACKET_HDR_LEN);
+    } else {
+        OverflowBuffer* buf = overflowBufferPool.construct();
+        packet = packetPool.construct(buf);
+        NOTICE("OverflowBuffer used.");
+    }
+    return &packet->base;
+}
+
+// See Driver::sendPacket()
+void
+XdpDriver::Impl::sendPacket(Driver::Packet* packet, IpAddress destination,
+                            int priority)
+{
+    XdpDriver::Impl::Packet* pkt =
+        container_of(packet, &XdpDriver::Impl::Packet::base);
+    uint32_t payloadLength = pkt->base.length + pkt->base.extLength;
+
+    // Packets destined to the local IP will never make it out to the NIC;
+    // copy them straight onto the loopback queue without Ethernet/IP
+    // framing.
+    if (destination == localIp) {
+        uint64_t loopFrame;
+        {
+            SpinLock::Lock lock(packetLock);
+            if (freeFrames.empty()) {
+                WARNING("No free frame for loopback; dropping packet");
+                return;
+            }
+            loopFrame = freeFrames.back();
+            freeFrames.pop_back();
+        }
+        uint8_t* data = frame(loopFrame);
+        memcpy(data, pkt->base.payload, pkt->base.length);
+        if (pkt->base.extLength > 0) {
+            memcpy(data + pkt->base.length, pkt->base.extData,
+                   pkt->base.extLength);
+        }
+        SpinLock::Lock lock(loopbackLock);
+        if (loopback.size() >= NB_LOOPBACK_SLOTS) {
+            WARNING("Loopback queue full with %zu packets queued; "
+                    "dropping packet",
+                    loopback.size());
+            SpinLock::Lock packetLockGuard(packetLock);
+            freeFrames.push_back(loopFrame);
+            return;
+        }
+        loopback.emplace_back(loopFrame, payloadLength);
+        return;
+    }
+
+    auto it = arpTable.find(destination);
+    if (it == arpTable.end()) {
+        WARNING("Failed to find ARP record for packet; dropping packet");
+        return;
+    }
+    MacAddress& destMac = it->second;
+
+    // The kernel owns a frame from the moment it enters the tx ring until
+    // it comes back through the completion ring, while the transport may
+    // hold on to the packet for retransmission; copy the packet into a
+    // fresh frame so that the two lifetimes stay independent.
+    uint64_t txFrame;
+    {
+        SpinLock::Lock lock(packetLock);
+        if (freeFrames.empty()) {
+            WARNING("No free frame for transmission; dropping packet");
+            return;
+        }
+        txFrame = freeFrames.back();
+        freeFrames.pop_back();
+    }
+
+    uint8_t* data = frame(txFrame);
+    struct ethhdr* ethHdr = reinterpret_cast<struct ethhdr*>(data);
+    memcpy(ethHdr->h_dest, destMac.address, ETH_ALEN);
+    memcpy(ethHdr->h_source, localMac.address, ETH_ALEN);
+    ethHdr->h_proto = htons(ETH_P_IP);
+
+    struct iphdr* ipHdr = reinterpret_cast<struct iphdr*>(data + ETH_HLEN);
+    ipHdr->version = 4;
+    ipHdr->ihl = 5;
+    ipHdr->tos = PRIORITY_TO_TOS[priority];
+    ipHdr->tot_len = htons(
+        Homa::Util::downCast<uint16_t>(IP_HDR_LEN + payloadLength));
+    ipHdr->id = 0;
+    ipHdr->frag_off = IP_DN_FRAGMENT_FLAG;
+    ipHdr->ttl = 64;
+    ipHdr->protocol = 6;
+    ipHdr->saddr = htonl((uint32_t)localIp);
+    ipHdr->daddr = htonl((uint32_t)destination);
+    ipHdr->check = 0;
+    ipHdr->check = ipv4Checksum(ipHdr);
+
+    memcpy(data + PACKET_HDR_LEN, pkt->base.payload, pkt->base.length);
+    if (pkt->base.extLength > 0) {
+        memcpy(data + PACKET_HDR_LEN + pkt->base.length, pkt->base.extData,
+               pkt->base.extLength);
+    }
+    uint32_t frameLength = PACKET_HDR_LEN + payloadLength;
+
+    {
+        SpinLock::Lock lock(txLock);
+        uint32_t idx;
+        if (xsk_ring_prod__reserve(&txRing, 1, &idx) != 1) {
+            // The tx ring is full of descriptors the kernel has not yet
+            // consumed; kick it and drop the packet rather than blocking
+            // the caller.
+            kickTx();
+            WARNING("AF_XDP tx ring full; dropping packet");
+            SpinLock::Lock packetLockGuard(packetLock);
+            freeFrames.push_back(txFrame);
+            return;
+        }
+        struct xdp_desc* desc = xsk_ring_prod__tx_desc(&txRing, idx);
+        desc->addr = txFrame;
+        desc->len = frameLength;
+        desc->options = 0;
+        xsk_ring_prod__submit(&txRing, 1);
+        inflightTxBytes.emplace(txFrame, frameLength);
+    }
+    queuedBytes.fetch_add(frameLength);
+
+    // Flush packets now if the driver is not corked.
+    if (corked.load() < 1) {
+        kickTx();
+    }
+}
+
+// See Driver::cork()
+void
+XdpDriver::Impl::cork()
+{
+    corked.fetch_add(1);
+}
+
+// See Driver::uncork()
+void
+XdpDriver::Impl::uncork()
+{
+    if (corked.fetch_sub(1) == 1) {
+        kickTx();
+    }
+}
+
+// See Driver::receivePackets()
+uint32_t
+XdpDriver::Impl::receivePackets(uint32_t maxPackets,
+                                Driver::Packet* receivedPackets[],
+                                IpAddress sourceAddresses[])
+{
+    uint32_t numPacketsReceived = 0;
+
+    // Process any packets destined to a local IP address.
+    {
+        SpinLock::Lock lock(loopbackLock);
+        while (numPacketsReceived < maxPackets && !loopback.empty()) {
+            uint64_t frameAddr = loopback.front().first;
+            uint32_t length = loopback.front().second;
+            loopback.pop_front();
+            SpinLock::Lock packetLockGuard(packetLock);
+            XdpDriver::Impl::Packet* packet =
+                packetPool.construct(frameAddr, frame(frameAddr));
+            packet->base.length = length;
+            receivedPackets[numPacketsReceived] = &packet->base;
+            sourceAddresses[numPacketsReceived] = localIp;
+            numPacketsReceived++;
+        }
+    }
+
+    // Return transmitted frames to the free list so that they are available
+    // for refilling the fill ring below.
+    reclaimTxCompletions();
+
+    SpinLock::Lock lock(rxLock);
+    uint32_t idx;
+    uint32_t incomingPkts = xsk_ring_cons__peek(
+        &rxRing,
+        std::min(maxPackets - numPacketsReceived, XDP_RING_BATCH_SIZE), &idx);
+
+    for (uint32_t i = 0; i < incomingPkts; ++i) {
+        const struct xdp_desc* desc = xsk_ring_cons__rx_desc(&rxRing, idx + i);
+        uint64_t frameAddr = desc->addr;
+        uint8_t* data = frame(frameAddr);
+
+        // The kernel redirects everything arriving on the bound queue to
+        // this socket; filter out traffic that is not Homa-over-IPv4
+        // addressed to us.
+        struct ethhdr* ethHdr = reinterpret_cast<struct ethhdr*>(data);
+        struct iphdr* ipHdr = reinterpret_cast<struct iphdr*>(data + ETH_HLEN);
+        if (desc->len < PACKET_HDR_LEN ||
+            ethHdr->h_proto != htons(ETH_P_IP) || ipHdr->protocol != 6 ||
+            !(IpAddress{ntohl(ipHdr->daddr)} == localIp)) {
+            SpinLock::Lock packetLockGuard(packetLock);
+            freeFrames.push_back(frameAddr);
+            continue;
+        }
+
+        uint32_t headerLength = ETH_HLEN + ipHdr->ihl * 4;
+        uint32_t length = ntohs(ipHdr->tot_len) - ipHdr->ihl * 4;
+        IpAddress srcIp{ntohl(ipHdr->saddr)};
+
+        SpinLock::Lock packetLockGuard(packetLock);
+        XdpDriver::Impl::Packet* packet =
+            packetPool.construct(frameAddr, data + headerLength);
+        packet->base.length = length;
+        receivedPackets[numPacketsReceived] = &packet->base;
+        sourceAddresses[numPacketsReceived] = srcIp;
+        numPacketsReceived++;
+    }
+    if (incomingPkts > 0) {
+        xsk_ring_cons__release(&rxRing, incomingPkts);
+    }
+
+    // Hand free frames back to the kernel to replace the ones just
+    // consumed, in one batch.
+    {
+        SpinLock::Lock packetLockGuard(packetLock);
+        uint32_t refill = Homa::Util::downCast<uint32_t>(std::min(
+            static_cast<size_t>(xsk_prod_nb_free(&fillRing,
+                                                 XDP_RING_BATCH_SIZE)),
+            freeFrames.size()));
+        if (refill > 0) {
+            uint32_t fillIdx;
+            refill = xsk_ring_prod__reserve(&fillRing, refill, &fillIdx);
+            for (uint32_t i = 0; i < refill; ++i) {
+                *xsk_ring_prod__fill_addr(&fillRing, fillIdx + i) =
+                    freeFrames.back();
+                freeFrames.pop_back();
+            }
+            xsk_ring_prod__submit(&fillRing, refill);
+        }
+    }
+    if (xsk_ring_prod__needs_wakeup(&fillRing)) {
+        recvfrom(xsk_socket__fd(xsk), nullptr, 0, MSG_DONTWAIT, nullptr,
+                 nullptr);
+    }
+
+    return numPacketsReceived;
+}
+
+// See Driver::releasePackets()
+void
+XdpDriver::Impl::releasePackets(Driver::Packet* packets[], uint16_t numPackets)
+{
+    SpinLock::Lock lock(packetLock);
+    for (uint16_t i = 0; i < numPackets; ++i) {
+        XdpDriver::Impl::Packet* packet =
+            container_of(packets[i], &XdpDriver::Impl::Packet::base);
+        if (packet->bufType == XdpDriver::Impl::Packet::FRAME) {
+            freeFrames.push_back(packet->bufRef.frameAddr);
+        } else {
+            overflowBufferPool.destroy(packet->bufRef.overflowBuf);
+        }
+        packetPool.destroy(packet);
+    }
+}
+
+// See Driver::getHighestPacketPriority()
+int
+XdpDriver::Impl::getHighestPacketPriority()
+{
+    return HIGHEST_PACKET_PRIORITY;
+}
+
+// See Driver::getMaxPayloadSize()
+uint32_t
+XdpDriver::Impl::getMaxPayloadSize()
+{
+    return MAX_PAYLOAD_SIZE;
+}
+
+// See Driver::getBandwidth()
+uint32_t
+XdpDriver::Impl::getBandwidth()
+{
+    return bandwidthMbps.load();
+}
+
+// See Driver::getLocalAddress()
+IpAddress
+XdpDriver::Impl::getLocalAddress()
+{
+    return localIp;
+}
+
+// See Driver::getQueuedBytes()
+uint32_t
+XdpDriver::Impl::getQueuedBytes()
+{
+    reclaimTxCompletions();
+    return queuedBytes.load();
+}
+
+/**
+ * Return a pointer to the start of the given UMEM frame.
+ *
+ * @param frameAddr
+ *      Byte offset of the frame within the UMEM region.
+ */
+uint8_t*
+XdpDriver::Impl::frame(uint64_t frameAddr)
+{
+    return static_cast<uint8_t*>(umemArea) + frameAddr;
+}
+
+/**
+ * Drain the completion ring, returning frames the kernel has finished
+ * transmitting to the free list and updating the queued byte estimate.
+ */
+void
+XdpDriver::Impl::reclaimTxCompletions()
+{
+    uint64_t completed[XDP_RING_BATCH_SIZE];
+    uint32_t numCompleted;
+    uint32_t reclaimedBytes = 0;
+    {
+        SpinLock::Lock lock(txLock);
+        uint32_t idx;
+        numCompleted =
+            xsk_ring_cons__peek(&compRing, XDP_RING_BATCH_SIZE, &idx);
+        if (numCompleted == 0) {
+            return;
+        }
+        for (uint32_t i = 0; i < numCompleted; ++i) {
+            completed[i] = *xsk_ring_cons__comp_addr(&compRing, idx + i);
+            auto it = inflightTxBytes.find(completed[i]);
+            if (it != inflightTxBytes.end()) {
+                reclaimedBytes += it->second;
+                inflightTxBytes.erase(it);
+            }
+        }
+        xsk_ring_cons__release(&compRing, numCompleted);
+    }
+    queuedBytes.fetch_sub(reclaimedBytes);
+
+    SpinLock::Lock lock(packetLock);
+    for (uint32_t i = 0; i < numCompleted; ++i) {
+        freeFrames.push_back(completed[i]);
+    }
+}
+
+/**
+ * Notify the kernel that there are packets to transmit, if it asked to be
+ * woken.
+ */
+void
+XdpDriver::Impl::kickTx()
+{
+    if (xsk_ring_prod__needs_wakeup(&txRing)) {
+        sendto(xsk_socket__fd(xsk), nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+    }
+}
+
+/**
+ * Helper function to create the AF_XDP socket and initialize the UMEM
+ * region and the driver's corresponding data structures.
+ *
+ * @param config
+ *      Optional configuration parameters (see Config).
+ *
+ * @throw DriverInitFailure
+ *      Thrown if the driver fails to initialize for any reason.
+ */
+void
+XdpDriver::Impl::_init(const Config* const config)
+{
+    (void)config;
+
+    // Populate the ARP table with records in /proc/net/arp (inspired by
+    // net-tools/arp.c)
+    std::ifstream input("/proc/net/arp");
+    for (std::string line; getline(input, line);) {
+        char ip[100];
+        char hwa[100];
+        char mask[100];
+        char dev[100];
+        int type, flags;
+        int cols = sscanf(line.c_str(), "%s 0x%x 0x%x %99s %99s %99s\n", ip,
+                          &type, &flags, hwa, mask, dev);
+        if (cols != 6)
+            continue;
+        arpTable.emplace(IpAddress::fromString(ip), MacAddress(hwa));
+    }
+
+    // Use ioctl to obtain the IP and MAC addresses of the network interface.
+    struct ifreq ifr;
+    if (ifname.length() >= sizeof(ifr.ifr_name)) {
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Interface name %s too long", ifname.c_str()));
+    }
+    ifname.copy(ifr.ifr_name, ifname.length());
+    ifr.ifr_name[ifname.length()] = 0;
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Failed to create socket: %s", strerror(errno)));
+    }
+
+    if (ioctl(fd, SIOCGIFADDR, &ifr) == -1) {
+        char* error = strerror(errno);
+        close(fd);
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Failed to obtain IP address: %s", error));
+    }
+    localIp = {be32toh(((struct sockaddr_in*)&ifr.ifr_addr)->sin_addr.s_addr)};
+
+    if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1) {
+        char* error = strerror(errno);
+        close(fd);
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Failed to obtain MAC address: %s", error));
+    }
+    close(fd);
+    memcpy(localMac.address, ifr.ifr_hwaddr.sa_data, 6);
+
+    // Read the link speed from sysfs; fall back to the default if the
+    // interface doesn't report one (e.g. virtual devices).
+    std::ifstream speedFile("/sys/class/net/" + ifname + "/speed");
+    int speedMbps = 0;
+    if (speedFile >> speedMbps && speedMbps > 0) {
+        bandwidthMbps.store(Homa::Util::downCast<uint32_t>(speedMbps));
+    } else {
+        NOTICE("Interface %s does not report a link speed; assuming %u Mbps",
+               ifname.c_str(), bandwidthMbps.load());
+    }
+
+    // Allocate the UMEM region and register it with the kernel.
+    size_t umemSize = static_cast<size_t>(NUM_FRAMES) * FRAME_SIZE;
+    umemArea = mmap(nullptr, umemSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (umemArea == MAP_FAILED) {
+        umemArea = nullptr;
+        throw DriverInitFailure(
+            HERE_STR, StringUtil::format("Failed to mmap UMEM region: %s",
+                                         strerror(errno)));
+    }
+    int ret = xsk_umem__create(&umem, umemArea, umemSize, &fillRing, &compRing,
+                               nullptr);
+    if (ret != 0) {
+        throw DriverInitFailure(
+            HERE_STR, StringUtil::format("Failed to create UMEM: %s",
+                                         strerror(-ret)));
+    }
+
+    // Create the AF_XDP socket; try zero-copy first and fall back to copy
+    // mode for NICs (and drivers) that don't support it.
+    struct xsk_socket_config xskConfig;
+    memset(&xskConfig, 0, sizeof(xskConfig));
+    xskConfig.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS;
+    xskConfig.tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+    xskConfig.bind_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY;
+    ret = xsk_socket__create(&xsk, ifname.c_str(),
+                             Homa::Util::downCast<uint32_t>(queueId), umem,
+                             &rxRing, &txRing, &xskConfig);
+    if (ret == 0) {
+        zeroCopy = true;
+    } else {
+        xskConfig.bind_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        ret = xsk_socket__create(&xsk, ifname.c_str(),
+                                 Homa::Util::downCast<uint32_t>(queueId), umem,
+                                 &rxRing, &txRing, &xskConfig);
+        if (ret != 0) {
+            throw DriverInitFailure(
+                HERE_STR,
+                StringUtil::format(
+                    "Failed to create AF_XDP socket on %s queue %d: %s",
+                    ifname.c_str(), queueId, strerror(-ret)));
+        }
+        NOTICE("Zero-copy bind unavailable on %s; using copy mode",
+               ifname.c_str());
+    }
+
+    // Ask the kernel to busy poll the driver's queue when the socket is
+    // read so that receive latency does not depend on interrupts.  These
+    // options are newer than AF_XDP itself; treat their absence as a
+    // performance issue, not an error.
+#if defined(SO_PREFER_BUSY_POLL) && defined(SO_BUSY_POLL_BUDGET)
+    int one = 1;
+    int busyPollUsecs = BUSY_POLL_USECS;
+    int busyPollBudget = BUSY_POLL_BUDGET;
+    if (setsockopt(xsk_socket__fd(xsk), SOL_SOCKET, SO_PREFER_BUSY_POLL, &one,
+                   sizeof(one)) != 0 ||
+        setsockopt(xsk_socket__fd(xsk), SOL_SOCKET, SO_BUSY_POLL,
+                   &busyPollUsecs, sizeof(busyPollUsecs)) != 0 ||
+        setsockopt(xsk_socket__fd(xsk), SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+                   &busyPollBudget, sizeof(busyPollBudget)) != 0) {
+        NOTICE("Failed to enable busy polling on %s: %s", ifname.c_str(),
+               strerror(errno));
+    }
+#else
+    NOTICE("Busy-poll socket options not available at compile time");
+#endif
+
+    // Pre-size the pools so that the frame-exhaustion fallback path never
+    // reaches malloc while under pressure.
+    {
+        SpinLock::Lock lock(packetLock);
+        packetPool.reserve(NUM_FRAMES);
+        overflowBufferPool.reserve(NB_OVERFLOW_BUFFERS);
+    }
+
+    // Hand an initial batch of frames to the kernel through the fill ring;
+    // the remainder seeds the free list.
+    uint32_t fillIdx;
+    uint32_t numFillFrames = xsk_ring_prod__reserve(
+        &fillRing, XSK_RING_PROD__DEFAULT_NUM_DESCS, &fillIdx);
+    for (uint32_t i = 0; i < numFillFrames; ++i) {
+        *xsk_ring_prod__fill_addr(&fillRing, fillIdx + i) =
+            static_cast<uint64_t>(i) * FRAME_SIZE;
+    }
+    xsk_ring_prod__submit(&fillRing, numFillFrames);
+    {
+        SpinLock::Lock lock(packetLock);
+        for (uint32_t i = numFillFrames; i < NUM_FRAMES; ++i) {
+            freeFrames.push_back(static_cast<uint64_t>(i) * FRAME_SIZE);
+        }
+    }
+
+    NOTICE("Using interface %s (queue %d, %s mode), ip %s", ifname.c_str(),
+           queueId, zeroCopy ? "zero-copy" : "copy",
+           IpAddress::toString(localIp).c_str());
+}
+
+}  // namespace XDP
+}  // namespace Drivers
+}  // namespace Homa
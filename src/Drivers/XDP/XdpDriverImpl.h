@@ -0,0 +1,259 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_DRIVERS_XDP_XDPDRIVERIMPL_H
+#define HOMA_DRIVERS_XDP_XDPDRIVERIMPL_H
+
+#include <Homa/Drivers/XDP/XdpDriver.h>
+
+#include <bpf/xsk.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ObjectPool.h"
+#include "SpinLock.h"
+
+namespace Homa {
+namespace Drivers {
+namespace XDP {
+
+// Number of packet buffer frames in the UMEM region shared with the kernel.
+// Frames circulate between the fill ring, the rx ring, the tx ring, the
+// completion ring, and the driver's free list; the region must be large
+// enough to keep every ring serviced while the transport holds on to
+// received packets.
+const uint32_t NUM_FRAMES = 8192;
+
+// Size of a single UMEM frame, in bytes; each frame holds one packet.
+const uint32_t FRAME_SIZE = XSK_UMEM__DEFAULT_FRAME_SIZE;
+
+// The number of UMEM frames the driver should try to reserve for receiving
+// packets.  Prevents applications from claiming more frames through
+// allocPacket() once the number of free frames reaches this level; the
+// degraded path falls back to OverflowBuffer objects instead.
+const uint32_t NB_FRAMES_RESERVED = 2048;
+
+// The number of OverflowBuffer objects to pre-allocate at initialization so
+// that the frame-exhaustion fallback path never reaches malloc.
+const uint32_t NB_OVERFLOW_BUFFERS = 1024;
+
+// Maximum number of descriptors processed from the rx, fill, and completion
+// rings in a single batch.
+const uint32_t XDP_RING_BATCH_SIZE = 32;
+
+// The number of packets that can be held in loopback before they get dropped.
+const uint32_t NB_LOOPBACK_SLOTS = 4096;
+
+// Number of microseconds the kernel should busy poll the driver's queue on
+// the application's behalf when the socket is read (see SO_BUSY_POLL).
+const int BUSY_POLL_USECS = 20;
+
+// Maximum number of packets the kernel should process per busy-poll cycle
+// (see SO_BUSY_POLL_BUDGET).
+const int BUSY_POLL_BUDGET = 64;
+
+/// Size of the IPv4 header prepended to every outbound packet, in bytes.
+const uint32_t IP_HDR_LEN = sizeof(struct iphdr);
+
+// Size of Ethernet header plus IP header, in bytes.
+const uint32_t PACKET_HDR_LEN = ETH_HLEN + IP_HDR_LEN;
+
+// The maximum payload the driver will carry in a single packet.  AF_XDP
+// frames could hold somewhat more, but the kernel path does not segment so
+// the standard Ethernet MTU is the safe ceiling.
+const uint32_t MAX_PAYLOAD_SIZE = ETH_DATA_LEN;
+
+/// Map from priority levels to values of the IP TOS field; matches the
+/// encoding used by the other Homa drivers so that mixed deployments agree
+/// on packet priorities.
+constexpr uint8_t PRIORITY_TO_TOS[8] = {0x20, 0x00, 0x40, 0x60,
+                                        0x80, 0xA0, 0xC0, 0xE0};
+
+/**
+ * A simple MAC address holder; parsed from the kernel's ARP table.
+ */
+struct MacAddress {
+    MacAddress() = default;
+
+    explicit MacAddress(const char* macStr);
+
+    /// The raw bytes of the MAC address in network order.
+    uint8_t address[6];
+};
+
+/**
+ * Allocated to store packet data when UMEM frames are not available.
+ */
+struct OverflowBuffer {
+    /// Array of bytes used to store a packet's payload.
+    char data[MAX_PAYLOAD_SIZE];
+};
+
+/**
+ * Holds the private members of the XdpDriver so that they are not exposed in
+ * the API header.
+ */
+class XdpDriver::Impl {
+  public:
+    /**
+     * AF_XDP specific Packet object used to track its lifetime and contents.
+     */
+    struct Packet {
+        explicit Packet(uint64_t frameAddr, void* data);
+        explicit Packet(OverflowBuffer* overflowBuf);
+
+        /// C-style "inheritance"
+        Driver::Packet base;
+
+        /// Used to indicate whether the packet is backed by a UMEM frame or
+        /// a driver-level OverflowBuffer.
+        enum BufferType { FRAME, OVERFLOW_BUF } bufType;  ///< Packet BufferType.
+
+        /// A reference to the buffer that backs this packet.
+        union {
+            uint64_t frameAddr;
+            OverflowBuffer* overflowBuf;
+        } bufRef;
+    };
+
+    Impl(const char* ifname, const Config* const config = nullptr);
+    virtual ~Impl();
+
+    // Interface Methods
+    Driver::Packet* allocPacket();
+    void sendPacket(Driver::Packet* packet, IpAddress destination,
+                    int priority);
+    void cork();
+    void uncork();
+    uint32_t receivePackets(uint32_t maxPackets,
+                            Driver::Packet* receivedPackets[],
+                            IpAddress sourceAddresses[]);
+    void releasePackets(Driver::Packet* packets[], uint16_t numPackets);
+    int getHighestPacketPriority();
+    uint32_t getMaxPayloadSize();
+    uint32_t getBandwidth();
+    IpAddress getLocalAddress();
+    uint32_t getQueuedBytes();
+
+  private:
+    void _init(const Config* const config);
+    uint8_t* frame(uint64_t frameAddr);
+    void reclaimTxCompletions();
+    void kickTx();
+
+    /// Name of the Linux network interface bound to the AF_XDP socket.
+    std::string ifname;
+
+    /// The interface receive queue to which the AF_XDP socket is bound.
+    int queueId;
+
+    /// Address resolution table that translates IP addresses to MAC addresses.
+    std::unordered_map<IpAddress, MacAddress, IpAddress::Hasher> arpTable;
+
+    /// Stores the IpAddress of the driver.
+    IpAddress localIp;
+
+    /// Stores the HW address of the network interface.
+    MacAddress localMac;
+
+    /// Stores the driver's maximum network packet priority (either default or
+    /// set by override).
+    const int HIGHEST_PACKET_PRIORITY;
+
+    /// Protects access to the packetPool and the free frame list.
+    SpinLock packetLock;
+
+    /// Provides memory allocation for the AF_XDP specific implementation of a
+    /// Driver Packet.
+    ObjectPool<Packet> packetPool;
+
+    /// Provides memory allocation for packet storage when UMEM frames are
+    /// running out.
+    ObjectPool<OverflowBuffer> overflowBufferPool;
+
+    /// UMEM frames (identified by their byte offset into the UMEM region)
+    /// that are not currently owned by the kernel, a Packet, or the loopback
+    /// queue.
+    std::vector<uint64_t> freeFrames;
+
+    /// The packet buffer region shared with the kernel; NUM_FRAMES frames of
+    /// FRAME_SIZE bytes each.
+    void* umemArea;
+
+    /// Handle for the UMEM registration of umemArea.
+    struct xsk_umem* umem;
+
+    /// The AF_XDP socket bound to the interface queue.
+    struct xsk_socket* xsk;
+
+    /// Producer ring through which free frames are handed to the kernel for
+    /// packet reception.
+    struct xsk_ring_prod fillRing;
+
+    /// Consumer ring through which the kernel returns transmitted frames.
+    struct xsk_ring_cons compRing;
+
+    /// Consumer ring through which the kernel delivers received packets.
+    struct xsk_ring_cons rxRing;
+
+    /// Producer ring through which packets are handed to the kernel for
+    /// transmission.
+    struct xsk_ring_prod txRing;
+
+    /// Provides thread safety for receive (rx and fill ring) operations.
+    SpinLock rxLock;
+
+    /// Provides thread safety for transmit (tx and completion ring)
+    /// operations.
+    SpinLock txLock;
+
+    /// Number of payload bytes associated with each frame currently queued
+    /// in the tx ring; consulted when the completion ring returns the frame.
+    std::unordered_map<uint64_t, uint32_t> inflightTxBytes;
+
+    /// Protects access to the loopback queue.
+    SpinLock loopbackLock;
+
+    /// Holds packets that are addressed to localhost instead of going through
+    /// the kernel; each entry is a (frame, payload length) pair.
+    std::deque<std::pair<uint64_t, uint32_t>> loopback;
+
+    /// True if the Driver should buffer sends for batched transmission.
+    std::atomic<int> corked;
+
+    /// Estimates the number of bytes waiting to be transmitted in the tx
+    /// ring.
+    std::atomic<uint32_t> queuedBytes;
+
+    /// Effective network bandwidth, in Mbits/second.
+    std::atomic<uint32_t> bandwidthMbps;
+
+    /// True if the socket was bound in zero-copy mode; false if the kernel
+    /// fell back to copying between the UMEM and the NIC.
+    bool zeroCopy;
+};
+
+}  // namespace XDP
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_DRIVERS_XDP_XDPDRIVERIMPL_H
@@ -0,0 +1,241 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_FLATMAP_H
+#define HOMA_CORE_FLATMAP_H
+
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace Homa {
+namespace Core {
+
+/**
+ * A simple open-addressing hash map with linear probing.
+ *
+ * Entries are stored in a single flat array of slots so that lookups touch
+ * only one or two cache lines in the common case; this makes the FlatMap
+ * well suited for small hot-path indexes (e.g. mapping a MessageId to its
+ * Message) where a node-based std::unordered_map would incur a pointer
+ * chase and allocation per entry.
+ *
+ * This class is not thread-safe.
+ *
+ * @tparam Key
+ *      Type of the key; must be copyable and equality comparable.
+ * @tparam Value
+ *      Type of the mapped value; must be copyable.
+ * @tparam Hash
+ *      A hash function object type for objects of type Key.
+ */
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class FlatMap {
+  public:
+    /**
+     * FlatMap constructor.
+     *
+     * @param initialCapacity
+     *      Initial number of slots in the table; will be rounded up to the
+     *      next power of 2.
+     */
+    explicit FlatMap(size_t initialCapacity = MIN_NUM_SLOTS)
+        : slots()
+        , numEntries(0)
+        , numTombstones(0)
+        , hasher()
+    {
+        size_t numSlots = MIN_NUM_SLOTS;
+        while (numSlots < initialCapacity) {
+            numSlots <<= 1;
+        }
+        slots.resize(numSlots);
+    }
+
+    /**
+     * Insert a new key-value pair into the map.
+     *
+     * The key must not already be present in the map.
+     *
+     * @param key
+     *      Key under which the value should be stored.
+     * @param value
+     *      Value to be stored.
+     */
+    void insert(const Key& key, const Value& value)
+    {
+        assert(find(key) == nullptr);
+        if (4 * (numEntries + numTombstones + 1) > 3 * slots.size()) {
+            // The table (including tombstones) is more than 3/4 full; rehash
+            // to keep probe sequences short.
+            rehash();
+        }
+        size_t index = hasher(key) & (slots.size() - 1);
+        while (slots[index].state == Slot::FULL) {
+            index = (index + 1) & (slots.size() - 1);
+        }
+        if (slots[index].state == Slot::TOMBSTONE) {
+            --numTombstones;
+        }
+        slots[index].key = key;
+        slots[index].value = value;
+        slots[index].state = Slot::FULL;
+        ++numEntries;
+    }
+
+    /**
+     * Remove the entry with the given key, if one exists.
+     *
+     * @param key
+     *      Key of the entry to be removed.
+     */
+    void remove(const Key& key)
+    {
+        size_t index = hasher(key) & (slots.size() - 1);
+        while (slots[index].state != Slot::EMPTY) {
+            if (slots[index].state == Slot::FULL && slots[index].key == key) {
+                slots[index].state = Slot::TOMBSTONE;
+                --numEntries;
+                ++numTombstones;
+                return;
+            }
+            index = (index + 1) & (slots.size() - 1);
+        }
+    }
+
+    /**
+     * Return a pointer to the value stored under the given key.
+     *
+     * The returned pointer is invalidated by any subsequent call to insert()
+     * or remove().
+     *
+     * @param key
+     *      Key of the entry to be found.
+     * @return
+     *      Pointer to the stored value if the key is present; nullptr,
+     *      otherwise.
+     */
+    Value* find(const Key& key)
+    {
+        size_t index = hasher(key) & (slots.size() - 1);
+        while (slots[index].state != Slot::EMPTY) {
+            if (slots[index].state == Slot::FULL && slots[index].key == key) {
+                return &slots[index].value;
+            }
+            index = (index + 1) & (slots.size() - 1);
+        }
+        return nullptr;
+    }
+
+    /**
+     * Return the number of entries in the map.
+     */
+    size_t size() const
+    {
+        return numEntries;
+    }
+
+    /**
+     * Check if the map contains no entries.
+     *
+     * @return
+     *      True, if there are no entries in this map; false, otherwise.
+     */
+    bool empty() const
+    {
+        return numEntries == 0;
+    }
+
+    /**
+     * Remove all entries from the map.
+     */
+    void clear()
+    {
+        for (auto& slot : slots) {
+            slot.state = Slot::EMPTY;
+        }
+        numEntries = 0;
+        numTombstones = 0;
+    }
+
+  private:
+    /// Minimum number of slots in the table; must be a power of 2.
+    static const size_t MIN_NUM_SLOTS = 16;
+
+    /**
+     * Holds a single key-value pair and the occupancy state of its position
+     * in the table.
+     */
+    struct Slot {
+        /// Possible occupancy states of a Slot.
+        enum State : uint8_t {
+            EMPTY = 0,  //< Slot has never held an entry; ends probe chains.
+            FULL,       //< Slot holds a live entry.
+            TOMBSTONE,  //< Slot held an entry that was removed; probe chains
+                        //< continue through this slot.
+        };
+
+        /// Slot constructor.
+        Slot()
+            : key()
+            , value()
+            , state(EMPTY)
+        {}
+
+        /// The key under which _value_ is stored; only valid when FULL.
+        Key key;
+        /// The stored value; only valid when FULL.
+        Value value;
+        /// This slot's occupancy state.
+        uint8_t state;
+    };
+
+    /**
+     * Grow the table and reinsert all live entries; drops accumulated
+     * tombstones.
+     */
+    void rehash()
+    {
+        std::vector<Slot> oldSlots(slots.size() * 2);
+        oldSlots.swap(slots);
+        numEntries = 0;
+        numTombstones = 0;
+        for (auto& slot : oldSlots) {
+            if (slot.state == Slot::FULL) {
+                insert(slot.key, slot.value);
+            }
+        }
+    }
+
+    /// Flat array of slots holding the map's entries.  The size of this
+    /// array is always a power of 2 so that hashes can be mapped to slot
+    /// indexes with a simple bit mask.
+    std::vector<Slot> slots;
+
+    /// Number of live entries in the map.
+    size_t numEntries;
+
+    /// Number of tombstone slots left behind by remove().
+    size_t numTombstones;
+
+    /// Key hash function container.
+    Hash hasher;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_FLATMAP_H
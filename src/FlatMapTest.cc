@@ -0,0 +1,113 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "FlatMap.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+TEST(FlatMapTest, constructor)
+{
+    FlatMap<int, int> map;
+    EXPECT_EQ(0U, map.size());
+    EXPECT_TRUE(map.empty());
+}
+
+TEST(FlatMapTest, insert_find)
+{
+    FlatMap<int, int> map;
+    map.insert(1, 100);
+    map.insert(2, 200);
+    EXPECT_EQ(2U, map.size());
+    EXPECT_FALSE(map.empty());
+    ASSERT_NE(nullptr, map.find(1));
+    EXPECT_EQ(100, *map.find(1));
+    ASSERT_NE(nullptr, map.find(2));
+    EXPECT_EQ(200, *map.find(2));
+    EXPECT_EQ(nullptr, map.find(3));
+}
+
+TEST(FlatMapTest, remove)
+{
+    FlatMap<int, int> map;
+    map.insert(1, 100);
+    map.insert(2, 200);
+    map.remove(1);
+    EXPECT_EQ(1U, map.size());
+    EXPECT_EQ(nullptr, map.find(1));
+    ASSERT_NE(nullptr, map.find(2));
+    EXPECT_EQ(200, *map.find(2));
+    // Removing a missing key should be a no-op.
+    map.remove(42);
+    EXPECT_EQ(1U, map.size());
+}
+
+TEST(FlatMapTest, remove_reinsert)
+{
+    // Reinserting a removed key must find a FULL or TOMBSTONE slot.
+    FlatMap<int, int> map;
+    map.insert(1, 100);
+    map.remove(1);
+    map.insert(1, 101);
+    ASSERT_NE(nullptr, map.find(1));
+    EXPECT_EQ(101, *map.find(1));
+    EXPECT_EQ(1U, map.size());
+}
+
+TEST(FlatMapTest, rehash)
+{
+    // Insert enough entries to force the table to grow several times.
+    FlatMap<int, int> map;
+    const int numEntries = 1000;
+    for (int i = 0; i < numEntries; ++i) {
+        map.insert(i, i * 10);
+    }
+    EXPECT_EQ(1000U, map.size());
+    for (int i = 0; i < numEntries; ++i) {
+        ASSERT_NE(nullptr, map.find(i));
+        EXPECT_EQ(i * 10, *map.find(i));
+    }
+}
+
+TEST(FlatMapTest, tombstone_churn)
+{
+    // Repeated insert/remove cycles should not degrade or overflow the
+    // table even though every remove leaves a tombstone behind.
+    FlatMap<int, int> map;
+    for (int i = 0; i < 10000; ++i) {
+        map.insert(i, i);
+        map.remove(i);
+    }
+    EXPECT_EQ(0U, map.size());
+    EXPECT_TRUE(map.empty());
+}
+
+TEST(FlatMapTest, clear)
+{
+    FlatMap<int, int> map;
+    map.insert(1, 100);
+    map.insert(2, 200);
+    map.clear();
+    EXPECT_EQ(0U, map.size());
+    EXPECT_EQ(nullptr, map.find(1));
+    EXPECT_EQ(nullptr, map.find(2));
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
@@ -25,4 +25,25 @@ Transport::create(Driver* driver, uint64_t transportId)
     return new Core::TransportImpl(driver, transportId);
 }
 
+Transport*
+Transport::create(Driver* driver, uint64_t transportId, int rxQueueId)
+{
+    return new Core::TransportImpl(driver, transportId, rxQueueId);
+}
+
+Transport*
+Transport::create(Driver* driver, uint64_t transportId, int rxQueueId,
+                  Transport::Mode mode)
+{
+    return new Core::TransportImpl(driver, transportId, rxQueueId, mode);
+}
+
+Transport*
+Transport::create(Driver* driver, uint64_t transportId, int rxQueueId,
+                  Transport::Mode mode, int numaNode)
+{
+    return new Core::TransportImpl(driver, transportId, rxQueueId, mode,
+                                   numaNode);
+}
+
 }  // namespace Homa
@@ -16,7 +16,10 @@
 #ifndef HOMA_CORE_INTRUSIVE_H
 #define HOMA_CORE_INTRUSIVE_H
 
+#include <cassert>
+#include <cstdint>
 #include <iterator>
+#include <utility>
 
 namespace Homa {
 namespace Core {
@@ -562,6 +565,741 @@ deprioritize(List<ElementType>* list, typename List<ElementType>::Node* node,
         list->insert(it_pos, node);
     }
 }
+/**
+ * Intrusive pairing heap implementation.
+ *
+ * Provides a priority queue over intrusively linked elements with O(1)
+ * insertion and amortized O(log n) removal and reordering.  Useful where
+ * keeping a sorted Intrusive::List would degenerate into long linear walks
+ * as the number of elements grows.
+ */
+template <typename ElementType, typename Compare>
+class PairingHeap {
+  public:
+    /**
+     * The intrusive metadata needed to add and remove an element from the
+     * PairingHeap.
+     */
+    class Node {
+      public:
+        /**
+         * PairingHeap::Node constructor.
+         *
+         * @param owner
+         *      Pointer to the object of which this Node is a member.
+         */
+        explicit Node(ElementType* owner)
+            : owner(owner)
+            , heap(nullptr)
+            , prev(nullptr)
+            , child(nullptr)
+            , sibling(nullptr)
+        {}
+
+        /**
+         * PairingHeap::Node destructor.
+         */
+        ~Node()
+        {
+            // Assert that the Node is cleanly removed from any PairingHeap.
+            assert(heap == nullptr);
+        }
+
+      private:
+        /// Pointer to the element object that this Node represents.
+        ElementType* const owner;
+        /// Pointer to the PairingHeap to which this Node is currently linked.
+        PairingHeap* heap;
+        /// Pointer to the parent Node if this Node is a leftmost child;
+        /// otherwise, pointer to the left sibling Node.  Null for the root.
+        Node* prev;
+        /// Pointer to this Node's leftmost child Node (if any).
+        Node* child;
+        /// Pointer to this Node's right sibling Node (if any).
+        Node* sibling;
+
+        friend class PairingHeap;
+    };
+
+    /**
+     * PairingHeap constructor.
+     */
+    PairingHeap()
+        : root(nullptr)
+        , count(0)
+        , comp()
+    {}
+
+    /**
+     * PairingHeap destructor.
+     */
+    ~PairingHeap()
+    {
+        clear();
+    }
+
+    /**
+     * Return a reference to the highest priority element in the PairingHeap.
+     *
+     * Calling top() on an empty PairingHeap is undefined.
+     */
+    ElementType& top()
+    {
+        return *root->owner;
+    }
+
+    /**
+     * Return a const reference to the highest priority element in the
+     * PairingHeap.
+     *
+     * Calling top() on an empty PairingHeap is undefined.
+     */
+    const ElementType& top() const
+    {
+        return *root->owner;
+    }
+
+    /**
+     * Check if the PairingHeap contains no elements.
+     *
+     * @return
+     *      True, if there are no elements in this PairingHeap; false,
+     *      otherwise.
+     */
+    bool empty() const
+    {
+        return root == nullptr;
+    }
+
+    /**
+     * Return the number of elements in the PairingHeap.
+     */
+    size_t size() const
+    {
+        return count;
+    }
+
+    /**
+     * Check if the given element is in the PairingHeap.
+     *
+     * @param node
+     *      Node element being checked.
+     * @return
+     *      True, if the node is in the PairingHeap; false, otherwise.
+     */
+    bool contains(Node* node) const
+    {
+        return node->heap == this;
+    }
+
+    /**
+     * Add an element to the PairingHeap.
+     *
+     * @param node
+     *      Node element to be added.
+     */
+    void push(Node* node)
+    {
+        // Ensure the node is not already linked.
+        assert(node->heap == nullptr);
+        node->heap = this;
+        root = (root == nullptr) ? node : meld(root, node);
+        ++count;
+    }
+
+    /**
+     * Remove the highest priority element from the PairingHeap.
+     *
+     * Calling pop() on an empty PairingHeap is undefined.
+     */
+    void pop()
+    {
+        Node* node = root;
+        root = mergePairs(node->child);
+        node->child = nullptr;
+        node->heap = nullptr;
+        --count;
+    }
+
+    /**
+     * Remove the given element from the PairingHeap.
+     *
+     * @param node
+     *      Node element to be removed; must be in this PairingHeap.
+     */
+    void remove(Node* node)
+    {
+        assert(contains(node));
+        if (node == root) {
+            pop();
+            return;
+        }
+        detach(node);
+        Node* subtree = mergePairs(node->child);
+        node->child = nullptr;
+        node->heap = nullptr;
+        if (subtree != nullptr) {
+            root = meld(root, subtree);
+        }
+        --count;
+    }
+
+    /**
+     * Restore the heap ordering after the given element's priority changed.
+     *
+     * @param node
+     *      Node element whose priority changed; must be in this PairingHeap.
+     */
+    void update(Node* node)
+    {
+        remove(node);
+        push(node);
+    }
+
+    /**
+     * Remove all linked Nodes from the PairingHeap.
+     *
+     * Does not invoke the comparator, so it is safe to call even when the
+     * linked elements are no longer comparable (e.g. during destruction).
+     */
+    void clear()
+    {
+        Node* node = root;
+        root = nullptr;
+        while (node != nullptr) {
+            Node* next = node->sibling;
+            // Move the node's children onto the work list.
+            Node* c = node->child;
+            while (c != nullptr) {
+                Node* nc = c->sibling;
+                c->sibling = next;
+                next = c;
+                c = nc;
+            }
+            node->heap = nullptr;
+            node->prev = nullptr;
+            node->child = nullptr;
+            node->sibling = nullptr;
+            node = next;
+        }
+        count = 0;
+    }
+
+  private:
+    /**
+     * Combine two heap-ordered subtrees into one (private helper method).
+     *
+     * @param a
+     *      Root Node of the first subtree; must not be linked to a parent or
+     *      sibling.
+     * @param b
+     *      Root Node of the second subtree; must not be linked to a parent or
+     *      sibling.
+     * @return
+     *      Root Node of the combined subtree.
+     */
+    Node* meld(Node* a, Node* b)
+    {
+        if (comp(*b->owner, *a->owner)) {
+            std::swap(a, b);
+        }
+        // Attach b as a's leftmost child.
+        b->sibling = a->child;
+        if (a->child != nullptr) {
+            a->child->prev = b;
+        }
+        b->prev = a;
+        a->child = b;
+        return a;
+    }
+
+    /**
+     * Unlink the given non-root Node from its parent and siblings (private
+     * helper method).  The node's children are left attached.
+     *
+     * @param node
+     *      Node to be unlinked.
+     */
+    static void detach(Node* node)
+    {
+        if (node->prev->child == node) {
+            node->prev->child = node->sibling;
+        } else {
+            node->prev->sibling = node->sibling;
+        }
+        if (node->sibling != nullptr) {
+            node->sibling->prev = node->prev;
+        }
+        node->prev = nullptr;
+        node->sibling = nullptr;
+    }
+
+    /**
+     * Combine a list of sibling subtrees into a single heap-ordered tree
+     * using the standard two-pass pairing strategy (private helper method).
+     *
+     * @param first
+     *      Leftmost Node of the sibling list; may be null.
+     * @return
+     *      Root Node of the combined tree, or null if first was null.
+     */
+    Node* mergePairs(Node* first)
+    {
+        // First pass: meld adjacent pairs of siblings, chaining the results
+        // together through their (otherwise unused) prev pointers.
+        Node* melded = nullptr;
+        Node* node = first;
+        while (node != nullptr) {
+            Node* a = node;
+            Node* b = a->sibling;
+            a->prev = nullptr;
+            a->sibling = nullptr;
+            if (b != nullptr) {
+                node = b->sibling;
+                b->prev = nullptr;
+                b->sibling = nullptr;
+                a = meld(a, b);
+            } else {
+                node = nullptr;
+            }
+            a->prev = melded;
+            melded = a;
+        }
+        // Second pass: meld the paired subtrees together back-to-front.
+        Node* result = nullptr;
+        while (melded != nullptr) {
+            Node* next = melded->prev;
+            melded->prev = nullptr;
+            result = (result == nullptr) ? melded : meld(result, melded);
+            melded = next;
+        }
+        return result;
+    }
+
+    /// Root Node of the heap-ordered tree; null if the heap is empty.
+    Node* root;
+    /// Number of elements in this heap.
+    size_t count;
+    /// Comparison function object which returns true when the first argument
+    /// should be ordered before the second.
+    Compare comp;
+};
+
+/**
+ * Intrusive skiplist implementation.
+ *
+ * Provides an ordered collection over intrusively linked elements with
+ * O(log n) insertion and repositioning and in-order forward iteration.
+ * Useful where elements must be visited in sorted order (which a heap cannot
+ * provide) but keeping a sorted Intrusive::List would degenerate into long
+ * linear walks as the number of elements grows.
+ */
+template <typename ElementType, typename Compare>
+class SkipList {
+  public:
+    class Iterator;
+
+    /// Number of levels in the skiplist.  With a branching factor of 2 this
+    /// comfortably covers tens of thousands of elements; beyond that the
+    /// structure still works but searches degrade gracefully toward linear
+    /// scans of the top level.
+    static const int MAX_HEIGHT = 16;
+
+    /**
+     * The intrusive metadata needed to add and remove an element from the
+     * SkipList.
+     */
+    class Node {
+      public:
+        /**
+         * SkipList::Node constructor.
+         *
+         * @param owner
+         *      Pointer to the object of which this Node is a member.
+         */
+        explicit Node(ElementType* owner)
+            : owner(owner)
+            , list(nullptr)
+            , height(0)
+            , next()
+            , prev()
+        {}
+
+        /**
+         * SkipList::Node destructor.
+         */
+        ~Node()
+        {
+            // Assert that the Node is cleanly removed from any SkipList.
+            assert(list == nullptr);
+        }
+
+      private:
+        /// Pointer to the element object that this Node represents.
+        ElementType* const owner;
+        /// Pointer to the SkipList to which this Node is currently linked.
+        SkipList* list;
+        /// Number of levels at which this Node is linked; chosen at random
+        /// when the Node is inserted.
+        int height;
+        /// Pointer to the next Node at each level; null past the last Node.
+        Node* next[MAX_HEIGHT];
+        /// Pointer to the previous Node at each level; the first Node at a
+        /// level points back to the SkipList's head sentinel.
+        Node* prev[MAX_HEIGHT];
+
+        friend class SkipList;
+        friend class Iterator;
+    };
+
+    /**
+     * A dereferenceable reference to an element in the SkipList.
+     */
+    class Iterator
+        : public std::iterator<std::forward_iterator_tag, ElementType> {
+      public:
+        /**
+         * Iterator empty constructor.
+         */
+        Iterator()
+            : node(nullptr)
+        {}
+
+        /**
+         * Return a reference to the element referred to by this Iterator.
+         */
+        ElementType& operator*()
+        {
+            return *node->owner;
+        }
+
+        /**
+         * Access member of the element referred to by this Iterator.
+         */
+        ElementType* operator->()
+        {
+            return node->owner;
+        }
+
+        /**
+         * Point this Iterator to the next element in the SkipList.
+         *
+         * @return
+         *      A reference to the updated Iterator.
+         */
+        Iterator& operator++()
+        {
+            node = node->next[0];
+            return *this;
+        }
+
+        /**
+         * Point this Iterator to the next element in the SkipList.
+         *
+         * @return
+         *      A copy of the Iterator before the update.
+         */
+        Iterator operator++(int)
+        {
+            Iterator old = *this;
+            node = node->next[0];
+            return old;
+        }
+
+        /**
+         * Return true if both this and the other Iterator refer to the same
+         * element in the SkipList; false otherwise.
+         */
+        bool operator==(const Iterator& other) const
+        {
+            return node == other.node;
+        }
+
+        /**
+         * Return true if both this and the other Iterator refer to different
+         * elements in the SkipList; false otherwise.
+         */
+        bool operator!=(const Iterator& other) const
+        {
+            return node != other.node;
+        }
+
+      private:
+        /**
+         * Iterator constructor.  Used by a SkipList to create a valid
+         * Iterator.
+         *
+         * @param node
+         *      Pointer to the Node to which this Iterator refers; null for
+         *      the past-the-end Iterator.
+         */
+        explicit Iterator(Node* node)
+            : node(node)
+        {}
+
+        /// The Node to which this Iterator refers.
+        Node* node;
+
+        friend class SkipList;
+    };
+
+    /**
+     * SkipList constructor.
+     */
+    SkipList()
+        : head(nullptr)
+        , count(0)
+        , randomState(0x9E3779B97F4A7C15UL)
+        , comp()
+    {}
+
+    /**
+     * SkipList destructor.
+     */
+    ~SkipList()
+    {
+        clear();
+    }
+
+    /**
+     * Return a reference to the smallest element in the SkipList.
+     *
+     * Calling front() on an empty SkipList is undefined.
+     */
+    ElementType& front()
+    {
+        return *head.next[0]->owner;
+    }
+
+    /**
+     * Return an Iterator to the smallest element in the SkipList.
+     */
+    Iterator begin()
+    {
+        return Iterator(head.next[0]);
+    }
+
+    /**
+     * Return an Iterator following the last element in the SkipList.
+     */
+    Iterator end()
+    {
+        return Iterator(nullptr);
+    }
+
+    /**
+     * Return an Iterator to the specified element if the element is in the
+     * SkipList.  Otherwise return SkipList::end.
+     *
+     * @param node
+     *      Node element whose Iterator should be returned.
+     * @return
+     *      An Iterator to the specified element if it is in the SkipList or
+     *      SkipList::end otherwise.
+     */
+    Iterator get(Node* node)
+    {
+        if (contains(node)) {
+            return Iterator(node);
+        } else {
+            return end();
+        }
+    }
+
+    /**
+     * Check if the SkipList contains no elements.
+     *
+     * @return
+     *      True, if there are no elements in this SkipList; false, otherwise.
+     */
+    bool empty() const
+    {
+        return head.next[0] == nullptr;
+    }
+
+    /**
+     * Return the number of elements in the SkipList.
+     */
+    size_t size() const
+    {
+        return count;
+    }
+
+    /**
+     * Check if the given element is in the SkipList.
+     *
+     * @param node
+     *      Node element being checked.
+     * @return
+     *      True, if the node is in the SkipList; false, otherwise.
+     */
+    bool contains(Node* node) const
+    {
+        return node->list == this;
+    }
+
+    /**
+     * Add an element to the SkipList at its sorted position.  Elements that
+     * compare equal to the new element precede it.
+     *
+     * No Iterators are invalidated.
+     *
+     * @param node
+     *      Node element to be inserted; must not already be linked.
+     */
+    void insert(Node* node)
+    {
+        // Ensure the node is not already linked.
+        assert(node->list == nullptr);
+        node->list = this;
+        node->height = randomHeight();
+        // Search down through the levels for the insertion point, recording
+        // the last node visited at each level as the node's predecessor.
+        Node* update[MAX_HEIGHT];
+        Node* pos = &head;
+        for (int level = MAX_HEIGHT - 1; level >= 0; --level) {
+            while (pos->next[level] != nullptr &&
+                   !comp(*node->owner, *pos->next[level]->owner)) {
+                pos = pos->next[level];
+            }
+            update[level] = pos;
+        }
+        for (int level = 0; level < node->height; ++level) {
+            node->next[level] = update[level]->next[level];
+            node->prev[level] = update[level];
+            if (node->next[level] != nullptr) {
+                node->next[level]->prev[level] = node;
+            }
+            update[level]->next[level] = node;
+        }
+        ++count;
+    }
+
+    /**
+     * Remove the node from this SkipList (no-op if the node is not linked).
+     *
+     * Iterators referring to the removed element are invalidated.
+     *
+     * @param node
+     *      Node to be removed from this SkipList.
+     */
+    void remove(Node* node)
+    {
+        assert(node->list == this || node->list == nullptr);
+        if (node->list == nullptr) {
+            return;
+        }
+        for (int level = 0; level < node->height; ++level) {
+            node->prev[level]->next[level] = node->next[level];
+            if (node->next[level] != nullptr) {
+                node->next[level]->prev[level] = node->prev[level];
+            }
+            node->next[level] = nullptr;
+            node->prev[level] = nullptr;
+        }
+        node->height = 0;
+        node->list = nullptr;
+        --count;
+    }
+
+    /**
+     * Removes the node element at pos.
+     *
+     * Iterators referring to the removed element are invalidated.
+     *
+     * @param pos
+     *      Iterator to the element to remove.
+     * @return
+     *      Iterator following the removed element.
+     */
+    Iterator remove(Iterator pos)
+    {
+        Iterator nextPos(pos.node->next[0]);
+        remove(pos.node);
+        return nextPos;
+    }
+
+    /**
+     * Restore the sorted order after the given element's key changed.
+     *
+     * O(1) when the element is already in position (the common case when
+     * keys change by small amounts); otherwise the element is relocated in
+     * O(log n).  No Iterators are invalidated unless the element moves, in
+     * which case Iterators referring to it remain valid but continue from
+     * its new position.
+     *
+     * @param node
+     *      Node element whose key changed; must be in this SkipList.
+     */
+    void update(Node* node)
+    {
+        assert(contains(node));
+        Node* before = node->prev[0];
+        Node* after = node->next[0];
+        if ((before == &head || !comp(*node->owner, *before->owner)) &&
+            (after == nullptr || !comp(*after->owner, *node->owner))) {
+            // The node is already in the right spot.
+            return;
+        }
+        remove(node);
+        insert(node);
+    }
+
+    /**
+     * Remove all linked Nodes from the SkipList.
+     *
+     * Invalidates any Iterators referring to elements in this SkipList.
+     */
+    void clear()
+    {
+        Node* node = head.next[0];
+        while (node != nullptr) {
+            Node* next = node->next[0];
+            for (int level = 0; level < node->height; ++level) {
+                node->next[level] = nullptr;
+                node->prev[level] = nullptr;
+            }
+            node->height = 0;
+            node->list = nullptr;
+            node = next;
+        }
+        for (int level = 0; level < MAX_HEIGHT; ++level) {
+            head.next[level] = nullptr;
+        }
+        count = 0;
+    }
+
+  private:
+    /**
+     * Return a random level count in [1, MAX_HEIGHT] with a geometric
+     * distribution (private helper method).
+     */
+    int randomHeight()
+    {
+        // xorshift64; cheap and good enough for level selection.
+        randomState ^= randomState << 13;
+        randomState ^= randomState >> 7;
+        randomState ^= randomState << 17;
+        uint64_t bits = randomState;
+        int height = 1;
+        while ((bits & 1) && height < MAX_HEIGHT) {
+            ++height;
+            bits >>= 1;
+        }
+        return height;
+    }
+
+    /// Sentinel Node preceding the first element at every level.
+    Node head;
+    /// Number of elements in this SkipList.
+    size_t count;
+    /// State of the PRNG used to choose Node heights.
+    uint64_t randomState;
+    /// Comparison function object which returns true when the first argument
+    /// should be ordered before the second.
+    Compare comp;
+};
+
 }  // namespace Intrusive
 }  // namespace Core
 }  // namespace Homa
@@ -601,6 +601,320 @@ TEST(IntrusiveTest, deprioritize)
     EXPECT_EQ(&foo[0], &(*++it));
 }
 
+struct Bar {
+    Bar()
+        : value(0)
+        , heapNode(this)
+    {}
+
+    struct Compare {
+        bool operator()(const Bar& a, const Bar& b)
+        {
+            return a.value < b.value;
+        }
+    };
+
+    int value;
+    Intrusive::PairingHeap<Bar, Compare>::Node heapNode;
+};
+
+class PairingHeapTest : public ::testing::Test {
+  public:
+    PairingHeapTest()
+        : bar()
+        , heap()
+    {
+        for (int i = 0; i < 5; ++i) {
+            bar[i].value = i;
+        }
+    }
+
+    void populateHeap()
+    {
+        // Push in a non-sorted order.
+        heap.push(&bar[2].heapNode);
+        heap.push(&bar[0].heapNode);
+        heap.push(&bar[4].heapNode);
+        heap.push(&bar[1].heapNode);
+        heap.push(&bar[3].heapNode);
+    }
+
+    Bar bar[5];
+    Intrusive::PairingHeap<Bar, Bar::Compare> heap;
+};
+
+TEST_F(PairingHeapTest, push)
+{
+    EXPECT_TRUE(heap.empty());
+
+    heap.push(&bar[2].heapNode);
+
+    EXPECT_EQ(&bar[2], &heap.top());
+    EXPECT_EQ(1U, heap.size());
+    EXPECT_TRUE(heap.contains(&bar[2].heapNode));
+
+    heap.push(&bar[0].heapNode);
+
+    EXPECT_EQ(&bar[0], &heap.top());
+    EXPECT_EQ(2U, heap.size());
+
+    heap.push(&bar[4].heapNode);
+
+    EXPECT_EQ(&bar[0], &heap.top());
+    EXPECT_EQ(3U, heap.size());
+
+    heap.clear();
+}
+
+TEST_F(PairingHeapTest, pop)
+{
+    populateHeap();
+
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ(&bar[i], &heap.top());
+        heap.pop();
+        EXPECT_FALSE(heap.contains(&bar[i].heapNode));
+        EXPECT_EQ(4U - i, heap.size());
+    }
+    EXPECT_TRUE(heap.empty());
+}
+
+TEST_F(PairingHeapTest, remove)
+{
+    populateHeap();
+
+    // Remove an interior element.
+    heap.remove(&bar[2].heapNode);
+
+    EXPECT_FALSE(heap.contains(&bar[2].heapNode));
+    EXPECT_EQ(4U, heap.size());
+
+    // Remove the top element.
+    heap.remove(&bar[0].heapNode);
+
+    EXPECT_FALSE(heap.contains(&bar[0].heapNode));
+    EXPECT_EQ(&bar[1], &heap.top());
+    EXPECT_EQ(3U, heap.size());
+
+    // Remaining elements come out in order.
+    heap.pop();
+    EXPECT_EQ(&bar[3], &heap.top());
+    heap.pop();
+    EXPECT_EQ(&bar[4], &heap.top());
+    heap.pop();
+    EXPECT_TRUE(heap.empty());
+}
+
+TEST_F(PairingHeapTest, update)
+{
+    populateHeap();
+
+    // Increase the top element's value; it should sink.
+    bar[0].value = 10;
+    heap.update(&bar[0].heapNode);
+
+    EXPECT_EQ(&bar[1], &heap.top());
+    EXPECT_EQ(5U, heap.size());
+
+    // Decrease an interior element's value; it should rise to the top.
+    bar[3].value = -1;
+    heap.update(&bar[3].heapNode);
+
+    EXPECT_EQ(&bar[3], &heap.top());
+    EXPECT_EQ(5U, heap.size());
+
+    heap.clear();
+}
+
+TEST_F(PairingHeapTest, clear)
+{
+    populateHeap();
+    EXPECT_EQ(5U, heap.size());
+
+    heap.clear();
+
+    EXPECT_TRUE(heap.empty());
+    EXPECT_EQ(0U, heap.size());
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_FALSE(heap.contains(&bar[i].heapNode));
+    }
+}
+
+struct Baz {
+    Baz()
+        : value(0)
+        , listNode(this)
+    {}
+
+    struct Compare {
+        bool operator()(const Baz& a, const Baz& b)
+        {
+            return a.value < b.value;
+        }
+    };
+
+    int value;
+    Intrusive::SkipList<Baz, Compare>::Node listNode;
+};
+
+class SkipListTest : public ::testing::Test {
+  public:
+    SkipListTest()
+        : baz()
+        , list()
+    {
+        for (int i = 0; i < 5; ++i) {
+            baz[i].value = i;
+        }
+    }
+
+    void populateList()
+    {
+        // Insert in a non-sorted order.
+        list.insert(&baz[2].listNode);
+        list.insert(&baz[0].listNode);
+        list.insert(&baz[4].listNode);
+        list.insert(&baz[1].listNode);
+        list.insert(&baz[3].listNode);
+    }
+
+    Baz baz[5];
+    Intrusive::SkipList<Baz, Baz::Compare> list;
+};
+
+TEST_F(SkipListTest, insert)
+{
+    EXPECT_TRUE(list.empty());
+
+    populateList();
+
+    EXPECT_EQ(5U, list.size());
+    auto it = list.begin();
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_TRUE(list.contains(&baz[i].listNode));
+        EXPECT_EQ(&baz[i], &(*it));
+        ++it;
+    }
+    EXPECT_EQ(list.end(), it);
+
+    list.clear();
+}
+
+TEST_F(SkipListTest, insert_equalKeys)
+{
+    // Elements with equal keys are kept in insertion order.
+    baz[1].value = 0;
+    baz[2].value = 0;
+    list.insert(&baz[0].listNode);
+    list.insert(&baz[1].listNode);
+    list.insert(&baz[2].listNode);
+
+    auto it = list.begin();
+    EXPECT_EQ(&baz[0], &(*it));
+    EXPECT_EQ(&baz[1], &(*++it));
+    EXPECT_EQ(&baz[2], &(*++it));
+
+    list.clear();
+}
+
+TEST_F(SkipListTest, remove_node)
+{
+    populateList();
+
+    // Remove an interior element.
+    list.remove(&baz[2].listNode);
+
+    EXPECT_FALSE(list.contains(&baz[2].listNode));
+    EXPECT_EQ(4U, list.size());
+
+    // Remove the front element.
+    list.remove(&baz[0].listNode);
+
+    EXPECT_FALSE(list.contains(&baz[0].listNode));
+    EXPECT_EQ(&baz[1], &list.front());
+    EXPECT_EQ(3U, list.size());
+
+    // Removing an unlinked element is a no-op.
+    list.remove(&baz[2].listNode);
+
+    EXPECT_EQ(3U, list.size());
+
+    list.clear();
+}
+
+TEST_F(SkipListTest, remove_iterator)
+{
+    populateList();
+
+    auto it = list.begin();
+    it = list.remove(it);
+
+    EXPECT_FALSE(list.contains(&baz[0].listNode));
+    EXPECT_EQ(&baz[1], &(*it));
+    EXPECT_EQ(4U, list.size());
+
+    list.clear();
+}
+
+TEST_F(SkipListTest, update)
+{
+    populateList();
+
+    // Increase the front element's value; it should sink to the back.
+    baz[0].value = 10;
+    list.update(&baz[0].listNode);
+
+    EXPECT_EQ(&baz[1], &list.front());
+    EXPECT_EQ(5U, list.size());
+
+    // Decrease an interior element's value; it should rise to the front.
+    baz[3].value = -1;
+    list.update(&baz[3].listNode);
+
+    EXPECT_EQ(&baz[3], &list.front());
+    EXPECT_EQ(5U, list.size());
+
+    // An element already in position stays put.
+    baz[2].value = 2;
+    list.update(&baz[2].listNode);
+
+    auto it = list.begin();
+    EXPECT_EQ(&baz[3], &(*it));
+    EXPECT_EQ(&baz[1], &(*++it));
+    EXPECT_EQ(&baz[2], &(*++it));
+    EXPECT_EQ(&baz[4], &(*++it));
+    EXPECT_EQ(&baz[0], &(*++it));
+
+    list.clear();
+}
+
+TEST_F(SkipListTest, get)
+{
+    populateList();
+
+    auto it = list.get(&baz[2].listNode);
+    EXPECT_EQ(&baz[2], &(*it));
+
+    list.remove(&baz[2].listNode);
+    EXPECT_EQ(list.end(), list.get(&baz[2].listNode));
+
+    list.clear();
+}
+
+TEST_F(SkipListTest, clear)
+{
+    populateList();
+    EXPECT_EQ(5U, list.size());
+
+    list.clear();
+
+    EXPECT_TRUE(list.empty());
+    EXPECT_EQ(0U, list.size());
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_FALSE(list.contains(&baz[i].listNode));
+    }
+}
+
 }  // namespace
 }  // namespace Core
 }  // namespace Homa
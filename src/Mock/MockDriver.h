@@ -41,11 +41,15 @@ class MockDriver : public Driver {
     MOCK_METHOD(void, sendPacket,
                 (Packet * packet, IpAddress destination, int priority),
                 (override));
+    MOCK_METHOD(void, cork, (), (override));
+    MOCK_METHOD(void, uncork, (), (override));
     MOCK_METHOD(void, flushPackets, ());
     MOCK_METHOD(uint32_t, receivePackets,
                 (uint32_t maxPackets, Packet* receivedPackets[],
                  IpAddress sourceAddresses[]),
                 (override));
+    MOCK_METHOD(bool, waitForPackets, (int rxQueueId, uint64_t maxWaitMicros),
+                (override));
     MOCK_METHOD(void, releasePackets, (Packet * packets[], uint16_t numPackets),
                 (override));
     MOCK_METHOD(int, getHighestPacketPriority, (), (override));
@@ -35,12 +35,15 @@ class MockPolicyManager : public Core::Policy::Manager {
 
     MOCK_METHOD0(getResendPriority, int());
     MOCK_METHOD0(getScheduledPolicy, Core::Policy::Scheduled());
+    MOCK_METHOD1(setDegreeOvercommitment, void(int degree));
     MOCK_METHOD2(getUnscheduledPolicy,
                  Core::Policy::Unscheduled(const IpAddress destination,
                                            const uint32_t messageLength));
     MOCK_METHOD3(signalNewMessage,
                  void(const IpAddress source, uint8_t policyVersion,
                       uint32_t messageLength));
+    MOCK_METHOD2(signalRttSample,
+                 void(const IpAddress peer, uint64_t rttCycles));
     MOCK_METHOD0(poll, void());
 };
 
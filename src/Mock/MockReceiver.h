@@ -42,7 +42,14 @@ class MockReceiver : public Core::Receiver {
     MOCK_METHOD(void, handlePingPacket,
                 (Driver::Packet * packet, IpAddress sourceIp), (override));
     MOCK_METHOD(Homa::InMessage*, receiveMessage, (), (override));
-    MOCK_METHOD(void, poll, (), (override));
+    MOCK_METHOD(uint32_t, receiveMessages,
+                (Homa::InMessage * messages[], uint32_t maxMessages),
+                (override));
+    MOCK_METHOD(bool, claimPiggybackGrant,
+                (IpAddress sourceIp, Protocol::MessageId* grantId,
+                 uint32_t* byteLimit, uint8_t* priority),
+                (override));
+    MOCK_METHOD(uint32_t, poll, (), (override));
     MOCK_METHOD(void, checkTimeouts, (), (override));
 };
 
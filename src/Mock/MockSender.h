@@ -45,7 +45,11 @@ class MockSender : public Core::Sender {
     MOCK_METHOD(void, handleUnknownPacket, (Driver::Packet * packet),
                 (override));
     MOCK_METHOD(void, handleErrorPacket, (Driver::Packet * packet), (override));
-    MOCK_METHOD(void, poll, (), (override));
+    MOCK_METHOD(void, applyGrant,
+                (Protocol::MessageId msgId, uint32_t byteLimit,
+                 uint8_t priority),
+                (override));
+    MOCK_METHOD(uint32_t, poll, (), (override));
     MOCK_METHOD(void, checkTimeouts, (), (override));
 };
 
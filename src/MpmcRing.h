@@ -0,0 +1,154 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_MPMCRING_H
+#define HOMA_CORE_MPMCRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace Homa {
+namespace Core {
+
+/**
+ * A bounded lock-free multi-producer, multi-consumer ring queue.
+ *
+ * Producers and consumers synchronize using only per-slot sequence numbers
+ * (Dmitry Vyukov's bounded MPMC queue algorithm), so uncontended push and
+ * pop operations involve no locks and touch a single cacheline.  Used for
+ * queues that would otherwise ping-pong a mutex between cores.
+ *
+ * @tparam T
+ *      Type of the elements held in the ring; should be small and trivially
+ *      copyable (e.g. a pointer).
+ * @tparam N
+ *      Number of elements the ring can hold; must be a power of two.
+ */
+template <typename T, size_t N>
+class MpmcRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+  public:
+    /**
+     * MpmcRing constructor.
+     */
+    MpmcRing()
+        : slots()
+        , head(0)
+        , tail(0)
+    {
+        for (size_t i = 0; i < N; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Add an element to the ring if there is room.
+     *
+     * @param item
+     *      Element to be added.
+     * @return
+     *      True, if the element was added; false, if the ring is full.
+     */
+    bool tryPush(T item)
+    {
+        Slot* slot;
+        uint64_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            slot = &slots[pos & (N - 1)];
+            uint64_t seq = slot->sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(seq - pos);
+            if (diff == 0) {
+                // Slot is free; try to claim it.
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Slot still holds an unconsumed element; the ring is full.
+                return false;
+            } else {
+                // Another producer claimed this slot; try the next one.
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->item = item;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Remove an element from the ring if one is available.
+     *
+     * @param[out] item
+     *      Filled with the removed element, if any.
+     * @return
+     *      True, if an element was removed; false, if the ring is empty.
+     */
+    bool tryPop(T* item)
+    {
+        Slot* slot;
+        uint64_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            slot = &slots[pos & (N - 1)];
+            uint64_t seq = slot->sequence.load(std::memory_order_acquire);
+            int64_t diff = static_cast<int64_t>(seq - (pos + 1));
+            if (diff == 0) {
+                // Slot holds an element; try to claim it.
+                if (head.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Slot has not been filled yet; the ring is empty.
+                return false;
+            } else {
+                // Another consumer claimed this slot; try the next one.
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        *item = slot->item;
+        slot->sequence.store(pos + N, std::memory_order_release);
+        return true;
+    }
+
+  private:
+    /**
+     * Holds a single element and the sequence number used to synchronize
+     * access to it.
+     */
+    struct Slot {
+        /// Synchronizes producer and consumer access to this slot.
+        std::atomic<uint64_t> sequence;
+        /// The element held in this slot.
+        T item;
+    };
+
+    /// Ring storage.
+    Slot slots[N];
+
+    /// Position of the next element to be removed.  Aligned to its own
+    /// cacheline to avoid false sharing with the producer-side tail.
+    alignas(64) std::atomic<uint64_t> head;
+
+    /// Position of the next element to be added.
+    alignas(64) std::atomic<uint64_t> tail;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_MPMCRING_H
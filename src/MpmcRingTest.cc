@@ -0,0 +1,74 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "MpmcRing.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+TEST(MpmcRingTest, pushPop)
+{
+    MpmcRing<int, 4> ring;
+    int item = 0;
+
+    EXPECT_FALSE(ring.tryPop(&item));
+
+    EXPECT_TRUE(ring.tryPush(1));
+    EXPECT_TRUE(ring.tryPush(2));
+
+    EXPECT_TRUE(ring.tryPop(&item));
+    EXPECT_EQ(1, item);
+    EXPECT_TRUE(ring.tryPop(&item));
+    EXPECT_EQ(2, item);
+    EXPECT_FALSE(ring.tryPop(&item));
+}
+
+TEST(MpmcRingTest, full)
+{
+    MpmcRing<int, 4> ring;
+    int item = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        EXPECT_TRUE(ring.tryPush(i));
+    }
+    EXPECT_FALSE(ring.tryPush(4));
+
+    EXPECT_TRUE(ring.tryPop(&item));
+    EXPECT_EQ(0, item);
+    EXPECT_TRUE(ring.tryPush(4));
+    EXPECT_FALSE(ring.tryPush(5));
+}
+
+TEST(MpmcRingTest, wraparound)
+{
+    MpmcRing<int, 4> ring;
+    int item = 0;
+
+    // Cycle through the ring several times to exercise the sequence number
+    // wraparound logic.
+    for (int i = 0; i < 20; ++i) {
+        EXPECT_TRUE(ring.tryPush(i));
+        EXPECT_TRUE(ring.tryPop(&item));
+        EXPECT_EQ(i, item);
+    }
+    EXPECT_FALSE(ring.tryPop(&item));
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
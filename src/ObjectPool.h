@@ -19,7 +19,11 @@
 #include "Homa/Exception.h"
 
 #include "Debug.h"
+#include "SpinLock.h"
+#include "ThreadId.h"
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
 
 /*
@@ -65,6 +69,9 @@ class ObjectPool {
     ObjectPool()
         : outstandingObjects(0)
         , pool()
+        , demandPeak(0)
+        , reservedBlocks(0)
+        , destroysSinceTrim(0)
     {}
 
     /**
@@ -116,9 +123,32 @@ class ObjectPool {
         }
 
         outstandingObjects++;
+        if (outstandingObjects > demandPeak) {
+            demandPeak = outstandingObjects;
+        }
         return object;
     }
 
+    /**
+     * Pre-allocate backing memory for the given number of objects so that
+     * subsequent construct() calls can be satisfied without reaching malloc.
+     * Useful for pools that back degraded or bursty paths where allocating
+     * on demand is least affordable.
+     *
+     * @param count
+     *      Number of objects worth of backing memory the pool should hold in
+     *      reserve (in addition to any outstanding objects).
+     */
+    void reserve(uint64_t count)
+    {
+        if (count > reservedBlocks) {
+            reservedBlocks = count;
+        }
+        while (pool.size() < count) {
+            pool.push_back(operator new(sizeof(T)));
+        }
+    }
+
     /**
      * Destroy an object previously allocated by this pool.
      */
@@ -128,15 +158,310 @@ class ObjectPool {
         object->~T();
         pool.push_back(static_cast<void*>(object));
         outstandingObjects--;
+        if (++destroysSinceTrim >= TRIM_INTERVAL) {
+            trim();
+        }
     }
 
   private:
+    /// Number of destroy() calls between trim passes; amortizes the cost of
+    /// trimming so that steady-state destruction stays O(1).
+    static const uint64_t TRIM_INTERVAL = 256;
+
+    /// Maximum number of cached blocks released per trim pass; bounds the
+    /// latency a single destroy() call can absorb.
+    static const size_t TRIM_BATCH = 64;
+
+    /**
+     * Release cached backing memory that recent demand no longer justifies.
+     *
+     * The pool tracks a decaying peak of the number of objects outstanding;
+     * cached blocks beyond that watermark (or beyond an explicit reserve())
+     * are freed, at most TRIM_BATCH per pass.  The decay provides
+     * hysteresis: after a load spike the cached memory drains over many trim
+     * passes, so a pool oscillating around its steady-state demand keeps
+     * enough cached memory to never reach malloc, while spike memory is
+     * eventually returned to the system.
+     */
+    void trim()
+    {
+        destroysSinceTrim = 0;
+        // Decay the watermark toward the current demand, but never below it.
+        demandPeak -= demandPeak / 8;
+        if (demandPeak < outstandingObjects) {
+            demandPeak = outstandingObjects;
+        }
+        uint64_t watermark = std::max(demandPeak, reservedBlocks);
+        size_t freed = 0;
+        while (pool.size() > watermark && freed < TRIM_BATCH) {
+            free(pool.back());
+            pool.pop_back();
+            freed++;
+        }
+    }
+
     /// Count of the number of objects for which construct() was called, but
     /// destroy() was not.
     uint64_t outstandingObjects;
 
     /// Pool of backing memory from previously destroyed objects.
     std::vector<void*> pool;
+
+    /// Decaying peak of outstandingObjects; the trim watermark.  See trim().
+    uint64_t demandPeak;
+
+    /// Number of blocks pinned in the pool by reserve(); trim() never
+    /// releases below this.
+    uint64_t reservedBlocks;
+
+    /// Number of destroy() calls since the last trim pass.
+    uint64_t destroysSinceTrim;
+};
+
+/**
+ * A thread-safe object allocator that gives each thread a private "magazine"
+ * of backing memory in front of a shared pool.
+ *
+ * construct() and destroy() operate on the calling thread's magazine, whose
+ * lock is uncontended in the common case; the magazine exchanges backing
+ * memory with the shared pool in batches of MAGAZINE_SIZE blocks, so the
+ * shared lock is taken only once per batch instead of once per object.  Use
+ * MagazineObjectPool instead of wrapping an ObjectPool in a single lock when
+ * objects are allocated and destroyed concurrently on a hot path (e.g.
+ * transport Message objects).
+ *
+ * Objects may be destroyed by a different thread than the one that
+ * constructed them; the backing memory simply accumulates in the destroying
+ * thread's magazine.
+ */
+template <typename T>
+class MagazineObjectPool {
+  public:
+    /**
+     * Construct a new MagazineObjectPool.  The pool begins life with no
+     * allocated memory.
+     */
+    MagazineObjectPool()
+        : outstandingObjects(0)
+        , demandPeak(0)
+        , flushesSinceTrim(0)
+        , shared()
+        , magazines()
+    {}
+
+    /**
+     * Destroy the MagazineObjectPool. The pool expects that all objects
+     * allocated from it have already been destroyed and will not go about
+     * cleaning up the caller's mess.
+     */
+    ~MagazineObjectPool()
+    {
+        for (size_t i = 0; i < NUM_MAGAZINES; ++i) {
+            for (void* block : magazines[i].blocks) {
+                free(block);
+            }
+        }
+        for (void* block : shared.blocks) {
+            free(block);
+        }
+
+        // Catching this isn't intended, but could be done if the caller really
+        // wants to, so make sure we free the pooled memory first.
+        if (outstandingObjects.load() > 0) {
+            ERROR("Pool destroyed with %lu objects still outstanding!",
+                  outstandingObjects.load());
+        }
+    }
+
+    /**
+     * Construct a new object of templated type T using memory from the
+     * calling thread's magazine.
+     *
+     * @param args
+     *      Arguments to provide to T's constructor.
+     * \throw
+     *      An exception is thrown if T's constructor throws.
+     */
+    template <typename... Args>
+    T* construct(Args&&... args)
+    {
+        Magazine* magazine = getMagazine();
+        SpinLock::Lock lock(magazine->mutex);
+        if (magazine->blocks.empty()) {
+            refill(magazine);
+        }
+        void* backing = magazine->blocks.back();
+        magazine->blocks.pop_back();
+
+        T* object = NULL;
+        try {
+            object = new (backing) T(static_cast<Args&&>(args)...);
+        } catch (...) {
+            magazine->blocks.push_back(backing);
+            throw;
+        }
+
+        uint64_t outstanding =
+            outstandingObjects.fetch_add(1, std::memory_order_relaxed) + 1;
+        uint64_t peak = demandPeak.load(std::memory_order_relaxed);
+        while (peak < outstanding &&
+               !demandPeak.compare_exchange_weak(peak, outstanding,
+                                                 std::memory_order_relaxed)) {
+        }
+        return object;
+    }
+
+    /**
+     * Destroy an object previously allocated by this pool; the backing
+     * memory is stashed in the calling thread's magazine.
+     */
+    void destroy(T* object)
+    {
+        assert(outstandingObjects.load() > 0);
+        object->~T();
+        Magazine* magazine = getMagazine();
+        SpinLock::Lock lock(magazine->mutex);
+        magazine->blocks.push_back(static_cast<void*>(object));
+        if (magazine->blocks.size() >= 2 * MAGAZINE_SIZE) {
+            flush(magazine);
+        }
+        outstandingObjects.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /// Count of the number of objects for which construct() was called, but
+    /// destroy() was not.
+    std::atomic<uint64_t> outstandingObjects;
+
+  private:
+    /// Number of backing memory blocks moved between a magazine and the
+    /// shared pool at a time.
+    static const size_t MAGAZINE_SIZE = 32;
+
+    /// Number of flush() batches between trim passes; amortizes the cost of
+    /// trimming so that steady-state destruction stays O(1).
+    static const uint64_t TRIM_INTERVAL = 8;
+
+    /// Maximum number of shared blocks released per trim pass; bounds the
+    /// latency a single destroy() call can absorb.
+    static const size_t TRIM_BATCH = 64;
+
+    /// Number of magazines; threads are assigned a magazine by thread id.
+    /// Must be large enough that concurrent threads rarely share one.
+    static const size_t NUM_MAGAZINES = 64;
+
+    /**
+     * Holds a single thread's private cache of backing memory.
+     */
+    struct Magazine {
+        /// Protects this magazine.  Uncontended unless multiple threads hash
+        /// to the same magazine.
+        SpinLock mutex;
+
+        /// Blocks of backing memory available to this magazine's thread.
+        std::vector<void*> blocks;
+
+        Magazine()
+            : mutex("MagazineObjectPool::Magazine::mutex")
+            , blocks()
+        {}
+    };
+
+    /**
+     * Return the calling thread's magazine.
+     */
+    Magazine* getMagazine()
+    {
+        return &magazines[ThreadId::getId() % NUM_MAGAZINES];
+    }
+
+    /**
+     * Move a batch of backing memory from the shared pool to the given
+     * magazine, allocating new memory if the shared pool is empty.  The
+     * caller must hold the magazine's mutex.
+     */
+    void refill(Magazine* magazine)
+    {
+        {
+            SpinLock::Lock lock(shared.mutex);
+            while (!shared.blocks.empty() &&
+                   magazine->blocks.size() < MAGAZINE_SIZE) {
+                magazine->blocks.push_back(shared.blocks.back());
+                shared.blocks.pop_back();
+            }
+        }
+        if (magazine->blocks.empty()) {
+            magazine->blocks.push_back(operator new(sizeof(T)));
+        }
+    }
+
+    /**
+     * Move a batch of backing memory from the given magazine back to the
+     * shared pool.  The caller must hold the magazine's mutex.
+     */
+    void flush(Magazine* magazine)
+    {
+        SpinLock::Lock lock(shared.mutex);
+        for (size_t i = 0; i < MAGAZINE_SIZE; ++i) {
+            shared.blocks.push_back(magazine->blocks.back());
+            magazine->blocks.pop_back();
+        }
+        if (++flushesSinceTrim >= TRIM_INTERVAL) {
+            trim();
+        }
+    }
+
+    /**
+     * Release shared-pool backing memory that recent demand no longer
+     * justifies; the concurrent counterpart of ObjectPool::trim().  The
+     * caller must hold the shared pool's mutex.
+     *
+     * The pool tracks a decaying peak of the number of objects outstanding;
+     * shared blocks beyond that watermark are freed, at most TRIM_BATCH per
+     * pass, so after a load spike (e.g. an incast filling a transport's
+     * message pool) the spike's memory drains back to the system over many
+     * flushes instead of being held for the process lifetime.  The decay
+     * provides hysteresis: a pool oscillating around its steady-state demand
+     * keeps enough cached memory to never reach malloc.
+     */
+    void trim()
+    {
+        flushesSinceTrim = 0;
+        uint64_t peak = demandPeak.load(std::memory_order_relaxed);
+        uint64_t outstanding =
+            outstandingObjects.load(std::memory_order_relaxed);
+        // Decay the watermark toward the current demand, but never below it.
+        peak -= peak / 8;
+        if (peak < outstanding) {
+            peak = outstanding;
+        }
+        demandPeak.store(peak, std::memory_order_relaxed);
+        size_t freed = 0;
+        while (shared.blocks.size() > peak && freed < TRIM_BATCH) {
+            free(shared.blocks.back());
+            shared.blocks.pop_back();
+            freed++;
+        }
+    }
+
+    /// Decaying peak of outstandingObjects; the trim watermark.  See trim().
+    std::atomic<uint64_t> demandPeak;
+
+    /// Number of flush() batches since the last trim pass; guarded by the
+    /// shared pool's mutex.
+    uint64_t flushesSinceTrim;
+
+    /// Backing memory shared by all magazines.
+    struct {
+        /// Protects the shared block list.  Taken once per batch, not once
+        /// per object.
+        SpinLock mutex;
+
+        /// Blocks of backing memory not currently held by any magazine.
+        std::vector<void*> blocks;
+    } shared;
+
+    /// Per-thread caches of backing memory.
+    Magazine magazines[NUM_MAGAZINES];
 };
 
 }  // namespace Homa
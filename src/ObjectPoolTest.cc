@@ -126,6 +126,23 @@ TEST(ObjectPoolTest, construct)
     pool.destroy(a);
 }
 
+TEST(ObjectPoolTest, reserve)
+{
+    ObjectPool<TestObject> pool;
+    pool.reserve(10);
+    EXPECT_EQ(10U, pool.pool.size());
+
+    // Constructing from a reserved pool consumes the reserve.
+    TestObject* a = pool.construct();
+    EXPECT_EQ(9U, pool.pool.size());
+
+    // Reserving less than is already pooled does nothing.
+    pool.reserve(5);
+    EXPECT_EQ(9U, pool.pool.size());
+
+    pool.destroy(a);
+}
+
 TEST(ObjectPoolTest, destroy)
 {
     ObjectPool<TestObject> pool;
@@ -175,4 +192,138 @@ TEST(ObjectPoolTest, destroy_randomOrder)
     }
 }
 
+TEST(ObjectPoolTest, trim)
+{
+    ObjectPool<TestObject> pool;
+    const int count = 300;
+    TestObject* objs[count];
+
+    for (int i = 0; i < count; i++) objs[i] = pool.construct();
+    EXPECT_EQ(300U, pool.demandPeak);
+
+    // The spike's memory is all still cached right after the spike drains;
+    // the watermark has only just started to decay.
+    for (int i = 0; i < count; i++) pool.destroy(objs[i]);
+    EXPECT_EQ(300U, pool.pool.size());
+
+    // Repeated trim passes decay the watermark and release the cached spike
+    // memory a batch at a time.
+    for (int i = 0; i < 100; i++) pool.trim();
+    EXPECT_LE(pool.pool.size(), 7U);
+}
+
+TEST(ObjectPoolTest, trim_respectsReserve)
+{
+    ObjectPool<TestObject> pool;
+    pool.reserve(10);
+    for (int i = 0; i < 100; i++) pool.trim();
+    EXPECT_EQ(10U, pool.pool.size());
+}
+
+TEST(MagazineObjectPoolTest, constructor)
+{
+    MagazineObjectPool<TestObject> pool;
+    EXPECT_EQ(0U, pool.outstandingObjects);
+    EXPECT_EQ(0U, pool.shared.blocks.size());
+}
+
+TEST(MagazineObjectPoolTest, destructor_objectsStillAllocated)
+{
+    VectorHandler handler;
+    Debug::setLogHandler(std::ref(handler));
+
+    MagazineObjectPool<TestObject>* pool =
+        new MagazineObjectPool<TestObject>();
+    TestObject* a = pool->construct();
+    (void)a;
+
+    delete pool;
+
+    EXPECT_EQ(1U, handler.messages.size());
+    const Debug::DebugMessage& m = handler.messages.at(0);
+    EXPECT_STREQ("src/ObjectPool.h", m.filename);
+    EXPECT_STREQ("~MagazineObjectPool", m.function);
+    EXPECT_EQ(int(Debug::LogLevel::ERROR), m.logLevel);
+    EXPECT_EQ("Pool destroyed with 1 objects still outstanding!", m.message);
+
+    Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
+}
+
+TEST(MagazineObjectPoolTest, construct)
+{
+    MagazineObjectPool<TestObject> pool;
+    EXPECT_THROW(pool.construct(true), Exception);
+    EXPECT_EQ(1U, pool.getMagazine()->blocks.size());
+    TestObject* a = pool.construct();
+    EXPECT_NE(static_cast<TestObject*>(NULL), a);
+    EXPECT_EQ(1U, pool.outstandingObjects);
+    pool.destroy(a);
+}
+
+TEST(MagazineObjectPoolTest, destroy)
+{
+    MagazineObjectPool<TestObject> pool;
+    bool destroyed = false;
+    pool.destroy(pool.construct(&destroyed));
+    EXPECT_TRUE(destroyed);
+    EXPECT_EQ(0U, pool.outstandingObjects);
+    EXPECT_EQ(1U, pool.getMagazine()->blocks.size());
+}
+
+TEST(MagazineObjectPoolTest, destroy_flushToShared)
+{
+    MagazineObjectPool<TestObject> pool;
+    const size_t magazineSize = MagazineObjectPool<TestObject>::MAGAZINE_SIZE;
+    const size_t count = 2 * magazineSize;
+    TestObject* toDestroy[count];
+
+    for (size_t i = 0; i < count; i++) toDestroy[i] = pool.construct();
+    EXPECT_EQ(0U, pool.shared.blocks.size());
+
+    // The magazine overflows on the last destroy and flushes a batch back
+    // to the shared pool.
+    for (size_t i = 0; i < count; i++) pool.destroy(toDestroy[i]);
+    EXPECT_EQ(magazineSize, pool.shared.blocks.size());
+    EXPECT_EQ(magazineSize, pool.getMagazine()->blocks.size());
+
+    // Exhausting the magazine triggers a refill that drains the shared pool
+    // instead of calling malloc.
+    for (size_t i = 0; i < magazineSize + 1; i++)
+        toDestroy[i] = pool.construct();
+    EXPECT_EQ(0U, pool.shared.blocks.size());
+    EXPECT_EQ(magazineSize - 1, pool.getMagazine()->blocks.size());
+    for (size_t i = 0; i < magazineSize + 1; i++) pool.destroy(toDestroy[i]);
+}
+
+TEST(MagazineObjectPoolTest, trim)
+{
+    MagazineObjectPool<TestObject> pool;
+    const size_t count = 256;
+    TestObject* objs[count];
+
+    for (size_t i = 0; i < count; i++) objs[i] = pool.construct();
+    EXPECT_EQ(256U, pool.demandPeak.load());
+
+    // Destroying everything flushes most of the spike's memory into the
+    // shared pool (the last partial magazine stays private).
+    for (size_t i = 0; i < count; i++) pool.destroy(objs[i]);
+    EXPECT_EQ(224U, pool.shared.blocks.size());
+
+    // The first trim pass only decays the watermark to the cached size; the
+    // second starts releasing blocks.
+    {
+        SpinLock::Lock lock(pool.shared.mutex);
+        pool.trim();
+        pool.trim();
+    }
+    EXPECT_EQ(196U, pool.shared.blocks.size());
+
+    // Repeated passes drain the rest of the spike.
+    for (int i = 0; i < 100; i++) {
+        SpinLock::Lock lock(pool.shared.mutex);
+        pool.trim();
+    }
+    EXPECT_LE(pool.shared.blocks.size(), 7U);
+}
+
 }  // namespace Homa
@@ -0,0 +1,125 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_PACER_H
+#define HOMA_CORE_PACER_H
+
+#include <Cycles.h>
+#include <Homa/Driver.h>
+
+#include <atomic>
+#include <cstdint>
+
+namespace Homa {
+namespace Core {
+
+/**
+ * Schedules the release time of each outbound DATA packet so that the send
+ * path emits packets at the network's bandwidth instead of bursting at line
+ * rate until the NIC queue fills.
+ *
+ * The Pacer maintains a virtual transmit clock: releasing a packet advances
+ * the clock by the packet's serialization delay at the rate reported by
+ * Driver::getBandwidth().  A packet may be released only once the real clock
+ * has caught up to the virtual clock; a small burst allowance lets the sender
+ * fill the NIC's pipeline after an idle period.  The bandwidth is cached at
+ * construction so the hot path makes no virtual calls.
+ *
+ * If the Driver does not report a bandwidth, pacing is disabled and every
+ * release request is granted.
+ *
+ * This class is thread-safe: the Sender's send queue shards may release
+ * packets concurrently, all charging the same virtual clock.
+ */
+class Pacer {
+  public:
+    /**
+     * Pacer constructor.
+     *
+     * @param driver
+     *      Driver whose reported bandwidth should be used to pace packets.
+     */
+    explicit Pacer(Driver* driver)
+        : cyclesPerByte(0.0)
+        , maxBurstCycles(0)
+        , nextReleaseTime(0)
+    {
+        uint32_t bandwidthMbps = driver->getBandwidth();
+        if (bandwidthMbps > 0) {
+            double bytesPerSecond = double(bandwidthMbps) * 1e6 / 8.0;
+            cyclesPerByte = PerfUtils::Cycles::perSecond() / bytesPerSecond;
+            // Allow roughly two full-size packets of burst so that the NIC
+            // is not starved between calls to trySend().
+            maxBurstCycles = uint64_t(
+                cyclesPerByte * 2 * double(driver->getMaxPayloadSize()));
+        }
+    }
+
+    /**
+     * Ask to release a packet of the given size to the driver.
+     *
+     * @param bytes
+     *      Number of bytes the packet will occupy on the wire.
+     * @return
+     *      True if the packet may be sent now; the packet's serialization
+     *      time is charged against the virtual transmit clock.  False if the
+     *      caller should hold the packet and try again later.
+     */
+    bool tryReleasePacket(uint32_t bytes)
+    {
+        if (cyclesPerByte == 0.0) {
+            // Pacing disabled.
+            return true;
+        }
+        uint64_t releaseTime =
+            nextReleaseTime.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t now = PerfUtils::Cycles::rdtsc();
+            if (releaseTime > now) {
+                return false;
+            }
+            // Cap the credit accumulated while idle at the burst allowance.
+            uint64_t base = releaseTime;
+            if (now - base > maxBurstCycles) {
+                base = now - maxBurstCycles;
+            }
+            // Claim the packet's serialization time with a CAS so concurrent
+            // releases from different send queue shards never double-spend
+            // the same transmit credit.
+            if (nextReleaseTime.compare_exchange_weak(
+                    releaseTime, base + uint64_t(cyclesPerByte * bytes),
+                    std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+  private:
+    /// Serialization delay of a single byte at the network's bandwidth; 0.0
+    /// if pacing is disabled.
+    double cyclesPerByte;
+
+    /// Largest amount of transmit credit (in cycles) that can build up while
+    /// the sender is idle.
+    uint64_t maxBurstCycles;
+
+    /// Virtual transmit clock: earliest time the next packet may be released.
+    std::atomic<uint64_t> nextReleaseTime;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_PACER_H
@@ -0,0 +1,227 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_PACKETARRAY_H
+#define HOMA_CORE_PACKETARRAY_H
+
+#include <Homa/Driver.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+namespace Homa {
+namespace Core {
+
+/**
+ * A sparse array of Driver::Packet pointers with small-message-optimized
+ * storage.
+ *
+ * The first NUM_INLINE_SLOTS entries are stored directly in the PacketArray
+ * so that messages of only a few packets (the common case) fit in a couple
+ * of cache lines and require no heap allocation.  Entries beyond the inline
+ * region are stored in fixed-size overflow extents which are allocated on
+ * demand and tracked by a directory that is itself demand-allocated; a
+ * message never pays for array capacity it does not use, so MAX_PACKETS can
+ * be large without bloating small messages.
+ *
+ * An unset entry is represented by a nullptr slot; Packet pointers stored in
+ * a PacketArray must therefore be non-null.
+ *
+ * This class is not thread-safe.
+ *
+ * @tparam MAX_PACKETS
+ *      Maximum number of Packet pointers the array can hold.
+ */
+template <size_t MAX_PACKETS>
+class PacketArray {
+  public:
+    /**
+     * PacketArray constructor.  All entries start out unset.
+     */
+    PacketArray()
+        : inlineSlots()
+        , extents(nullptr)
+    {}
+
+    /**
+     * PacketArray destructor.  Frees any allocated overflow extents; the
+     * Packet objects themselves are not released (that is the owning
+     * Message's responsibility).
+     */
+    ~PacketArray()
+    {
+        if (extents != nullptr) {
+            for (size_t i = 0; i < NUM_EXTENTS; ++i) {
+                delete[] extents[i];
+            }
+            delete[] extents;
+        }
+    }
+
+    /**
+     * Return the Packet pointer stored at the given index.
+     *
+     * @param index
+     *      Index of the desired entry; must be less than MAX_PACKETS.
+     * @return
+     *      The stored Packet pointer if the entry is set; nullptr otherwise.
+     */
+    Driver::Packet* get(size_t index) const
+    {
+        assert(index < MAX_PACKETS);
+        if (index < NUM_INLINE_SLOTS) {
+            return inlineSlots[index];
+        }
+        if (extents == nullptr) {
+            return nullptr;
+        }
+        Driver::Packet** extent =
+            extents[(index - NUM_INLINE_SLOTS) / EXTENT_SIZE];
+        if (extent == nullptr) {
+            return nullptr;
+        }
+        return extent[(index - NUM_INLINE_SLOTS) % EXTENT_SIZE];
+    }
+
+    /**
+     * Store the given Packet pointer at the given index, allocating an
+     * overflow extent if necessary.
+     *
+     * @param index
+     *      Index of the entry to set; must be less than MAX_PACKETS.
+     * @param packet
+     *      The Packet pointer to store; must be non-null.
+     */
+    void set(size_t index, Driver::Packet* packet)
+    {
+        assert(index < MAX_PACKETS);
+        assert(packet != nullptr);
+        if (index < NUM_INLINE_SLOTS) {
+            inlineSlots[index] = packet;
+            return;
+        }
+        if (extents == nullptr) {
+            // Value-initialization zeroes the directory so that extents read
+            // back as unallocated.
+            extents = new Driver::Packet**[NUM_EXTENTS]();
+        }
+        Driver::Packet**& extent =
+            extents[(index - NUM_INLINE_SLOTS) / EXTENT_SIZE];
+        if (extent == nullptr) {
+            // Value-initialization zeroes the new extent so that its other
+            // entries read back as unset.
+            extent = new Driver::Packet*[EXTENT_SIZE]();
+        }
+        extent[(index - NUM_INLINE_SLOTS) % EXTENT_SIZE] = packet;
+    }
+
+    /**
+     * Release every stored Packet back to the given driver and unset all
+     * entries.
+     *
+     * Contiguous entries that happen to share an inline region or extent are
+     * released with a single call to Driver::releasePackets().
+     *
+     * @param driver
+     *      Driver to which the Packet objects should be returned.
+     * @param numPackets
+     *      Number of entries that are set; used to stop scanning early.
+     */
+    void releasePackets(Driver* driver, int numPackets)
+    {
+        int packetsFound = 0;
+        packetsFound +=
+            releaseRegion(driver, inlineSlots, NUM_INLINE_SLOTS,
+                          numPackets - packetsFound);
+        for (size_t i = 0;
+             extents != nullptr && i < NUM_EXTENTS && packetsFound < numPackets;
+             ++i) {
+            if (extents[i] != nullptr) {
+                packetsFound += releaseRegion(driver, extents[i], EXTENT_SIZE,
+                                              numPackets - packetsFound);
+            }
+        }
+    }
+
+  private:
+    /// Number of entries stored directly in the PacketArray.
+    static const size_t NUM_INLINE_SLOTS = 8;
+
+    /// Number of entries in each demand-allocated overflow extent.
+    static const size_t EXTENT_SIZE = 64;
+
+    /// Number of overflow extents needed to cover MAX_PACKETS entries.
+    static const size_t NUM_EXTENTS =
+        (MAX_PACKETS - NUM_INLINE_SLOTS + EXTENT_SIZE - 1) / EXTENT_SIZE;
+
+    /**
+     * Release the set entries within a single contiguous region of slots,
+     * clearing them as it goes.
+     *
+     * @param driver
+     *      Driver to which the Packet objects should be returned.
+     * @param slots
+     *      First slot of the region.
+     * @param numSlots
+     *      Number of slots in the region.
+     * @param maxPackets
+     *      Largest number of packets that remain to be released.
+     * @return
+     *      The number of packets released.
+     */
+    static int releaseRegion(Driver* driver, Driver::Packet** slots,
+                             size_t numSlots, int maxPackets)
+    {
+        int released = 0;
+        int num = 0;
+        size_t index = 0;
+        for (size_t i = 0; i < numSlots && released + num < maxPackets; ++i) {
+            if (slots[i] != nullptr) {
+                if (num == 0) {
+                    // First packet in new run.
+                    index = i;
+                }
+                ++num;
+            } else if (num != 0) {
+                // End of run; release it.
+                driver->releasePackets(&slots[index], num);
+                released += num;
+                num = 0;
+            }
+        }
+        if (num != 0) {
+            // Release the last run (if any).
+            driver->releasePackets(&slots[index], num);
+            released += num;
+        }
+        std::fill(slots, slots + numSlots, nullptr);
+        return released;
+    }
+
+    /// Inline storage for the first NUM_INLINE_SLOTS entries.
+    Driver::Packet* inlineSlots[NUM_INLINE_SLOTS];
+
+    /// Directory of demand-allocated overflow extents covering the remaining
+    /// entries; nullptr until the first entry beyond the inline region is
+    /// set.  A directory entry is nullptr until some slot in its extent is
+    /// first set.
+    Driver::Packet*** extents;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_PACKETARRAY_H
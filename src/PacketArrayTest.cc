@@ -0,0 +1,116 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "Mock/MockDriver.h"
+#include "PacketArray.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+using ::testing::Eq;
+using ::testing::NiceMock;
+
+TEST(PacketArrayTest, constructor)
+{
+    PacketArray<1024> array;
+    EXPECT_EQ(nullptr, array.extents);
+    EXPECT_EQ(nullptr, array.get(0));
+    EXPECT_EQ(nullptr, array.get(7));
+    EXPECT_EQ(nullptr, array.get(1023));
+}
+
+TEST(PacketArrayTest, set_get_inline)
+{
+    PacketArray<1024> array;
+    Driver::Packet* packet = (Driver::Packet*)42;
+    array.set(0, packet);
+    EXPECT_EQ(packet, array.get(0));
+    EXPECT_EQ(nullptr, array.get(1));
+}
+
+TEST(PacketArrayTest, set_get_extent)
+{
+    PacketArray<1024> array;
+    Driver::Packet* packet = (Driver::Packet*)42;
+    // The extent directory is only allocated once an overflow entry is set.
+    EXPECT_EQ(nullptr, array.extents);
+    array.set(8, packet);
+    ASSERT_NE(nullptr, array.extents);
+    ASSERT_NE(nullptr, array.extents[0]);
+    EXPECT_EQ(packet, array.get(8));
+    EXPECT_EQ(nullptr, array.get(9));
+    // A second extent should only be allocated when needed.
+    EXPECT_EQ(nullptr, array.extents[1]);
+    array.set(1023, packet);
+    EXPECT_EQ(packet, array.get(1023));
+}
+
+TEST(PacketArrayTest, set_get_largeIndex)
+{
+    PacketArray<65536> array;
+    Driver::Packet* packet = (Driver::Packet*)42;
+    EXPECT_EQ(nullptr, array.get(65535));
+    array.set(65535, packet);
+    EXPECT_EQ(packet, array.get(65535));
+    EXPECT_EQ(nullptr, array.get(65534));
+}
+
+TEST(PacketArrayTest, releasePackets_contiguous)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    PacketArray<1024> array;
+    for (int i = 0; i < 12; ++i) {
+        array.set(i, reinterpret_cast<Driver::Packet*>(
+                static_cast<uintptr_t>(42 + i)));
+    }
+
+    // Packets are released per physical region: one call for the inline
+    // slots and one for the overflow extent.
+    EXPECT_CALL(mockDriver, releasePackets(Eq(array.inlineSlots), Eq(8)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Eq(array.extents[0]), Eq(4)))
+        .Times(1);
+
+    array.releasePackets(&mockDriver, 12);
+
+    EXPECT_EQ(nullptr, array.get(0));
+    EXPECT_EQ(nullptr, array.get(11));
+}
+
+TEST(PacketArrayTest, releasePackets_holes)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    PacketArray<1024> array;
+    array.set(0, (Driver::Packet*)42);
+    array.set(1, (Driver::Packet*)43);
+    array.set(3, (Driver::Packet*)44);
+    array.set(4, (Driver::Packet*)45);
+
+    EXPECT_CALL(mockDriver, releasePackets(Eq(&array.inlineSlots[0]), Eq(2)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Eq(&array.inlineSlots[3]), Eq(2)))
+        .Times(1);
+
+    array.releasePackets(&mockDriver, 4);
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
@@ -15,72 +15,557 @@
 
 #include "Perf.h"
 
+#include <algorithm>
+#include <cstring>
 #include <mutex>
-#include <unordered_set>
+#include <unordered_map>
+
+#include "SpinLock.h"
 
 namespace Homa {
 namespace Perf {
 
+// Definitions for Histogram's in-class initialized constants so that
+// ODR-uses (e.g. binding them to references) link under C++11/14.
+const uint32_t Histogram::SUB_BUCKET_BITS;
+const uint32_t Histogram::SUB_BUCKET_COUNT;
+const uint32_t Histogram::NUM_BUCKETS;
+
 namespace Internal {
 
 /**
- * Protects access to globalCounters and perThreadCounters
+ * Head of the registry of every thread's counters; a lock-free singly-linked
+ * list of ThreadCounters nodes.  Nodes are pushed when a thread first touches
+ * its counters and are never removed (see ThreadCounters), so readers can
+ * walk the list without locks.
  */
-std::mutex mutex;
+std::atomic<ThreadCounters*> threadCounterList(nullptr);
+
+// Init per-peer statistics collection disabled.
+std::atomic<bool> collectPerPeerStats(false);
 
 /**
- * Contains statistics information for any thread that as already exited.
+ * Protects access to peerCounters.
  */
-Counters globalCounters;
+std::mutex peerMutex;
 
 /**
- * Set of all counters for all threads.
+ * Counters for every peer this process has exchanged packets with while
+ * per-peer collection was enabled.  Entries are heap-allocated and never
+ * freed so that samplers can cache the pointers lock-free.
  */
-std::unordered_set<const Counters*> perThreadCounters;
+std::unordered_map<IpAddress, PeerCounters*, IpAddress::Hasher> peerCounters;
 
 }  // namespace Internal
 
-// Init thread local thread counters
-thread_local ThreadCounters counters;
+// Init thread local thread counters; the node is intentionally leaked so
+// that the registry never references freed memory (see ThreadCounters).
+thread_local ThreadCounters& counters = *(new ThreadCounters());
 
 /**
  * Construct and register a new per thread set of counters.
  */
 ThreadCounters::ThreadCounters()
     : Counters()
+    , next(nullptr)
+    , transportId(0)
 {
-    std::lock_guard<std::mutex> lock(Internal::mutex);
-    Internal::perThreadCounters.insert(this);
+    // Lock-free push onto the registry; release ordering publishes the fully
+    // constructed node to concurrent readers.
+    ThreadCounters* head =
+        Internal::threadCounterList.load(std::memory_order_relaxed);
+    do {
+        next = head;
+    } while (!Internal::threadCounterList.compare_exchange_weak(
+        head, this, std::memory_order_release, std::memory_order_relaxed));
 }
 
 /**
- * Deregister and destruct a per thread set of counters.
+ * @sa setThreadTransportId()
  */
-ThreadCounters::~ThreadCounters()
+void
+setThreadTransportId(uint64_t transportId)
 {
-    std::lock_guard<std::mutex> lock(Internal::mutex);
-    Internal::globalCounters.add(this);
-    Internal::perThreadCounters.erase(this);
+    ThreadCounters& node = counters;
+    if (node.transportId.load(std::memory_order_relaxed) != transportId) {
+        node.transportId.store(transportId, std::memory_order_relaxed);
+    }
 }
 
+namespace {
+
 /**
+ * Fill the provided stats structure with the current counter values of every
+ * registered thread working on the given transport (or of every thread, if
+ * transportId is 0).
+ *
+ * Lock-free: walks the thread-counter registry performing one relaxed atomic
+ * read per counter per thread, so collection stays cheap no matter how often
+ * it runs.
  */
 void
-getStats(Stats* stats)
+collectStats(uint64_t transportId, Stats* stats)
 {
-    std::lock_guard<std::mutex> lock(Internal::mutex);
     stats->timestamp = PerfUtils::Cycles::rdtsc();
     stats->cycles_per_second = PerfUtils::Cycles::perSecond();
 
     Counters output;
-    output.add(&Internal::globalCounters);
-
-    for (const Counters* counters : Internal::perThreadCounters) {
-        output.add(counters);
+    for (ThreadCounters* node =
+             Internal::threadCounterList.load(std::memory_order_acquire);
+         node != nullptr; node = node->next) {
+        if (transportId == 0 ||
+            node->transportId.load(std::memory_order_relaxed) == transportId) {
+            output.add(node);
+        }
     }
 
     output.dumpStats(stats);
 }
 
+}  // namespace
+
+/**
+ */
+void
+getStats(Stats* stats)
+{
+    collectStats(0, stats);
+}
+
+namespace {
+
+/// Every scalar counter in Stats in a fixed order that defines both the
+/// delta computation and the binary serialization layout;
+/// STATS_SNAPSHOT_VERSION must be bumped whenever this table changes.
+uint64_t Stats::*const statsScalars[] = {
+    &Stats::active_cycles,
+    &Stats::idle_cycles,
+    &Stats::allocated_rx_messages,
+    &Stats::received_rx_messages,
+    &Stats::delivered_rx_messages,
+    &Stats::destroyed_rx_messages,
+    &Stats::allocated_tx_messages,
+    &Stats::released_tx_messages,
+    &Stats::destroyed_tx_messages,
+    &Stats::tx_bytes,
+    &Stats::rx_bytes,
+    &Stats::tx_data_pkts,
+    &Stats::rx_data_pkts,
+    &Stats::tx_grant_pkts,
+    &Stats::rx_grant_pkts,
+    &Stats::tx_done_pkts,
+    &Stats::rx_done_pkts,
+    &Stats::tx_resend_pkts,
+    &Stats::rx_resend_pkts,
+    &Stats::tx_busy_pkts,
+    &Stats::rx_busy_pkts,
+    &Stats::tx_ping_pkts,
+    &Stats::rx_ping_pkts,
+    &Stats::tx_unknown_pkts,
+    &Stats::rx_unknown_pkts,
+    &Stats::tx_error_pkts,
+    &Stats::rx_error_pkts,
+    &Stats::rx_overload_pushbacks,
+    &Stats::rx_compacted_pkts,
+    &Stats::mbuf_overflow_allocs,
+    &Stats::tx_mbuf_alloc_denials,
+    &Stats::mbuf_recycles,
+};
+
+/// Number of entries in statsScalars.
+const uint32_t NUM_STATS_SCALARS =
+    sizeof(statsScalars) / sizeof(statsScalars[0]);
+
+/// Every histogram array in Stats, in serialization order.
+Histogram (Stats::*const statsHistograms[])[NUM_MESSAGE_SIZE_CLASSES] = {
+    &Stats::tx_sent_latency,
+    &Stats::tx_completed_latency,
+    &Stats::rx_delivery_latency,
+};
+
+/// Number of histogram arrays in statsHistograms.
+const uint32_t NUM_STATS_HISTOGRAM_ARRAYS =
+    sizeof(statsHistograms) / sizeof(statsHistograms[0]);
+
+/// Total number of histograms a serialized snapshot carries.
+const uint32_t NUM_STATS_HISTOGRAMS =
+    NUM_STATS_HISTOGRAM_ARRAYS * NUM_MESSAGE_SIZE_CLASSES;
+
+/**
+ * Append a fixed-size value to the serialization buffer, advancing the
+ * offset.  A null buffer only advances the offset; used to size a snapshot
+ * before writing it.
+ */
+template <typename T>
+void
+append(char* buffer, size_t* offset, T value)
+{
+    if (buffer != nullptr) {
+        std::memcpy(buffer + *offset, &value, sizeof(T));
+    }
+    *offset += sizeof(T);
+}
+
+/**
+ * Extract a fixed-size value from the serialization buffer, advancing the
+ * offset.
+ *
+ * @return
+ *      False if the buffer ends before the value does.
+ */
+template <typename T>
+bool
+extract(const char* buffer, size_t length, size_t* offset, T* value)
+{
+    if (*offset + sizeof(T) > length) {
+        return false;
+    }
+    std::memcpy(value, buffer + *offset, sizeof(T));
+    *offset += sizeof(T);
+    return true;
+}
+
+}  // namespace
+
+/**
+ * Construct a StatsMonitor covering every transport in the process.
+ */
+StatsMonitor::StatsMonitor()
+    : StatsMonitor(0)
+{}
+
+/**
+ * Construct a StatsMonitor covering a single transport.
+ */
+StatsMonitor::StatsMonitor(uint64_t transportId)
+    : transportId(transportId)
+    , prev()
+    , hasPrev(false)
+{}
+
+/**
+ * @sa StatsMonitor::snapshot()
+ */
+void
+StatsMonitor::snapshot(StatsSnapshot* snapshot)
+{
+    snapshot->version = STATS_SNAPSHOT_VERSION;
+    snapshot->transportId = transportId;
+    collectStats(transportId, &snapshot->total);
+    snapshot->timestamp = snapshot->total.timestamp;
+    snapshot->cycles_per_second = snapshot->total.cycles_per_second;
+    snapshot->interval_cycles =
+        hasPrev ? snapshot->timestamp - prev.timestamp : 0;
+
+    // Deltas subtract the previous snapshot's values; prev is zeroed at
+    // construction so a monitor's first delta equals its total.
+    Stats* delta = &snapshot->delta;
+    delta->timestamp = snapshot->timestamp;
+    delta->cycles_per_second = snapshot->cycles_per_second;
+    for (uint32_t i = 0; i < NUM_STATS_SCALARS; ++i) {
+        delta->*statsScalars[i] =
+            snapshot->total.*statsScalars[i] - prev.*statsScalars[i];
+    }
+    for (uint32_t h = 0; h < NUM_STATS_HISTOGRAM_ARRAYS; ++h) {
+        for (uint32_t i = 0; i < NUM_MESSAGE_SIZE_CLASSES; ++i) {
+            const Histogram& cur = (snapshot->total.*statsHistograms[h])[i];
+            const Histogram& old = (prev.*statsHistograms[h])[i];
+            Histogram& out = (delta->*statsHistograms[h])[i];
+            out.sample_count = cur.sample_count - old.sample_count;
+            for (uint32_t j = 0; j < Histogram::NUM_BUCKETS; ++j) {
+                out.buckets[j] = cur.buckets[j] - old.buckets[j];
+            }
+        }
+    }
+
+    prev = snapshot->total;
+    hasPrev = true;
+}
+
+/**
+ * @sa StatsMonitor::serialize()
+ */
+size_t
+StatsMonitor::serialize(const StatsSnapshot& snapshot, void* buffer,
+                        size_t length)
+{
+    // The first pass (out == nullptr) only computes the required size so
+    // that a too-small buffer is left untouched; the second pass writes.
+    char* out = nullptr;
+    size_t required = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        size_t offset = 0;
+        append(out, &offset, snapshot.version);
+        append(out, &offset, uint32_t(0));  // reserved
+        append(out, &offset, snapshot.transportId);
+        append(out, &offset, snapshot.timestamp);
+        append(out, &offset, snapshot.cycles_per_second);
+        append(out, &offset, snapshot.interval_cycles);
+        append(out, &offset, NUM_STATS_SCALARS);
+        for (uint32_t i = 0; i < NUM_STATS_SCALARS; ++i) {
+            append(out, &offset, snapshot.total.*statsScalars[i]);
+            append(out, &offset, snapshot.delta.*statsScalars[i]);
+        }
+        append(out, &offset, NUM_STATS_HISTOGRAMS);
+        for (uint32_t h = 0; h < NUM_STATS_HISTOGRAM_ARRAYS; ++h) {
+            for (uint32_t i = 0; i < NUM_MESSAGE_SIZE_CLASSES; ++i) {
+                const Histogram& total = (snapshot.total.*statsHistograms[h])[i];
+                const Histogram& delta = (snapshot.delta.*statsHistograms[h])[i];
+                append(out, &offset, total.sample_count);
+                append(out, &offset, delta.sample_count);
+                // Only the buckets that changed during the interval are
+                // carried; an idle histogram costs a fixed 20 bytes.
+                uint32_t numBuckets = 0;
+                for (uint32_t j = 0; j < Histogram::NUM_BUCKETS; ++j) {
+                    if (delta.buckets[j] != 0) {
+                        numBuckets++;
+                    }
+                }
+                append(out, &offset, numBuckets);
+                for (uint32_t j = 0; j < Histogram::NUM_BUCKETS; ++j) {
+                    if (delta.buckets[j] != 0) {
+                        append(out, &offset, uint16_t(j));
+                        append(out, &offset, delta.buckets[j]);
+                    }
+                }
+            }
+        }
+        if (pass == 0) {
+            required = offset;
+            if (length < required) {
+                return required;
+            }
+            out = static_cast<char*>(buffer);
+        }
+    }
+    return required;
+}
+
+/**
+ * @sa StatsMonitor::deserialize()
+ */
+bool
+StatsMonitor::deserialize(const void* buffer, size_t length,
+                          StatsSnapshot* snapshot)
+{
+    const char* in = static_cast<const char*>(buffer);
+    size_t offset = 0;
+    uint32_t reserved = 0;
+    if (!extract(in, length, &offset, &snapshot->version) ||
+        snapshot->version != STATS_SNAPSHOT_VERSION ||
+        !extract(in, length, &offset, &reserved) ||
+        !extract(in, length, &offset, &snapshot->transportId) ||
+        !extract(in, length, &offset, &snapshot->timestamp) ||
+        !extract(in, length, &offset, &snapshot->cycles_per_second) ||
+        !extract(in, length, &offset, &snapshot->interval_cycles)) {
+        return false;
+    }
+
+    std::memset(&snapshot->total, 0, sizeof(Stats));
+    std::memset(&snapshot->delta, 0, sizeof(Stats));
+    snapshot->total.timestamp = snapshot->timestamp;
+    snapshot->total.cycles_per_second = snapshot->cycles_per_second;
+    snapshot->delta.timestamp = snapshot->timestamp;
+    snapshot->delta.cycles_per_second = snapshot->cycles_per_second;
+
+    uint32_t numScalars = 0;
+    if (!extract(in, length, &offset, &numScalars) ||
+        numScalars != NUM_STATS_SCALARS) {
+        return false;
+    }
+    for (uint32_t i = 0; i < NUM_STATS_SCALARS; ++i) {
+        if (!extract(in, length, &offset, &(snapshot->total.*statsScalars[i])) ||
+            !extract(in, length, &offset, &(snapshot->delta.*statsScalars[i]))) {
+            return false;
+        }
+    }
+
+    uint32_t numHistograms = 0;
+    if (!extract(in, length, &offset, &numHistograms) ||
+        numHistograms != NUM_STATS_HISTOGRAMS) {
+        return false;
+    }
+    for (uint32_t h = 0; h < NUM_STATS_HISTOGRAM_ARRAYS; ++h) {
+        for (uint32_t i = 0; i < NUM_MESSAGE_SIZE_CLASSES; ++i) {
+            Histogram& total = (snapshot->total.*statsHistograms[h])[i];
+            Histogram& delta = (snapshot->delta.*statsHistograms[h])[i];
+            uint32_t numBuckets = 0;
+            if (!extract(in, length, &offset, &total.sample_count) ||
+                !extract(in, length, &offset, &delta.sample_count) ||
+                !extract(in, length, &offset, &numBuckets) ||
+                numBuckets > Histogram::NUM_BUCKETS) {
+                return false;
+            }
+            for (uint32_t n = 0; n < numBuckets; ++n) {
+                uint16_t index = 0;
+                uint64_t count = 0;
+                if (!extract(in, length, &offset, &index) ||
+                    index >= Histogram::NUM_BUCKETS ||
+                    !extract(in, length, &offset, &count)) {
+                    return false;
+                }
+                delta.buckets[index] = count;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @sa messageSizeClass()
+ */
+uint32_t
+messageSizeClass(uint32_t messageLength)
+{
+    if (messageLength <= 1500) {
+        return 0;
+    } else if (messageLength <= 10000) {
+        return 1;
+    } else if (messageLength <= 100000) {
+        return 2;
+    } else {
+        return 3;
+    }
+}
+
+/**
+ * @sa Histogram::bucketIndex()
+ */
+uint32_t
+Histogram::bucketIndex(uint64_t value)
+{
+    if (value < SUB_BUCKET_COUNT) {
+        return static_cast<uint32_t>(value);
+    }
+    // Position of the most significant set bit determines the power-of-two
+    // range; the next SUB_BUCKET_BITS bits select the sub-bucket within it.
+    uint32_t msb = 63 - static_cast<uint32_t>(__builtin_clzll(value));
+    uint32_t subBucket = static_cast<uint32_t>(
+        (value >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1));
+    return ((msb - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + subBucket;
+}
+
+/**
+ * @sa Histogram::bucketFloor()
+ */
+uint64_t
+Histogram::bucketFloor(uint32_t index)
+{
+    if (index < SUB_BUCKET_COUNT) {
+        return index;
+    }
+    uint32_t msb = (index >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+    uint64_t subBucket = index & (SUB_BUCKET_COUNT - 1);
+    return (1ul << msb) | (subBucket << (msb - SUB_BUCKET_BITS));
+}
+
+/**
+ * @sa Histogram::getPercentile()
+ */
+uint64_t
+Histogram::getPercentile(double percentile) const
+{
+    if (sample_count == 0) {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(
+        (percentile / 100.0) * static_cast<double>(sample_count));
+    if (rank >= sample_count) {
+        rank = sample_count - 1;
+    }
+    uint64_t cumulative = 0;
+    for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+        cumulative += buckets[i];
+        if (cumulative > rank) {
+            return bucketFloor(i);
+        }
+    }
+    return bucketFloor(NUM_BUCKETS - 1);
+}
+
+/**
+ * @sa getPeerCounters()
+ */
+PeerCounters*
+getPeerCounters(IpAddress peer)
+{
+    // Fast path: each thread remembers the peers it has already looked up.
+    thread_local std::unordered_map<IpAddress, PeerCounters*,
+                                    IpAddress::Hasher>
+        cache;
+    auto it = cache.find(peer);
+    if (it != cache.end()) {
+        return it->second;
+    }
+    std::lock_guard<std::mutex> lock(Internal::peerMutex);
+    PeerCounters*& entry = Internal::peerCounters[peer];
+    if (entry == nullptr) {
+        entry = new PeerCounters();
+    }
+    cache.insert({peer, entry});
+    return entry;
+}
+
+/**
+ * @sa setPerPeerStatsEnabled()
+ */
+void
+setPerPeerStatsEnabled(bool enabled)
+{
+    Internal::collectPerPeerStats.store(enabled, std::memory_order_relaxed);
+}
+
+/**
+ * @sa getPerPeerStats()
+ */
+void
+getPerPeerStats(std::vector<std::pair<IpAddress, PeerStats>>* stats)
+{
+    std::lock_guard<std::mutex> lock(Internal::peerMutex);
+    stats->clear();
+    stats->reserve(Internal::peerCounters.size());
+    for (auto& entry : Internal::peerCounters) {
+        PeerStats peerStats;
+        entry.second->dumpStats(&peerStats);
+        stats->emplace_back(entry.first, peerStats);
+    }
+}
+
+/**
+ * @sa getLockStats()
+ */
+void
+getLockStats(std::vector<LockStats>* stats)
+{
+    stats->clear();
+    for (SpinLock::Metrics* metrics =
+             SpinLock::Metrics::registry().load(std::memory_order_acquire);
+         metrics != nullptr; metrics = metrics->next) {
+        // Merge entries sharing a name; a racing first use of a lock site
+        // can register the same name twice (see SpinLock::Metrics).
+        LockStats* entry = nullptr;
+        for (LockStats& candidate : *stats) {
+            if (std::strcmp(candidate.name, metrics->name) == 0) {
+                entry = &candidate;
+                break;
+            }
+        }
+        if (entry == nullptr) {
+            stats->push_back({metrics->name, 0, 0, 0});
+            entry = &stats->back();
+        }
+        entry->contended_acquisitions +=
+            metrics->contendedAcquisitions.load(std::memory_order_relaxed);
+        entry->failed_spins +=
+            metrics->failedSpins.load(std::memory_order_relaxed);
+        entry->wait_cycles +=
+            metrics->waitCycles.load(std::memory_order_relaxed);
+    }
+    std::sort(stats->begin(), stats->end(),
+              [](const LockStats& a, const LockStats& b) {
+                  return a.wait_cycles > b.wait_cycles;
+              });
+}
+
 }  // namespace Perf
 }  // namespace Homa
@@ -74,6 +74,65 @@ struct Counters {
         }
     };
 
+    /**
+     * Wrapper class for a log-bucketed histogram of recorded values.
+     *
+     * Like Stat, instances are merged across threads when statistics are
+     * gathered; record() is only called by the owning thread so relaxed
+     * atomic increments suffice.
+     */
+    struct HistogramCounter {
+        /**
+         * Default constructor.
+         */
+        HistogramCounter()
+            : buckets()
+        {
+            for (uint32_t i = 0; i < Histogram::NUM_BUCKETS; ++i) {
+                buckets[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * Record a single value into this histogram.
+         */
+        inline void record(uint64_t value)
+        {
+            buckets[Histogram::bucketIndex(value)].fetch_add(
+                1, std::memory_order_relaxed);
+        }
+
+        /**
+         * Add the contents of another HistogramCounter to this one.
+         *
+         * This method is thread-safe.
+         */
+        inline void add(const HistogramCounter& other)
+        {
+            for (uint32_t i = 0; i < Histogram::NUM_BUCKETS; ++i) {
+                buckets[i].fetch_add(
+                    other.buckets[i].load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+            }
+        }
+
+        /**
+         * Export this histogram's contents to a Histogram structure.
+         */
+        void dumpStats(Histogram* histogram)
+        {
+            histogram->sample_count = 0;
+            for (uint32_t i = 0; i < Histogram::NUM_BUCKETS; ++i) {
+                histogram->buckets[i] =
+                    buckets[i].load(std::memory_order_relaxed);
+                histogram->sample_count += histogram->buckets[i];
+            }
+        }
+
+        /// Number of recorded values that fell into each bucket.
+        std::atomic<uint64_t> buckets[Histogram::NUM_BUCKETS];
+    };
+
     /**
      * Default constructor.
      */
@@ -105,6 +164,11 @@ struct Counters {
         , rx_unknown_pkts(0)
         , tx_error_pkts(0)
         , rx_error_pkts(0)
+        , rx_overload_pushbacks(0)
+        , rx_compacted_pkts(0)
+        , mbuf_overflow_allocs(0)
+        , tx_mbuf_alloc_denials(0)
+        , mbuf_recycles(0)
     {}
 
     /**
@@ -144,6 +208,16 @@ struct Counters {
         rx_unknown_pkts.add(other->rx_unknown_pkts);
         tx_error_pkts.add(other->tx_error_pkts);
         rx_error_pkts.add(other->rx_error_pkts);
+        rx_overload_pushbacks.add(other->rx_overload_pushbacks);
+        rx_compacted_pkts.add(other->rx_compacted_pkts);
+        mbuf_overflow_allocs.add(other->mbuf_overflow_allocs);
+        tx_mbuf_alloc_denials.add(other->tx_mbuf_alloc_denials);
+        mbuf_recycles.add(other->mbuf_recycles);
+        for (uint32_t i = 0; i < NUM_MESSAGE_SIZE_CLASSES; ++i) {
+            tx_sent_latency[i].add(other->tx_sent_latency[i]);
+            tx_completed_latency[i].add(other->tx_completed_latency[i]);
+            rx_delivery_latency[i].add(other->rx_delivery_latency[i]);
+        }
     }
 
     /**
@@ -178,6 +252,16 @@ struct Counters {
         stats->rx_unknown_pkts = rx_unknown_pkts.get();
         stats->tx_error_pkts = tx_error_pkts.get();
         stats->rx_error_pkts = rx_error_pkts.get();
+        stats->rx_overload_pushbacks = rx_overload_pushbacks.get();
+        stats->rx_compacted_pkts = rx_compacted_pkts.get();
+        stats->mbuf_overflow_allocs = mbuf_overflow_allocs.get();
+        stats->tx_mbuf_alloc_denials = tx_mbuf_alloc_denials.get();
+        stats->mbuf_recycles = mbuf_recycles.get();
+        for (uint32_t i = 0; i < NUM_MESSAGE_SIZE_CLASSES; ++i) {
+            tx_sent_latency[i].dumpStats(&stats->tx_sent_latency[i]);
+            tx_completed_latency[i].dumpStats(&stats->tx_completed_latency[i]);
+            rx_delivery_latency[i].dumpStats(&stats->rx_delivery_latency[i]);
+        }
     }
 
     /// CPU time spent running the Homa poll loop in cycles.
@@ -260,20 +344,193 @@ struct Counters {
 
     /// Number of error packets received.
     Stat<uint64_t> rx_error_pkts;
+
+    /// Number of new scheduled messages pushed back (dropped and throttled
+    /// with an empty grant) because the Receiver was overloaded.
+    Stat<uint64_t> rx_overload_pushbacks;
+
+    /// Number of inbound DATA packets whose contents were copied into a
+    /// CompactArena so the driver's buffer could be released on arrival.
+    Stat<uint64_t> rx_compacted_pkts;
+
+    /// Number of packet buffers backed by driver-level OverflowBuffers
+    /// because the driver's packet buffer pool was exhausted.
+    Stat<uint64_t> mbuf_overflow_allocs;
+
+    /// Number of transmit packet buffer allocations refused because the
+    /// driver was holding buffers in reserve for packet reception.
+    Stat<uint64_t> tx_mbuf_alloc_denials;
+
+    /// Number of packet buffer allocations served from a driver-level
+    /// recycle cache instead of the packet buffer pool.
+    Stat<uint64_t> mbuf_recycles;
+
+    /// Distribution of cycles from OutMessage::send() to Status::SENT,
+    /// indexed by message size class.
+    HistogramCounter tx_sent_latency[NUM_MESSAGE_SIZE_CLASSES];
+
+    /// Distribution of cycles from OutMessage::send() to Status::COMPLETED,
+    /// indexed by message size class.
+    HistogramCounter tx_completed_latency[NUM_MESSAGE_SIZE_CLASSES];
+
+    /// Distribution of cycles from an incoming message's first DATA packet
+    /// to its delivery to the application, indexed by message size class.
+    HistogramCounter rx_delivery_latency[NUM_MESSAGE_SIZE_CLASSES];
 };
 
+/**
+ * Collection of performance counters attributed to a single remote peer.
+ *
+ * Unlike Counters, a PeerCounters instance is shared by every thread that
+ * exchanges packets with the peer, so updates must use atomic increments;
+ * relaxed ordering keeps them cheap.  Instances are allocated once per peer
+ * and never freed, so samplers may cache pointers without synchronization.
+ */
+struct PeerCounters {
+    /**
+     * Wrapper class for individual per-peer counter entries.
+     */
+    template <typename T>
+    struct Stat : private std::atomic<T> {
+        /**
+         * Passthrough constructor.
+         */
+        template <typename... Args>
+        Stat(Args&&... args)
+            : std::atomic<T>(static_cast<Args&&>(args)...)
+        {}
+
+        /**
+         * Add the given value to this Stat.
+         *
+         * This method is thread-safe.
+         */
+        inline void add(T val)
+        {
+            this->fetch_add(val, std::memory_order_relaxed);
+        }
+
+        /**
+         * Return the stat value.
+         *
+         * This method is thread-safe.
+         */
+        inline T get() const
+        {
+            return this->load(std::memory_order_relaxed);
+        }
+    };
+
+    /**
+     * Default constructor.
+     */
+    PeerCounters()
+        : tx_bytes(0)
+        , rx_bytes(0)
+        , tx_data_pkts(0)
+        , rx_data_pkts(0)
+        , tx_retransmit_pkts(0)
+        , tx_resend_pkts(0)
+        , grant_stalls(0)
+    {}
+
+    /**
+     * Export this object's counter values to a PeerStats structure.
+     */
+    void dumpStats(PeerStats* stats)
+    {
+        stats->tx_bytes = tx_bytes.get();
+        stats->rx_bytes = rx_bytes.get();
+        stats->tx_data_pkts = tx_data_pkts.get();
+        stats->rx_data_pkts = rx_data_pkts.get();
+        stats->tx_retransmit_pkts = tx_retransmit_pkts.get();
+        stats->tx_resend_pkts = tx_resend_pkts.get();
+        stats->grant_stalls = grant_stalls.get();
+    }
+
+    /// Number of bytes sent to the peer.
+    Stat<uint64_t> tx_bytes;
+
+    /// Number of bytes received from the peer.
+    Stat<uint64_t> rx_bytes;
+
+    /// Number of data packets sent to the peer.
+    Stat<uint64_t> tx_data_pkts;
+
+    /// Number of data packets received from the peer.
+    Stat<uint64_t> rx_data_pkts;
+
+    /// Number of data packets retransmitted to the peer.
+    Stat<uint64_t> tx_retransmit_pkts;
+
+    /// Number of resend requests sent to the peer.
+    Stat<uint64_t> tx_resend_pkts;
+
+    /// Number of grant stalls on messages outbound to the peer.
+    Stat<uint64_t> grant_stalls;
+};
+
+namespace Internal {
+/// True when per-peer statistics collection is enabled; checked on the packet
+/// hot path so the flag is exposed here for inlining.
+extern std::atomic<bool> collectPerPeerStats;
+}  // namespace Internal
+
+/**
+ * Return true if per-peer statistics are currently being collected.
+ *
+ * A single relaxed load; cheap enough to check per packet so that the
+ * disabled configuration costs nothing beyond this branch.
+ */
+inline bool
+perPeerStatsEnabled()
+{
+    return Internal::collectPerPeerStats.load(std::memory_order_relaxed);
+}
+
+/**
+ * Return the counters attributed to the given peer, creating them on first
+ * use.  The returned pointer remains valid for the lifetime of the process.
+ *
+ * This method is thread-safe; repeated lookups for the same peer from the
+ * same thread hit a thread-local cache and take no locks.
+ */
+PeerCounters* getPeerCounters(IpAddress peer);
+
 /**
  * Thread-local collection of performance counters.
+ *
+ * Instances are heap-allocated, linked into a global registry, and never
+ * freed so that statistics collection can walk the registry with relaxed
+ * atomic reads and no locks (see getStats()); a thread that exits leaves its
+ * counter values behind and they remain part of every future total.
  */
 struct ThreadCounters : public Counters {
     ThreadCounters();
-    ~ThreadCounters();
+
+    /// Next node in the global registry of per-thread counters.
+    ThreadCounters* next;
+
+    /// Identifier of the Transport whose work the owning thread most recently
+    /// performed; 0 until the thread first does transport work.  Used to
+    /// scope statistics collection to a single transport (see StatsMonitor).
+    std::atomic<uint64_t> transportId;
 };
 
 /**
- * Per thread counters.
+ * Per thread counters; allocated and registered on the thread's first use.
+ */
+extern thread_local ThreadCounters& counters;
+
+/**
+ * Attribute the calling thread's counters to the given transport.
+ *
+ * Called from the transport's polling entry points so that a StatsMonitor
+ * scoped to one transport only aggregates the threads working on it.  Cheap
+ * enough to call per poll: a relaxed load and, only when the thread changes
+ * transports, a relaxed store.
  */
-extern thread_local ThreadCounters counters;
+void setThreadTransportId(uint64_t transportId);
 
 /**
  * Provides a convenient way to measure multiple consecutive cycle time
@@ -0,0 +1,225 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include "Perf.h"
+#include "SpinLock.h"
+
+namespace Homa {
+namespace Perf {
+namespace {
+
+TEST(PerfTest, messageSizeClass)
+{
+    EXPECT_EQ(0U, messageSizeClass(0));
+    EXPECT_EQ(0U, messageSizeClass(1500));
+    EXPECT_EQ(1U, messageSizeClass(1501));
+    EXPECT_EQ(1U, messageSizeClass(10000));
+    EXPECT_EQ(2U, messageSizeClass(10001));
+    EXPECT_EQ(2U, messageSizeClass(100000));
+    EXPECT_EQ(3U, messageSizeClass(100001));
+    EXPECT_EQ(3U, messageSizeClass(UINT32_MAX));
+}
+
+TEST(PerfTest, histogram_bucketIndex)
+{
+    // Values below SUB_BUCKET_COUNT map to their own buckets.
+    for (uint64_t value = 0; value < Histogram::SUB_BUCKET_COUNT; ++value) {
+        EXPECT_EQ(value, Histogram::bucketIndex(value));
+    }
+    // Larger values map to monotonically non-decreasing bucket indexes.
+    uint32_t prevIndex = 0;
+    for (int shift = 0; shift < 63; ++shift) {
+        uint32_t index = Histogram::bucketIndex(1ul << shift);
+        EXPECT_GE(index, prevIndex);
+        prevIndex = index;
+    }
+    EXPECT_LT(Histogram::bucketIndex(UINT64_MAX), Histogram::NUM_BUCKETS);
+}
+
+TEST(PerfTest, histogram_bucketFloor)
+{
+    // bucketFloor() inverts bucketIndex(): the floor of a value's bucket is
+    // no larger than the value and maps back to the same bucket.
+    uint64_t values[] = {0, 1, 15, 16, 17, 100, 1000, 12345, 1ul << 32,
+                         UINT64_MAX};
+    for (uint64_t value : values) {
+        uint32_t index = Histogram::bucketIndex(value);
+        uint64_t floor = Histogram::bucketFloor(index);
+        EXPECT_LE(floor, value);
+        EXPECT_EQ(index, Histogram::bucketIndex(floor));
+    }
+}
+
+TEST(PerfTest, histogram_getPercentile)
+{
+    Histogram histogram;
+    memset(&histogram, 0, sizeof(histogram));
+    EXPECT_EQ(0U, histogram.getPercentile(99.0));
+
+    // 100 samples of value 10 and one outlier of value 1000000.
+    histogram.buckets[Histogram::bucketIndex(10)] = 100;
+    histogram.buckets[Histogram::bucketIndex(1000000)] = 1;
+    histogram.sample_count = 101;
+
+    EXPECT_EQ(10U, histogram.getPercentile(50.0));
+    EXPECT_EQ(10U, histogram.getPercentile(99.0));
+    uint64_t p999 = histogram.getPercentile(99.9);
+    EXPECT_LE(p999, 1000000U);
+    EXPECT_GT(p999, 900000U);
+}
+
+TEST(PerfTest, histogramCounter_record)
+{
+    Counters::HistogramCounter counter;
+    counter.record(0);
+    counter.record(10);
+    counter.record(10);
+    counter.record(1000000);
+
+    Histogram histogram;
+    counter.dumpStats(&histogram);
+    EXPECT_EQ(4U, histogram.sample_count);
+    EXPECT_EQ(1U, histogram.buckets[Histogram::bucketIndex(0)]);
+    EXPECT_EQ(2U, histogram.buckets[Histogram::bucketIndex(10)]);
+    EXPECT_EQ(1U, histogram.buckets[Histogram::bucketIndex(1000000)]);
+}
+
+TEST(PerfTest, statsMonitor_snapshot)
+{
+    // Scope the monitor to an id no other test uses so that only the
+    // counter bumps below show up in the deltas.
+    const uint64_t TRANSPORT_ID = 0xBEEF;
+    setThreadTransportId(TRANSPORT_ID);
+    StatsMonitor monitor(TRANSPORT_ID);
+
+    StatsSnapshot first;
+    monitor.snapshot(&first);
+    EXPECT_EQ(STATS_SNAPSHOT_VERSION, first.version);
+    EXPECT_EQ(TRANSPORT_ID, first.transportId);
+    EXPECT_EQ(0U, first.interval_cycles);
+    // A monitor's first delta equals its total.
+    EXPECT_EQ(first.total.tx_bytes, first.delta.tx_bytes);
+
+    counters.tx_bytes.add(100);
+    counters.rx_data_pkts.add(3);
+    counters.tx_sent_latency[0].record(10);
+
+    StatsSnapshot second;
+    monitor.snapshot(&second);
+    EXPECT_LT(0U, second.interval_cycles);
+    EXPECT_EQ(first.total.tx_bytes + 100, second.total.tx_bytes);
+    EXPECT_EQ(100U, second.delta.tx_bytes);
+    EXPECT_EQ(3U, second.delta.rx_data_pkts);
+    EXPECT_EQ(0U, second.delta.tx_data_pkts);
+    EXPECT_EQ(1U, second.delta.tx_sent_latency[0].sample_count);
+    EXPECT_EQ(1U, second.delta.tx_sent_latency[0]
+                      .buckets[Histogram::bucketIndex(10)]);
+
+    // A monitor scoped to a different transport sees none of this thread's
+    // counters.
+    StatsMonitor other(0xF00D);
+    StatsSnapshot empty;
+    other.snapshot(&empty);
+    EXPECT_EQ(0U, empty.total.tx_bytes);
+
+    setThreadTransportId(0);
+}
+
+TEST(PerfTest, statsMonitor_serialize)
+{
+    const uint64_t TRANSPORT_ID = 0xBEEF;
+    setThreadTransportId(TRANSPORT_ID);
+    StatsMonitor monitor(TRANSPORT_ID);
+
+    StatsSnapshot snapshot;
+    monitor.snapshot(&snapshot);
+    counters.tx_bytes.add(42);
+    counters.rx_delivery_latency[1].record(1000);
+    monitor.snapshot(&snapshot);
+
+    // A zero-length call sizes the buffer without writing anything.
+    size_t required = StatsMonitor::serialize(snapshot, nullptr, 0);
+    ASSERT_LT(0U, required);
+    std::vector<char> buffer(required);
+    EXPECT_EQ(required,
+              StatsMonitor::serialize(snapshot, buffer.data(), buffer.size()));
+
+    StatsSnapshot restored;
+    ASSERT_TRUE(StatsMonitor::deserialize(buffer.data(), buffer.size(),
+                                          &restored));
+    EXPECT_EQ(snapshot.version, restored.version);
+    EXPECT_EQ(snapshot.transportId, restored.transportId);
+    EXPECT_EQ(snapshot.timestamp, restored.timestamp);
+    EXPECT_EQ(snapshot.interval_cycles, restored.interval_cycles);
+    EXPECT_EQ(snapshot.total.tx_bytes, restored.total.tx_bytes);
+    EXPECT_EQ(42U, restored.delta.tx_bytes);
+    EXPECT_EQ(snapshot.delta.rx_delivery_latency[1].sample_count,
+              restored.delta.rx_delivery_latency[1].sample_count);
+    EXPECT_EQ(1U, restored.delta.rx_delivery_latency[1]
+                      .buckets[Histogram::bucketIndex(1000)]);
+
+    // Truncated buffers are rejected; short output buffers are left alone.
+    EXPECT_FALSE(StatsMonitor::deserialize(buffer.data(), required / 2,
+                                           &restored));
+    std::vector<char> small(required / 2, '\x5A');
+    EXPECT_EQ(required,
+              StatsMonitor::serialize(snapshot, small.data(), small.size()));
+    EXPECT_EQ('\x5A', small.front());
+
+    setThreadTransportId(0);
+}
+
+TEST(PerfTest, getLockStats)
+{
+    std::vector<LockStats> stats;
+    getLockStats(&stats);
+#ifdef HOMA_LOCK_STATS
+    // Force some contention on a named lock.
+    SpinLock lock("PerfTest::getLockStats");
+    lock.lock();
+    std::thread waiter([&lock] {
+        lock.lock();
+        lock.unlock();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    lock.unlock();
+    waiter.join();
+
+    getLockStats(&stats);
+    const LockStats* entry = nullptr;
+    for (const LockStats& candidate : stats) {
+        if (std::strcmp(candidate.name, "PerfTest::getLockStats") == 0) {
+            entry = &candidate;
+        }
+    }
+    ASSERT_NE(nullptr, entry);
+    EXPECT_LE(1U, entry->contended_acquisitions);
+    EXPECT_LE(1U, entry->failed_spins);
+    EXPECT_LT(0U, entry->wait_cycles);
+#else
+    // Contention tracking is compiled out; no lock sites are registered.
+    EXPECT_TRUE(stats.empty());
+#endif
+}
+
+}  // namespace
+}  // namespace Perf
+}  // namespace Homa
@@ -15,7 +15,11 @@
 
 #include "Policy.h"
 
+#include <Cycles.h>
+
+#include <algorithm>
 #include <iterator>
+#include <tuple>
 
 namespace Homa {
 namespace Core {
@@ -30,6 +34,11 @@ namespace Default {
 const uint32_t RTT_TIME_US = 8;
 const uint32_t UNSCHEDULED_PRIORITY_CUTOFFS[] = {469, 5521, 15267};
 const int MAX_OVERCOMMIT_COUNT = 4;
+/// Minimum time between recomputations of the unscheduled priority cutoffs.
+const uint32_t CUTOFF_REFRESH_INTERVAL_MS = 100;
+/// Minimum number of observed messages before the cutoffs are recomputed;
+/// prevents a handful of messages from swinging the policy.
+const uint64_t MIN_CUTOFF_SAMPLES = 1000;
 }  // namespace Default
 
 /**
@@ -44,8 +53,15 @@ Manager::Manager(Driver* driver)
     , localUnscheduledPolicy()
     , localScheduledPolicy()
     , peerPolicies()
+    , snapshot(nullptr)
+    , retiredSnapshots()
+    , retiredPolicies()
     , RTT_BYTES(Default::RTT_TIME_US * (driver->getBandwidth() / 8))
     , MAX_PRIORITY(driver->getHighestPacketPriority())
+    , messageCounts()
+    , unscheduledBytes()
+    , sampleCount(0)
+    , nextCutoffUpdateCycles(0)
 {
     // Set default unschedule policy
     localUnscheduledPolicy.version = 0;
@@ -62,6 +78,27 @@ Manager::Manager(Driver* driver)
     localScheduledPolicy.degreeOvercommitment = Default::MAX_OVERCOMMIT_COUNT;
     localScheduledPolicy.minScheduledBytes = RTT_BYTES;
     localScheduledPolicy.maxScheduledBytes = 2 * RTT_BYTES;
+
+    // Publish the initial policy snapshot for lock-free readers.
+    SpinLock::Lock lock(mutex);
+    publishSnapshot(lock);
+}
+
+/**
+ * Policy::Manager destructor.
+ */
+Manager::~Manager()
+{
+    delete snapshot.load(std::memory_order_acquire);
+    for (const Snapshot* retired : retiredSnapshots) {
+        delete retired;
+    }
+    for (auto& entry : peerPolicies) {
+        delete entry.second;
+    }
+    for (const UnscheduledPolicy* retired : retiredPolicies) {
+        delete retired;
+    }
 }
 
 /**
@@ -84,9 +121,30 @@ Manager::getResendPriority()
  */
 Scheduled
 Manager::getScheduledPolicy()
+{
+    // Lock-free; the scheduled policy is read on every grant decision.
+    return snapshot.load(std::memory_order_acquire)->scheduledPolicy;
+}
+
+/**
+ * Set the number of messages to which the Receiver will concurrently grant.
+ *
+ * Granting to more than one peer at a time (overcommitment) keeps the
+ * downlink busy when the highest priority sender stalls, at the cost of
+ * additional buffer occupancy.  The requested degree is raised if necessary
+ * to cover the scheduled priority levels so that every level can be
+ * assigned to some message (see Policy::Scheduled).
+ *
+ * @param degree
+ *      Number of messages that can be granted concurrently.
+ */
+void
+Manager::setDegreeOvercommitment(int degree)
 {
     SpinLock::Lock lock(mutex);
-    return localScheduledPolicy;
+    localScheduledPolicy.degreeOvercommitment =
+        std::max(degree, localScheduledPolicy.maxScheduledPriority + 1);
+    publishSnapshot(lock);
 }
 
 /**
@@ -107,21 +165,33 @@ Unscheduled
 Manager::getUnscheduledPolicy(const IpAddress destination,
                               const uint32_t messageLength)
 {
-    SpinLock::Lock lock(mutex);
-    Unscheduled policy;
-    auto ret = peerPolicies.insert({destination, UnscheduledPolicy()});
-    UnscheduledPolicy* peer = &ret.first->second;
-    bool inserted = ret.second;
-    if (inserted) {
-        // No existing peer policy; set policy to the default.
-        peer->version = 0;
-        peer->highestPriority = MAX_PRIORITY;
-        peer->priorityCutoffBytes = std::vector<uint32_t>(
-            std::begin(Default::UNSCHEDULED_PRIORITY_CUTOFFS),
-            std::end(Default::UNSCHEDULED_PRIORITY_CUTOFFS));
+    // Fast path: look the peer up in the current snapshot without locking.
+    const Snapshot* snap = snapshot.load(std::memory_order_acquire);
+    const UnscheduledPolicy* peer;
+    auto it = snap->peers.find(destination);
+    if (it != snap->peers.end()) {
+        peer = it->second;
+    } else {
+        // First reference to this peer; fall back to the locked path which
+        // inserts the default policy record and republishes the snapshot.
+        SpinLock::Lock lock(mutex);
+        peer = getPeerPolicy(destination, lock);
     }
+
+    Unscheduled policy;
     policy.version = peer->version;
-    policy.unscheduledByteLimit = RTT_BYTES;
+    uint64_t rttCycles = peer->rttCycles.load(std::memory_order_relaxed);
+    if (rttCycles != 0) {
+        // Size the unscheduled byte limit to the measured path RTT; bound the
+        // adjustment so that one bad sample cannot starve or flood a path.
+        uint64_t rttNs = PerfUtils::Cycles::toNanoseconds(rttCycles);
+        uint64_t limit = rttNs * (driver->getBandwidth() / 8) / 1000;
+        limit = std::max<uint64_t>(limit, RTT_BYTES / 8);
+        limit = std::min<uint64_t>(limit, 8 * RTT_BYTES);
+        policy.unscheduledByteLimit = Util::downCast<uint32_t>(limit);
+    } else {
+        policy.unscheduledByteLimit = RTT_BYTES;
+    }
     int rank = 0;
     int numCutoffs = peer->priorityCutoffBytes.size();
     for (; rank < numCutoffs; ++rank) {
@@ -153,8 +223,177 @@ Manager::signalNewMessage(const IpAddress source, uint8_t policyVersion,
     SpinLock::Lock lock(mutex);
     (void)source;
     (void)policyVersion;
-    (void)messageLength;
-    // TODO(cstlee): Collect statistics
+    int bucket = 0;
+    for (uint32_t length = messageLength; length > 1; length >>= 1) {
+        ++bucket;
+    }
+    messageCounts[bucket]++;
+    unscheduledBytes[bucket] += std::min(messageLength, RTT_BYTES);
+    sampleCount++;
+}
+
+/**
+ * Record a round-trip-time measurement to a particular peer.
+ *
+ * Called by the Sender when a GRANT closes the loop on a message's initial
+ * packet burst.  The samples feed a per-peer smoothed RTT that sizes the
+ * unscheduled byte limit returned by getUnscheduledPolicy() to the actual
+ * path length.
+ *
+ * @param peer
+ *      IpAddress of the Transport to which the measurement was taken.
+ * @param rttCycles
+ *      The measured round-trip-time in rdtsc cycles.
+ */
+void
+Manager::signalRttSample(const IpAddress peer, uint64_t rttCycles)
+{
+    SpinLock::Lock lock(mutex);
+    UnscheduledPolicy* policy = getPeerPolicy(peer, lock);
+    uint64_t srtt = policy->rttCycles.load(std::memory_order_relaxed);
+    if (srtt == 0) {
+        srtt = rttCycles;
+    } else {
+        // Standard exponentially weighted moving average (gain 1/8).
+        int64_t diff = static_cast<int64_t>(rttCycles) -
+                       static_cast<int64_t>(srtt);
+        srtt += diff / 8;
+    }
+    policy->rttCycles.store(srtt, std::memory_order_relaxed);
+}
+
+/**
+ * Return the policy record for a particular peer, creating it with the
+ * default policy if this is the first time the peer has been referenced.
+ *
+ * @param peer
+ *      IpAddress of the Transport whose policy record should be returned.
+ * @param lock
+ *      Reminder to hold the Manager::mutex during this call.
+ */
+Manager::UnscheduledPolicy*
+Manager::getPeerPolicy(const IpAddress peer, const SpinLock::Lock& lock)
+{
+    auto ret = peerPolicies.emplace(peer, nullptr);
+    bool inserted = ret.second;
+    if (inserted) {
+        // No existing peer policy; start from the current local policy so
+        // that peers first referenced after a cutoff recomputation see the
+        // recomputed values rather than the static defaults.
+        UnscheduledPolicy* policy = new UnscheduledPolicy();
+        policy->version = localUnscheduledPolicy.version;
+        policy->highestPriority = localUnscheduledPolicy.highestPriority;
+        policy->priorityCutoffBytes =
+            localUnscheduledPolicy.priorityCutoffBytes;
+        policy->rttCycles = 0;
+        ret.first->second = policy;
+        // Make the new peer visible to lock-free readers.
+        publishSnapshot(lock);
+    }
+    return ret.first->second;
+}
+
+/**
+ * Build a new immutable Snapshot from the current policy state and publish
+ * it for lock-free readers.
+ *
+ * The previous Snapshot may still be referenced by concurrent readers, so it
+ * is retired rather than freed; retired Snapshots are reclaimed when the
+ * Manager is destroyed.
+ *
+ * @param lock
+ *      Reminder to hold the Manager::mutex during this call.
+ */
+void
+Manager::publishSnapshot(const SpinLock::Lock& lock)
+{
+    (void)lock;
+    Snapshot* next = new Snapshot();
+    next->scheduledPolicy = localScheduledPolicy;
+    for (auto& entry : peerPolicies) {
+        next->peers.emplace(entry.first, entry.second);
+    }
+    const Snapshot* prev =
+        snapshot.exchange(next, std::memory_order_acq_rel);
+    if (prev != nullptr) {
+        retiredSnapshots.push_back(prev);
+    }
+}
+
+/**
+ * Recompute the unscheduled priority cutoffs from the message-size histogram
+ * so that each unscheduled priority level carries roughly the same share of
+ * the observed unscheduled bytes.  If the cutoffs changed, bumps the policy
+ * version, disseminates the new policy to every peer record, and republishes
+ * the Snapshot; the histogram is decayed either way so the policy tracks
+ * workload shifts.
+ *
+ * @param lock
+ *      Reminder to hold the Manager::mutex during this call.
+ */
+void
+Manager::updateUnscheduledCutoffs(const SpinLock::Lock& lock)
+{
+    (void)lock;
+    uint64_t totalBytes = 0;
+    for (int b = 0; b < NUM_HISTOGRAM_BUCKETS; ++b) {
+        totalBytes += unscheduledBytes[b];
+    }
+    if (totalBytes == 0) {
+        return;
+    }
+
+    const size_t numCutoffs = localUnscheduledPolicy.priorityCutoffBytes.size();
+    std::vector<uint32_t> cutoffs;
+    cutoffs.reserve(numCutoffs);
+    uint64_t accumulated = 0;
+    for (int b = 0; b < NUM_HISTOGRAM_BUCKETS && cutoffs.size() < numCutoffs;
+         ++b) {
+        accumulated += unscheduledBytes[b];
+        // Place a cutoff at this bucket's upper bound for every priority
+        // level whose byte share has been filled by the buckets so far.
+        while (cutoffs.size() < numCutoffs &&
+               accumulated * (numCutoffs + 1) >=
+                   totalBytes * (cutoffs.size() + 1)) {
+            uint64_t bound = 1ull << (b + 1);
+            if (!cutoffs.empty() && bound <= cutoffs.back()) {
+                // Keep the cutoffs strictly increasing when one bucket
+                // dominates the distribution.
+                bound = uint64_t(cutoffs.back()) + 1;
+            }
+            bound = std::min<uint64_t>(bound, 0xFFFFFFFFu);
+            cutoffs.push_back(Util::downCast<uint32_t>(bound));
+        }
+    }
+
+    if (cutoffs != localUnscheduledPolicy.priorityCutoffBytes) {
+        localUnscheduledPolicy.priorityCutoffBytes = std::move(cutoffs);
+        localUnscheduledPolicy.version++;
+        // Disseminate the recomputed policy to the per-peer records that
+        // getUnscheduledPolicy() serves.  Published records are immutable
+        // (except for rttCycles), so each peer gets a fresh record carrying
+        // over its smoothed RTT while the old record is retired.
+        for (auto& entry : peerPolicies) {
+            const UnscheduledPolicy* old = entry.second;
+            UnscheduledPolicy* updated = new UnscheduledPolicy();
+            updated->version = localUnscheduledPolicy.version;
+            updated->highestPriority = old->highestPriority;
+            updated->priorityCutoffBytes =
+                localUnscheduledPolicy.priorityCutoffBytes;
+            updated->rttCycles =
+                old->rttCycles.load(std::memory_order_relaxed);
+            entry.second = updated;
+            retiredPolicies.push_back(old);
+        }
+        publishSnapshot(lock);
+    }
+
+    // Decay the histogram so old traffic fades out of the statistics.
+    for (int b = 0; b < NUM_HISTOGRAM_BUCKETS; ++b) {
+        messageCounts[b] /= 2;
+        unscheduledBytes[b] /= 2;
+    }
+    sampleCount /= 2;
 }
 
 /**
@@ -165,7 +404,17 @@ void
 Manager::poll()
 {
     SpinLock::Lock lock(mutex);
-    // TODO(cstlee): Add policy update logic
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    if (now < nextCutoffUpdateCycles) {
+        return;
+    }
+    nextCutoffUpdateCycles =
+        now + PerfUtils::Cycles::fromMicroseconds(
+                  1000 * Default::CUTOFF_REFRESH_INTERVAL_MS);
+    if (sampleCount < Default::MIN_CUTOFF_SAMPLES) {
+        return;
+    }
+    updateUnscheduledCutoffs(lock);
 }
 
 }  // namespace Policy
@@ -18,6 +18,7 @@
 
 #include <Homa/Driver.h>
 
+#include <atomic>
 #include <cstdint>
 #include <unordered_map>
 #include <vector>
@@ -72,19 +73,26 @@ struct Scheduled {
 class Manager {
   public:
     explicit Manager(Driver* driver);
-    virtual ~Manager() = default;
+    virtual ~Manager();
     virtual int getResendPriority();
     virtual Scheduled getScheduledPolicy();
+    virtual void setDegreeOvercommitment(int degree);
     virtual Unscheduled getUnscheduledPolicy(const IpAddress destination,
                                              const uint32_t messageLength);
     virtual void signalNewMessage(const IpAddress source, uint8_t policyVersion,
                                   uint32_t messageLength);
+    virtual void signalRttSample(const IpAddress peer, uint64_t rttCycles);
     virtual void poll();
 
   private:
     /**
      * Holds the known network priority policy for a particular Homa::Transport
      * on the network.
+     *
+     * Once a policy record has been published in a Snapshot, every field
+     * except rttCycles is immutable; changing any other field requires
+     * holding the Manager::mutex, replacing the record with a fresh copy,
+     * retiring the old one, and republishing the Snapshot.
      */
     struct UnscheduledPolicy {
         /// The version number of this policy.
@@ -95,8 +103,40 @@ class Manager {
         /// The number of bytes below which a particular network priority should
         /// be used.
         std::vector<uint32_t> priorityCutoffBytes;
+        /// Smoothed round-trip-time to this peer in cycles; 0 until the first
+        /// sample arrives.  Used to size the unscheduled byte limit to the
+        /// actual path length instead of the network-wide assumption.  Atomic
+        /// so the per-message update in signalRttSample() can race with
+        /// lock-free policy reads without republishing the Snapshot.
+        std::atomic<uint64_t> rttCycles;
     };
 
+    /**
+     * An immutable view of the Manager's published policy state; readers on
+     * the hot path load the current Snapshot through an atomic pointer
+     * instead of taking the Manager::mutex.
+     */
+    struct Snapshot {
+        /// The scheduled policy at the time this Snapshot was published.
+        Scheduled scheduledPolicy;
+        /// Pointers to the policy records of every known peer.  The records
+        /// are heap-allocated and never freed while a Snapshot referencing
+        /// them may still be read; superseded records are retired and
+        /// reclaimed with the Manager.
+        std::unordered_map<IpAddress, const UnscheduledPolicy*,
+                           IpAddress::Hasher>
+            peers;
+    };
+
+    UnscheduledPolicy* getPeerPolicy(const IpAddress peer,
+                                     const SpinLock::Lock& lock);
+    void publishSnapshot(const SpinLock::Lock& lock);
+    void updateUnscheduledCutoffs(const SpinLock::Lock& lock);
+
+    /// Number of buckets in the log2-scale histogram of observed message
+    /// sizes; covers every possible uint32_t message length.
+    static const int NUM_HISTOGRAM_BUCKETS = 32;
+
     /// Monitor-style lock
     SpinLock mutex;
     /// Driver used by the Transport that owns this Manager.
@@ -106,12 +146,39 @@ class Manager {
     /// The scheduled policy for the Transport that owns this Policy::Manager.
     Scheduled localScheduledPolicy;
     /// Collection of the known Policies for each peered Homa::Transport;
-    std::unordered_map<IpAddress, UnscheduledPolicy, IpAddress::Hasher>
+    /// the records are heap-allocated so that published Snapshots can keep
+    /// referencing a superseded record until the Manager is destroyed.
+    std::unordered_map<IpAddress, UnscheduledPolicy*, IpAddress::Hasher>
         peerPolicies;
+    /// The currently published Snapshot; never null after construction.
+    std::atomic<const Snapshot*> snapshot;
+    /// Previously published Snapshots that may still be referenced by
+    /// concurrent readers; reclaimed in the destructor.  Snapshots are only
+    /// republished on structural changes (new peers, scheduled policy
+    /// updates), so this list stays small.
+    std::vector<const Snapshot*> retiredSnapshots;
+    /// Peer policy records that have been superseded but may still be
+    /// referenced by a previously published Snapshot; reclaimed in the
+    /// destructor.
+    std::vector<const UnscheduledPolicy*> retiredPolicies;
     /// Number of bytes that can be transmitted in one round-trip-time.
     const uint32_t RTT_BYTES;
     /// The highest network packet priority that the driver supports.
     const int MAX_PRIORITY;
+    /// Histogram of observed incoming message sizes; bucket b counts
+    /// messages whose length's highest set bit is b.  Fed by
+    /// signalNewMessage() and decayed when the cutoffs are recomputed so the
+    /// policy tracks the live workload.
+    uint64_t messageCounts[NUM_HISTOGRAM_BUCKETS];
+    /// Unscheduled bytes (message length capped at RTT_BYTES) observed per
+    /// histogram bucket; used to split the unscheduled priority levels so
+    /// that each level carries roughly the same share of bytes.
+    uint64_t unscheduledBytes[NUM_HISTOGRAM_BUCKETS];
+    /// Number of messages recorded in the histogram since the last decay.
+    uint64_t sampleCount;
+    /// Cycle time after which poll() should next consider recomputing the
+    /// unscheduled priority cutoffs.
+    uint64_t nextCutoffUpdateCycles;
 };
 
 }  // namespace Policy
@@ -13,6 +13,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <Cycles.h>
 #include <gtest/gtest.h>
 
 #include "Mock/MockDriver.h"
@@ -68,8 +69,8 @@ TEST(PolicyManagerTest, getUnscheduledPolicy)
         EXPECT_EQ(7, policy.priority);
     }
 
-    manager.peerPolicies.at(dest).version = 1;
-    manager.peerPolicies.at(dest).highestPriority = 2;
+    manager.peerPolicies.at(dest)->version = 1;
+    manager.peerPolicies.at(dest)->highestPriority = 2;
 
     {
         Policy::Unscheduled policy = manager.getUnscheduledPolicy(dest, 1000);
@@ -86,6 +87,178 @@ TEST(PolicyManagerTest, getUnscheduledPolicy)
     }
 }
 
+TEST(PolicyManagerTest, setDegreeOvercommitment)
+{
+    Homa::Mock::MockDriver mockDriver;
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    Policy::Manager manager(&mockDriver);
+    ASSERT_EQ(3, manager.localScheduledPolicy.maxScheduledPriority);
+
+    manager.setDegreeOvercommitment(8);
+
+    EXPECT_EQ(8, manager.getScheduledPolicy().degreeOvercommitment);
+
+    // Requested degree too small to cover the scheduled priority levels;
+    // the degree should be raised to maxScheduledPriority + 1.
+    manager.setDegreeOvercommitment(1);
+
+    EXPECT_EQ(4, manager.getScheduledPolicy().degreeOvercommitment);
+}
+
+TEST(PolicyManagerTest, signalRttSample)
+{
+    Homa::Mock::MockDriver mockDriver;
+    EXPECT_CALL(mockDriver, getBandwidth)
+        .WillRepeatedly(Return(8000));
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    Policy::Manager manager(&mockDriver);
+    IpAddress dest{22};
+    ASSERT_EQ(8000U, manager.RTT_BYTES);
+
+    // No samples yet; the default network-wide limit is used.
+    EXPECT_EQ(8000U, manager.getUnscheduledPolicy(dest, 1).unscheduledByteLimit);
+
+    // A 40 us RTT at 8000 Mbps should allow roughly 40000 unscheduled bytes.
+    manager.signalRttSample(dest, PerfUtils::Cycles::fromMicroseconds(40));
+    EXPECT_EQ(PerfUtils::Cycles::fromMicroseconds(40),
+              manager.peerPolicies.at(dest)->rttCycles.load());
+    uint32_t limit = manager.getUnscheduledPolicy(dest, 1).unscheduledByteLimit;
+    EXPECT_LE(39000U, limit);
+    EXPECT_GE(41000U, limit);
+
+    // An implausibly large sample is clamped to 8x the default limit.
+    manager.signalRttSample(dest, PerfUtils::Cycles::fromMicroseconds(100000));
+    EXPECT_EQ(64000U,
+              manager.getUnscheduledPolicy(dest, 1).unscheduledByteLimit);
+
+    // An implausibly small sample is clamped to 1/8 the default limit.
+    manager.peerPolicies.at(dest)->rttCycles = 1;
+    EXPECT_EQ(1000U,
+              manager.getUnscheduledPolicy(dest, 1).unscheduledByteLimit);
+}
+
+TEST(PolicyManagerTest, publishSnapshot)
+{
+    Homa::Mock::MockDriver mockDriver;
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    Policy::Manager manager(&mockDriver);
+    IpAddress dest{22};
+
+    const Policy::Manager::Snapshot* initial = manager.snapshot.load();
+    ASSERT_NE(nullptr, initial);
+    EXPECT_TRUE(initial->peers.empty());
+
+    // The first reference to a peer republishes the snapshot.
+    manager.getUnscheduledPolicy(dest, 1);
+
+    const Policy::Manager::Snapshot* withPeer = manager.snapshot.load();
+    EXPECT_NE(initial, withPeer);
+    EXPECT_EQ(1U, withPeer->peers.count(dest));
+    EXPECT_EQ(1U, manager.retiredSnapshots.size());
+
+    // Lookups of a known peer are served from the published snapshot.
+    manager.getUnscheduledPolicy(dest, 1);
+    EXPECT_EQ(withPeer, manager.snapshot.load());
+
+    // RTT samples update the peer record in place without republishing.
+    manager.signalRttSample(dest, 100);
+    EXPECT_EQ(withPeer, manager.snapshot.load());
+
+    // Scheduled policy changes republish the snapshot.
+    manager.setDegreeOvercommitment(8);
+    EXPECT_NE(withPeer, manager.snapshot.load());
+    EXPECT_EQ(8, manager.getScheduledPolicy().degreeOvercommitment);
+}
+
+TEST(PolicyManagerTest, signalNewMessage_histogram)
+{
+    Homa::Mock::MockDriver mockDriver;
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    Policy::Manager manager(&mockDriver);
+    IpAddress source{22};
+    ASSERT_EQ(8000U, manager.RTT_BYTES);
+
+    manager.signalNewMessage(source, 0, 1);
+    manager.signalNewMessage(source, 0, 500);
+    manager.signalNewMessage(source, 0, 100000);
+
+    EXPECT_EQ(1U, manager.messageCounts[0]);
+    EXPECT_EQ(1U, manager.messageCounts[8]);
+    EXPECT_EQ(1U, manager.messageCounts[16]);
+    EXPECT_EQ(1U, manager.unscheduledBytes[0]);
+    EXPECT_EQ(500U, manager.unscheduledBytes[8]);
+    // Bytes beyond RTT_BYTES are scheduled; the histogram caps them.
+    EXPECT_EQ(8000U, manager.unscheduledBytes[16]);
+    EXPECT_EQ(3U, manager.sampleCount);
+}
+
+TEST(PolicyManagerTest, poll_updateCutoffs)
+{
+    Homa::Mock::MockDriver mockDriver;
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    Policy::Manager manager(&mockDriver);
+    IpAddress source{22};
+    ASSERT_EQ(3U, manager.localUnscheduledPolicy.priorityCutoffBytes.size());
+
+    // Reference a peer before the recomputation so the dissemination to
+    // existing records can be observed.
+    ASSERT_EQ(0, manager.getUnscheduledPolicy(source, 512).version);
+
+    for (int i = 0; i < 400; ++i) {
+        manager.signalNewMessage(source, 0, 512);
+    }
+    for (int i = 0; i < 400; ++i) {
+        manager.signalNewMessage(source, 0, 4096);
+    }
+    for (int i = 0; i < 200; ++i) {
+        manager.signalNewMessage(source, 0, 100000);
+    }
+    ASSERT_EQ(1000U, manager.sampleCount);
+    manager.nextCutoffUpdateCycles = 0;
+
+    manager.poll();
+
+    std::vector<uint32_t> expected{8192, 8193, 131072};
+    EXPECT_EQ(expected, manager.localUnscheduledPolicy.priorityCutoffBytes);
+    EXPECT_EQ(1, manager.localUnscheduledPolicy.version);
+    EXPECT_EQ(500U, manager.sampleCount);
+    EXPECT_LT(0U, manager.nextCutoffUpdateCycles);
+
+    // The recomputed policy is what getUnscheduledPolicy() now serves: a
+    // 512 byte message falls below every new cutoff and keeps the highest
+    // priority, while the old cutoffs would have demoted it one level.
+    Policy::Unscheduled served = manager.getUnscheduledPolicy(source, 512);
+    EXPECT_EQ(1, served.version);
+    EXPECT_EQ(7, served.priority);
+
+    // A second poll() within the refresh interval should do nothing.
+    manager.poll();
+
+    EXPECT_EQ(1, manager.localUnscheduledPolicy.version);
+    EXPECT_EQ(500U, manager.sampleCount);
+}
+
+TEST(PolicyManagerTest, poll_tooFewSamples)
+{
+    Homa::Mock::MockDriver mockDriver;
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    Policy::Manager manager(&mockDriver);
+    IpAddress source{22};
+
+    manager.signalNewMessage(source, 0, 512);
+    manager.nextCutoffUpdateCycles = 0;
+
+    manager.poll();
+
+    EXPECT_EQ(0, manager.localUnscheduledPolicy.version);
+    EXPECT_EQ(1U, manager.sampleCount);
+}
+
 }  // namespace
 }  // namespace Policy
 }  // namespace Core
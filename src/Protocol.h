@@ -17,6 +17,7 @@
 #define HOMA_PROTOCOL_H
 
 #include <cstdint>
+#include <cstring>
 #include <functional>
 
 namespace Homa {
@@ -75,13 +76,27 @@ struct MessageId {
      * as keys in unordered_maps.
      */
     struct Hasher {
-        /// Return a "hash" of the given MessageId.
+        /// Return a hash of the given MessageId.  The common case is many
+        /// ids sharing one transportId with sequential sequence numbers, so
+        /// the combined words are run through a full 64-bit finalizer to
+        /// spread consecutive ids across the entire hash range.
         std::size_t operator()(const MessageId& messageId) const
         {
-            std::size_t h1 = std::hash<uint64_t>()(messageId.transportId);
-            std::size_t h2 = std::hash<uint64_t>()(messageId.sequence);
-            return h1 ^ (h2 << 1);
+            uint64_t h =
+                messageId.sequence + messageId.transportId * GOLDEN_RATIO;
+            // SplitMix64 finalizer (mix64variant13).
+            h ^= h >> 30;
+            h *= 0xbf58476d1ce4e5b9ul;
+            h ^= h >> 27;
+            h *= 0x94d049bb133111ebul;
+            h ^= h >> 31;
+            return h;
         }
+
+      private:
+        /// 2^64 divided by the golden ratio; decorrelates the two words
+        /// before the finalizer mixes them.
+        static const uint64_t GOLDEN_RATIO = 0x9e3779b97f4a7c15ul;
     };
 } __attribute__((packed));
 
@@ -103,6 +118,7 @@ enum Opcode {
     PING = 26,
     UNKNOWN = 27,
     ERROR = 28,
+    DATA_SINGLE = 29,
 };
 
 /**
@@ -163,6 +179,30 @@ struct DataHeader {
     uint16_t index;  ///< Index of this packet in the array of packets that form
                      ///< the message.
 
+    /// Flag set in _flags_ while the sending application is still producing
+    /// the message (see Homa::OutMessage::Options::STREAM); totalLength is
+    /// then only the number of bytes produced so far and may grow in later
+    /// packets.  A DATA packet without this flag carries the message's final
+    /// length.
+    static const uint8_t FLAG_STREAM_OPEN = 0x01;
+
+    uint8_t flags;  ///< ORed combination of the FLAG_* values above; 0 for a
+                    ///< message whose length was known when it was sent.
+
+    // In request/response workloads, GRANTs for an inbound message and DATA
+    // of the outbound response flow between the same pair of transports.  A
+    // pending grant can be folded into an outgoing DATA packet instead of
+    // being sent as a standalone GRANT packet; the fields below carry such a
+    // piggybacked grant.
+
+    uint8_t piggybackGrant;   ///< Nonzero means the grant fields below carry a
+                              ///< valid grant for a message inbound to this
+                              ///< packet's sender; zero means they should be
+                              ///< ignored.
+    MessageId grantId;        ///< Id of the inbound message being granted.
+    uint32_t grantByteLimit;  ///< @sa GrantHeader::byteLimit.
+    uint8_t grantPriority;    ///< @sa GrantHeader::priority.
+
     // The remaining packet bytes after the header constitute message data
     // starting at the offset corresponding to the given packet index.
 
@@ -175,6 +215,37 @@ struct DataHeader {
         , policyVersion(policyVersion)
         , unscheduledIndexLimit(unscheduledIndexLimit)
         , index(index)
+        , flags(0)
+        , piggybackGrant(0)
+        , grantId(0, 0)
+        , grantByteLimit(0)
+        , grantPriority(0)
+    {
+        common.prefix.sport = htobe16(sport);
+        common.prefix.dport = htobe16(dport);
+    }
+} __attribute__((packed));
+
+/**
+ * Describes the wire format for a DATA_SINGLE packet, which contains an
+ * entire single-packet message.  Compared to DataHeader, the totalLength,
+ * unscheduledIndexLimit, and index fields are omitted since they are implied
+ * for a message that fits in one packet; the message length is simply the
+ * packet length less this header.
+ */
+struct DataHeaderSingle {
+    CommonHeader common;    ///< Common header fields.
+    uint8_t policyVersion;  ///< Version of the network priority policy being
+                            ///< used by the Sender.
+
+    // The remaining packet bytes after the header constitute the entire
+    // message data.
+
+    /// DataHeaderSingle constructor.
+    DataHeaderSingle(uint16_t sport, uint16_t dport, MessageId messageId,
+                     uint8_t policyVersion)
+        : common(Opcode::DATA_SINGLE, messageId)
+        , policyVersion(policyVersion)
     {
         common.prefix.sport = htobe16(sport);
         common.prefix.dport = htobe16(dport);
@@ -219,26 +290,58 @@ struct DoneHeader {
 
 /**
  * Describes the wire format for a RESEND packet.  The RESEND packet is used by
- * the receiver to request that a particular range of packets within a Message
- * be resent.
+ * the receiver to request that particular packets within a Message be resent.
+ * A bitmap identifies the packets within the requested window that are
+ * actually missing so that packets which were merely reordered are not
+ * retransmitted.
  */
 struct ResendHeader {
+    /// Number of bytes in resendMask; one RESEND can describe the missing
+    /// packets within a window of up to 8 * RESEND_MASK_BYTES packets.
+    static const uint16_t RESEND_MASK_BYTES = 32;
+
     CommonHeader common;  ///< Common header fields.
     uint16_t index;  ///< Index of the first packet that should be resent among
                      ///< the array of packets that form the message.
-    uint16_t num;  ///< Number of packet in the range of packets that should be
-                   ///< resent starting with the packet at _index_.
+    uint16_t num;  ///< Number of packets in the window of packets that may need
+                   ///< to be resent starting with the packet at _index_; must
+                   ///< be no more than 8 * RESEND_MASK_BYTES.
     uint8_t priority;  ///< The granted priority if this RESEND is interpreted
                        ///< as a GRANT.  (See GrantHeader.priority)
-
-    /// DoneHeader constructor.
+    uint8_t resendMask[RESEND_MASK_BYTES];  ///< Bitmap over the window
+                                            ///< [index, index + num); bit i
+                                            ///< set means packet (index + i)
+                                            ///< is missing and should be
+                                            ///< resent.
+
+    /// ResendHeader constructor.  If no bitmap is provided, every packet in
+    /// the window [index, index + num) is marked for resend.
     ResendHeader(MessageId messageId, uint16_t index, uint16_t num,
-                 uint8_t priority)
+                 uint8_t priority, const uint8_t* mask = nullptr)
         : common(Opcode::RESEND, messageId)
         , index(index)
         , num(num)
         , priority(priority)
-    {}
+        , resendMask()
+    {
+        if (mask != nullptr) {
+            memcpy(resendMask, mask, RESEND_MASK_BYTES);
+        } else {
+            for (uint16_t i = 0; i < num; ++i) {
+                resendMask[i >> 3] = static_cast<uint8_t>(
+                    resendMask[i >> 3] | (1u << (i & 7)));
+            }
+        }
+    }
+
+    /**
+     * Return true if the packet at offset i within the window should be
+     * resent; i must be less than num.
+     */
+    bool shouldResend(uint16_t i) const
+    {
+        return (resendMask[i >> 3] >> (i & 7)) & 1;
+    }
 } __attribute__((packed));
 
 /**
@@ -17,7 +17,12 @@
 
 #include <Cycles.h>
 
+#include <algorithm>
+#include <cstring>
+
+#include "BulkCopy.h"
 #include "Perf.h"
+#include "TimeTrace.h"
 
 namespace Homa {
 namespace Core {
@@ -40,13 +45,25 @@ Receiver::Receiver(Driver* driver, Policy::Manager* policyManager,
                    uint64_t messageTimeoutCycles, uint64_t resendIntervalCycles)
     : driver(driver)
     , policyManager(policyManager)
-    , messageBuckets(messageTimeoutCycles, resendIntervalCycles)
-    , schedulerMutex()
+    , earliestTimeout(UINT64_MAX)
+    , messageBuckets(messageTimeoutCycles, resendIntervalCycles,
+                     &earliestTimeout)
+    , schedulerMutex("Receiver::schedulerMutex")
     , scheduledPeers()
     , receivedMessages()
+    , portQueues()
+    , streamingThreshold(0)
+    , compactionThreshold(0)
+    , wakeupCallback()
+    , grantQuantum(DEFAULT_GRANT_QUANTUM)
+    , grantCoordinator(nullptr)
+    , overloadThreshold(DEFAULT_OVERLOAD_THRESHOLD)
+    , schedulerGeneration(0)
+    , grantedGeneration(0)
     , granting()
-    , nextBucketIndex(0)
     , messageAllocator()
+    , arenaAllocator()
+    , reclaimList()
 {}
 
 /**
@@ -58,23 +75,38 @@ Receiver::~Receiver()
     scheduledPeers.clear();
     peerTable.clear();
     receivedMessages.mutex.lock();
-    receivedMessages.queue.clear();
+    receivedMessages.overflow.clear();
+    Message* unused;
+    while (receivedMessages.ring.tryPop(&unused)) {
+    }
+    portQueues.mutex.lock();
+    for (auto& entry : portQueues.map) {
+        DeliveryQueue* queue = entry.second;
+        queue->overflow.clear();
+        while (queue->ring.tryPop(&unused)) {
+        }
+        delete queue;
+    }
+    portQueues.map.clear();
     for (auto it = messageBuckets.buckets.begin();
          it != messageBuckets.buckets.end(); ++it) {
         MessageBucket* bucket = *it;
-        bucket->mutex.lock();
-        auto iit = bucket->messages.begin();
-        while (iit != bucket->messages.end()) {
-            Message* message = &(*iit);
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        while (!bucket->messages.empty()) {
+            Message* message = &bucket->messages.front();
             bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
             bucket->resendTimeouts.cancelTimeout(&message->resendTimeout);
-            iit = bucket->messages.remove(iit);
-            {
-                SpinLock::Lock lock_allocator(messageAllocator.mutex);
-                messageAllocator.pool.destroy(message);
-            }
+            bucket->removeMessage(message, lock_bucket);
+            messageAllocator.destroy(message);
         }
     }
+    // Reclaim any messages still awaiting deferred reclamation.
+    SpinLock::Lock lock_reclaim(reclaimList.mutex);
+    while (!reclaimList.list.empty()) {
+        Message* message = &reclaimList.list.front();
+        reclaimList.list.pop_front();
+        messageAllocator.destroy(message);
+    }
 }
 
 /**
@@ -90,81 +122,232 @@ Receiver::handleDataPacket(Driver::Packet* packet, IpAddress sourceIp)
 {
     Protocol::Packet::DataHeader* header =
         static_cast<Protocol::Packet::DataHeader*>(packet->payload);
-    uint16_t dataHeaderLength = sizeof(Protocol::Packet::DataHeader);
+    // Unpack the header fields that differ between the two DATA formats.
+    // Single-packet messages arrive with the compact DATA_SINGLE header
+    // whose omitted fields are implied.
+    uint16_t dataHeaderLength;
+    uint32_t totalLength;
+    uint8_t policyVersion;
+    uint16_t unscheduledIndexLimit;
+    uint16_t packetIndex;
+    bool streamOpenPkt;
+    if (header->common.opcode == Protocol::Packet::DATA_SINGLE) {
+        Protocol::Packet::DataHeaderSingle* singleHeader =
+            static_cast<Protocol::Packet::DataHeaderSingle*>(packet->payload);
+        dataHeaderLength = sizeof(Protocol::Packet::DataHeaderSingle);
+        totalLength = Util::downCast<uint32_t>(packet->length +
+                                               packet->extLength -
+                                               dataHeaderLength);
+        policyVersion = singleHeader->policyVersion;
+        unscheduledIndexLimit = 1;
+        packetIndex = 0;
+        streamOpenPkt = false;
+    } else {
+        dataHeaderLength = sizeof(Protocol::Packet::DataHeader);
+        totalLength = header->totalLength;
+        policyVersion = header->policyVersion;
+        unscheduledIndexLimit = header->unscheduledIndexLimit;
+        packetIndex = header->index;
+        streamOpenPkt =
+            header->flags & Protocol::Packet::DataHeader::FLAG_STREAM_OPEN;
+    }
     Protocol::MessageId id = header->common.messageId;
+    TIME_TRACE("Receiver::handleDataPacket: DATA packet for message",
+               id.sequence);
 
     MessageBucket* bucket = messageBuckets.getBucket(id);
-    SpinLock::Lock lock_bucket(bucket->mutex);
-    Message* message = bucket->findMessage(id, lock_bucket);
-    if (message == nullptr) {
-        // New message
-        int messageLength = header->totalLength;
-        int numUnscheduledPackets = header->unscheduledIndexLimit;
-        {
-            SpinLock::Lock lock_allocator(messageAllocator.mutex);
+    Message* message = nullptr;
+    // Set when this packet makes the message deliverable; the handoff (and
+    // the application's wakeup callback) runs after the bucket lock is
+    // released so the callback cannot stall the bucket or deadlock against
+    // a thread draining the delivery queues.
+    bool deliver = false;
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        message = bucket->findMessage(id, lock_bucket);
+        if (message == nullptr) {
+            // New message
+            int packetDataLength =
+                driver->getMaxPayloadSize() - dataHeaderLength;
+            int numExpectedPackets =
+                (Util::downCast<int>(totalLength) + packetDataLength - 1) /
+                packetDataLength;
+            size_t threshold =
+                overloadThreshold.load(std::memory_order_relaxed);
+            if ((numExpectedPackets > unscheduledIndexLimit || streamOpenPkt) &&
+                threshold != 0 &&
+                messageAllocator.outstandingObjects.load(
+                    std::memory_order_relaxed) >= threshold) {
+                // Too many inbound messages are already outstanding (being
+                // assembled or awaiting the application); taking on another
+                // scheduled message would only deepen the backlog until senders
+                // start timing out.  Drop the packet and answer with an empty
+                // grant so the sender stays patient and backs off instead (see
+                // Homa::Transport::setOverloadThreshold()).
+                Perf::counters.rx_overload_pushbacks.add(1);
+                Perf::counters.tx_grant_pkts.add(1);
+                ControlPacket::send<Protocol::Packet::GrantHeader>(
+                    driver, sourceIp, id, 0, 0);
+                driver->releasePackets(&packet, 1);
+                return;
+            }
+            int messageLength = totalLength;
+            int numUnscheduledPackets = unscheduledIndexLimit;
             SocketAddress srcAddress = {
                 .ip = sourceIp, .port = be16toh(header->common.prefix.sport)};
-            message = messageAllocator.pool.construct(
+            message = messageAllocator.construct(
                 this, driver, dataHeaderLength, messageLength, id, srcAddress,
-                numUnscheduledPackets);
+                numUnscheduledPackets, be16toh(header->common.prefix.dport),
+                streamOpenPkt);
             Perf::counters.allocated_rx_messages.add(1);
-        }
+            message->arrivalCycles = PerfUtils::Cycles::rdtsc();
+
+            size_t compactLimit =
+                compactionThreshold.load(std::memory_order_relaxed);
+            if (compactLimit != 0 && !streamOpenPkt &&
+                totalLength <= compactLimit &&
+                numExpectedPackets <= CompactArena::MAX_PACKETS &&
+                Util::downCast<size_t>(numExpectedPackets) *
+                        driver->getMaxPayloadSize() <=
+                    CompactArena::DATA_BYTES) {
+                // Small message: copy its packets into a pooled arena as they
+                // arrive so the driver's packet buffers are not pinned for the
+                // message's lifetime (see setCompactionThreshold()).  Streams
+                // are excluded because their final length is not yet known.
+                message->compactArena = arenaAllocator.construct();
+            }
 
-        bucket->messages.push_back(&message->bucketNode);
-        policyManager->signalNewMessage(
-            message->source.ip, header->policyVersion, header->totalLength);
+            bucket->addMessage(message, lock_bucket);
+            policyManager->signalNewMessage(message->source.ip, policyVersion,
+                                            totalLength);
 
-        if (message->scheduled) {
-            // Message needs to be scheduled.
-            SpinLock::Lock lock_scheduler(schedulerMutex);
-            schedule(message, lock_scheduler);
+            if (message->scheduled) {
+                // Message needs to be scheduled.
+                SpinLock::Lock lock_scheduler(schedulerMutex);
+                schedule(message, lock_scheduler);
+            }
         }
-    }
 
-    // Things that must be true (sanity check)
-    assert(id == message->id);
-    assert(message->driver == driver);
-    assert(message->source.ip == sourceIp);
-    assert(message->source.port == be16toh(header->common.prefix.sport));
-    assert(message->messageLength == Util::downCast<int>(header->totalLength));
+        // Things that must be true (sanity check)
+        assert(id == message->id);
+        assert(message->driver == driver);
+        assert(message->source.ip == sourceIp);
+        assert(message->source.port == be16toh(header->common.prefix.sport));
+
+        if (message->streamOpen) {
+            // The sender is still producing this message; fold in any growth
+            // the packet announces and close the stream once the sender has
+            // finalized the length.  Packets can arrive out of order, so the
+            // length only ever ratchets up.
+            if (Util::downCast<int>(totalLength) > message->messageLength) {
+                int delta =
+                    Util::downCast<int>(totalLength) - message->messageLength;
+                message->messageLength = Util::downCast<int>(totalLength);
+                message->numExpectedPackets =
+                    (message->messageLength + message->PACKET_DATA_LENGTH - 1) /
+                    message->PACKET_DATA_LENGTH;
+                assert(message->scheduled);
+                SpinLock::Lock lock_scheduler(schedulerMutex);
+                ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+                info->messageLength += delta;
+                info->bytesRemaining += delta;
+                if (info->peer == nullptr) {
+                    // The message had been fully granted and dropped out of the
+                    // schedule; the new bytes put it back in need of GRANTs.
+                    schedule(message, lock_scheduler);
+                } else {
+                    updateSchedule(message, lock_scheduler);
+                }
+            }
+            if (!streamOpenPkt) {
+                message->streamOpen = false;
+            }
+        } else {
+            assert(message->messageLength >= Util::downCast<int>(totalLength));
+        }
 
-    // Add the packet
-    bool packetAdded = message->setPacket(header->index, packet);
-    if (packetAdded) {
-        // Update schedule for scheduled messages.
-        if (message->scheduled) {
-            SpinLock::Lock lock_scheduler(schedulerMutex);
-            ScheduledMessageInfo* info = &message->scheduledMessageInfo;
-            // Update the schedule if the message is still being scheduled
-            // (i.e. still linked to a scheduled peer).
-            if (info->peer != nullptr) {
-                int packetDataBytes =
-                    packet->length - message->TRANSPORT_HEADER_LENGTH;
-                assert(info->bytesRemaining >= packetDataBytes);
-                info->bytesRemaining -= packetDataBytes;
-                updateSchedule(message, lock_scheduler);
+        // Add the packet
+        bool packetAdded;
+        if (message->compactArena != nullptr) {
+            packetAdded = message->compactPacket(packetIndex, packet);
+            if (packetAdded) {
+                Perf::counters.rx_compacted_pkts.add(1);
             }
+        } else {
+            packetAdded = message->setPacket(packetIndex, packet);
         }
+        if (packetAdded) {
+            // Update schedule for scheduled messages.
+            if (message->scheduled) {
+                SpinLock::Lock lock_scheduler(schedulerMutex);
+                ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+                // Update the schedule if the message is still being scheduled
+                // (i.e. still linked to a scheduled peer).
+                if (info->peer != nullptr) {
+                    int packetDataBytes =
+                        packet->length - message->TRANSPORT_HEADER_LENGTH;
+                    assert(info->bytesRemaining >= packetDataBytes);
+                    info->bytesRemaining -= packetDataBytes;
+                    updateSchedule(message, lock_scheduler);
+                }
+            }
 
-        // Receiving a new packet means the message is still active so it
-        // shouldn't time out until a while later.
-        bucket->messageTimeouts.setTimeout(&message->messageTimeout);
-        if (message->numPackets < message->numExpectedPackets) {
-            // Still waiting for more packets to arrive but the arrival of a
-            // new packet means we should wait a while longer before requesting
-            // RESENDs of the missing packets.
-            bucket->resendTimeouts.setTimeout(&message->resendTimeout);
+            // Receiving a new packet means the message is still active so it
+            // shouldn't time out until a while later.
+            bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+            if (message->numPackets < message->numExpectedPackets ||
+                message->streamOpen) {
+                // Still waiting for more packets to arrive but the arrival of a
+                // new packet means we should wait a while longer before
+                // requesting RESENDs of the missing packets.
+                bucket->resendTimeouts.setTimeout(&message->resendTimeout);
+                // Streaming mode: deliver large messages as soon as their first
+                // packet arrives so the application can process the prefix
+                // while the rest is still in flight (see readableBytes()).
+                size_t threshold =
+                    streamingThreshold.load(std::memory_order_relaxed);
+                if (threshold != 0 && !message->delivered &&
+                    Util::downCast<size_t>(message->messageLength) >=
+                        threshold) {
+                    message->delivered = true;
+                    deliver = true;
+                }
+            } else {
+                // All message packets have been received.
+                message->state.store(Message::State::COMPLETED);
+                bucket->resendTimeouts.cancelTimeout(&message->resendTimeout);
+                if (!message->delivered) {
+                    message->delivered = true;
+                    deliver = true;
+                }
+            }
+            if (message->compactArena != nullptr) {
+                // The packet's contents were copied into the arena; the
+                // driver's buffer can be returned immediately instead of being
+                // pinned for the message's lifetime.
+                driver->releasePackets(&packet, 1);
+            }
         } else {
-            // All message packets have been received.
-            message->state.store(Message::State::COMPLETED);
-            bucket->resendTimeouts.cancelTimeout(&message->resendTimeout);
-            SpinLock::Lock lock_received_messages(receivedMessages.mutex);
-            receivedMessages.queue.push_back(&message->receivedMessageNode);
-            Perf::counters.received_rx_messages.add(1);
+            // must be a duplicate packet; drop packet.
+            // A retransmitted packet can still carry a stream's final length
+            // (see Sender::closeMessage()), in which case the message may have
+            // just become complete even though the packet itself is a
+            // duplicate.
+            if (!message->streamOpen &&
+                message->state.load() == Message::State::IN_PROGRESS &&
+                message->numPackets >= message->numExpectedPackets) {
+                message->state.store(Message::State::COMPLETED);
+                bucket->resendTimeouts.cancelTimeout(&message->resendTimeout);
+                if (!message->delivered) {
+                    message->delivered = true;
+                    deliver = true;
+                }
+            }
+            driver->releasePackets(&packet, 1);
         }
-    } else {
-        // must be a duplicate packet; drop packet.
-        driver->releasePackets(&packet, 1);
+    }
+    if (deliver) {
+        deliverMessage(message);
     }
     return;
 }
@@ -264,26 +447,256 @@ Receiver::handlePingPacket(Driver::Packet* packet, IpAddress sourceIp)
 Homa::InMessage*
 Receiver::receiveMessage()
 {
-    SpinLock::Lock lock_received_messages(receivedMessages.mutex);
+    return receiveMessage(&receivedMessages);
+}
+
+/**
+ * Return a handle to a new received Message from a particular delivery queue.
+ *
+ * Used by sockets to drain the queue of their port (see openPort()); the
+ * default Transport::receive() path drains _receivedMessages_.
+ *
+ * @param queue
+ *      The delivery queue from which a message should be popped.
+ * @return
+ *      A new Message which has been received, if available; otherwise,
+ *      nullptr.
+ *
+ * @sa dropMessage()
+ */
+Homa::InMessage*
+Receiver::receiveMessage(DeliveryQueue* queue)
+{
     Message* message = nullptr;
-    if (!receivedMessages.queue.empty()) {
-        message = &receivedMessages.queue.front();
-        receivedMessages.queue.pop_front();
+    if (!queue->ring.tryPop(&message) &&
+        queue->overflowCount.load(std::memory_order_acquire) > 0) {
+        SpinLock::Lock lock_received_messages(queue->mutex);
+        if (!queue->overflow.empty()) {
+            message = &queue->overflow.front();
+            queue->overflow.pop_front();
+            queue->overflowCount.fetch_sub(1, std::memory_order_release);
+        }
+    }
+    if (message != nullptr) {
         Perf::counters.delivered_rx_messages.add(1);
+        Perf::counters
+            .rx_delivery_latency[Perf::messageSizeClass(
+                Util::downCast<uint32_t>(message->messageLength))]
+            .record(PerfUtils::Cycles::rdtsc() - message->arrivalCycles);
     }
     return message;
 }
 
+/**
+ * Return a batch of new received Messages.
+ *
+ * Compared to calling receiveMessage() repeatedly, this method lets the
+ * application dequeue many small messages per call.
+ *
+ * @param[out] messages
+ *      Array to be filled with handles to the received messages; must hold
+ *      at least maxMessages entries.
+ * @param maxMessages
+ *      The maximum number of messages that should be returned.
+ * @return
+ *      The number of messages actually returned; may be zero.
+ *
+ * @sa dropMessage()
+ */
+uint32_t
+Receiver::receiveMessages(Homa::InMessage* messages[], uint32_t maxMessages)
+{
+    uint32_t numMessages = 0;
+    Message* message = nullptr;
+    while (numMessages < maxMessages &&
+           receivedMessages.ring.tryPop(&message)) {
+        messages[numMessages++] = message;
+    }
+    if (numMessages < maxMessages &&
+        receivedMessages.overflowCount.load(std::memory_order_acquire) > 0) {
+        SpinLock::Lock lock_received_messages(receivedMessages.mutex);
+        while (numMessages < maxMessages &&
+               !receivedMessages.overflow.empty()) {
+            message = &receivedMessages.overflow.front();
+            receivedMessages.overflow.pop_front();
+            receivedMessages.overflowCount.fetch_sub(
+                1, std::memory_order_release);
+            messages[numMessages++] = message;
+        }
+    }
+    if (numMessages > 0) {
+        Perf::counters.delivered_rx_messages.add(numMessages);
+        uint64_t now = PerfUtils::Cycles::rdtsc();
+        for (uint32_t i = 0; i < numMessages; ++i) {
+            Message* delivered = static_cast<Message*>(messages[i]);
+            Perf::counters
+                .rx_delivery_latency[Perf::messageSizeClass(
+                    Util::downCast<uint32_t>(delivered->messageLength))]
+                .record(now - delivered->arrivalCycles);
+        }
+    }
+    return numMessages;
+}
+
+/**
+ * Open a dedicated delivery queue for inbound messages sent to the given
+ * port.
+ *
+ * While the port is open, messages whose DATA packets carry the port in
+ * their dport field are routed to the returned queue at completion time
+ * instead of the shared default queue, so the socket that owns the port can
+ * poll for its messages without filtering (see
+ * receiveMessage(DeliveryQueue*)).
+ *
+ * @param port
+ *      The port to be opened.
+ * @return
+ *      The delivery queue for the port if it was opened; nullptr if the port
+ *      is already open.
+ *
+ * @sa closePort()
+ */
+Receiver::DeliveryQueue*
+Receiver::openPort(uint16_t port)
+{
+    SpinLock::Lock lock_ports(portQueues.mutex);
+    if (portQueues.map.find(port) != portQueues.map.end()) {
+        return nullptr;
+    }
+    DeliveryQueue* queue = new DeliveryQueue();
+    portQueues.map.insert({port, queue});
+    portQueues.openPorts.fetch_add(1, std::memory_order_release);
+    return queue;
+}
+
+/**
+ * Close a port previously opened with openPort() and free its delivery
+ * queue.
+ *
+ * Messages still waiting in the port's queue are moved to the default queue
+ * so they remain retrievable through receiveMessage().  The caller must
+ * ensure no concurrent receiveMessage(DeliveryQueue*) calls on the port's
+ * queue are in progress.
+ *
+ * @param port
+ *      The port to be closed; must not already be closed.
+ */
+void
+Receiver::closePort(uint16_t port)
+{
+    DeliveryQueue* queue = nullptr;
+    {
+        SpinLock::Lock lock_ports(portQueues.mutex);
+        auto it = portQueues.map.find(port);
+        assert(it != portQueues.map.end());
+        queue = it->second;
+        portQueues.map.erase(it);
+        portQueues.openPorts.fetch_sub(1, std::memory_order_release);
+    }
+    // The queue is no longer reachable from deliverMessage() (which only
+    // pushes to per-port queues while holding portQueues.mutex), so it can
+    // be drained and freed without further locking.
+    Message* message = nullptr;
+    while (queue->ring.tryPop(&message)) {
+        enqueueMessage(&receivedMessages, message);
+    }
+    while (!queue->overflow.empty()) {
+        message = &queue->overflow.front();
+        queue->overflow.pop_front();
+        enqueueMessage(&receivedMessages, message);
+    }
+    delete queue;
+}
+
+/**
+ * Claim a pending grant for the highest priority scheduled message inbound
+ * from the given peer so that it can be piggybacked on an outgoing DATA
+ * packet instead of being sent as a standalone GRANT packet.
+ *
+ * The claim performs the same bookkeeping as trySendGrants(): the message's
+ * granted byte limit is advanced and the message is unscheduled once fully
+ * granted, so a claimed grant MUST actually be transmitted by the caller.
+ *
+ * @param sourceIp
+ *      The peer to which the caller is about to send a DATA packet.
+ * @param[out] grantId
+ *      Id of the inbound message being granted.
+ * @param[out] byteLimit
+ *      @sa Protocol::Packet::GrantHeader::byteLimit.
+ * @param[out] priority
+ *      @sa Protocol::Packet::GrantHeader::priority.
+ * @return
+ *      True if the peer was owed a grant and the output parameters were
+ *      filled in; false if there is nothing to piggyback.
+ */
+bool
+Receiver::claimPiggybackGrant(IpAddress sourceIp,
+                              Protocol::MessageId* grantId,
+                              uint32_t* byteLimit, uint8_t* priority)
+{
+    SpinLock::Lock lock(schedulerMutex);
+    if (scheduledPeers.empty()) {
+        return false;
+    }
+    Peer* peer = peerTable.find(sourceIp);
+    if (peer == nullptr || peer->scheduledMessages.empty()) {
+        return false;
+    }
+    Message* message = &peer->scheduledMessages.top();
+    ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+
+    // Mirror the grant condition and limit calculation in trySendGrants().
+    Policy::Scheduled policy = policyManager->getScheduledPolicy();
+    int receivedBytes = info->messageLength - info->bytesRemaining;
+    if (info->bytesGranted - receivedBytes >= policy.minScheduledBytes) {
+        // The message has enough bytes granted; nothing is owed.
+        return false;
+    }
+    int newGrantLimit = std::min(receivedBytes + policy.maxScheduledBytes,
+                                 info->messageLength);
+    assert(newGrantLimit >= info->bytesGranted);
+    if (newGrantLimit - info->bytesGranted <
+            grantQuantum.load(std::memory_order_relaxed) &&
+        newGrantLimit != info->messageLength) {
+        // Quantization: too little progress to be worth a grant yet.
+        return false;
+    }
+    if (grantCoordinator != nullptr &&
+        !grantCoordinator->tryAcquire(newGrantLimit - info->bytesGranted)) {
+        // The host-wide grant budget is exhausted; defer the grant.
+        return false;
+    }
+    info->coordinatedBytes += newGrantLimit - info->bytesGranted;
+    info->bytesGranted = newGrantLimit;
+    *grantId = message->id;
+    *byteLimit = Util::downCast<uint32_t>(info->bytesGranted);
+    // Reuse the priority assigned during the last grant round; a fresh
+    // standalone GRANT would recalculate it, but being off by a round is
+    // preferable to sending an extra control packet.
+    *priority = Util::downCast<uint8_t>(info->priority);
+
+    if (info->messageLength <= info->bytesGranted) {
+        // All packets granted; unschedule the message.
+        unschedule(message, lock);
+    }
+    return true;
+}
+
 /**
  * Allow the Receiver to make progress toward receiving incoming messages.
  *
  * This method must be called eagerly to ensure messages are received.
+ *
+ * @return
+ *      Number of GRANT packets issued during this call.
  */
-void
+uint32_t
 Receiver::poll()
 {
-    trySendGrants();
+    uint32_t grantsSent = trySendGrants();
     checkTimeouts();
+    reclaimMessages();
+    return grantsSent;
 }
 
 /**
@@ -294,43 +707,71 @@ Receiver::poll()
 void
 Receiver::checkTimeouts()
 {
-    uint index = nextBucketIndex.fetch_add(1, std::memory_order_relaxed) &
-                 MessageBucketMap::HASH_KEY_MASK;
-    MessageBucket* bucket = messageBuckets.buckets.at(index);
     uint64_t now = PerfUtils::Cycles::rdtsc();
-    checkResendTimeouts(now, bucket);
-    checkMessageTimeouts(now, bucket);
+    uint64_t expiration = earliestTimeout.load(std::memory_order_relaxed);
+    if (now < expiration) {
+        // No timeout is near; nothing to do.
+        return;
+    }
+    // Claim the sweep; concurrent callers take the fast path out.
+    if (!earliestTimeout.compare_exchange_strong(expiration, UINT64_MAX,
+                                                 std::memory_order_relaxed)) {
+        return;
+    }
+    uint64_t newEarliest = UINT64_MAX;
+    // Batch any RESEND packets emitted during the sweep into one TX burst.
+    ControlPacket::Corked corked(driver);
+    for (MessageBucket* bucket : messageBuckets.buckets) {
+        checkResendTimeouts(now, bucket);
+        checkMessageTimeouts(now, bucket);
+        newEarliest = std::min({newEarliest,
+                                bucket->messageTimeouts.getNextTimeout(),
+                                bucket->resendTimeouts.getNextTimeout()});
+    }
+    // Timeouts (re)scheduled during the sweep have already lowered the
+    // cached time themselves.
+    lowerEarliestTimeout(&earliestTimeout, newEarliest);
 }
 
 /**
- * Destruct a Message. Will release all contained Packet objects.
+ * Reclaim the resources of a bounded batch of released messages.
+ *
+ * Messages released by the application are queued for reclamation instead of
+ * being destroyed inline; this method releases their packets and returns them
+ * to the message pool, a few messages at a time so no single call stalls the
+ * pipeline.
  */
-Receiver::Message::~Message()
+void
+Receiver::reclaimMessages()
 {
-    // Find contiguous ranges of packets and release them back to the
-    // driver.
-    int num = 0;
-    int index = 0;
-    int packetsFound = 0;
-    for (int i = 0; i < MAX_MESSAGE_PACKETS && packetsFound < numPackets; ++i) {
-        if (occupied.test(i)) {
-            if (num == 0) {
-                // First packet in new region.
-                index = i;
-            }
-            ++num;
-            ++packetsFound;
-        } else {
-            if (num != 0) {
-                // End of region; release the last region.
-                driver->releasePackets(&packets[index], num);
-                num = 0;
+    // Largest number of messages reclaimed per call.
+    const int RECLAIM_LIMIT = 8;
+    for (int i = 0; i < RECLAIM_LIMIT; ++i) {
+        Message* message = nullptr;
+        {
+            SpinLock::Lock lock(reclaimList.mutex);
+            if (reclaimList.list.empty()) {
+                return;
             }
+            message = &reclaimList.list.front();
+            reclaimList.list.pop_front();
         }
+        messageAllocator.destroy(message);
+        Perf::counters.destroyed_rx_messages.add(1);
     }
-    if (num != 0) {
-        // Release the last region (if any).
-        driver->releasePackets(&packets[index], num);
+}
+
+/**
+ * Destruct a Message. Will release all contained Packet objects.
+ */
+Receiver::Message::~Message()
+{
+    if (compactArena != nullptr) {
+        // The packets array holds the arena's shadow descriptors; the
+        // driver's buffers were released on arrival.
+        receiver->arenaAllocator.destroy(compactArena);
+    } else {
+        packets.releasePackets(driver, numPackets);
     }
 }
 
@@ -398,8 +839,8 @@ Receiver::Message::get(size_t offset, void* destination, size_t count) const
         if (packet != nullptr) {
             char* source = static_cast<char*>(packet->payload);
             source += packetOffset + TRANSPORT_HEADER_LENGTH;
-            std::memcpy(static_cast<char*>(destination) + bytesCopied, source,
-                        bytesToCopy);
+            BulkCopy::copy(static_cast<char*>(destination) + bytesCopied,
+                           source, bytesToCopy, _count);
         } else {
             ERROR("Message is missing data starting at packet index %u",
                   packetIndex);
@@ -412,6 +853,54 @@ Receiver::Message::get(size_t offset, void* destination, size_t count) const
     return bytesCopied;
 }
 
+/**
+ * @copydoc Homa::InMessage::getIov()
+ */
+size_t
+Receiver::Message::getIov(size_t offset, size_t count, Iovec iov[],
+                          size_t maxIov) const
+{
+    // This operation should be performed with the offset relative to the
+    // logical beginning of the Message.
+    int _offset = Util::downCast<int>(offset);
+    int _count = Util::downCast<int>(count);
+    int realOffset = _offset + start;
+    int packetIndex = realOffset / PACKET_DATA_LENGTH;
+    int packetOffset = realOffset % PACKET_DATA_LENGTH;
+    int bytesCovered = 0;
+    size_t numIov = 0;
+
+    // Offset is passed the end of the message.
+    if (realOffset >= messageLength) {
+        return 0;
+    }
+
+    if (realOffset + _count > messageLength) {
+        _count = messageLength - realOffset;
+    }
+
+    while (bytesCovered < _count && numIov < maxIov) {
+        int bytesInPacket =
+            std::min(_count - bytesCovered, PACKET_DATA_LENGTH - packetOffset);
+        Driver::Packet* packet = getPacket(packetIndex);
+        if (packet != nullptr) {
+            const char* source = static_cast<char*>(packet->payload);
+            source += packetOffset + TRANSPORT_HEADER_LENGTH;
+            iov[numIov].base = source;
+            iov[numIov].length = Util::downCast<size_t>(bytesInPacket);
+            numIov++;
+        } else {
+            ERROR("Message is missing data starting at packet index %u",
+                  packetIndex);
+            break;
+        }
+        bytesCovered += bytesInPacket;
+        packetIndex++;
+        packetOffset = 0;
+    }
+    return numIov;
+}
+
 /**
  * @copydoc Homa::InMessage::length()
  */
@@ -421,6 +910,16 @@ Receiver::Message::length() const
     return Util::downCast<size_t>(messageLength - start);
 }
 
+/**
+ * @copydoc Homa::InMessage::readableBytes()
+ */
+size_t
+Receiver::Message::readableBytes() const
+{
+    int available = contiguousBytes.load(std::memory_order_acquire);
+    return Util::downCast<size_t>(std::max(0, available - start));
+}
+
 /**
  * @copydoc Homa::InMessage::strip()
  */
@@ -451,10 +950,7 @@ Receiver::Message::release()
 Driver::Packet*
 Receiver::Message::getPacket(size_t index) const
 {
-    if (occupied.test(index)) {
-        return packets[index];
-    }
-    return nullptr;
+    return packets.get(index);
 }
 
 /**
@@ -476,15 +972,121 @@ Receiver::Message::getPacket(size_t index) const
 bool
 Receiver::Message::setPacket(size_t index, Driver::Packet* packet)
 {
-    if (occupied.test(index)) {
+    if (packets.get(index) != nullptr) {
         return false;
     }
-    packets[index] = packet;
-    occupied.set(index);
+    packets.set(index, packet);
     numPackets++;
+    // Advance the contiguous watermark past any previously received packets
+    // that this packet connects to the front of the message.
+    while (contiguousPackets < numExpectedPackets &&
+           packets.get(contiguousPackets) != nullptr) {
+        contiguousPackets++;
+    }
+    contiguousBytes.store(
+        std::min(contiguousPackets * PACKET_DATA_LENGTH, messageLength),
+        std::memory_order_release);
     return true;
 }
 
+/**
+ * Copy the given packet's contents into this message's CompactArena and store
+ * the arena's shadow descriptor as the Packet of the given index if one does
+ * not already exist.
+ *
+ * Unlike setPacket(), ownership of the given Packet always stays with the
+ * caller; the driver's buffer is no longer needed once this returns.
+ *
+ * @param index
+ *      The Packet's index in the array of packets that form the message.
+ *      "packet index = "packet message offset" / PACKET_DATA_LENGTH
+ * @param packet
+ *      The packet whose contents should be copied.
+ * @return
+ *      True if the packet was stored; false if a packet already exists (the new
+ *      packet is ignored).
+ */
+bool
+Receiver::Message::compactPacket(size_t index, Driver::Packet* packet)
+{
+    assert(compactArena != nullptr);
+    if (packets.get(index) != nullptr) {
+        return false;
+    }
+    char* slot = compactArena->data +
+                 index * (TRANSPORT_HEADER_LENGTH + PACKET_DATA_LENGTH);
+    std::memcpy(slot, packet->payload, packet->length);
+    if (packet->extLength > 0) {
+        // Flatten any external buffer (e.g. a loopbacked zero-copy send) so
+        // the copy is contiguous like a wire packet.
+        std::memcpy(slot + packet->length, packet->extData, packet->extLength);
+    }
+    Driver::Packet* shadow = &compactArena->packets[index];
+    shadow->payload = slot;
+    shadow->length = packet->length + packet->extLength;
+    return setPacket(index, shadow);
+}
+
+/**
+ * Add a Message to the given delivery queue.
+ *
+ * @param queue
+ *      The delivery queue to which the message should be added.
+ * @param message
+ *      Message to be added.
+ */
+void
+Receiver::enqueueMessage(DeliveryQueue* queue, Receiver::Message* message)
+{
+    if (!queue->ring.tryPush(message)) {
+        // The ring is full; fall back to the overflow list.
+        SpinLock::Lock lock_received_messages(queue->mutex);
+        queue->overflow.push_back(&message->receivedMessageNode);
+        queue->overflowCount.fetch_add(1, std::memory_order_release);
+    }
+}
+
+/**
+ * Hand a Message over to the application by adding it to a delivery queue.
+ *
+ * The message goes to the queue of the port it was sent to if a socket has
+ * that port open (see openPort()); otherwise it goes to the shared default
+ * queue drained by receiveMessage().
+ *
+ * Called at most once per message, either when the message is completely
+ * received or, in streaming mode, when its first packet arrives.  Must not
+ * be called while holding the bucket mutex (or any other Receiver lock) so
+ * that the application's wakeup callback runs lock-free.
+ *
+ * @param message
+ *      Message to be delivered; the caller must have set Message::delivered
+ *      while holding the bucket mutex.
+ */
+void
+Receiver::deliverMessage(Receiver::Message* message)
+{
+    bool delivered = false;
+    if (portQueues.openPorts.load(std::memory_order_acquire) > 0) {
+        SpinLock::Lock lock_ports(portQueues.mutex);
+        auto it = portQueues.map.find(message->destinationPort);
+        if (it != portQueues.map.end()) {
+            // Push while holding portQueues.mutex so that closePort() cannot
+            // free the queue mid-delivery.
+            enqueueMessage(it->second, message);
+            delivered = true;
+        }
+    }
+    if (!delivered) {
+        enqueueMessage(&receivedMessages, message);
+    }
+    Perf::counters.received_rx_messages.add(1);
+    if (wakeupCallback) {
+        // Invoked outside any Receiver lock so the callback cannot deadlock
+        // against a thread draining the delivery queues.
+        wakeupCallback();
+    }
+}
+
 /**
  * Inform the Receiver that an Message returned by receiveMessage() is not
  * needed and can be dropped.
@@ -512,12 +1114,12 @@ Receiver::dropMessage(Receiver::Message* message)
                 unschedule(message, lock_scheduler);
             }
         }
-        bucket->messages.remove(&message->bucketNode);
-        {
-            SpinLock::Lock lock_allocator(messageAllocator.mutex);
-            messageAllocator.pool.destroy(message);
-            Perf::counters.destroyed_rx_messages.add(1);
-        }
+        bucket->removeMessage(message, lock_bucket);
+        // Defer the actual reclamation (packet release and destruction) to
+        // reclaimMessages() so that releasing a large message does not stall
+        // this call or the bucket.
+        SpinLock::Lock lock_reclaim(reclaimList.mutex);
+        reclaimList.list.push_back(&message->receivedMessageNode);
     }
 }
 
@@ -576,10 +1178,14 @@ Receiver::checkMessageTimeouts(uint64_t now, MessageBucket* bucket)
                 }
             }
 
-            bucket->messages.remove(&message->bucketNode);
-            {
-                SpinLock::Lock lock_allocator(messageAllocator.mutex);
-                messageAllocator.pool.destroy(message);
+            if (message->delivered) {
+                // The message was streamed to the application early; the
+                // application owns it, so just mark it DROPPED and let the
+                // application release it.
+                message->state.store(Message::State::DROPPED);
+            } else {
+                bucket->removeMessage(message, lock_bucket);
+                messageAllocator.destroy(message);
             }
         } else {
             // Message timed out but we already made it available to the
@@ -648,69 +1254,105 @@ Receiver::checkResendTimeouts(uint64_t now, MessageBucket* bucket)
             }
         }
 
+        // Collect the missing packets into as few RESENDs as possible; each
+        // RESEND carries a bitmap identifying the missing packets within a
+        // window of up to 8 * RESEND_MASK_BYTES packets so that packets which
+        // were merely reordered are not retransmitted.
+        //
+        // The RESEND also includes the current granted priority so that it
+        // can act as a GRANT in case a GRANT was lost.  If this message
+        // hasn't been scheduled (i.e. no grants have been sent) then the
+        // priority will hold the default value; this is ok since the Sender
+        // will ignore the priority field for resends of purely unscheduled
+        // packets (see Sender::handleResendPacket()).
+        const int MASK_PACKETS =
+            8 * Protocol::Packet::ResendHeader::RESEND_MASK_BYTES;
+        uint8_t mask[Protocol::Packet::ResendHeader::RESEND_MASK_BYTES] = {};
         for (int i = 0; i < grantIndexLimit; ++i) {
-            if (message->getPacket(i) == nullptr) {
-                // Unreceived packet
-                if (num == 0) {
-                    // First unreceived packet
-                    index = i;
-                }
-                ++num;
-            } else {
+            if (message->getPacket(i) != nullptr) {
                 // Received packet
-                if (num != 0) {
-                    // Send out the range of packets found so far.
-                    //
-                    // The RESEND also includes the current granted priority
-                    // so that it can act as a GRANT in case a GRANT was
-                    // lost.  If this message hasn't been scheduled (i.e. no
-                    // grants have been sent) then the priority will hold
-                    // the default value; this is ok since the Sender will
-                    // ignore the priority field for resends of purely
-                    // unscheduled packets (see
-                    // Sender::handleResendPacket()).
-                    SpinLock::Lock lock_scheduler(schedulerMutex);
-                    Perf::counters.tx_resend_pkts.add(1);
-                    ControlPacket::send<Protocol::Packet::ResendHeader>(
-                        message->driver, message->source.ip, message->id,
-                        Util::downCast<uint16_t>(index),
-                        Util::downCast<uint16_t>(num),
-                        message->scheduledMessageInfo.priority);
-                    num = 0;
+                continue;
+            }
+            // Unreceived packet
+            if (num != 0 && i - index >= MASK_PACKETS) {
+                // The current window is full; send it out.
+                SpinLock::Lock lock_scheduler(schedulerMutex);
+                Perf::counters.tx_resend_pkts.add(1);
+                if (Perf::perPeerStatsEnabled()) {
+                    Perf::getPeerCounters(message->source.ip)
+                        ->tx_resend_pkts.add(1);
                 }
+                ControlPacket::send<Protocol::Packet::ResendHeader>(
+                    message->driver, message->source.ip, message->id,
+                    Util::downCast<uint16_t>(index),
+                    Util::downCast<uint16_t>(num),
+                    message->scheduledMessageInfo.priority, mask);
+                num = 0;
+                std::memset(mask, 0, sizeof(mask));
+            }
+            if (num == 0) {
+                // First unreceived packet of this window.
+                index = i;
             }
+            int offset = i - index;
+            mask[offset >> 3] = static_cast<uint8_t>(
+                mask[offset >> 3] | (1u << (offset & 7)));
+            num = offset + 1;
         }
         if (num != 0) {
-            // Send out the last range of packets found.
+            // Send out the last window of missing packets.
             SpinLock::Lock lock_scheduler(schedulerMutex);
             Perf::counters.tx_resend_pkts.add(1);
+            if (Perf::perPeerStatsEnabled()) {
+                Perf::getPeerCounters(message->source.ip)
+                    ->tx_resend_pkts.add(1);
+            }
             ControlPacket::send<Protocol::Packet::ResendHeader>(
                 message->driver, message->source.ip, message->id,
                 Util::downCast<uint16_t>(index), Util::downCast<uint16_t>(num),
-                message->scheduledMessageInfo.priority);
+                message->scheduledMessageInfo.priority, mask);
         }
     }
 }
 
 /**
  * Send GRANTs to incoming Message according to the Receiver's policy.
+ *
+ * @return
+ *      Number of GRANT packets issued during this call.
  */
-void
+uint32_t
 Receiver::trySendGrants()
 {
     Perf::Timer timer;
 
     // Skip scheduling if another poller is already working on it.
     if (granting.test_and_set()) {
-        return;
+        return 0;
+    }
+
+    // Fast path out when nothing in the schedule changed since the last
+    // completed grant round; during steady-state bulk receive most polls
+    // fall out here without even taking the schedulerMutex.
+    if (schedulerGeneration.load(std::memory_order_acquire) ==
+        grantedGeneration) {
+        granting.clear();
+        return 0;
     }
 
     SpinLock::Lock lock(schedulerMutex);
     if (scheduledPeers.empty()) {
+        grantedGeneration = schedulerGeneration.load(std::memory_order_relaxed);
         granting.clear();
-        return;
+        return 0;
     }
 
+    TIME_TRACE("Receiver::trySendGrants: start; scheduled peers",
+               scheduledPeers.size());
+
+    // Batch the GRANTs sent to the scheduled peers into one TX burst.
+    ControlPacket::Corked corked(driver);
+
     /* The overall goal is to grant up to policy.degreeOvercommitment number of
      * scheduled messages simultaneously.  Each of these messages should always
      * have at least policy.minScheduledBytes number of bytes granted.  Ideally,
@@ -729,11 +1371,23 @@ Receiver::trySendGrants()
         std::max(0, (policy.maxScheduledPriority + 1) -
                         Util::downCast<int>(scheduledPeers.size()));
 
-    auto it = scheduledPeers.begin();
+    // Pop the highest priority peers off the schedule one at a time; any
+    // peer that still has scheduled messages after the grant round is
+    // reinserted below.  The degree of overcommitment is derived from the
+    // (small) number of network priority levels so this bound is generous.
+    const int MAX_OVERCOMMITMENT = 64;
+    Peer* visitedPeers[MAX_OVERCOMMITMENT];
+    int numVisitedPeers = 0;
+    uint32_t grantsSent = 0;
+    bool coordinatorBlocked = false;
+    int maxSlots = std::min(policy.degreeOvercommitment, MAX_OVERCOMMITMENT);
     int slot = 0;
-    while (it != scheduledPeers.end() && slot < policy.degreeOvercommitment) {
-        assert(!it->scheduledMessages.empty());
-        Message* message = &it->scheduledMessages.front();
+    while (!scheduledPeers.empty() && slot < maxSlots) {
+        Peer* peer = &scheduledPeers.top();
+        scheduledPeers.pop();
+        visitedPeers[numVisitedPeers++] = peer;
+        assert(!peer->scheduledMessages.empty());
+        Message* message = &peer->scheduledMessages.top();
         ScheduledMessageInfo* info = &message->scheduledMessageInfo;
         // Access message const variables without message mutex.
         const Protocol::MessageId id = message->id;
@@ -744,34 +1398,83 @@ Receiver::trySendGrants()
             std::max(0, policy.maxScheduledPriority - slot - unusedPriorities);
 
         // Send a GRANT if there are too few bytes granted and unreceived.
+        // Clean peers are skipped: they received no new data since their
+        // last visit so the evaluation could not have a different outcome.
         int receivedBytes = info->messageLength - info->bytesRemaining;
-        if (info->bytesGranted - receivedBytes < policy.minScheduledBytes) {
+        if (peer->dirty &&
+            info->bytesGranted - receivedBytes < policy.minScheduledBytes) {
             // Calculate new grant limit
             int newGrantLimit = std::min(
                 receivedBytes + policy.maxScheduledBytes, info->messageLength);
             assert(newGrantLimit >= info->bytesGranted);
-            info->bytesGranted = newGrantLimit;
-            Perf::counters.tx_grant_pkts.add(1);
-            ControlPacket::send<Protocol::Packet::GrantHeader>(
-                driver, sourceIp, id,
-                Util::downCast<uint32_t>(info->bytesGranted), info->priority);
-            Perf::counters.active_cycles.add(timer.split());
+            // Quantize: defer the GRANT until it would advance the limit by
+            // at least grantQuantum bytes, so a large inbound transfer does
+            // not emit a GRANT for every packet-sized sliver of progress.
+            // The message's final GRANT is always sent.
+            bool sendGrant = newGrantLimit - info->bytesGranted >=
+                                 grantQuantum.load(std::memory_order_relaxed) ||
+                             newGrantLimit == info->messageLength;
+            if (sendGrant && grantCoordinator != nullptr &&
+                !grantCoordinator->tryAcquire(newGrantLimit -
+                                              info->bytesGranted)) {
+                // The host-wide grant budget is exhausted; defer the grant.
+                coordinatorBlocked = true;
+                sendGrant = false;
+            }
+            if (sendGrant) {
+                info->coordinatedBytes += newGrantLimit - info->bytesGranted;
+                info->bytesGranted = newGrantLimit;
+                ++grantsSent;
+                Perf::counters.tx_grant_pkts.add(1);
+                ControlPacket::send<Protocol::Packet::GrantHeader>(
+                    driver, sourceIp, id,
+                    Util::downCast<uint32_t>(info->bytesGranted),
+                    info->priority);
+                Perf::counters.active_cycles.add(timer.split());
+            }
         }
 
-        // Update the iterator first since calling unschedule() may cause the
-        // iterator to become invalid.
-        ++it;
+        // A peer stays dirty while its top message is still owed a grant
+        // (e.g. one deferred by quantization) so it is re-evaluated in the
+        // next round.
+        peer->dirty =
+            (info->bytesGranted - receivedBytes < policy.minScheduledBytes);
 
         if (info->messageLength <= info->bytesGranted) {
-            // All packets granted, unschedule the message.
-            unschedule(message, lock);
+            // All packets granted, unschedule the message.  The peer is
+            // currently popped out of scheduledPeers, so only the message
+            // needs to be removed.
+            peer->scheduledMessages.remove(&info->scheduledMessageNode);
+            info->peer = nullptr;
+            if (grantCoordinator != nullptr && info->coordinatedBytes > 0) {
+                grantCoordinator->release(info->coordinatedBytes);
+            }
+            info->coordinatedBytes = 0;
             Perf::counters.active_cycles.add(timer.split());
         }
 
         ++slot;
     }
 
+    // Reinsert the peers that still have scheduled messages.
+    for (int i = 0; i < numVisitedPeers; ++i) {
+        if (!visitedPeers[i]->scheduledMessages.empty()) {
+            scheduledPeers.push(&visitedPeers[i]->scheduledPeerNode);
+        }
+    }
+
+    // Snapshot the generation while still holding the schedulerMutex; all
+    // schedule mutations are made under the mutex so this cannot miss a
+    // concurrent update, and it absorbs the bumps this walk made itself.
+    // When a grant was deferred for lack of host-wide budget, skip the
+    // snapshot so the next round retries; the budget is freed by other
+    // transports whose activity this Receiver cannot observe.
+    if (!coordinatorBlocked) {
+        grantedGeneration = schedulerGeneration.load(std::memory_order_relaxed);
+    }
+
     granting.clear();
+    return grantsSent;
 }
 
 /**
@@ -791,27 +1494,21 @@ Receiver::schedule(Receiver::Message* message, const SpinLock::Lock& lock)
     ScheduledMessageInfo* info = &message->scheduledMessageInfo;
     Peer* peer = &peerTable[message->source.ip];
     // Insert the Message
-    peer->scheduledMessages.push_front(&info->scheduledMessageNode);
-    Intrusive::deprioritize<Message>(&peer->scheduledMessages,
-                                     &info->scheduledMessageNode,
-                                     ScheduledMessageInfo::ComparePriority());
+    peer->scheduledMessages.push(&info->scheduledMessageNode);
     info->peer = peer;
     if (!scheduledPeers.contains(&peer->scheduledPeerNode)) {
-        // Must be the only message of this peer; push the peer to the
-        // end of list to be moved later.
+        // Must be the only message of this peer.
         assert(peer->scheduledMessages.size() == 1);
-        scheduledPeers.push_front(&peer->scheduledPeerNode);
-        Intrusive::deprioritize<Peer>(&scheduledPeers, &peer->scheduledPeerNode,
-                                      Peer::ComparePriority());
-    } else if (&info->peer->scheduledMessages.front() == message) {
-        // Update the Peer's position in the queue since the new message is the
-        // peer's first scheduled message.
-        Intrusive::prioritize<Peer>(&scheduledPeers,
-                                    &info->peer->scheduledPeerNode,
-                                    Peer::ComparePriority());
+        scheduledPeers.push(&peer->scheduledPeerNode);
+    } else if (&info->peer->scheduledMessages.top() == message) {
+        // Update the Peer's position in the heap since the new message is the
+        // peer's highest priority scheduled message.
+        scheduledPeers.update(&info->peer->scheduledPeerNode);
     } else {
-        // The peer's first scheduled message did not change.  Nothing to do.
+        // The peer's highest priority message did not change.  Nothing to do.
     }
+    peer->dirty = true;
+    schedulerGeneration.fetch_add(1, std::memory_order_release);
 }
 
 /**
@@ -831,29 +1528,36 @@ Receiver::unschedule(Receiver::Message* message, const SpinLock::Lock& lock)
     ScheduledMessageInfo* info = &message->scheduledMessageInfo;
     assert(info->peer != nullptr);
     Peer* peer = info->peer;
-    Intrusive::List<Peer>::Iterator it =
-        scheduledPeers.get(&peer->scheduledPeerNode);
-    Peer::ComparePriority comp;
+    bool wasTop = (&peer->scheduledMessages.top() == message);
 
     // Remove message.
     assert(peer->scheduledMessages.contains(&info->scheduledMessageNode));
     peer->scheduledMessages.remove(&info->scheduledMessageNode);
     info->peer = nullptr;
 
-    // Cleanup the schedule
-    if (peer->scheduledMessages.empty()) {
+    // Return any host-wide grant budget the message still holds.
+    if (grantCoordinator != nullptr && info->coordinatedBytes > 0) {
+        grantCoordinator->release(info->coordinatedBytes);
+    }
+    info->coordinatedBytes = 0;
+
+    // Cleanup the schedule.  The peer may have been popped out of
+    // scheduledPeers by trySendGrants(); in that case the peer's position
+    // will be fixed up when it is reinserted.
+    if (!scheduledPeers.contains(&peer->scheduledPeerNode)) {
+        // Nothing to do.
+    } else if (peer->scheduledMessages.empty()) {
         // Remove the empty peer.
-        scheduledPeers.remove(it);
-    } else if (std::next(it) == scheduledPeers.end() ||
-               !comp(*std::next(it), *it)) {
-        // Peer already in the right place (peer incremented as part of the
-        // check).  Note that only "next" needs be checked (and not "prev")
-        // since removing a message cannot increase the peer's priority.
+        scheduledPeers.remove(&peer->scheduledPeerNode);
+    } else if (wasTop) {
+        // The peer's priority may have dropped; update its position.
+        scheduledPeers.update(&peer->scheduledPeerNode);
     } else {
-        // Peer needs to be moved.
-        Intrusive::deprioritize<Peer>(&scheduledPeers, &peer->scheduledPeerNode,
-                                      comp);
+        // The peer's highest priority message did not change.  Nothing to do.
     }
+    // The peer's next message (if any) may now be owed grants.
+    peer->dirty = true;
+    schedulerGeneration.fetch_add(1, std::memory_order_release);
 }
 
 /**
@@ -876,18 +1580,28 @@ Receiver::updateSchedule(Receiver::Message* message, const SpinLock::Lock& lock)
     assert(info->peer != nullptr);
     assert(info->peer->scheduledMessages.contains(&info->scheduledMessageNode));
 
-    // Update the message's position within its Peer scheduled message queue.
-    Intrusive::prioritize<Message>(&info->peer->scheduledMessages,
-                                   &info->scheduledMessageNode,
-                                   ScheduledMessageInfo::ComparePriority());
+    // Granted bytes that have now been received are no longer outstanding;
+    // return them to the host-wide grant budget.
+    if (grantCoordinator != nullptr && info->coordinatedBytes > 0) {
+        int receivedBytes = info->messageLength - info->bytesRemaining;
+        int outstanding = std::max(0, info->bytesGranted - receivedBytes);
+        if (outstanding < info->coordinatedBytes) {
+            grantCoordinator->release(info->coordinatedBytes - outstanding);
+            info->coordinatedBytes = outstanding;
+        }
+    }
+
+    // Update the message's position within its Peer scheduled message heap.
+    info->peer->scheduledMessages.update(&info->scheduledMessageNode);
 
-    // Update the Peer's position in the queue if this message is now the first
-    // scheduled message.
-    if (&info->peer->scheduledMessages.front() == message) {
-        Intrusive::prioritize<Peer>(&scheduledPeers,
-                                    &info->peer->scheduledPeerNode,
-                                    Peer::ComparePriority());
+    // Update the Peer's position in the heap if this message is now the
+    // peer's highest priority scheduled message.
+    if (&info->peer->scheduledMessages.top() == message &&
+        scheduledPeers.contains(&info->peer->scheduledPeerNode)) {
+        scheduledPeers.update(&info->peer->scheduledPeerNode);
     }
+    info->peer->dirty = true;
+    schedulerGeneration.fetch_add(1, std::memory_order_release);
 }
 
 }  // namespace Core
@@ -22,17 +22,30 @@
 
 #include <atomic>
 #include <deque>
+#include <functional>
 #include <unordered_map>
+#include <vector>
 
 #include "ControlPacket.h"
+#include "FlatMap.h"
 #include "Intrusive.h"
+#include "MpmcRing.h"
 #include "ObjectPool.h"
+#include "PacketArray.h"
 #include "Policy.h"
 #include "Protocol.h"
 #include "SpinLock.h"
 #include "Timeout.h"
 #include "Util.h"
 
+/// Number of buckets in the Sender's and Receiver's MessageBucketMaps; must
+/// be a power of 2.  Overridable at build time (see the CMake variable of
+/// the same name) so large deployments can size the maps to their number of
+/// in-flight messages.
+#ifndef HOMA_MESSAGE_BUCKET_COUNT
+#define HOMA_MESSAGE_BUCKET_COUNT 256
+#endif
+
 namespace Homa {
 namespace Core {
 
@@ -52,8 +65,97 @@ class Receiver {
     virtual void handleBusyPacket(Driver::Packet* packet);
     virtual void handlePingPacket(Driver::Packet* packet, IpAddress sourceIp);
     virtual Homa::InMessage* receiveMessage();
-    virtual void poll();
+    virtual uint32_t receiveMessages(Homa::InMessage* messages[],
+                                     uint32_t maxMessages);
+    virtual bool claimPiggybackGrant(IpAddress sourceIp,
+                                     Protocol::MessageId* grantId,
+                                     uint32_t* byteLimit, uint8_t* priority);
+    virtual uint32_t poll();
     virtual void checkTimeouts();
+    virtual void reclaimMessages();
+
+    /**
+     * Set the minimum message length, in bytes, at which inbound messages are
+     * delivered to the application as soon as their first packet arrives (see
+     * Homa::Transport::setStreamingThreshold()); 0 disables early delivery.
+     *
+     * Called by the Transport that owns this Receiver.
+     */
+    void setStreamingThreshold(size_t lengthBytes)
+    {
+        streamingThreshold.store(lengthBytes, std::memory_order_relaxed);
+    }
+
+    /**
+     * Set the maximum message length, in bytes, at which inbound messages
+     * have their packet payloads copied into a pooled arena on arrival so
+     * that the driver's packet buffers can be released immediately (see
+     * Homa::Transport::setCompactionThreshold()); 0 disables compaction.
+     *
+     * Called by the Transport that owns this Receiver.
+     */
+    void setCompactionThreshold(size_t lengthBytes)
+    {
+        compactionThreshold.store(lengthBytes, std::memory_order_relaxed);
+    }
+
+    /**
+     * Set the grant quantization unit, in bytes: a GRANT for a message is
+     * only sent once it would advance the message's granted byte limit by at
+     * least this much, except that a message's final GRANT is always sent.
+     * Larger values reduce the control packet rate at some cost in
+     * scheduling precision; values above the scheduled byte window stall
+     * senders.  0 disables quantization.
+     *
+     * Called by the Transport that owns this Receiver.
+     */
+    void setGrantQuantum(size_t bytes)
+    {
+        grantQuantum.store(Util::downCast<int>(bytes),
+                           std::memory_order_relaxed);
+        // A smaller quantum can release previously deferred GRANTs; make
+        // sure the next grant round does not skip the walk.
+        schedulerGeneration.fetch_add(1, std::memory_order_release);
+    }
+
+    /**
+     * Attach this Receiver to a host-wide grant coordinator (see
+     * Homa::GrantCoordinator); nullptr detaches it.
+     *
+     * Called by the Transport that owns this Receiver.
+     */
+    void setGrantCoordinator(GrantCoordinator* coordinator)
+    {
+        SpinLock::Lock lock(schedulerMutex);
+        grantCoordinator = coordinator;
+        // Attaching or detaching changes what the next grant round may send.
+        schedulerGeneration.fetch_add(1, std::memory_order_release);
+    }
+
+    /**
+     * Set the number of outstanding inbound messages beyond which this
+     * Receiver pushes back on new scheduled messages (see
+     * Homa::Transport::setOverloadThreshold()); 0 disables the overload
+     * check.
+     *
+     * Called by the Transport that owns this Receiver.
+     */
+    void setOverloadThreshold(size_t messages)
+    {
+        overloadThreshold.store(messages, std::memory_order_relaxed);
+    }
+
+    /**
+     * Set the callback invoked when an inbound message is handed to a
+     * delivery queue (see Homa::Transport::setWakeupCallback()).
+     *
+     * Called by the Transport that owns this Receiver before packets start
+     * flowing.
+     */
+    void setWakeupCallback(std::function<void()> callback)
+    {
+        wakeupCallback = std::move(callback);
+    }
 
   private:
     // Forward declaration
@@ -88,13 +190,16 @@ class Receiver {
             : messageLength(length)
             , bytesRemaining(length)
             , bytesGranted(0)
+            , coordinatedBytes(0)
             , priority(0)
             , peer(nullptr)
             , scheduledMessageNode(message)
         {}
 
-        /// The number of bytes this Message is expected to contain.
-        const int messageLength;
+        /// The number of bytes this Message is expected to contain; grows
+        /// when the sender of a streamed message announces a larger length
+        /// (see Protocol::Packet::DataHeader::FLAG_STREAM_OPEN).
+        int messageLength;
 
         /// The number of bytes that still needs to be received for this
         /// Message.
@@ -103,6 +208,11 @@ class Receiver {
         /// The cumulative number of bytes that have granted for this Message.
         int bytesGranted;
 
+        /// The number of granted-but-unreceived bytes this Message has
+        /// debited from the host-wide grant coordinator; always 0 when no
+        /// coordinator is attached (see Receiver::setGrantCoordinator()).
+        int coordinatedBytes;
+
         /// The network priority at which the Receiver requests Message be sent.
         int priority;
 
@@ -112,7 +222,34 @@ class Receiver {
 
         /// Intrusive structure used by the Receiver to keep track of when this
         /// message should be issued grants.
-        Intrusive::List<Message>::Node scheduledMessageNode;
+        Intrusive::PairingHeap<Message, ComparePriority>::Node
+            scheduledMessageNode;
+    };
+
+    /**
+     * Pooled storage for a small inbound message whose packet payloads are
+     * copied out of the driver's packet buffers on arrival (see
+     * setCompactionThreshold()).  Holds a copy of each packet's contents
+     * plus a shadow Driver::Packet descriptor pointing at the copy, so the
+     * rest of the Message machinery (data access, resend gap detection) is
+     * oblivious to the compaction.
+     */
+    struct CompactArena {
+        /// Maximum number of packets a compacted message can contain.
+        static const int MAX_PACKETS = 8;
+
+        /// Number of bytes of packet contents the arena can hold across all
+        /// of its packet slots; bounds the message sizes eligible for
+        /// compaction together with MAX_PACKETS.
+        static const size_t DATA_BYTES = 8192;
+
+        /// Shadow packet descriptors handed out in place of the driver's;
+        /// each points into data.
+        Driver::Packet packets[MAX_PACKETS];
+
+        /// Copies of the packets' contents (transport header included),
+        /// placed at fixed strides of the driver's maximum payload size.
+        char data[DATA_BYTES];
     };
 
     /**
@@ -135,25 +272,33 @@ class Receiver {
         explicit Message(Receiver* receiver, Driver* driver,
                          size_t packetHeaderLength, size_t messageLength,
                          Protocol::MessageId id, SocketAddress source,
-                         int numUnscheduledPackets)
+                         int numUnscheduledPackets,
+                         uint16_t destinationPort = 0,
+                         bool streamOpen = false)
             : receiver(receiver)
             , driver(driver)
             , id(id)
             , source(source)
+            , destinationPort(destinationPort)
             , TRANSPORT_HEADER_LENGTH(packetHeaderLength)
             , PACKET_DATA_LENGTH(driver->getMaxPayloadSize() -
                                  TRANSPORT_HEADER_LENGTH)
             , numExpectedPackets((messageLength + PACKET_DATA_LENGTH - 1) /
                                  PACKET_DATA_LENGTH)
             , numUnscheduledPackets(numUnscheduledPackets)
-            , scheduled(numExpectedPackets > numUnscheduledPackets)
+            , scheduled(streamOpen ||
+                        numExpectedPackets > numUnscheduledPackets)
+            , streamOpen(streamOpen)
             , start(0)
             , messageLength(messageLength)
             , numPackets(0)
-            , occupied()
-            // packets is not initialized to reduce the work done during
-            // construction. See Message::occupied.
+            , contiguousPackets(0)
+            , contiguousBytes(0)
+            , packets()
+            , compactArena(nullptr)
             , state(Message::State::IN_PROGRESS)
+            , delivered(false)
+            , arrivalCycles(0)
             , bucketNode(this)
             , receivedMessageNode(this)
             , messageTimeout(this)
@@ -167,7 +312,10 @@ class Receiver {
         virtual void fail() const;
         virtual size_t get(size_t offset, void* destination,
                            size_t count) const;
+        virtual size_t getIov(size_t offset, size_t count, Iovec iov[],
+                              size_t maxIov) const;
         virtual size_t length() const;
+        virtual size_t readableBytes() const;
         virtual void strip(size_t count);
         virtual void release();
 
@@ -181,10 +329,15 @@ class Receiver {
 
       private:
         /// Define the maximum number of packets that a message can hold.
-        static const int MAX_MESSAGE_PACKETS = 1024;
+        /// Packet indexes are carried in 16-bit protocol fields (e.g.
+        /// Protocol::Packet::DataHeader::index), so this is the protocol's
+        /// ceiling; the PacketArray only allocates storage for the packets a
+        /// message actually contains.
+        static const int MAX_MESSAGE_PACKETS = 65536;
 
         Driver::Packet* getPacket(size_t index) const;
         bool setPacket(size_t index, Driver::Packet* packet);
+        bool compactPacket(size_t index, Driver::Packet* packet);
 
         /// The Receiver responsible for this message.
         Receiver* const receiver;
@@ -199,6 +352,11 @@ class Receiver {
         /// Contains source address this message.
         const SocketAddress source;
 
+        /// The local port to which this message was sent (the dport field of
+        /// its DATA packets); used to route the completed message to the
+        /// delivery queue of the socket open on that port, if any.
+        const uint16_t destinationPort;
+
         /// Number of bytes at the beginning of each Packet that should be
         /// reserved for the Homa transport header.
         const int TRANSPORT_HEADER_LENGTH;
@@ -206,16 +364,26 @@ class Receiver {
         /// Number of bytes of data in each full packet.
         const int PACKET_DATA_LENGTH;
 
-        /// Number of packets the message is expected to contain.
-        const int numExpectedPackets;
+        /// Number of packets the message is expected to contain; grows along
+        /// with messageLength while the message's stream is open.
+        int numExpectedPackets;
 
         /// Number of packets that will be sent without GRANTs.
         const int numUnscheduledPackets;
 
         /// True if the Message exceeds the unscheduled byte limit and requires
-        /// GRANTs to be sent.
+        /// GRANTs to be sent.  A streamed message is always scheduled since
+        /// its sender depends on GRANTs to pace the bytes it produces.
         const bool scheduled;
 
+        /// True while the sending application may still append to this
+        /// Message: the message was sent as a stream and its final length has
+        /// not yet been announced (see
+        /// Protocol::Packet::DataHeader::FLAG_STREAM_OPEN).  The message
+        /// cannot complete while its stream is open.  Access to this member
+        /// is protected by the associated MessageBucket::mutex.
+        bool streamOpen;
+
         /// First byte where data is or will go if empty.
         int start;
 
@@ -225,17 +393,42 @@ class Receiver {
         /// Number of packets currently contained in this message.
         int numPackets;
 
-        /// Bit array representing which entires in the _packets_ array are set.
-        /// Used to avoid having to zero out the entire _packets_ array.
-        std::bitset<MAX_MESSAGE_PACKETS> occupied;
+        /// Number of contiguous packets at the beginning of this message that
+        /// have been received; only advanced while holding the bucket mutex.
+        int contiguousPackets;
+
+        /// Number of contiguous bytes at the beginning of this message that
+        /// have been received; mirrors contiguousPackets but can be read by
+        /// the application without holding the bucket mutex.
+        std::atomic<int> contiguousBytes;
 
         /// Collection of Packet objects that make up this context's Message.
         /// These Packets will be released when this context is destroyed.
-        Driver::Packet* packets[MAX_MESSAGE_PACKETS];
+        /// Small messages use only the inline slots; larger messages allocate
+        /// overflow extents on demand.
+        PacketArray<MAX_MESSAGE_PACKETS> packets;
+
+        /// Arena holding this message's packet contents if the message was
+        /// compacted on arrival; nullptr otherwise.  When set, the packets
+        /// array holds the arena's shadow descriptors instead of driver
+        /// packets and the driver's buffers have already been released.
+        CompactArena* compactArena;
 
         /// This message's current state.
         std::atomic<State> state;
 
+        /// True if this message has been made available to the application
+        /// (either completely received or delivered early in streaming mode);
+        /// such messages are owned by the application and must not be
+        /// destroyed by timeout processing.  Access to this member is
+        /// protected by the associated MessageBucket::mutex.
+        bool delivered;
+
+        /// Cycle time at which this message's first DATA packet arrived;
+        /// used to record the delivery latency distribution when the message
+        /// is handed to the application.
+        uint64_t arrivalCycles;
+
         /// Intrusive structure used by the Receiver to hold on to this Message
         /// in one of the Receiver's MessageBuckets.  Access to this structure
         /// is protected by the associated MessageBucket::mutex;
@@ -278,13 +471,18 @@ class Receiver {
          *      Number of cycles of inactivity to wait between requesting
          *      retransmission of un-received parts of a Message.
          *      liveness of a Message.
+         * @param earliestTimeout
+         *      Pointer to the Receiver's cached earliest timeout expiration
+         *      time; shared by the timeout managers of all buckets.
          */
         explicit MessageBucket(uint64_t messageTimeoutCycles,
-                               uint64_t resendIntervalCycles)
-            : mutex()
+                               uint64_t resendIntervalCycles,
+                               std::atomic<uint64_t>* earliestTimeout)
+            : mutex("Receiver::MessageBucket::mutex")
             , messages()
-            , messageTimeouts(messageTimeoutCycles)
-            , resendTimeouts(resendIntervalCycles)
+            , messageIndex()
+            , messageTimeouts(messageTimeoutCycles, earliestTimeout)
+            , resendTimeouts(resendIntervalCycles, earliestTimeout)
         {}
 
         /**
@@ -302,14 +500,40 @@ class Receiver {
                              const SpinLock::Lock& lock)
         {
             (void)lock;
-            Message* message = nullptr;
-            for (auto it = messages.begin(); it != messages.end(); ++it) {
-                if (it->id == msgId) {
-                    message = &(*it);
-                    break;
-                }
-            }
-            return message;
+            Message** message = messageIndex.find(msgId);
+            return message != nullptr ? *message : nullptr;
+        }
+
+        /**
+         * Add a Message to this bucket, making it findable by its MessageId.
+         *
+         * @param message
+         *      Message to be added; must not already be in the bucket.
+         * @param lock
+         *      Reminder to hold the MessageBucket::mutex during this call. (Not
+         *      used)
+         */
+        void addMessage(Message* message, const SpinLock::Lock& lock)
+        {
+            (void)lock;
+            messages.push_back(&message->bucketNode);
+            messageIndex.insert(message->id, message);
+        }
+
+        /**
+         * Remove a Message from this bucket.
+         *
+         * @param message
+         *      Message to be removed.
+         * @param lock
+         *      Reminder to hold the MessageBucket::mutex during this call. (Not
+         *      used)
+         */
+        void removeMessage(Message* message, const SpinLock::Lock& lock)
+        {
+            (void)lock;
+            messageIndex.remove(message->id);
+            messages.remove(&message->bucketNode);
         }
 
         /// Mutex protecting the contents of this bucket.
@@ -318,6 +542,12 @@ class Receiver {
         /// Collection of inbound messages
         Intrusive::List<Message> messages;
 
+        /// Hash index mapping a MessageId to the corresponding Message in
+        /// _messages_; used so inbound packets can resolve their Message in
+        /// O(1) instead of scanning the list.
+        FlatMap<Protocol::MessageId, Message*, Protocol::MessageId::Hasher>
+            messageIndex;
+
         /// Maintains Message objects in increasing order of timeout.
         TimeoutManager<Message> messageTimeouts;
 
@@ -332,9 +562,12 @@ class Receiver {
     struct MessageBucketMap {
         /**
          * The number of buckets in a MessageBuckets in this map.  This must be
-         * a power of 2.
+         * a power of 2.  Large deployments with many in-flight messages can
+         * raise the default (256) at build time by defining
+         * HOMA_MESSAGE_BUCKET_COUNT (see the CMake variable of the same
+         * name).
          */
-        static const int NUM_BUCKETS = 256;
+        static const int NUM_BUCKETS = HOMA_MESSAGE_BUCKET_COUNT;
 
         // Make sure the number of buckets is a power of 2.
         static_assert(Util::isPowerOfTwo(NUM_BUCKETS));
@@ -342,10 +575,7 @@ class Receiver {
         /**
          * Bit mask used to map from a hashed key to the bucket index.
          */
-        static const uint HASH_KEY_MASK = 0xFF;
-
-        // Make sure bit mask correctly matches the number of buckets.
-        static_assert(NUM_BUCKETS == HASH_KEY_MASK + 1);
+        static const uint HASH_KEY_MASK = NUM_BUCKETS - 1;
 
         /**
          * Helper method to create the set of buckets.
@@ -357,14 +587,19 @@ class Receiver {
          *      Number of cycles of inactivity to wait between requesting
          *      retransmission of un-received parts of a Message.
          *      liveness of a Message.
+         * @param earliestTimeout
+         *      Pointer to the Receiver's cached earliest timeout expiration
+         *      time; shared by the timeout managers of all buckets.
          */
         static std::array<MessageBucket*, NUM_BUCKETS> makeBuckets(
-            uint64_t messageTimeoutCycles, uint64_t resendIntervalCycles)
+            uint64_t messageTimeoutCycles, uint64_t resendIntervalCycles,
+            std::atomic<uint64_t>* earliestTimeout)
         {
             std::array<MessageBucket*, NUM_BUCKETS> buckets;
             for (int i = 0; i < NUM_BUCKETS; ++i) {
-                buckets[i] = new MessageBucket(messageTimeoutCycles,
-                                               resendIntervalCycles);
+                buckets[i] = new MessageBucket(
+                    messageTimeoutCycles, resendIntervalCycles,
+                    earliestTimeout);
             }
             return buckets;
         }
@@ -379,10 +614,15 @@ class Receiver {
          *      Number of cycles of inactivity to wait between requesting
          *      retransmission of un-received parts of a Message.
          *      liveness of a Message.
+         * @param earliestTimeout
+         *      Pointer to the Receiver's cached earliest timeout expiration
+         *      time; shared by the timeout managers of all buckets.
          */
         explicit MessageBucketMap(uint64_t messageTimeoutCycles,
-                                  uint64_t resendIntervalCycles)
-            : buckets(makeBuckets(messageTimeoutCycles, resendIntervalCycles))
+                                  uint64_t resendIntervalCycles,
+                                  std::atomic<uint64_t>* earliestTimeout)
+            : buckets(makeBuckets(messageTimeoutCycles, resendIntervalCycles,
+                                  earliestTimeout))
             , hasher()
         {}
 
@@ -423,6 +663,7 @@ class Receiver {
         Peer()
             : scheduledMessages()
             , scheduledPeerNode(this)
+            , dirty(true)
         {}
 
         /**
@@ -443,21 +684,152 @@ class Receiver {
                 assert(!a.scheduledMessages.empty());
                 assert(!b.scheduledMessages.empty());
                 ScheduledMessageInfo::ComparePriority comp;
-                return comp(a.scheduledMessages.front(),
-                            b.scheduledMessages.front());
+                return comp(a.scheduledMessages.top(),
+                            b.scheduledMessages.top());
             }
         };
 
-        /// Contains all the scheduled messages coming from a single transport.
-        Intrusive::List<Message> scheduledMessages;
+        /// Contains all the scheduled messages coming from a single transport,
+        /// prioritized by fewest bytesRemaining (SRPT).
+        Intrusive::PairingHeap<Message, ScheduledMessageInfo::ComparePriority>
+            scheduledMessages;
         /// Intrusive structure to track all Peers with scheduled messages.
-        Intrusive::List<Peer>::Node scheduledPeerNode;
+        Intrusive::PairingHeap<Peer, ComparePriority>::Node scheduledPeerNode;
+        /// True if the peer's grant state may have changed since its last
+        /// visit in trySendGrants(): a message was (un)scheduled or new data
+        /// arrived.  Clean peers skip the grant evaluation.  Access guarded
+        /// by the schedulerMutex.
+        bool dirty;
+    };
+
+    /**
+     * Maps from the IpAddress of a peer transport to the Peer object holding
+     * its inbound scheduled messages.
+     *
+     * Probed under the schedulerMutex on every scheduled DATA packet
+     * arrival; backed by an open-addressing FlatMap so the probe walks a
+     * flat array of inline keys instead of chasing a node-based map's
+     * bucket chains.  The Peer objects themselves are pool-allocated rather
+     * than stored inline in the table because they must be address-stable:
+     * the scheduledPeers heap and each message's ScheduledMessageInfo point
+     * into them, and the table moves its slots when it grows.
+     */
+    struct PeerTable {
+        /**
+         * PeerTable constructor.
+         */
+        PeerTable()
+            : map()
+            , pool()
+            , peers()
+        {}
+
+        /**
+         * PeerTable destructor.
+         */
+        ~PeerTable()
+        {
+            clear();
+        }
+
+        /**
+         * Return the Peer for the given peer transport address, creating it
+         * if the address has no Peer yet.
+         */
+        Peer& operator[](const IpAddress& ip)
+        {
+            Peer** entry = map.find(ip);
+            if (entry != nullptr) {
+                return **entry;
+            }
+            Peer* peer = pool.construct();
+            map.insert(ip, peer);
+            peers.push_back(peer);
+            return *peer;
+        }
+
+        /**
+         * Return the Peer for the given peer transport address, or nullptr
+         * if the address has no Peer.
+         */
+        Peer* find(const IpAddress& ip)
+        {
+            Peer** entry = map.find(ip);
+            return entry != nullptr ? *entry : nullptr;
+        }
+
+        /**
+         * Return the Peer for the given peer transport address, which must
+         * exist.
+         */
+        Peer& at(const IpAddress& ip)
+        {
+            Peer** entry = map.find(ip);
+            assert(entry != nullptr);
+            return **entry;
+        }
+
+        /**
+         * Destroy all Peers and empty the table.
+         */
+        void clear()
+        {
+            for (Peer* peer : peers) {
+                pool.destroy(peer);
+            }
+            peers.clear();
+            map.clear();
+        }
+
+        /// Maps a peer's address to its pool-allocated Peer.
+        FlatMap<IpAddress, Peer*, IpAddress::Hasher> map;
+
+        /// Allocates and caches Peer objects.
+        ObjectPool<Peer> pool;
+
+        /// All live Peers; used by clear() to destroy them, since the map
+        /// itself cannot be iterated.
+        std::vector<Peer*> peers;
+    };
+
+    /**
+     * Holds completely received Message objects until the application asks
+     * for them.  The Receiver has one default queue for messages not claimed
+     * by any socket plus one queue per open port (see openPort()).
+     */
+    struct DeliveryQueue {
+        /**
+         * DeliveryQueue constructor.
+         */
+        DeliveryQueue()
+            : ring()
+            , mutex()
+            , overflow()
+            , overflowCount(0)
+        {}
+
+        /// Holds the delivery queue in the common case; pushed and popped
+        /// without locks.
+        MpmcRing<Message*, 4096> ring;
+        /// Protects DeliveryQueue::overflow.
+        SpinLock mutex;
+        /// Holds completed messages that could not be added to the ring
+        /// because it was full; drained after the ring.
+        Intrusive::List<Message> overflow;
+        /// The number of messages in DeliveryQueue::overflow; used to skip
+        /// taking the mutex when the overflow list is empty.
+        std::atomic<int> overflowCount;
     };
 
+    DeliveryQueue* openPort(uint16_t port);
+    void closePort(uint16_t port);
+    Homa::InMessage* receiveMessage(DeliveryQueue* queue);
+    void enqueueMessage(DeliveryQueue* queue, Message* message);
+    void deliverMessage(Message* message);
     void dropMessage(Receiver::Message* message);
     void checkMessageTimeouts(uint64_t now, MessageBucket* bucket);
     void checkResendTimeouts(uint64_t now, MessageBucket* bucket);
-    void trySendGrants();
+    uint32_t trySendGrants();
     void schedule(Message* message, const SpinLock::Lock& lock);
     void unschedule(Message* message, const SpinLock::Lock& lock);
     void updateSchedule(Message* message, const SpinLock::Lock& lock);
@@ -469,6 +841,11 @@ class Receiver {
     /// Provider of network packet priority and grant policy decisions.
     Policy::Manager* const policyManager;
 
+    /// Cached lower bound on the earliest expiration time of any timeout in
+    /// any bucket; lowered by TimeoutManager::setTimeout().  Lets
+    /// checkTimeouts() return in O(1) when no timeout is near.
+    std::atomic<uint64_t> earliestTimeout;
+
     /// Tracks the set of inbound messages being received by this Receiver.
     MessageBucketMap messageBuckets;
 
@@ -478,38 +855,115 @@ class Receiver {
 
     /// Collection of all peers; used for fast access.  Access is protected by
     /// the schedulerMutex.
-    std::unordered_map<IpAddress, Peer, IpAddress::Hasher> peerTable;
+    PeerTable peerTable;
+
+    /// Peers with inbound messages that require grants to complete,
+    /// prioritized by each peer's highest priority message.  Access is
+    /// protected by the schedulerMutex.
+    Intrusive::PairingHeap<Peer, Peer::ComparePriority> scheduledPeers;
 
-    /// List of peers with inbound messages that require grants to complete.
-    /// Access is protected by the schedulerMutex.
-    Intrusive::List<Peer> scheduledPeers;
+    /// Completely received Message objects waiting to be delivered to the
+    /// application; the default destination for messages whose port has no
+    /// socket open (see receiveMessage()).
+    DeliveryQueue receivedMessages;
 
-    /// Message objects to be processed by the transport.
+    /// Per-port delivery queues for the ports with a socket open (see
+    /// openPort()).  Each queue is allocated by openPort() and freed by
+    /// closePort().
     struct {
-        /// Protects the receivedMessage.queue
+        /// Protects portQueues.map.  Also held while pushing a message onto a
+        /// per-port queue so that closePort() cannot free the queue
+        /// mid-delivery.
         SpinLock mutex;
-        /// List of completely received messages.
-        Intrusive::List<Message> queue;
-    } receivedMessages;
+        /// Maps an open port number to its delivery queue.  Entries are only
+        /// added and removed while holding portQueues.mutex.
+        std::unordered_map<uint16_t, DeliveryQueue*> map;
+        /// The number of open ports; used by deliverMessage() to skip taking
+        /// the mutex when no socket is open.
+        std::atomic<int> openPorts;
+    } portQueues;
+
+    /// Minimum message length, in bytes, for streaming (early) delivery of
+    /// inbound messages; 0 disables early delivery.
+    std::atomic<size_t> streamingThreshold;
+
+    /// Maximum message length, in bytes, for compact-on-arrival storage of
+    /// inbound messages; 0 disables compaction (see
+    /// setCompactionThreshold()).
+    std::atomic<size_t> compactionThreshold;
+
+    /// Invoked, outside any Receiver lock, when a message is handed to a
+    /// delivery queue; empty if no callback is registered.  Set once by the
+    /// owning Transport before packets start flowing (see
+    /// setWakeupCallback()).
+    std::function<void()> wakeupCallback;
+
+    /// Default grant quantization unit, in bytes; a few full packets on a
+    /// typical MTU (see setGrantQuantum()).
+    static const int DEFAULT_GRANT_QUANTUM = 4096;
+
+    /// Grant quantization unit, in bytes; see setGrantQuantum().
+    std::atomic<int> grantQuantum;
+
+    /// Host-wide coordinator from which additional grant bytes are acquired
+    /// before a GRANT is sent; nullptr disables host-wide coordination.
+    /// Guarded by the schedulerMutex (see setGrantCoordinator()).
+    GrantCoordinator* grantCoordinator;
+
+    /// Default overload threshold, in outstanding inbound messages; far
+    /// beyond any healthy backlog, so pushback only starts when the
+    /// application has clearly stopped keeping up (see
+    /// setOverloadThreshold()).
+    static const size_t DEFAULT_OVERLOAD_THRESHOLD = 8192;
+
+    /// Number of outstanding inbound messages beyond which new scheduled
+    /// messages are pushed back; 0 disables the overload check (see
+    /// setOverloadThreshold()).
+    std::atomic<size_t> overloadThreshold;
+
+    /// Incremented whenever the scheduler state changes: a message is
+    /// (un)scheduled, new data arrives for a scheduled message, or the grant
+    /// quantum changes.  Compared against grantedGeneration so that
+    /// trySendGrants() can skip the grant walk entirely when nothing changed
+    /// since the last round.
+    std::atomic<uint64_t> schedulerGeneration;
+
+    /// The value of schedulerGeneration when the last grant round completed.
+    /// Only accessed by the thread holding the granting flag.
+    uint64_t grantedGeneration;
 
     /// True if the Receiver is executing trySendGrants(); false, otherwise.
     /// Used to prevent concurrent calls to trySendGrants() from blocking on
     /// each other.
     std::atomic_flag granting = ATOMIC_FLAG_INIT;
 
-    /// The index of the next bucket in the messageBuckets::buckets array to
-    /// process in the poll loop. The index is held in the lower order bits of
-    /// this variable; the higher order bits should be masked off using the
-    /// MessageBucketMap::HASH_KEY_MASK bit mask.
-    std::atomic<uint> nextBucketIndex;
+    /// Used to allocate Message objects; thread-safe with per-thread magazine
+    /// caches so allocation does not serialize all app threads on one lock.
+    MagazineObjectPool<Message> messageAllocator;
+
+    /// Used to allocate CompactArena objects for compact-on-arrival storage
+    /// of small inbound messages (see setCompactionThreshold()).
+    MagazineObjectPool<CompactArena> arenaAllocator;
 
-    /// Used to allocate Message objects.
+    /// Messages that have been removed from all tracking structures but whose
+    /// packets and memory have not yet been returned.  Reclaimed in bounded
+    /// batches by reclaimMessages() so that releasing a large message never
+    /// stalls a single poll iteration.
     struct {
-        /// Protects the messageAllocator.pool
+        /// Protects access to reclaimList.list.
         SpinLock mutex;
-        /// Pool from which Message objects can be allocated.
-        ObjectPool<Message> pool;
-    } messageAllocator;
+        /// The messages awaiting reclamation, linked by their
+        /// receivedMessageNode.
+        Intrusive::List<Message> list;
+    } reclaimList;
+
+    /// TransportImpl's pipelined mode drives trySendGrants() directly from a
+    /// dedicated stage thread.
+    friend class TransportImpl;
+
+    /// SocketImpl holds the delivery queue of its port and drains it through
+    /// receiveMessage(DeliveryQueue*).
+    friend class SocketImpl;
 };
 
 }  // namespace Core
@@ -17,6 +17,7 @@
 #include <Homa/Debug.h>
 #include <gtest/gtest.h>
 
+#include <cstdint>
 #include <mutex>
 
 #include "Mock/MockDriver.h"
@@ -112,6 +113,7 @@ TEST_F(ReceiverTest, handleDataPacket)
     header->totalLength = totalMessageLength;
     header->policyVersion = policyVersion;
     header->unscheduledIndexLimit = 1;
+    header->common.prefix.dport = htobe16(60001);
     IpAddress sourceIp{22};
 
     // -------------------------------------------------------------------------
@@ -135,6 +137,7 @@ TEST_F(ReceiverTest, handleDataPacket)
     }
     ASSERT_NE(nullptr, message);
     EXPECT_EQ(id, message->id);
+    EXPECT_EQ(60001, message->destinationPort);
     EXPECT_EQ(totalMessageLength, message->messageLength);
     EXPECT_EQ(4U, message->numExpectedPackets);
     EXPECT_EQ(Receiver::Message::State::IN_PROGRESS, message->state);
@@ -205,7 +208,9 @@ TEST_F(ReceiverTest, handleDataPacket)
     EXPECT_EQ(4U, message->numPackets);
     EXPECT_EQ(0U, info->bytesRemaining);
     EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
-    EXPECT_EQ(message, &receiver->receivedMessages.queue.back());
+    Receiver::Message* delivered = nullptr;
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPop(&delivered));
+    EXPECT_EQ(message, delivered);
     Mock::VerifyAndClearExpectations(&mockDriver);
 
     // -------------------------------------------------------------------------
@@ -220,13 +225,379 @@ TEST_F(ReceiverTest, handleDataPacket)
     Mock::VerifyAndClearExpectations(&mockDriver);
 }
 
+TEST_F(ReceiverTest, handleDataPacket_singlePacket)
+{
+    const Protocol::MessageId id(42, 33);
+    const uint32_t messageLength = 420;
+    const uint8_t policyVersion = 1;
+    const uint16_t HEADER_SIZE = sizeof(Protocol::Packet::DataHeaderSingle);
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+
+    Protocol::Packet::DataHeaderSingle* header =
+        static_cast<Protocol::Packet::DataHeaderSingle*>(mockPacket.payload);
+    header->common.opcode = Protocol::Packet::DATA_SINGLE;
+    header->common.messageId = id;
+    header->common.prefix.sport = htobe16(60001);
+    header->policyVersion = policyVersion;
+    mockPacket.length = HEADER_SIZE + messageLength;
+    IpAddress sourceIp{22};
+
+    EXPECT_CALL(mockPolicyManager,
+                signalNewMessage(Eq(sourceIp), Eq(policyVersion),
+                                 Eq(messageLength)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(0);
+
+    // TEST CALL
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+    // ---------
+
+    Receiver::Message* message = nullptr;
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        message = bucket->findMessage(id, lock_bucket);
+    }
+    ASSERT_NE(nullptr, message);
+    EXPECT_EQ(id, message->id);
+    EXPECT_EQ(messageLength, message->messageLength);
+    EXPECT_EQ(1U, message->numExpectedPackets);
+    EXPECT_FALSE(message->scheduled);
+    EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
+    Receiver::Message* delivered = nullptr;
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPop(&delivered));
+    EXPECT_EQ(message, delivered);
+}
+
+TEST_F(ReceiverTest, handleDataPacket_streaming)
+{
+    const Protocol::MessageId id(42, 33);
+    const uint16_t HEADER_SIZE = sizeof(Protocol::Packet::DataHeader);
+    const uint32_t PACKET_DATA_LENGTH =
+        mockDriver.getMaxPayloadSize() - HEADER_SIZE;
+    // Three full packets plus a 500 byte tail in packet[3].
+    const uint32_t totalMessageLength = 3 * PACKET_DATA_LENGTH + 500;
+
+    Receiver::Message* message = nullptr;
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.opcode = Protocol::Packet::DATA;
+    header->common.messageId = id;
+    header->totalLength = totalMessageLength;
+    header->policyVersion = 1;
+    header->unscheduledIndexLimit = 1;
+    IpAddress sourceIp{22};
+
+    // Receive packet[1] with the threshold above the message length; the
+    // message should not be delivered early.
+    receiver->setStreamingThreshold(totalMessageLength + 1);
+    header->index = 1;
+    mockPacket.length = HEADER_SIZE + PACKET_DATA_LENGTH;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        message = bucket->findMessage(id, lock_bucket);
+    }
+    ASSERT_NE(nullptr, message);
+    EXPECT_FALSE(message->delivered);
+    EXPECT_EQ(0U, message->readableBytes());
+    Receiver::Message* delivered = nullptr;
+    EXPECT_FALSE(receiver->receivedMessages.ring.tryPop(&delivered));
+
+    // Receive packet[0] with the threshold lowered; the message should be
+    // delivered while still IN_PROGRESS, with the readable watermark covering
+    // the two contiguous packets.
+    receiver->setStreamingThreshold(PACKET_DATA_LENGTH);
+    header->index = 0;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    EXPECT_TRUE(message->delivered);
+    EXPECT_EQ(Receiver::Message::State::IN_PROGRESS, message->state);
+    EXPECT_EQ(2 * PACKET_DATA_LENGTH, message->readableBytes());
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPop(&delivered));
+    EXPECT_EQ(message, delivered);
+
+    // Receive packet[3]; not contiguous with the front, so the watermark
+    // should not advance.
+    header->index = 3;
+    mockPacket.length = HEADER_SIZE + 500;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    EXPECT_EQ(2 * PACKET_DATA_LENGTH, message->readableBytes());
+    EXPECT_FALSE(receiver->receivedMessages.ring.tryPop(&delivered));
+
+    // Receive packet[2]. Finished; the message must not be delivered twice.
+    header->index = 2;
+    mockPacket.length = HEADER_SIZE + PACKET_DATA_LENGTH;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
+    EXPECT_EQ(totalMessageLength, message->readableBytes());
+    EXPECT_FALSE(receiver->receivedMessages.ring.tryPop(&delivered));
+}
+
+TEST_F(ReceiverTest, handleDataPacket_streamOpen)
+{
+    const Protocol::MessageId id(42, 33);
+    const uint16_t HEADER_SIZE = sizeof(Protocol::Packet::DataHeader);
+
+    Receiver::Message* message = nullptr;
+    Receiver::ScheduledMessageInfo* info = nullptr;
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.opcode = Protocol::Packet::DATA;
+    header->common.messageId = id;
+    header->totalLength = 1946;
+    header->policyVersion = 1;
+    header->unscheduledIndexLimit = 2;
+    header->flags = Protocol::Packet::DataHeader::FLAG_STREAM_OPEN;
+    IpAddress sourceIp{22};
+
+    // Receive packet[0]; the stream is open, so the carried totalLength is
+    // only a lower bound and the message must be scheduled.
+    header->index = 0;
+    mockPacket.length = HEADER_SIZE + 973;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        message = bucket->findMessage(id, lock_bucket);
+    }
+    ASSERT_NE(nullptr, message);
+    EXPECT_TRUE(message->streamOpen);
+    ASSERT_TRUE(message->scheduled);
+    EXPECT_EQ(1946, message->messageLength);
+    EXPECT_EQ(2U, message->numExpectedPackets);
+    info = &message->scheduledMessageInfo;
+    EXPECT_NE(nullptr, info->peer);
+    EXPECT_EQ(973U, info->bytesRemaining);
+
+    // Receive packet[1] announcing more data; the message length ratchets up
+    // and the scheduler learns about the new bytes.
+    header->index = 1;
+    header->totalLength = 3420;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    EXPECT_TRUE(message->streamOpen);
+    EXPECT_EQ(3420, message->messageLength);
+    EXPECT_EQ(4U, message->numExpectedPackets);
+    EXPECT_EQ(3420, info->messageLength);
+    EXPECT_EQ(1474U, info->bytesRemaining);
+    EXPECT_EQ(Receiver::Message::State::IN_PROGRESS, message->state);
+
+    // Receive packet[2]; no growth, stream still open.
+    header->index = 2;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    EXPECT_EQ(3U, message->numPackets);
+    EXPECT_EQ(501U, info->bytesRemaining);
+    EXPECT_EQ(Receiver::Message::State::IN_PROGRESS, message->state);
+
+    // Receive the final packet[3] without the stream-open flag; the length is
+    // now final and the message completes.
+    header->index = 3;
+    header->flags = 0;
+    mockPacket.length = HEADER_SIZE + 501;
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    EXPECT_FALSE(message->streamOpen);
+    EXPECT_EQ(4U, message->numPackets);
+    EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
+    Receiver::Message* delivered = nullptr;
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPop(&delivered));
+    EXPECT_EQ(message, delivered);
+}
+
+TEST_F(ReceiverTest, handleDataPacket_streamCloseDuplicate)
+{
+    const Protocol::MessageId id(42, 33);
+    const uint16_t HEADER_SIZE = sizeof(Protocol::Packet::DataHeader);
+
+    Receiver::Message* message = nullptr;
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.opcode = Protocol::Packet::DATA;
+    header->common.messageId = id;
+    header->totalLength = 1946;
+    header->policyVersion = 1;
+    header->unscheduledIndexLimit = 2;
+    header->flags = Protocol::Packet::DataHeader::FLAG_STREAM_OPEN;
+    IpAddress sourceIp{22};
+    mockPacket.length = HEADER_SIZE + 973;
+
+    // Receive both packets while the stream is still open; even though every
+    // expected packet has arrived, the length is not final so the message
+    // cannot complete.
+    header->index = 0;
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+    header->index = 1;
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        message = bucket->findMessage(id, lock_bucket);
+    }
+    ASSERT_NE(nullptr, message);
+    EXPECT_EQ(2U, message->numPackets);
+    EXPECT_TRUE(message->streamOpen);
+    EXPECT_EQ(Receiver::Message::State::IN_PROGRESS, message->state);
+
+    // The sender closed the stream after everything was transmitted, so the
+    // final length arrives on a retransmit of the last packet.  The packet is
+    // a duplicate but it completes the message.
+    header->flags = 0;
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+
+    EXPECT_FALSE(message->streamOpen);
+    EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
+    Receiver::Message* delivered = nullptr;
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPop(&delivered));
+    EXPECT_EQ(message, delivered);
+}
+
+TEST_F(ReceiverTest, handleDataPacket_compacted)
+{
+    const Protocol::MessageId id(42, 33);
+    const uint32_t totalMessageLength = 1500;
+    const uint16_t HEADER_SIZE = sizeof(Protocol::Packet::DataHeader);
+
+    receiver->setCompactionThreshold(4096);
+
+    Receiver::Message* message = nullptr;
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.opcode = Protocol::Packet::DATA;
+    header->common.messageId = id;
+    header->totalLength = totalMessageLength;
+    header->policyVersion = 1;
+    header->unscheduledIndexLimit = 2;
+    header->flags = 0;
+    IpAddress sourceIp{22};
+
+    // -------------------------------------------------------------------------
+    // Receive packet[0]; its contents are copied into an arena and the
+    // driver's buffer is released right away.
+    header->index = 0;
+    mockPacket.length = HEADER_SIZE + 973;
+    std::memset(payload + HEADER_SIZE, 'a', 973);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    // TEST CALL
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+    // ---------
+
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        message = bucket->findMessage(id, lock_bucket);
+    }
+    ASSERT_NE(nullptr, message);
+    ASSERT_NE(nullptr, message->compactArena);
+    EXPECT_EQ(1U, message->numPackets);
+    Driver::Packet* shadow = message->getPacket(0);
+    ASSERT_NE(nullptr, shadow);
+    EXPECT_NE(&mockPacket, shadow);
+    EXPECT_EQ(message->compactArena->data, shadow->payload);
+    EXPECT_EQ(mockPacket.length, shadow->length);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // -------------------------------------------------------------------------
+    // Receive packet[0] again; the duplicate is dropped and released without
+    // touching the arena.
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    // TEST CALL
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+    // ---------
+
+    EXPECT_EQ(1U, message->numPackets);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // -------------------------------------------------------------------------
+    // Receive packet[1]. Finished; the application reads the copied contents.
+    header->index = 1;
+    mockPacket.length = HEADER_SIZE + 527;
+    std::memset(payload + HEADER_SIZE, 'b', 527);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    // TEST CALL
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+    // ---------
+
+    EXPECT_EQ(2U, message->numPackets);
+    EXPECT_EQ(Receiver::Message::State::COMPLETED, message->state);
+    Receiver::Message* delivered = nullptr;
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPop(&delivered));
+    EXPECT_EQ(message, delivered);
+
+    char buf[1500];
+    EXPECT_EQ(1500U, message->get(0, buf, sizeof(buf)));
+    EXPECT_EQ('a', buf[0]);
+    EXPECT_EQ('a', buf[972]);
+    EXPECT_EQ('b', buf[973]);
+    EXPECT_EQ('b', buf[1499]);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // -------------------------------------------------------------------------
+    // A message over the threshold keeps the driver's packet buffers.
+    const Protocol::MessageId bigId(42, 34);
+    header->common.messageId = bigId;
+    header->totalLength = 8000;
+    header->unscheduledIndexLimit = 9;
+    header->index = 0;
+    mockPacket.length = HEADER_SIZE + 973;
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(0);
+
+    // TEST CALL
+    receiver->handleDataPacket(&mockPacket, sourceIp);
+    // ---------
+
+    Receiver::Message* bigMessage = nullptr;
+    Receiver::MessageBucket* bigBucket =
+        receiver->messageBuckets.getBucket(bigId);
+    {
+        SpinLock::Lock lock_bucket(bigBucket->mutex);
+        bigMessage = bigBucket->findMessage(bigId, lock_bucket);
+    }
+    ASSERT_NE(nullptr, bigMessage);
+    EXPECT_EQ(nullptr, bigMessage->compactArena);
+    EXPECT_EQ(&mockPacket, bigMessage->getPacket(0));
+    Mock::VerifyAndClearExpectations(&mockDriver);
+}
+
 TEST_F(ReceiverTest, handleBusyPacket_basic)
 {
     Protocol::MessageId id(42, 32);
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{0, 60001}, 0);
     Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
-    bucket->messages.push_back(&message->bucketNode);
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        bucket->addMessage(message, lock_bucket);
+    }
 
     Protocol::Packet::BusyHeader* busyHeader =
         (Protocol::Packet::BusyHeader*)mockPacket.payload;
@@ -255,11 +626,84 @@ TEST_F(ReceiverTest, handleBusyPacket_unknown)
     receiver->handleBusyPacket(&mockPacket);
 }
 
+TEST_F(ReceiverTest, handleDataPacket_overloadPushback)
+{
+    const Protocol::MessageId id(42, 33);
+    const uint16_t HEADER_SIZE = sizeof(Protocol::Packet::DataHeader);
+    IpAddress sourceIp{22};
+
+    // Hold an outstanding message so the Receiver is at its (lowered)
+    // overload threshold.
+    Receiver::Message* filler = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 20000, Protocol::MessageId(42, 1),
+        SocketAddress{IP(99), 0}, 0);
+    receiver->setOverloadThreshold(1);
+
+    char dataPayload[1028];
+    Homa::Mock::MockDriver::MockPacket dataPacket{dataPayload};
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload);
+    header->common.opcode = Protocol::Packet::DATA;
+    header->common.messageId = id;
+    header->common.prefix.sport = htobe16(0);
+    header->common.prefix.dport = htobe16(60001);
+    header->totalLength = 3500;
+    header->policyVersion = 1;
+    header->unscheduledIndexLimit = 1;
+    header->index = 1;
+    dataPacket.length = HEADER_SIZE + 1000;
+
+    // The first packet of a new scheduled message is dropped and answered
+    // with an empty GRANT.
+    EXPECT_CALL(mockPolicyManager, signalNewMessage(_, _, _)).Times(0);
+    EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), Eq(sourceIp), _))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&dataPacket), Eq(1)))
+        .Times(1);
+
+    // TEST CALL
+    receiver->handleDataPacket(&dataPacket, sourceIp);
+    // ---------
+
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        EXPECT_EQ(nullptr, bucket->findMessage(id, lock_bucket));
+    }
+    Protocol::Packet::GrantHeader* grant =
+        (Protocol::Packet::GrantHeader*)payload;
+    EXPECT_EQ(Protocol::Packet::GRANT, grant->common.opcode);
+    EXPECT_EQ(id, grant->common.messageId);
+    EXPECT_EQ(0U, grant->byteLimit);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Disabling the overload check lets the same packet through.
+    receiver->setOverloadThreshold(0);
+    EXPECT_CALL(mockPolicyManager, signalNewMessage(_, _, _)).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&dataPacket), Eq(1)))
+        .Times(0);
+
+    // TEST CALL
+    receiver->handleDataPacket(&dataPacket, sourceIp);
+    // ---------
+
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        EXPECT_NE(nullptr, bucket->findMessage(id, lock_bucket));
+    }
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    receiver->messageAllocator.destroy(filler);
+}
+
 TEST_F(ReceiverTest, handlePingPacket_basic)
 {
     Protocol::MessageId id(42, 32);
     IpAddress mockAddress{22};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 20000, id, SocketAddress{mockAddress, 0}, 0);
     ASSERT_TRUE(message->scheduled);
     Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
@@ -267,7 +711,10 @@ TEST_F(ReceiverTest, handlePingPacket_basic)
     info->priority = 3;
 
     Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
-    bucket->messages.push_back(&message->bucketNode);
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        bucket->addMessage(message, lock_bucket);
+    }
 
     char pingPayload[1028];
     Homa::Mock::MockDriver::MockPacket pingPacket{pingPayload};
@@ -324,27 +771,288 @@ TEST_F(ReceiverTest, handlePingPacket_unknown)
     EXPECT_EQ(id, header->common.messageId);
 }
 
-TEST_F(ReceiverTest, receiveMessage)
+TEST_F(ReceiverTest, receiveMessage)
+{
+    Receiver::Message* msg0 = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
+        SocketAddress{22, 60001}, 0);
+    Receiver::Message* msg1 = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
+        SocketAddress{22, 60001}, 0);
+
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPush(msg0));
+    receiver->receivedMessages.overflow.push_back(&msg1->receivedMessageNode);
+    receiver->receivedMessages.overflowCount.fetch_add(1);
+
+    // The ring is drained before the overflow list.
+    EXPECT_EQ(msg0, receiver->receiveMessage());
+    EXPECT_EQ(1, receiver->receivedMessages.overflowCount.load());
+
+    EXPECT_EQ(msg1, receiver->receiveMessage());
+    EXPECT_EQ(0, receiver->receivedMessages.overflowCount.load());
+    EXPECT_TRUE(receiver->receivedMessages.overflow.empty());
+
+    EXPECT_EQ(nullptr, receiver->receiveMessage());
+}
+
+TEST_F(ReceiverTest, receiveMessages)
+{
+    Receiver::Message* msg[3];
+    for (int i = 0; i < 3; ++i) {
+        msg[i] = receiver->messageAllocator.construct(
+            receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
+            SocketAddress{22, 60001}, 0);
+    }
+
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPush(msg[0]));
+    EXPECT_TRUE(receiver->receivedMessages.ring.tryPush(msg[1]));
+    receiver->receivedMessages.overflow.push_back(
+        &msg[2]->receivedMessageNode);
+    receiver->receivedMessages.overflowCount.fetch_add(1);
+
+    Homa::InMessage* messages[4];
+
+    EXPECT_EQ(3U, receiver->receiveMessages(messages, 4));
+    EXPECT_EQ(msg[0], messages[0]);
+    EXPECT_EQ(msg[1], messages[1]);
+    EXPECT_EQ(msg[2], messages[2]);
+    EXPECT_EQ(0, receiver->receivedMessages.overflowCount.load());
+    EXPECT_TRUE(receiver->receivedMessages.overflow.empty());
+
+    EXPECT_EQ(0U, receiver->receiveMessages(messages, 4));
+}
+
+TEST_F(ReceiverTest, openPort)
+{
+    Receiver::DeliveryQueue* queue = receiver->openPort(60001);
+    ASSERT_NE(nullptr, queue);
+    EXPECT_EQ(1U, receiver->portQueues.map.count(60001));
+    EXPECT_EQ(queue, receiver->portQueues.map.at(60001));
+    EXPECT_EQ(1, receiver->portQueues.openPorts.load());
+
+    // The port is already open.
+    EXPECT_EQ(nullptr, receiver->openPort(60001));
+    EXPECT_EQ(1, receiver->portQueues.openPorts.load());
+
+    receiver->closePort(60001);
+}
+
+TEST_F(ReceiverTest, closePort)
+{
+    Receiver::Message* msg0 = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
+        SocketAddress{22, 60001}, 0, 60001);
+    Receiver::Message* msg1 = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 1),
+        SocketAddress{22, 60001}, 0, 60001);
+
+    Receiver::DeliveryQueue* queue = receiver->openPort(60001);
+    ASSERT_NE(nullptr, queue);
+    EXPECT_TRUE(queue->ring.tryPush(msg0));
+    queue->overflow.push_back(&msg1->receivedMessageNode);
+    queue->overflowCount.fetch_add(1);
+
+    receiver->closePort(60001);
+
+    EXPECT_EQ(0U, receiver->portQueues.map.count(60001));
+    EXPECT_EQ(0, receiver->portQueues.openPorts.load());
+
+    // Undelivered messages moved to the default queue.
+    EXPECT_EQ(msg0, receiver->receiveMessage());
+    EXPECT_EQ(msg1, receiver->receiveMessage());
+    EXPECT_EQ(nullptr, receiver->receiveMessage());
+}
+
+TEST_F(ReceiverTest, deliverMessage_portQueue)
+{
+    Receiver::Message* msg0 = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
+        SocketAddress{22, 60001}, 0, 60001);
+    Receiver::Message* msg1 = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 1),
+        SocketAddress{22, 60001}, 0, 60002);
+
+    Receiver::DeliveryQueue* queue = receiver->openPort(60001);
+    ASSERT_NE(nullptr, queue);
+
+    // msg0's port is open; routed to the port's queue.
+    receiver->deliverMessage(msg0);
+    EXPECT_EQ(msg0, receiver->receiveMessage(queue));
+    EXPECT_EQ(nullptr, receiver->receiveMessage());
+
+    // msg1's port is not open; routed to the default queue.
+    receiver->deliverMessage(msg1);
+    EXPECT_EQ(nullptr, receiver->receiveMessage(queue));
+    EXPECT_EQ(msg1, receiver->receiveMessage());
+
+    receiver->closePort(60001);
+}
+
+TEST_F(ReceiverTest, deliverMessage_wakeupCallback)
+{
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
+        SocketAddress{22, 60001}, 0, 60001);
+
+    int wakeups = 0;
+    receiver->setWakeupCallback([&wakeups] { ++wakeups; });
+
+    receiver->deliverMessage(message);
+    EXPECT_EQ(1, wakeups);
+    EXPECT_EQ(message, receiver->receiveMessage());
+}
+
+TEST_F(ReceiverTest, claimPiggybackGrant)
+{
+    Protocol::MessageId id = {42, 10};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 10000, id,
+        SocketAddress{IP(100), 60001}, 10);
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->schedule(message, lock_scheduler);
+    }
+    Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+    info->priority = 1;
+    info->bytesGranted = 2000;
+    info->bytesRemaining -= 1000;  // 1000 bytes received.
+
+    Policy::Scheduled policy;
+    policy.maxScheduledPriority = 1;
+    policy.degreeOvercommitment = 2;
+    policy.minScheduledBytes = 5000;
+    policy.maxScheduledBytes = 6000;
+
+    Protocol::MessageId grantId(0, 0);
+    uint32_t byteLimit = 0;
+    uint8_t priority = 0;
+
+    // The peer is owed a grant; the claim should advance the granted limit.
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+
+    EXPECT_TRUE(
+        receiver->claimPiggybackGrant(IP(100), &grantId, &byteLimit,
+                                      &priority));
+
+    EXPECT_EQ(id, grantId);
+    EXPECT_EQ(7000U, byteLimit);
+    EXPECT_EQ(1, priority);
+    EXPECT_EQ(7000, info->bytesGranted);
+    EXPECT_NE(nullptr, info->peer);
+
+    // Enough bytes are now granted; nothing further is owed.
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+
+    EXPECT_FALSE(
+        receiver->claimPiggybackGrant(IP(100), &grantId, &byteLimit,
+                                      &priority));
+
+    EXPECT_EQ(7000, info->bytesGranted);
+
+    // No scheduled messages from this peer.
+    EXPECT_FALSE(
+        receiver->claimPiggybackGrant(IP(200), &grantId, &byteLimit,
+                                      &priority));
+}
+
+TEST_F(ReceiverTest, claimPiggybackGrant_quantized)
+{
+    Protocol::MessageId id = {42, 10};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 10000, id,
+        SocketAddress{IP(100), 60001}, 10);
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->schedule(message, lock_scheduler);
+    }
+    Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+    info->bytesGranted = 6500;
+    info->bytesRemaining -= 2000;  // 2000 bytes received.
+
+    Policy::Scheduled policy;
+    policy.maxScheduledPriority = 1;
+    policy.degreeOvercommitment = 2;
+    policy.minScheduledBytes = 5000;
+    policy.maxScheduledBytes = 6000;
+
+    Protocol::MessageId grantId(0, 0);
+    uint32_t byteLimit = 0;
+    uint8_t priority = 0;
+
+    // The new limit (8000) advances bytesGranted by less than the quantum;
+    // nothing should be piggybacked.
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+
+    EXPECT_FALSE(
+        receiver->claimPiggybackGrant(IP(100), &grantId, &byteLimit,
+                                      &priority));
+
+    EXPECT_EQ(6500, info->bytesGranted);
+
+    // Shrinking the quantum below the advancement releases the grant.
+    receiver->setGrantQuantum(1000);
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+
+    EXPECT_TRUE(
+        receiver->claimPiggybackGrant(IP(100), &grantId, &byteLimit,
+                                      &priority));
+
+    EXPECT_EQ(8000U, byteLimit);
+    EXPECT_EQ(8000, info->bytesGranted);
+}
+
+TEST_F(ReceiverTest, claimPiggybackGrant_fullyGranted)
 {
-    Receiver::Message* msg0 = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
-        SocketAddress{22, 60001}, 0);
-    Receiver::Message* msg1 = receiver->messageAllocator.pool.construct(
-        receiver, &mockDriver, 0, 0, Protocol::MessageId(42, 0),
-        SocketAddress{22, 60001}, 0);
+    Protocol::MessageId id = {42, 10};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 10000, id,
+        SocketAddress{IP(100), 60001}, 10);
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->schedule(message, lock_scheduler);
+    }
+    Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+    info->bytesGranted = 6000;
+    info->bytesRemaining -= 6000;  // 6000 bytes received.
+
+    Policy::Scheduled policy;
+    policy.maxScheduledPriority = 1;
+    policy.degreeOvercommitment = 2;
+    policy.minScheduledBytes = 5000;
+    policy.maxScheduledBytes = 6000;
 
-    receiver->receivedMessages.queue.push_back(&msg0->receivedMessageNode);
-    receiver->receivedMessages.queue.push_back(&msg1->receivedMessageNode);
-    EXPECT_FALSE(receiver->receivedMessages.queue.empty());
+    Protocol::MessageId grantId(0, 0);
+    uint32_t byteLimit = 0;
+    uint8_t priority = 0;
 
-    EXPECT_EQ(msg0, receiver->receiveMessage());
-    EXPECT_FALSE(receiver->receivedMessages.queue.empty());
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
 
-    EXPECT_EQ(msg1, receiver->receiveMessage());
-    EXPECT_TRUE(receiver->receivedMessages.queue.empty());
+    // The grant covers the whole message; it should be unscheduled.
+    EXPECT_TRUE(
+        receiver->claimPiggybackGrant(IP(100), &grantId, &byteLimit,
+                                      &priority));
+
+    EXPECT_EQ(id, grantId);
+    EXPECT_EQ(10000U, byteLimit);
+    EXPECT_EQ(10000, info->bytesGranted);
+    EXPECT_EQ(nullptr, info->peer);
+    EXPECT_TRUE(receiver->scheduledPeers.empty());
+}
 
-    EXPECT_EQ(nullptr, receiver->receiveMessage());
-    EXPECT_TRUE(receiver->receivedMessages.queue.empty());
+TEST_F(ReceiverTest, claimPiggybackGrant_nothingScheduled)
+{
+    Protocol::MessageId grantId(0, 0);
+    uint32_t byteLimit = 0;
+    uint8_t priority = 0;
+
+    EXPECT_FALSE(
+        receiver->claimPiggybackGrant(IP(100), &grantId, &byteLimit,
+                                      &priority));
 }
 
 TEST_F(ReceiverTest, poll)
@@ -356,59 +1064,91 @@ TEST_F(ReceiverTest, poll)
 TEST_F(ReceiverTest, checkTimeouts)
 {
     Receiver::MessageBucket* bucket = receiver->messageBuckets.buckets.at(0);
+    Protocol::MessageId id = {42, 32};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 1000, id, SocketAddress{22, 60001}, 0);
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        bucket->addMessage(message, lock_bucket);
+    }
+    message->state = Receiver::Message::State::COMPLETED;
 
-    EXPECT_EQ(0, receiver->nextBucketIndex.load());
-
+    // No timeout scheduled; fast path out.
+    EXPECT_EQ(UINT64_MAX, receiver->earliestTimeout.load());
     receiver->checkTimeouts();
 
-    EXPECT_EQ(1, receiver->nextBucketIndex.load());
+    // Scheduling a timeout lowers the cached expiration time.
+    bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+    EXPECT_EQ(message->messageTimeout.expirationCycleTime,
+              receiver->earliestTimeout.load());
+
+    // Timeout not yet elapsed; fast path leaves the cached time alone.
+    receiver->checkTimeouts();
+    EXPECT_EQ(&bucket->messageTimeouts.list,
+              message->messageTimeout.node.list);
+    EXPECT_EQ(message->messageTimeout.expirationCycleTime,
+              receiver->earliestTimeout.load());
+
+    // Advance the clock past the timeout; the sweep processes it and resets
+    // the cached expiration time.
+    PerfUtils::Cycles::mockTscValue =
+        message->messageTimeout.expirationCycleTime;
+    receiver->checkTimeouts();
+    EXPECT_EQ(Receiver::Message::State::DROPPED, message->getState());
+    EXPECT_EQ(nullptr, message->messageTimeout.node.list);
+    EXPECT_EQ(UINT64_MAX, receiver->earliestTimeout.load());
+    PerfUtils::Cycles::mockTscValue = 10000;
 }
 
 TEST_F(ReceiverTest, Message_destructor_basic)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
 
     const uint16_t NUM_PKTS = 5;
 
     message->numPackets = NUM_PKTS;
     for (int i = 0; i < NUM_PKTS; ++i) {
-        message->occupied.set(i);
+        message->packets.set(i, reinterpret_cast<Driver::Packet*>(
+                static_cast<uintptr_t>(42 + i)));
     }
 
-    EXPECT_CALL(mockDriver, releasePackets(Eq(message->packets), Eq(NUM_PKTS)))
+    EXPECT_CALL(mockDriver, releasePackets(Eq(message->packets.inlineSlots),
+                                           Eq(NUM_PKTS)))
         .Times(1);
 
-    receiver->messageAllocator.pool.destroy(message);
+    receiver->messageAllocator.destroy(message);
 }
 
 TEST_F(ReceiverTest, Message_destructor_holes)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
 
     const uint16_t NUM_PKTS = 4;
 
     message->numPackets = NUM_PKTS;
-    message->occupied.set(0);
-    message->occupied.set(1);
-    message->occupied.set(3);
-    message->occupied.set(4);
+    message->packets.set(0, (Driver::Packet*)42);
+    message->packets.set(1, (Driver::Packet*)43);
+    message->packets.set(3, (Driver::Packet*)44);
+    message->packets.set(4, (Driver::Packet*)45);
 
-    EXPECT_CALL(mockDriver, releasePackets(Eq(&message->packets[0]), Eq(2)))
+    EXPECT_CALL(mockDriver,
+                releasePackets(Eq(&message->packets.inlineSlots[0]), Eq(2)))
         .Times(1);
-    EXPECT_CALL(mockDriver, releasePackets(Eq(&message->packets[3]), Eq(2)))
+    EXPECT_CALL(mockDriver,
+                releasePackets(Eq(&message->packets.inlineSlots[3]), Eq(2)))
         .Times(1);
 
-    receiver->messageAllocator.pool.destroy(message);
+    receiver->messageAllocator.destroy(message);
 }
 
 TEST_F(ReceiverTest, Message_acknowledge)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
 
     EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
@@ -430,7 +1170,7 @@ TEST_F(ReceiverTest, Message_acknowledge)
 TEST_F(ReceiverTest, Message_dropped)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
 
     message->state = Receiver::Message::State::IN_PROGRESS;
@@ -445,7 +1185,7 @@ TEST_F(ReceiverTest, Message_dropped)
 TEST_F(ReceiverTest, Message_fail)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
 
     EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
@@ -468,7 +1208,7 @@ TEST_F(ReceiverTest, Message_get_basic)
 {
     ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(2048));
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0);
     char buf[4096];
     Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
@@ -495,7 +1235,7 @@ TEST_F(ReceiverTest, Message_get_offsetTooLarge)
 {
     ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(2048));
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0);
     char buf[4096];
     Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
@@ -521,7 +1261,7 @@ TEST_F(ReceiverTest, Message_get_missingPacket)
 
     ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(2048));
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0);
     char buf[4096];
     Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
@@ -550,20 +1290,115 @@ TEST_F(ReceiverTest, Message_get_missingPacket)
     Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
 }
 
+TEST_F(ReceiverTest, Message_getIov_basic)
+{
+    ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(2048));
+    Protocol::MessageId id = {42, 32};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0);
+    char buf[4096];
+    Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
+    Homa::Mock::MockDriver::MockPacket packet1{buf + 2048};
+
+    message->setPacket(0, &packet0);
+    message->setPacket(1, &packet1);
+    packet0.length = 24 + 24 + 2000;
+    packet1.length = 24 + 7;
+    message->start = 24;
+    EXPECT_EQ(24U, message->TRANSPORT_HEADER_LENGTH);
+
+    // Range spans the packet boundary; should be described in place without
+    // copying any bytes.
+    InMessage::Iovec iov[2];
+    size_t numIov = message->getIov(2000 - 7, 20, iov, 2);
+
+    EXPECT_EQ(2U, numIov);
+    EXPECT_EQ(static_cast<const void*>(buf + 24 + 24 + 2000 - 7), iov[0].base);
+    EXPECT_EQ(7U, iov[0].length);
+    EXPECT_EQ(static_cast<const void*>(buf + 2048 + 24), iov[1].base);
+    EXPECT_EQ(7U, iov[1].length);
+
+    // A short iov array truncates the result.
+    numIov = message->getIov(2000 - 7, 20, iov, 1);
+    EXPECT_EQ(1U, numIov);
+
+    // An offset passed the end of the message covers no regions.
+    numIov = message->getIov(4000, 20, iov, 2);
+    EXPECT_EQ(0U, numIov);
+}
+
+TEST_F(ReceiverTest, Message_borrowContiguous)
+{
+    ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(2048));
+    Protocol::MessageId id = {42, 32};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 24, 24 + 2007, id, SocketAddress{22, 60001}, 0);
+    char buf[4096];
+    Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
+    Homa::Mock::MockDriver::MockPacket packet1{buf + 2048};
+
+    message->setPacket(0, &packet0);
+    message->setPacket(1, &packet1);
+    packet0.length = 24 + 24 + 2000;
+    packet1.length = 24 + 7;
+    message->start = 24;
+
+    // Range within a single packet: borrow succeeds.
+    EXPECT_EQ(static_cast<const void*>(buf + 24 + 24),
+              message->borrowContiguous(0, 100));
+
+    // Range spanning two packets: caller must fall back to get()/getIov().
+    EXPECT_EQ(nullptr, message->borrowContiguous(2000 - 7, 14));
+}
+
 TEST_F(ReceiverTest, Message_length)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
     message->messageLength = 200;
     message->start = 20;
     EXPECT_EQ(180U, message->length());
 }
 
+TEST_F(ReceiverTest, Message_readableBytes)
+{
+    const uint16_t HEADER_SIZE = sizeof(Protocol::Packet::DataHeader);
+    const uint32_t PACKET_DATA_LENGTH =
+        mockDriver.getMaxPayloadSize() - HEADER_SIZE;
+    // Two full packets plus a 500 byte tail in packet[2].
+    const int messageLength = 2 * PACKET_DATA_LENGTH + 500;
+    Protocol::MessageId id = {42, 32};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, HEADER_SIZE, messageLength, id,
+        SocketAddress{22, 60001}, 0);
+
+    EXPECT_EQ(0U, message->readableBytes());
+
+    // A packet that is not contiguous with the front does not advance the
+    // watermark.
+    message->setPacket(1, (Driver::Packet*)42);
+    EXPECT_EQ(0U, message->readableBytes());
+
+    message->setPacket(0, (Driver::Packet*)42);
+    EXPECT_EQ(2 * PACKET_DATA_LENGTH, message->readableBytes());
+
+    message->strip(500);
+    EXPECT_EQ(2 * PACKET_DATA_LENGTH - 500, message->readableBytes());
+
+    // The last (partial) packet is bounded by the message length.
+    message->setPacket(2, (Driver::Packet*)42);
+    EXPECT_EQ(2 * PACKET_DATA_LENGTH, message->readableBytes());
+    EXPECT_EQ(message->length(), message->readableBytes());
+
+    message->numPackets = 0;  // Prevent release of the fake packets.
+    receiver->messageAllocator.destroy(message);
+}
+
 TEST_F(ReceiverTest, Message_strip)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
     message->messageLength = 30;
     message->start = 0;
@@ -585,15 +1420,14 @@ TEST_F(ReceiverTest, Message_release)
 TEST_F(ReceiverTest, Message_getPacket)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
 
     Driver::Packet* packet = (Driver::Packet*)42;
-    message->packets[0] = packet;
 
     EXPECT_EQ(nullptr, message->getPacket(0));
 
-    message->occupied.set(0);
+    message->packets.set(0, packet);
 
     EXPECT_EQ(packet, message->getPacket(0));
 }
@@ -601,17 +1435,16 @@ TEST_F(ReceiverTest, Message_getPacket)
 TEST_F(ReceiverTest, Message_setPacket)
 {
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 0, id, SocketAddress{22, 60001}, 0);
     Driver::Packet* packet = (Driver::Packet*)42;
 
-    EXPECT_FALSE(message->occupied.test(0));
+    EXPECT_EQ(nullptr, message->packets.get(0));
     EXPECT_EQ(0U, message->numPackets);
 
     EXPECT_TRUE(message->setPacket(0, packet));
 
-    EXPECT_EQ(packet, message->packets[0]);
-    EXPECT_TRUE(message->occupied.test(0));
+    EXPECT_EQ(packet, message->packets.get(0));
     EXPECT_EQ(1U, message->numPackets);
 
     EXPECT_FALSE(message->setPacket(0, packet));
@@ -622,17 +1455,20 @@ TEST_F(ReceiverTest, MessageBucket_findMessage)
     Receiver::MessageBucket* bucket = receiver->messageBuckets.buckets.at(0);
 
     Protocol::MessageId id0 = {42, 0};
-    Receiver::Message* msg0 = receiver->messageAllocator.pool.construct(
+    Receiver::Message* msg0 = receiver->messageAllocator.construct(
         receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 0, id0,
         SocketAddress{0, 60001}, 0);
     Protocol::MessageId id1 = {42, 1};
-    Receiver::Message* msg1 = receiver->messageAllocator.pool.construct(
+    Receiver::Message* msg1 = receiver->messageAllocator.construct(
         receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 0, id1,
         SocketAddress{0, 60001}, 0);
     Protocol::MessageId id_none = {42, 42};
 
-    bucket->messages.push_back(&msg0->bucketNode);
-    bucket->messages.push_back(&msg1->bucketNode);
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        bucket->addMessage(msg0, lock_bucket);
+        bucket->addMessage(msg1, lock_bucket);
+    }
 
     SpinLock::Lock lock_bucket(bucket->mutex);
     EXPECT_EQ(msg0, bucket->findMessage(msg0->id, lock_bucket));
@@ -655,17 +1491,20 @@ TEST_F(ReceiverTest, dropMessage)
     SpinLock dummyMutex;
     SpinLock::Lock dummy(dummyMutex);
     Protocol::MessageId id = {42, 32};
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, 0, 1000, id, SocketAddress{22, 60001}, 0);
     ASSERT_TRUE(message->scheduled);
     Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
 
-    bucket->messages.push_back(&message->bucketNode);
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        bucket->addMessage(message, lock_bucket);
+    }
     receiver->schedule(message, dummy);
     bucket->messageTimeouts.setTimeout(&message->messageTimeout);
     bucket->resendTimeouts.setTimeout(&message->resendTimeout);
 
-    EXPECT_EQ(1U, receiver->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(1U, receiver->messageAllocator.outstandingObjects);
     EXPECT_EQ(message, bucket->findMessage(id, dummy));
     EXPECT_EQ(&receiver->peerTable[message->source.ip],
               message->scheduledMessageInfo.peer);
@@ -674,7 +1513,13 @@ TEST_F(ReceiverTest, dropMessage)
 
     receiver->dropMessage(message);
 
-    EXPECT_EQ(0U, receiver->messageAllocator.pool.outstandingObjects);
+    // Reclamation is deferred to reclaimMessages().
+    EXPECT_EQ(1U, receiver->messageAllocator.outstandingObjects);
+    EXPECT_FALSE(receiver->reclaimList.list.empty());
+
+    receiver->reclaimMessages();
+
+    EXPECT_EQ(0U, receiver->messageAllocator.outstandingObjects);
     EXPECT_EQ(nullptr, bucket->findMessage(id, dummy));
     EXPECT_EQ(nullptr, message->scheduledMessageInfo.peer);
     EXPECT_TRUE(bucket->messageTimeouts.list.empty());
@@ -689,13 +1534,16 @@ TEST_F(ReceiverTest, checkMessageTimeouts)
     for (uint64_t i = 0; i < 3; ++i) {
         Protocol::MessageId id = {42, 10 + i};
         op[i] = reinterpret_cast<void*>(i);
-        message[i] = receiver->messageAllocator.pool.construct(
+        message[i] = receiver->messageAllocator.construct(
             receiver, &mockDriver, 0, 1000, id, SocketAddress{0, 60001}, 0);
-        bucket->messages.push_back(&message[i]->bucketNode);
+        {
+            SpinLock::Lock lock_bucket(bucket->mutex);
+            bucket->addMessage(message[i], lock_bucket);
+        }
         bucket->messageTimeouts.setTimeout(&message[i]->messageTimeout);
         bucket->resendTimeouts.setTimeout(&message[i]->resendTimeout);
     }
-    ASSERT_EQ(3U, receiver->messageAllocator.pool.outstandingObjects);
+    ASSERT_EQ(3U, receiver->messageAllocator.outstandingObjects);
 
     // Message[0]: Normal timeout: IN_PROGRESS
     message[0]->messageTimeout.expirationCycleTime = 9998;
@@ -730,14 +1578,14 @@ TEST_F(ReceiverTest, checkMessageTimeouts)
     EXPECT_EQ(nullptr, message[0]->resendTimeout.node.list);
     EXPECT_EQ(nullptr, message[0]->scheduledMessageInfo.peer);
     EXPECT_FALSE(bucket->messages.contains(&message[0]->bucketNode));
-    EXPECT_EQ(2U, receiver->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(2U, receiver->messageAllocator.outstandingObjects);
 
     // Message[1]: Normal timeout: COMPLETED
     EXPECT_EQ(nullptr, message[1]->messageTimeout.node.list);
     EXPECT_EQ(nullptr, message[1]->resendTimeout.node.list);
     EXPECT_EQ(Receiver::Message::State::DROPPED, message[1]->getState());
     EXPECT_TRUE(bucket->messages.contains(&message[1]->bucketNode));
-    EXPECT_EQ(2U, receiver->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(2U, receiver->messageAllocator.outstandingObjects);
 
     // Message[2]: No timeout
     EXPECT_EQ(&bucket->messageTimeouts.list,
@@ -745,7 +1593,42 @@ TEST_F(ReceiverTest, checkMessageTimeouts)
     EXPECT_EQ(&bucket->resendTimeouts.list,
               message[2]->resendTimeout.node.list);
     EXPECT_TRUE(bucket->messages.contains(&message[2]->bucketNode));
-    EXPECT_EQ(2U, receiver->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(2U, receiver->messageAllocator.outstandingObjects);
+}
+
+TEST_F(ReceiverTest, checkMessageTimeouts_streamed)
+{
+    Protocol::MessageId id = {42, 10};
+    Receiver::MessageBucket* bucket = receiver->messageBuckets.getBucket(id);
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, 0, 1000, id, SocketAddress{0, 60001}, 0);
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        bucket->addMessage(message, lock_bucket);
+    }
+    bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+    bucket->resendTimeouts.setTimeout(&message->resendTimeout);
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->schedule(message, lock_scheduler);
+    }
+    // Message was streamed to the application before being fully received.
+    message->delivered = true;
+    ASSERT_EQ(Receiver::Message::State::IN_PROGRESS, message->state.load());
+
+    // setTimeout() armed the timeout for "now" + messageTimeoutCycles; run the
+    // check as of that deadline so the timeout elapses through the
+    // TimeoutManager API.
+    receiver->checkMessageTimeouts(10000 + messageTimeoutCycles, bucket);
+
+    // The application owns the message; it must be marked DROPPED but not
+    // destroyed.
+    EXPECT_EQ(nullptr, message->messageTimeout.node.list);
+    EXPECT_EQ(nullptr, message->resendTimeout.node.list);
+    EXPECT_EQ(nullptr, message->scheduledMessageInfo.peer);
+    EXPECT_EQ(Receiver::Message::State::DROPPED, message->getState());
+    EXPECT_TRUE(bucket->messages.contains(&message->bucketNode));
+    EXPECT_EQ(1U, receiver->messageAllocator.outstandingObjects);
 }
 
 TEST_F(ReceiverTest, checkResendTimeouts)
@@ -754,7 +1637,7 @@ TEST_F(ReceiverTest, checkResendTimeouts)
     Receiver::MessageBucket* bucket = receiver->messageBuckets.buckets.at(0);
     for (uint64_t i = 0; i < 3; ++i) {
         Protocol::MessageId id = {42, 10 + i};
-        message[i] = receiver->messageAllocator.pool.construct(
+        message[i] = receiver->messageAllocator.construct(
             receiver, &mockDriver, 0, 10000, id, SocketAddress{22, 60001}, 5);
         bucket->resendTimeouts.setTimeout(&message[i]->resendTimeout);
     }
@@ -792,23 +1675,14 @@ TEST_F(ReceiverTest, checkResendTimeouts)
     EXPECT_EQ(10000U, PerfUtils::Cycles::rdtsc());
 
     char buf1[1024];
-    char buf2[1024];
     Homa::Mock::MockDriver::MockPacket mockResendPacket1{buf1};
-    Homa::Mock::MockDriver::MockPacket mockResendPacket2{buf2};
 
-    EXPECT_CALL(mockDriver, allocPacket())
-        .WillOnce(Return(&mockResendPacket1))
-        .WillOnce(Return(&mockResendPacket2));
+    EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockResendPacket1));
     EXPECT_CALL(mockDriver, sendPacket(Eq(&mockResendPacket1),
                                        Eq(message[0]->source.ip), _))
         .Times(1);
-    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockResendPacket2),
-                                       Eq(message[0]->source.ip), _))
-        .Times(1);
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockResendPacket1), Eq(1)))
         .Times(1);
-    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockResendPacket2), Eq(1)))
-        .Times(1);
 
     // TEST CALL
     receiver->checkResendTimeouts(10000, bucket);
@@ -816,22 +1690,22 @@ TEST_F(ReceiverTest, checkResendTimeouts)
     EXPECT_EQ(message[2]->resendTimeout.expirationCycleTime,
               bucket->resendTimeouts.nextTimeout.load());
 
-    // Message[0]: Normal timeout: resends
+    // Message[0]: Normal timeout: resends.  Both hole ranges ([2,6) and
+    // [8,10)) are covered by a single RESEND whose bitmap marks only the
+    // missing packets.
     EXPECT_EQ(10100, message[0]->resendTimeout.expirationCycleTime);
     Protocol::Packet::ResendHeader* header1 =
         static_cast<Protocol::Packet::ResendHeader*>(mockResendPacket1.payload);
     EXPECT_EQ(Protocol::Packet::RESEND, header1->common.opcode);
     EXPECT_EQ(message[0]->id, header1->common.messageId);
     EXPECT_EQ(2U, header1->index);
-    EXPECT_EQ(4U, header1->num);
+    EXPECT_EQ(8U, header1->num);
+    EXPECT_EQ(0xCF, header1->resendMask[0]);
+    for (uint16_t i = 1;
+         i < Protocol::Packet::ResendHeader::RESEND_MASK_BYTES; ++i) {
+        EXPECT_EQ(0U, header1->resendMask[i]);
+    }
     EXPECT_EQ(sizeof(Protocol::Packet::ResendHeader), mockResendPacket1.length);
-    Protocol::Packet::ResendHeader* header2 =
-        static_cast<Protocol::Packet::ResendHeader*>(mockResendPacket2.payload);
-    EXPECT_EQ(Protocol::Packet::RESEND, header2->common.opcode);
-    EXPECT_EQ(message[0]->id, header2->common.messageId);
-    EXPECT_EQ(8U, header2->index);
-    EXPECT_EQ(2U, header2->num);
-    EXPECT_EQ(sizeof(Protocol::Packet::ResendHeader), mockResendPacket2.length);
 
     // Message[1]: Blocked on grants
     EXPECT_EQ(10100, message[1]->resendTimeout.expirationCycleTime);
@@ -846,7 +1720,7 @@ TEST_F(ReceiverTest, trySendGrants)
     Receiver::ScheduledMessageInfo* info[4];
     for (uint32_t i = 0; i < 4; ++i) {
         Protocol::MessageId id = {42, 10 + i};
-        message[i] = receiver->messageAllocator.pool.construct(
+        message[i] = receiver->messageAllocator.construct(
             receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader),
             10000 * (i + 1), id, SocketAddress{IP(100 + i), 60001},
             10 * (i + 1));
@@ -875,6 +1749,8 @@ TEST_F(ReceiverTest, trySendGrants)
     info[0]->bytesRemaining -= 1000;
     EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
         .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, cork).Times(1);
+    EXPECT_CALL(mockDriver, uncork).Times(1);
     EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
     EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), _, _)).Times(1);
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
@@ -899,6 +1775,10 @@ TEST_F(ReceiverTest, trySendGrants)
     policy.minScheduledBytes = 5000;
     policy.maxScheduledBytes = 10000;
     info[1]->bytesRemaining -= 1000;
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->updateSchedule(message[1], lock_scheduler);
+    }
     EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
         .WillOnce(Return(policy));
     EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
@@ -921,6 +1801,8 @@ TEST_F(ReceiverTest, trySendGrants)
     policy.degreeOvercommitment = 4;
     policy.minScheduledBytes = 5000;
     policy.maxScheduledBytes = 10000;
+    // The policy change alone does not dirty the schedule; force a round.
+    receiver->schedulerGeneration.fetch_add(1);
     EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
         .WillOnce(Return(policy));
     EXPECT_CALL(mockDriver, sendPacket(_, _, _)).Times(0);
@@ -940,6 +1822,7 @@ TEST_F(ReceiverTest, trySendGrants)
     policy.degreeOvercommitment = 6;
     policy.minScheduledBytes = 5000;
     policy.maxScheduledBytes = 10000;
+    receiver->schedulerGeneration.fetch_add(1);
     EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
         .WillOnce(Return(policy));
     EXPECT_CALL(mockDriver, sendPacket(_, _, _)).Times(0);
@@ -953,6 +1836,217 @@ TEST_F(ReceiverTest, trySendGrants)
     Mock::VerifyAndClearExpectations(&mockDriver);
 }
 
+TEST_F(ReceiverTest, trySendGrants_quantized)
+{
+    Protocol::MessageId id = {42, 10};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 10000, id,
+        SocketAddress{IP(100), 60001}, 10);
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->schedule(message, lock_scheduler);
+    }
+    Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+    info->bytesGranted = 5000;
+    info->bytesRemaining -= 1000;  // 1000 bytes received.
+
+    Policy::Scheduled policy;
+    policy.maxScheduledPriority = 0;
+    policy.degreeOvercommitment = 1;
+    policy.minScheduledBytes = 5000;
+    policy.maxScheduledBytes = 5500;
+
+    // The new limit (6500) advances bytesGranted by less than the quantum;
+    // the GRANT should be deferred.
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, sendPacket(_, _, _)).Times(0);
+
+    receiver->trySendGrants();
+
+    EXPECT_EQ(5000, info->bytesGranted);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Shrinking the quantum below the advancement releases the GRANT.
+    receiver->setGrantQuantum(1000);
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    receiver->trySendGrants();
+
+    EXPECT_EQ(6500, info->bytesGranted);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // The final GRANT of a message is sent no matter how small.
+    receiver->setGrantQuantum(1U << 20);
+    info->bytesRemaining -= 4000;  // 5000 bytes received.
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->updateSchedule(message, lock_scheduler);
+    }
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    receiver->trySendGrants();
+
+    EXPECT_EQ(info->messageLength, info->bytesGranted);
+    EXPECT_EQ(nullptr, info->peer);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+}
+
+TEST_F(ReceiverTest, trySendGrants_grantCoordinator)
+{
+    GrantCoordinator coordinator(5000);
+    receiver->setGrantCoordinator(&coordinator);
+    receiver->setGrantQuantum(1000);
+
+    Protocol::MessageId id = {42, 10};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 10000, id,
+        SocketAddress{IP(100), 60001}, 10);
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->schedule(message, lock_scheduler);
+    }
+    Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+
+    Policy::Scheduled policy;
+    policy.maxScheduledPriority = 0;
+    policy.degreeOvercommitment = 1;
+    policy.minScheduledBytes = 5000;
+    policy.maxScheduledBytes = 6000;
+
+    // The first grant is debited from the budget (overshoot is allowed).
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    EXPECT_EQ(1U, receiver->trySendGrants());
+
+    EXPECT_EQ(6000, info->bytesGranted);
+    EXPECT_EQ(6000, info->coordinatedBytes);
+    EXPECT_EQ(6000, coordinator.outstandingBytes.load());
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Receiving granted bytes returns them to the budget.
+    info->bytesRemaining -= 2000;  // 2000 bytes received.
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->updateSchedule(message, lock_scheduler);
+    }
+    EXPECT_EQ(4000, info->coordinatedBytes);
+    EXPECT_EQ(4000, coordinator.outstandingBytes.load());
+
+    // Another transport on the host exhausts the budget; the grant the
+    // message is now owed is deferred.
+    EXPECT_TRUE(coordinator.tryAcquire(900000));
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, sendPacket(_, _, _)).Times(0);
+
+    EXPECT_EQ(0U, receiver->trySendGrants());
+
+    EXPECT_EQ(6000, info->bytesGranted);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Budget freed elsewhere on the host releases the deferred grant even
+    // though nothing changed in the local schedule.
+    coordinator.release(900000);
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    EXPECT_EQ(1U, receiver->trySendGrants());
+
+    EXPECT_EQ(8000, info->bytesGranted);
+    EXPECT_EQ(6000, info->coordinatedBytes);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Unscheduling returns the message's remaining budget.
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->unschedule(message, lock_scheduler);
+    }
+    EXPECT_EQ(0, info->coordinatedBytes);
+    EXPECT_EQ(0, coordinator.outstandingBytes.load());
+}
+
+TEST_F(ReceiverTest, trySendGrants_unchangedSchedule)
+{
+    Protocol::MessageId id = {42, 10};
+    Receiver::Message* message = receiver->messageAllocator.construct(
+        receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 10000, id,
+        SocketAddress{IP(100), 60001}, 10);
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->schedule(message, lock_scheduler);
+    }
+    Receiver::ScheduledMessageInfo* info = &message->scheduledMessageInfo;
+    info->bytesGranted = 5000;
+
+    Policy::Scheduled policy;
+    policy.maxScheduledPriority = 0;
+    policy.degreeOvercommitment = 1;
+    policy.minScheduledBytes = 5000;
+    policy.maxScheduledBytes = 10000;
+
+    // First round does the walk (and grants nothing new).
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, sendPacket(_, _, _)).Times(0);
+
+    receiver->trySendGrants();
+
+    EXPECT_EQ(receiver->schedulerGeneration.load(),
+              receiver->grantedGeneration);
+
+    Mock::VerifyAndClearExpectations(&mockDriver);
+    Mock::VerifyAndClearExpectations(&mockPolicyManager);
+
+    // Nothing changed; the next round skips the walk entirely.
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy()).Times(0);
+    EXPECT_CALL(mockDriver, sendPacket(_, _, _)).Times(0);
+
+    receiver->trySendGrants();
+
+    // New data dirties the schedule and re-enables the walk.
+    info->bytesRemaining -= 1000;
+    {
+        SpinLock::Lock lock_scheduler(receiver->schedulerMutex);
+        receiver->updateSchedule(message, lock_scheduler);
+    }
+    EXPECT_CALL(mockPolicyManager, getScheduledPolicy())
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    receiver->trySendGrants();
+
+    EXPECT_EQ(10000, info->bytesGranted);
+}
+
 TEST_F(ReceiverTest, schedule)
 {
     Receiver::Message* message[4];
@@ -961,7 +2055,7 @@ TEST_F(ReceiverTest, schedule)
     int messageLength[4] = {2000, 3000, 1000, 4000};
     for (uint64_t i = 0; i < 4; ++i) {
         Protocol::MessageId id = {42, 10 + i};
-        message[i] = receiver->messageAllocator.pool.construct(
+        message[i] = receiver->messageAllocator.construct(
             receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader),
             messageLength[i], id, SocketAddress{address[i], 60001}, 0);
         info[i] = &message[i]->scheduledMessageInfo;
@@ -977,8 +2071,9 @@ TEST_F(ReceiverTest, schedule)
     receiver->schedule(message[0], lock);
 
     EXPECT_EQ(&receiver->peerTable.at(IP(22)), info[0]->peer);
-    EXPECT_EQ(message[0], &info[0]->peer->scheduledMessages.front());
-    EXPECT_EQ(info[0]->peer, &receiver->scheduledPeers.front());
+    EXPECT_EQ(message[0], &info[0]->peer->scheduledMessages.top());
+    EXPECT_EQ(info[0]->peer, &receiver->scheduledPeers.top());
+    EXPECT_EQ(1U, receiver->scheduledPeers.size());
 
     //--------------------------------------------------------------------------
     // NEW PEER
@@ -989,8 +2084,9 @@ TEST_F(ReceiverTest, schedule)
     receiver->schedule(message[1], lock);
 
     EXPECT_EQ(&receiver->peerTable.at(IP(33)), info[1]->peer);
-    EXPECT_EQ(message[1], &info[1]->peer->scheduledMessages.front());
-    EXPECT_EQ(info[1]->peer, &receiver->scheduledPeers.back());
+    EXPECT_EQ(message[1], &info[1]->peer->scheduledMessages.top());
+    EXPECT_EQ(info[0]->peer, &receiver->scheduledPeers.top());
+    EXPECT_EQ(2U, receiver->scheduledPeers.size());
 
     //--------------------------------------------------------------------------
     // PEER PRIORITY BUMP
@@ -1001,8 +2097,9 @@ TEST_F(ReceiverTest, schedule)
     receiver->schedule(message[2], lock);
 
     EXPECT_EQ(&receiver->peerTable.at(IP(33)), info[2]->peer);
-    EXPECT_EQ(message[2], &info[2]->peer->scheduledMessages.front());
-    EXPECT_EQ(info[2]->peer, &receiver->scheduledPeers.front());
+    EXPECT_EQ(message[2], &info[2]->peer->scheduledMessages.top());
+    EXPECT_EQ(info[2]->peer, &receiver->scheduledPeers.top());
+    EXPECT_EQ(2U, receiver->scheduledPeers.size());
 
     //--------------------------------------------------------------------------
     // PEER NO PRIORITY CHANGE
@@ -1013,8 +2110,10 @@ TEST_F(ReceiverTest, schedule)
     receiver->schedule(message[3], lock);
 
     EXPECT_EQ(&receiver->peerTable.at(IP(22)), info[3]->peer);
-    EXPECT_EQ(message[3], &info[3]->peer->scheduledMessages.back());
-    EXPECT_EQ(info[3]->peer, &receiver->scheduledPeers.back());
+    EXPECT_EQ(message[0], &info[3]->peer->scheduledMessages.top());
+    EXPECT_EQ(2U, info[3]->peer->scheduledMessages.size());
+    EXPECT_EQ(info[2]->peer, &receiver->scheduledPeers.top());
+    EXPECT_EQ(2U, receiver->scheduledPeers.size());
 }
 
 TEST_F(ReceiverTest, unschedule)
@@ -1026,7 +2125,7 @@ TEST_F(ReceiverTest, unschedule)
     for (uint32_t i = 0; i < 5; ++i) {
         Protocol::MessageId id = {42, 10 + i};
         IpAddress source = IP((i / 3) + 10);
-        message[i] = receiver->messageAllocator.pool.construct(
+        message[i] = receiver->messageAllocator.construct(
             receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader),
             messageLength[i], id, SocketAddress{source, 60001}, 0);
         info[i] = &message[i]->scheduledMessageInfo;
@@ -1039,11 +2138,10 @@ TEST_F(ReceiverTest, unschedule)
     ASSERT_EQ(IP(10), message[2]->source.ip);
     ASSERT_EQ(IP(11), message[3]->source.ip);
     ASSERT_EQ(IP(11), message[4]->source.ip);
-    ASSERT_EQ(&scheduledPeers.front(), &receiver->peerTable.at(IP(10)));
-    ASSERT_EQ(&scheduledPeers.back(), &receiver->peerTable.at(IP(11)));
+    ASSERT_EQ(2U, scheduledPeers.size());
 
-    // <10>: [0](10) -> [1](20) -> [2](30)
-    // <11>: [3](10) -> [4](20)
+    // <10>: [0](10), [1](20), [2](30)
+    // <11>: [3](10), [4](20)
     EXPECT_EQ(10, info[0]->bytesRemaining);
     EXPECT_EQ(20, info[1]->bytesRemaining);
     EXPECT_EQ(30, info[2]->bytesRemaining);
@@ -1051,41 +2149,43 @@ TEST_F(ReceiverTest, unschedule)
     EXPECT_EQ(20, info[4]->bytesRemaining);
 
     //--------------------------------------------------------------------------
-    // Remove message[4]; peer already at end.
-    // <10>: [0](10) -> [1](20) -> [2](30)
+    // Remove message[4]; peer priority unchanged.
+    // <10>: [0](10), [1](20), [2](30)
     // <11>: [3](10)
 
     receiver->unschedule(message[4], lock);
 
     EXPECT_EQ(nullptr, info[4]->peer);
-    EXPECT_EQ(&scheduledPeers.front(), &receiver->peerTable.at(IP(10)));
-    EXPECT_EQ(&scheduledPeers.back(), &receiver->peerTable.at(IP(11)));
+    EXPECT_EQ(2U, scheduledPeers.size());
     EXPECT_EQ(3U, receiver->peerTable.at(IP(10)).scheduledMessages.size());
     EXPECT_EQ(1U, receiver->peerTable.at(IP(11)).scheduledMessages.size());
 
     //--------------------------------------------------------------------------
-    // Remove message[1]; peer in correct position.
-    // <10>: [0](10) -> [2](30)
+    // Remove message[1]; not the peer's highest priority message.
+    // <10>: [0](10), [2](30)
     // <11>: [3](10)
 
     receiver->unschedule(message[1], lock);
 
     EXPECT_EQ(nullptr, info[1]->peer);
-    EXPECT_EQ(&scheduledPeers.front(), &receiver->peerTable.at(IP(10)));
-    EXPECT_EQ(&scheduledPeers.back(), &receiver->peerTable.at(IP(11)));
+    EXPECT_EQ(2U, scheduledPeers.size());
+    EXPECT_EQ(message[0],
+              &receiver->peerTable.at(IP(10)).scheduledMessages.top());
     EXPECT_EQ(2U, receiver->peerTable.at(IP(10)).scheduledMessages.size());
     EXPECT_EQ(1U, receiver->peerTable.at(IP(11)).scheduledMessages.size());
 
     //--------------------------------------------------------------------------
-    // Remove message[0]; peer needs to be reordered.
+    // Remove message[0]; peer's priority drops below the other peer.
     // <11>: [3](10)
     // <10>: [2](30)
 
     receiver->unschedule(message[0], lock);
 
     EXPECT_EQ(nullptr, info[0]->peer);
-    EXPECT_EQ(&scheduledPeers.front(), &receiver->peerTable.at(IP(11)));
-    EXPECT_EQ(&scheduledPeers.back(), &receiver->peerTable.at(IP(10)));
+    EXPECT_EQ(2U, scheduledPeers.size());
+    EXPECT_EQ(&scheduledPeers.top(), &receiver->peerTable.at(IP(11)));
+    EXPECT_EQ(message[2],
+              &receiver->peerTable.at(IP(10)).scheduledMessages.top());
     EXPECT_EQ(1U, receiver->peerTable.at(IP(11)).scheduledMessages.size());
     EXPECT_EQ(1U, receiver->peerTable.at(IP(10)).scheduledMessages.size());
 
@@ -1096,8 +2196,10 @@ TEST_F(ReceiverTest, unschedule)
     receiver->unschedule(message[3], lock);
 
     EXPECT_EQ(nullptr, info[3]->peer);
-    EXPECT_EQ(&scheduledPeers.front(), &receiver->peerTable.at(IP(10)));
-    EXPECT_EQ(&scheduledPeers.back(), &receiver->peerTable.at(IP(10)));
+    EXPECT_EQ(1U, scheduledPeers.size());
+    EXPECT_EQ(&scheduledPeers.top(), &receiver->peerTable.at(IP(10)));
+    EXPECT_FALSE(scheduledPeers.contains(
+        &receiver->peerTable.at(IP(11)).scheduledPeerNode));
     EXPECT_EQ(1U, receiver->peerTable.at(IP(10)).scheduledMessages.size());
     EXPECT_EQ(0U, receiver->peerTable.at(IP(11)).scheduledMessages.size());
 }
@@ -1112,12 +2214,12 @@ TEST_F(ReceiverTest, updateSchedule)
         Protocol::MessageId id = {42, 10 + i};
         int messageLength = 10 * (i + 1);
         IpAddress source = IP(((i + 1) / 2) + 10);
-        other[i] = receiver->messageAllocator.pool.construct(
+        other[i] = receiver->messageAllocator.construct(
             receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader),
             10 * (i + 1), id, SocketAddress{source, 60001}, 0);
         receiver->schedule(other[i], lock);
     }
-    Receiver::Message* message = receiver->messageAllocator.pool.construct(
+    Receiver::Message* message = receiver->messageAllocator.construct(
         receiver, &mockDriver, sizeof(Protocol::Packet::DataHeader), 100,
         Protocol::MessageId(42, 1), SocketAddress{11, 60001}, 0);
     receiver->schedule(message, lock);
@@ -1126,11 +2228,10 @@ TEST_F(ReceiverTest, updateSchedule)
     ASSERT_EQ(&peerTable.at(IP(11)), other[1]->scheduledMessageInfo.peer);
     ASSERT_EQ(&peerTable.at(IP(11)), other[2]->scheduledMessageInfo.peer);
     ASSERT_EQ(&peerTable.at(IP(11)), message->scheduledMessageInfo.peer);
-    ASSERT_EQ(&receiver->scheduledPeers.front(), &peerTable.at(IP(10)));
-    ASSERT_EQ(&receiver->scheduledPeers.back(), &peerTable.at(IP(11)));
+    ASSERT_EQ(&receiver->scheduledPeers.top(), &peerTable.at(IP(10)));
 
     //--------------------------------------------------------------------------
-    // Move message up within peer.
+    // Move message up within peer; not yet the peer's highest priority.
     // 10 : [10]
     // 11 : [20][XX][30]
     message->scheduledMessageInfo.bytesRemaining = 25;
@@ -1138,26 +2239,21 @@ TEST_F(ReceiverTest, updateSchedule)
     receiver->updateSchedule(message, lock);
 
     auto& scheduledPeers = receiver->scheduledPeers;
-    EXPECT_EQ(&scheduledPeers.back(), &receiver->peerTable.at(IP(11)));
-    Receiver::Peer* peer = &receiver->scheduledPeers.back();
-    auto it = peer->scheduledMessages.begin();
-    EXPECT_TRUE(
-        std::next(receiver->peerTable.at(IP(11)).scheduledMessages.begin()) ==
-        message->scheduledMessageInfo.peer->scheduledMessages.get(
-            &message->scheduledMessageInfo.scheduledMessageNode));
+    EXPECT_EQ(&scheduledPeers.top(), &receiver->peerTable.at(IP(10)));
+    EXPECT_EQ(other[1],
+              &receiver->peerTable.at(IP(11)).scheduledMessages.top());
 
     //--------------------------------------------------------------------------
-    // Move message to front within peer.  No peer reordering.
+    // Move message to the top within peer.  No peer reordering.
     // 10 : [10]
     // 11 : [XX][20][30]
     message->scheduledMessageInfo.bytesRemaining = 10;
 
     receiver->updateSchedule(message, lock);
 
-    EXPECT_EQ(&scheduledPeers.back(), &receiver->peerTable.at(IP(11)));
-    EXPECT_EQ(receiver->peerTable.at(IP(11)).scheduledMessages.begin(),
-              message->scheduledMessageInfo.peer->scheduledMessages.get(
-                  &message->scheduledMessageInfo.scheduledMessageNode));
+    EXPECT_EQ(&scheduledPeers.top(), &receiver->peerTable.at(IP(10)));
+    EXPECT_EQ(message,
+              &receiver->peerTable.at(IP(11)).scheduledMessages.top());
 
     //--------------------------------------------------------------------------
     // Reorder peer.
@@ -1167,10 +2263,9 @@ TEST_F(ReceiverTest, updateSchedule)
 
     receiver->updateSchedule(message, lock);
 
-    EXPECT_EQ(&scheduledPeers.front(), &receiver->peerTable.at(IP(11)));
-    EXPECT_EQ(receiver->peerTable.at(IP(11)).scheduledMessages.begin(),
-              message->scheduledMessageInfo.peer->scheduledMessages.get(
-                  &message->scheduledMessageInfo.scheduledMessageNode));
+    EXPECT_EQ(&scheduledPeers.top(), &receiver->peerTable.at(IP(11)));
+    EXPECT_EQ(message,
+              &receiver->peerTable.at(IP(11)).scheduledMessages.top());
 }
 
 }  // namespace
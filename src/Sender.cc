@@ -18,14 +18,24 @@
 #include <Cycles.h>
 
 #include <algorithm>
+#include <cstring>
+#include <functional>
+#include <thread>
 
+#include "BulkCopy.h"
 #include "ControlPacket.h"
 #include "Debug.h"
 #include "Perf.h"
+#include "Receiver.h"
+#include "TimeTrace.h"
 
 namespace Homa {
 namespace Core {
 
+// Definition for Message's in-class initialized constant so that ODR-uses
+// (e.g. binding it to a reference) link under C++11/14.
+const size_t Sender::Message::MAX_MESSAGE_PACKETS;
+
 /**
  * Sender Constructor.
  *
@@ -48,21 +58,31 @@ Sender::Sender(uint64_t transportId, Driver* driver,
     : transportId(transportId)
     , driver(driver)
     , policyManager(policyManager)
+    , grantSource(nullptr)
+    , wakeupCallback()
     , nextMessageSequenceNumber(1)
-    , DRIVER_QUEUED_BYTE_LIMIT(2 * driver->getMaxPayloadSize())
-    , messageBuckets(messageTimeoutCycles, pingIntervalCycles)
-    , queueMutex()
-    , sendQueue()
-    , sending()
-    , sendReady(false)
-    , nextBucketIndex(0)
+    , earliestTimeout(UINT64_MAX)
+    , messageBuckets(messageTimeoutCycles, pingIntervalCycles,
+                     &earliestTimeout)
+    , sendShards()
+    , pacer(driver)
     , messageAllocator()
+    , reclaimList()
 {}
 
 /**
  * Sender Destructor
  */
-Sender::~Sender() {}
+Sender::~Sender()
+{
+    // Reclaim any messages still awaiting deferred reclamation.
+    SpinLock::Lock lock(reclaimList.mutex);
+    while (!reclaimList.list.empty()) {
+        Message* message = &reclaimList.list.front();
+        reclaimList.list.pop_front();
+        messageAllocator.destroy(message);
+    }
+}
 
 /**
  * Allocate an OutMessage that can be sent with this Sender.
@@ -70,9 +90,8 @@ Sender::~Sender() {}
 Homa::OutMessage*
 Sender::allocMessage(uint16_t sourcePort)
 {
-    SpinLock::Lock lock_allocator(messageAllocator.mutex);
     Perf::counters.allocated_tx_messages.add(1);
-    return messageAllocator.pool.construct(this, sourcePort);
+    return messageAllocator.construct(this, sourcePort);
 }
 
 /**
@@ -89,61 +108,76 @@ Sender::handleDonePacket(Driver::Packet* packet)
     Protocol::MessageId msgId = header->common.messageId;
 
     MessageBucket* bucket = messageBuckets.getBucket(msgId);
-    SpinLock::Lock lock(bucket->mutex);
-    Message* message = bucket->findMessage(msgId, lock);
+    bool completed = false;
+    {
+        SpinLock::Lock lock(bucket->mutex);
+        Message* message = bucket->findMessage(msgId, lock);
 
-    if (message == nullptr) {
-        // No message for this DONE packet; must be old. Just drop it.
-        driver->releasePackets(&packet, 1);
-        return;
-    }
+        if (message == nullptr) {
+            // No message for this DONE packet; must be old. Just drop it.
+            driver->releasePackets(&packet, 1);
+            return;
+        }
 
-    // Process DONE packet
-    OutMessage::Status status = message->getStatus();
-    switch (status) {
-        case OutMessage::Status::SENT:
-            // Expected behavior
-            bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
-            bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
-            message->state.store(OutMessage::Status::COMPLETED);
-            break;
-        case OutMessage::Status::CANCELED:
-            // Canceled by the the application; just ignore the DONE.
-            break;
-        case OutMessage::Status::COMPLETED:
-            // Message already DONE
-            NOTICE("Message (%lu, %lu) received duplicate DONE confirmation",
-                   msgId.transportId, msgId.sequence);
-            break;
-        case OutMessage::Status::FAILED:
-            WARNING(
-                "Message (%lu, %lu) received DONE confirmation after the "
-                "message was already declared FAILED",
-                msgId.transportId, msgId.sequence);
-            break;
-        case OutMessage::Status::NOT_STARTED:
-            WARNING(
-                "Message (%lu, %lu) received DONE confirmation but sending has "
-                "NOT_STARTED (message not yet sent); DONE is ignored.",
-                msgId.transportId, msgId.sequence);
-            break;
-        case OutMessage::Status::IN_PROGRESS:
-            WARNING(
-                "Message (%lu, %lu) received DONE confirmation while sending "
-                "is still IN_PROGRESS (message not completely sent); DONE is "
-                "ignored.",
-                msgId.transportId, msgId.sequence);
-            break;
-        default:
-            // Unexpected status
-            ERROR(
-                "Message (%lu, %lu) received DONE confirmation while in an "
-                "unexpected state; DONE is ignored.",
-                msgId.transportId, msgId.sequence);
-            break;
+        // Process DONE packet
+        OutMessage::Status status = message->getStatus();
+        switch (status) {
+            case OutMessage::Status::SENT:
+                // Expected behavior
+                bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
+                bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
+                message->state.store(OutMessage::Status::COMPLETED);
+                completed = true;
+                Perf::counters
+                    .tx_completed_latency[Perf::messageSizeClass(
+                        Util::downCast<uint32_t>(message->messageLength))]
+                    .record(PerfUtils::Cycles::rdtsc() -
+                            message->sendStartCycles);
+                break;
+            case OutMessage::Status::CANCELED:
+                // Canceled by the the application; just ignore the DONE.
+                break;
+            case OutMessage::Status::COMPLETED:
+                // Message already DONE
+                NOTICE("Message (%lu, %lu) received duplicate DONE confirmation",
+                       msgId.transportId, msgId.sequence);
+                break;
+            case OutMessage::Status::FAILED:
+                WARNING(
+                    "Message (%lu, %lu) received DONE confirmation after the "
+                    "message was already declared FAILED",
+                    msgId.transportId, msgId.sequence);
+                break;
+            case OutMessage::Status::NOT_STARTED:
+                WARNING(
+                    "Message (%lu, %lu) received DONE confirmation but sending has "
+                    "NOT_STARTED (message not yet sent); DONE is ignored.",
+                    msgId.transportId, msgId.sequence);
+                break;
+            case OutMessage::Status::IN_PROGRESS:
+                WARNING(
+                    "Message (%lu, %lu) received DONE confirmation while sending "
+                    "is still IN_PROGRESS (message not completely sent); DONE is "
+                    "ignored.",
+                    msgId.transportId, msgId.sequence);
+                break;
+            default:
+                // Unexpected status
+                ERROR(
+                    "Message (%lu, %lu) received DONE confirmation while in an "
+                    "unexpected state; DONE is ignored.",
+                    msgId.transportId, msgId.sequence);
+                break;
+        }
     }
 
     driver->releasePackets(&packet, 1);
+
+    if (completed && wakeupCallback) {
+        // Invoked outside the bucket mutex so the callback cannot deadlock
+        // against a thread touching the same bucket.
+        wakeupCallback();
+    }
 }
 
 /**
@@ -185,12 +219,14 @@ Sender::handleResendPacket(Driver::Packet* packet)
     bucket->messageTimeouts.setTimeout(&message->messageTimeout);
     bucket->pingTimeouts.setTimeout(&message->pingTimeout);
 
-    SpinLock::Lock lock_queue(queueMutex);
     QueuedMessageInfo* info = &message->queuedMessageInfo;
+    SendShard* shard = &sendShards[info->shard];
+    SpinLock::Lock lock_queue(shard->queueMutex);
 
     // Check if RESEND request is out of range.
     if (index >= info->packets->numPackets ||
-        resendEnd > info->packets->numPackets) {
+        resendEnd > info->packets->numPackets ||
+        header->num > 8 * Protocol::Packet::ResendHeader::RESEND_MASK_BYTES) {
         WARNING(
             "Message (%lu, %lu) RESEND request range out of bounds: requested "
             "range [%d, %d); message only contains %d packets; peer Transport "
@@ -208,7 +244,7 @@ Sender::handleResendPacket(Driver::Packet* packet)
         // will never be overridden since the resend index will not exceed the
         // preset packetsGranted.
         info->priority = header->priority;
-        sendReady.store(true);
+        shard->sendReady.store(true);
     }
 
     if (index >= info->packetsSent) {
@@ -221,15 +257,40 @@ Sender::handleResendPacket(Driver::Packet* packet)
             driver, info->destination.ip, info->id);
     } else {
         // There are some packets to resend but only resend packets that have
-        // already been sent.
+        // already been sent and that the Receiver marked missing; packets
+        // whose mask bit is clear arrived out of order and need not be
+        // retransmitted.
         resendEnd = std::min(resendEnd, info->packetsSent);
         int resendPriority = policyManager->getResendPriority();
+        Perf::PeerCounters* peerCounters =
+            Perf::perPeerStatsEnabled()
+                ? Perf::getPeerCounters(message->destination.ip)
+                : nullptr;
+        // Collect the retransmitted packets into driver-level bursts.
+        Driver::Packet* burst[TX_BURST_SIZE];
+        uint16_t burstCount = 0;
         for (uint16_t i = index; i < resendEnd; ++i) {
+            if (!header->shouldResend(Util::downCast<uint16_t>(i - index))) {
+                continue;
+            }
             Driver::Packet* packet = info->packets->getPacket(i);
             // Packets will be sent at the priority their original priority.
             Perf::counters.tx_data_pkts.add(1);
-            Perf::counters.tx_bytes.add(packet->length);
-            driver->sendPacket(packet, message->destination.ip, resendPriority);
+            Perf::counters.tx_bytes.add(packet->length + packet->extLength);
+            if (peerCounters != nullptr) {
+                peerCounters->tx_retransmit_pkts.add(1);
+                peerCounters->tx_bytes.add(packet->length + packet->extLength);
+            }
+            burst[burstCount++] = packet;
+            if (burstCount == TX_BURST_SIZE) {
+                driver->sendPackets(burstCount, burst, message->destination.ip,
+                                    resendPriority);
+                burstCount = 0;
+            }
+        }
+        if (burstCount > 0) {
+            driver->sendPackets(burstCount, burst, message->destination.ip,
+                                resendPriority);
         }
     }
 
@@ -247,22 +308,47 @@ Sender::handleGrantPacket(Driver::Packet* packet)
 {
     Protocol::Packet::GrantHeader* header =
         static_cast<Protocol::Packet::GrantHeader*>(packet->payload);
-    Protocol::MessageId msgId = header->common.messageId;
+    applyGrant(header->common.messageId, header->byteLimit, header->priority);
+    driver->releasePackets(&packet, 1);
+}
 
+/**
+ * Apply a grant to the associated outbound message.  Called for both
+ * standalone GRANT packets (see handleGrantPacket()) and grants piggybacked
+ * on inbound DATA packets.
+ *
+ * @param msgId
+ *      Id of the message being granted.
+ * @param byteLimit
+ *      @sa Protocol::Packet::GrantHeader::byteLimit.
+ * @param priority
+ *      @sa Protocol::Packet::GrantHeader::priority.
+ */
+void
+Sender::applyGrant(Protocol::MessageId msgId, uint32_t byteLimit,
+                   uint8_t priority)
+{
     MessageBucket* bucket = messageBuckets.getBucket(msgId);
     SpinLock::Lock lock(bucket->mutex);
     Message* message = bucket->findMessage(msgId, lock);
     if (message == nullptr) {
         // No message for this grant; grant must be old. Just drop it.
-        driver->releasePackets(&packet, 1);
         return;
     }
 
     bucket->messageTimeouts.setTimeout(&message->messageTimeout);
     bucket->pingTimeouts.setTimeout(&message->pingTimeout);
 
+    if (message->transmitStartCycles != 0) {
+        // The first GRANT for this message closes the loop on the initial
+        // packet burst; use it as an RTT sample for the destination.
+        policyManager->signalRttSample(
+            message->destination.ip,
+            PerfUtils::Cycles::rdtsc() - message->transmitStartCycles);
+        message->transmitStartCycles = 0;
+    }
+
     if (message->state.load() == OutMessage::Status::IN_PROGRESS) {
-        SpinLock::Lock lock_queue(queueMutex);
         QueuedMessageInfo* info = &message->queuedMessageInfo;
 
         // Convert the byteLimit to a packet index limit such that the packet
@@ -270,31 +356,50 @@ Sender::handleGrantPacket(Driver::Packet* packet)
         // can cause at most 1 packet worth of data to be sent without a grant
         // but allows the sender to always send full packets.
         int incomingGrantIndex =
-            (header->byteLimit + info->packets->PACKET_DATA_LENGTH - 1) /
-            info->packets->PACKET_DATA_LENGTH;
-
-        // Make that grants don't exceed the number of packets.  Internally,
-        // the sender always assumes that packetsGranted <= numPackets.
-        if (incomingGrantIndex > info->packets->numPackets) {
-            WARNING(
-                "Message (%lu, %lu) GRANT exceeds message length; granted "
-                "packets: %d, message packets %d; extra grants are ignored.",
-                msgId.transportId, msgId.sequence, incomingGrantIndex,
-                info->packets->numPackets);
-            incomingGrantIndex = info->packets->numPackets;
+            (byteLimit + message->PACKET_DATA_LENGTH - 1) /
+            message->PACKET_DATA_LENGTH;
+
+        // Make that grants don't exceed the number of published packets.
+        // Internally, the sender always assumes that packetsGranted <=
+        // packetsPublished.  A streamed message can legitimately be granted
+        // ahead of the data the application has produced so far; the excess
+        // is simply dropped and the receiver re-grants as data arrives.
+        // The acquire pairs with the release in publishStreamData() so that
+        // the headers of all published packets are visible before a grant
+        // can expose them to the transmitting thread.
+        int packetsPublished =
+            info->packetsPublished.load(std::memory_order_acquire);
+        if (incomingGrantIndex > packetsPublished) {
+            if (!(message->options & OutMessage::Options::STREAM)) {
+                WARNING(
+                    "Message (%lu, %lu) GRANT exceeds message length; granted "
+                    "packets: %d, message packets %d; extra grants are "
+                    "ignored.",
+                    msgId.transportId, msgId.sequence, incomingGrantIndex,
+                    packetsPublished);
+            }
+            incomingGrantIndex = packetsPublished;
         }
 
-        if (info->packetsGranted < incomingGrantIndex) {
-            info->packetsGranted = incomingGrantIndex;
+        // Raise the grant watermark without taking the queueMutex: the
+        // watermark only ever increases while the message is queued and the
+        // sendQueue's SRPT order depends only on unsentBytes, so no
+        // reordering is needed and trySend() can simply read the atomic.
+        int prevGrantIndex =
+            info->packetsGranted.load(std::memory_order_relaxed);
+        while (prevGrantIndex < incomingGrantIndex &&
+               !info->packetsGranted.compare_exchange_weak(
+                   prevGrantIndex, incomingGrantIndex,
+                   std::memory_order_relaxed)) {
+        }
+        if (prevGrantIndex < incomingGrantIndex) {
             // Note that the priority of messages under the unscheduled byte
             // limit will never be overridden since the incomingGrantIndex will
             // not exceed the preset packetsGranted.
-            info->priority = header->priority;
-            sendReady.store(true);
+            info->priority.store(priority, std::memory_order_relaxed);
+            sendShards[info->shard].sendReady.store(true);
         }
     }
-
-    driver->releasePackets(&packet, 1);
 }
 
 /**
@@ -333,14 +438,17 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
         // failed since the application asked for the message not to be retried.
 
         // Remove Message from sendQueue.
-        if (message->numPackets > 1) {
-            SpinLock::Lock lock_queue(queueMutex);
+        if (message->numPackets > 1 ||
+            (message->options & OutMessage::Options::STREAM)) {
             QueuedMessageInfo* info = &message->queuedMessageInfo;
+            SendShard* shard = &sendShards[info->shard];
+            SpinLock::Lock lock_queue(shard->queueMutex);
+            mergeStagedMessages(shard);
             if (message->state == OutMessage::Status::IN_PROGRESS) {
-                assert(sendQueue.contains(&info->sendQueueNode));
-                sendQueue.remove(&info->sendQueueNode);
+                assert(shard->sendQueue.contains(&info->sendQueueNode));
+                shard->sendQueue.remove(&info->sendQueueNode);
             }
-            assert(!sendQueue.contains(&info->sendQueueNode));
+            assert(!shard->sendQueue.contains(&info->sendQueueNode));
         }
 
         bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
@@ -348,17 +456,20 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
         message->state.store(OutMessage::Status::FAILED);
     } else {
         // Message isn't done yet so we will restart sending the message.
+        const bool stream = message->options & OutMessage::Options::STREAM;
 
         // Make sure the message is not in the sendQueue before making any
         // changes to the message.
-        if (message->numPackets > 1) {
-            SpinLock::Lock lock_queue(queueMutex);
+        if (message->numPackets > 1 || stream) {
             QueuedMessageInfo* info = &message->queuedMessageInfo;
+            SendShard* shard = &sendShards[info->shard];
+            SpinLock::Lock lock_queue(shard->queueMutex);
+            mergeStagedMessages(shard);
             if (message->state == OutMessage::Status::IN_PROGRESS) {
-                assert(sendQueue.contains(&info->sendQueueNode));
-                sendQueue.remove(&info->sendQueueNode);
+                assert(shard->sendQueue.contains(&info->sendQueueNode));
+                shard->sendQueue.remove(&info->sendQueueNode);
             }
-            assert(!sendQueue.contains(&info->sendQueueNode));
+            assert(!shard->sendQueue.contains(&info->sendQueueNode));
         }
 
         message->state.store(OutMessage::Status::IN_PROGRESS);
@@ -370,31 +481,57 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
             ((policy.unscheduledByteLimit + message->PACKET_DATA_LENGTH - 1) /
              message->PACKET_DATA_LENGTH);
 
+        // Streamed messages write headers when data is published; keep the
+        // captured policy values in step so later publishes match.
+        message->policyVersion = policy.version;
+        message->unscheduledIndexLimit = unscheduledIndexLimit;
+
         // Update the policy version for each packet
-        for (uint16_t i = 0; i < message->numPackets; ++i) {
-            Driver::Packet* dataPacket = message->getPacket(i);
+        int numHeaderedPackets =
+            stream ? message->queuedMessageInfo.packetsPublished.load(
+                         std::memory_order_relaxed)
+                   : message->numPackets;
+        if (message->numPackets == 1 && !stream) {
+            // Single-packet messages carry the compact DATA_SINGLE header.
+            Driver::Packet* dataPacket = message->getPacket(0);
             assert(dataPacket != nullptr);
-            Protocol::Packet::DataHeader* header =
-                static_cast<Protocol::Packet::DataHeader*>(dataPacket->payload);
-            header->policyVersion = policy.version;
-            header->unscheduledIndexLimit =
-                Util::downCast<uint16_t>(unscheduledIndexLimit);
+            Protocol::Packet::DataHeaderSingle* singleHeader =
+                static_cast<Protocol::Packet::DataHeaderSingle*>(
+                    dataPacket->payload);
+            singleHeader->policyVersion = policy.version;
+        } else {
+            for (int i = 0; i < numHeaderedPackets; ++i) {
+                Driver::Packet* dataPacket = message->getPacket(i);
+                assert(dataPacket != nullptr);
+                Protocol::Packet::DataHeader* header =
+                    static_cast<Protocol::Packet::DataHeader*>(
+                        dataPacket->payload);
+                header->policyVersion = policy.version;
+                header->unscheduledIndexLimit =
+                    Util::downCast<uint16_t>(unscheduledIndexLimit);
+            }
         }
 
         // Reset the timeouts
         bucket->messageTimeouts.setTimeout(&message->messageTimeout);
         bucket->pingTimeouts.setTimeout(&message->pingTimeout);
 
-        assert(message->numPackets > 0);
-        if (message->numPackets == 1) {
+        assert(message->numPackets > 0 || stream);
+        if (message->numPackets == 1 && !stream) {
             // If there is only one packet in the message, send it right away.
             Driver::Packet* dataPacket = message->getPacket(0);
             assert(dataPacket != nullptr);
             Perf::counters.tx_data_pkts.add(1);
-            Perf::counters.tx_bytes.add(dataPacket->length);
+            Perf::counters.tx_bytes.add(dataPacket->length +
+                                        dataPacket->extLength);
             driver->sendPacket(dataPacket, message->destination.ip,
                                policy.priority);
             message->state.store(OutMessage::Status::SENT);
+            Perf::counters
+                .tx_sent_latency[Perf::messageSizeClass(
+                    Util::downCast<uint32_t>(message->messageLength))]
+                .record(PerfUtils::Cycles::rdtsc() -
+                        message->sendStartCycles);
             // This message must be still be held by the application since the
             // message still exists (it would have been removed when dropped
             // because single packet messages are never IN_PROGRESS). Assuming
@@ -408,28 +545,29 @@ Sender::handleUnknownPacket(Driver::Packet* packet)
                 bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
             }
         } else {
-            // Otherwise, queue the message to be sent in SRPT order.
-            SpinLock::Lock lock_queue(queueMutex);
+            // Otherwise, queue the message to be sent in SRPT order.  The
+            // message keeps the shard it was assigned when first queued.
             QueuedMessageInfo* info = &message->queuedMessageInfo;
+            SendShard* shard = &sendShards[info->shard];
+            SpinLock::Lock lock_queue(shard->queueMutex);
             // Some of these values should still be set from when the message
             // was first queued.
             assert(info->id == message->id);
             assert(!memcmp(&info->destination, &message->destination,
                            sizeof(info->destination)));
             assert(info->packets == message);
-            // Some values need to be updated
-            info->unsentBytes = message->messageLength;
-            info->packetsGranted =
-                std::min(unscheduledIndexLimit, message->numPackets);
+            // Some values need to be updated.  Only published bytes/packets
+            // take part in the restart; an open stream's unpublished tail is
+            // published by later appends as usual.
+            info->unsentBytes = info->publishedBytes;
+            info->packetsGranted = std::min(
+                unscheduledIndexLimit,
+                info->packetsPublished.load(std::memory_order_relaxed));
             info->priority = policy.priority;
             info->packetsSent = 0;
-            // Insert and move message into the correct order in the priority
-            // queue.
-            sendQueue.push_front(&info->sendQueueNode);
-            Intrusive::deprioritize<Message>(
-                &sendQueue, &info->sendQueueNode,
-                QueuedMessageInfo::ComparePriority());
-            sendReady.store(true);
+            // Insert the message at its position in the priority queue.
+            shard->sendQueue.insert(&info->sendQueueNode);
+            shard->sendReady.store(true);
         }
     }
 
@@ -509,12 +647,17 @@ Sender::handleErrorPacket(Driver::Packet* packet)
  * Allow the Sender to make progress toward sending outgoing messages.
  *
  * This method must be called eagerly to ensure messages are sent.
+ *
+ * @return
+ *      Number of data packets sent during this call.
  */
-void
+uint32_t
 Sender::poll()
 {
-    trySend();
+    uint32_t packetsSent = trySend();
     checkTimeouts();
+    reclaimMessages();
+    return packetsSent;
 }
 
 /**
@@ -525,12 +668,58 @@ Sender::poll()
 void
 Sender::checkTimeouts()
 {
-    uint index = nextBucketIndex.fetch_add(1, std::memory_order_relaxed) &
-                 MessageBucketMap::HASH_KEY_MASK;
-    MessageBucket* bucket = messageBuckets.buckets.at(index);
     uint64_t now = PerfUtils::Cycles::rdtsc();
-    checkPingTimeouts(now, bucket);
-    checkMessageTimeouts(now, bucket);
+    uint64_t expiration = earliestTimeout.load(std::memory_order_relaxed);
+    if (now < expiration) {
+        // No timeout is near; nothing to do.
+        return;
+    }
+    // Claim the sweep; concurrent callers take the fast path out.
+    if (!earliestTimeout.compare_exchange_strong(expiration, UINT64_MAX,
+                                                 std::memory_order_relaxed)) {
+        return;
+    }
+    uint64_t newEarliest = UINT64_MAX;
+    // Batch any PING packets emitted during the sweep into one TX burst.
+    ControlPacket::Corked corked(driver);
+    for (MessageBucket* bucket : messageBuckets.buckets) {
+        checkPingTimeouts(now, bucket);
+        checkMessageTimeouts(now, bucket);
+        newEarliest = std::min({newEarliest,
+                                bucket->messageTimeouts.getNextTimeout(),
+                                bucket->pingTimeouts.getNextTimeout()});
+    }
+    // Timeouts (re)scheduled during the sweep have already lowered the
+    // cached time themselves.
+    lowerEarliestTimeout(&earliestTimeout, newEarliest);
+}
+
+/**
+ * Reclaim the resources of a bounded batch of released messages.
+ *
+ * Messages released by the application (or finished sending after release)
+ * are queued for reclamation instead of being destroyed inline; this method
+ * releases their packets and returns them to the message pool, a few
+ * messages at a time so no single call stalls the pipeline.
+ */
+void
+Sender::reclaimMessages()
+{
+    // Largest number of messages reclaimed per call.
+    const int RECLAIM_LIMIT = 8;
+    for (int i = 0; i < RECLAIM_LIMIT; ++i) {
+        Message* message = nullptr;
+        {
+            SpinLock::Lock lock(reclaimList.mutex);
+            if (reclaimList.list.empty()) {
+                return;
+            }
+            message = &reclaimList.list.front();
+            reclaimList.list.pop_front();
+        }
+        messageAllocator.destroy(message);
+        Perf::counters.destroyed_tx_messages.add(1);
+    }
 }
 
 /**
@@ -539,7 +728,13 @@ Sender::checkTimeouts()
 Sender::Message::~Message()
 {
     // Sender message must be contiguous
-    driver->releasePackets(packets, numPackets);
+    packets.releasePackets(driver, numAllocatedPackets);
+    // Return any externally-owned buffers to the application.
+    for (ExternalBlock& block : externalBlocks) {
+        if (block.done != nullptr) {
+            block.done(block.arg);
+        }
+    }
 }
 
 /**
@@ -560,14 +755,24 @@ Sender::Message::append(const void* source, size_t count)
         _count = maxMessageLength - messageLength;
     }
 
+    if (_count > 0) {
+        // Bulk-allocate all the packets this append will touch up front.
+        allocMissingPackets(messageLength / PACKET_DATA_LENGTH,
+                            (messageLength + _count - 1) / PACKET_DATA_LENGTH);
+    }
+
     while (bytesCopied < _count) {
         int bytesToCopy =
             std::min(_count - bytesCopied, PACKET_DATA_LENGTH - packetOffset);
         Driver::Packet* packet = getOrAllocPacket(packetIndex);
+        // Inline data cannot follow an external buffer within a packet; see
+        // Homa::OutMessage::appendExternal().
+        assert(packet->extData == nullptr);
         char* destination = static_cast<char*>(packet->payload);
         destination += packetOffset + TRANSPORT_HEADER_LENGTH;
-        std::memcpy(destination, static_cast<const char*>(source) + bytesCopied,
-                    bytesToCopy);
+        BulkCopy::copy(destination,
+                       static_cast<const char*>(source) + bytesCopied,
+                       bytesToCopy, _count);
         // TODO(cstlee): A Message probably shouldn't be in charge of setting
         //               the packet length.
         packet->length += bytesToCopy;
@@ -578,6 +783,63 @@ Sender::Message::append(const void* source, size_t count)
     }
 
     messageLength += _count;
+
+    if ((options & OutMessage::Options::STREAM) &&
+        state.load() == OutMessage::Status::IN_PROGRESS) {
+        // Streamed send: make any newly completed packets transmittable.
+        sender->publishStreamData(this);
+    }
+}
+
+/**
+ * @copydoc Homa::OutMessage::appendExternal()
+ */
+void
+Sender::Message::appendExternal(const void* source, size_t count,
+                                void (*done)(void* arg), void* arg)
+{
+    int _count = Util::downCast<int>(count);
+    int packetIndex = messageLength / PACKET_DATA_LENGTH;
+    int packetOffset = messageLength % PACKET_DATA_LENGTH;
+    int bytesAdded = 0;
+    int maxMessageLength = PACKET_DATA_LENGTH * MAX_MESSAGE_PACKETS;
+
+    if (messageLength + _count > maxMessageLength) {
+        WARNING("Max message size limit (%dB) reached; %d of %d bytes appended",
+                maxMessageLength, maxMessageLength - messageLength, _count);
+        _count = maxMessageLength - messageLength;
+    }
+
+    if (_count > 0) {
+        // Bulk-allocate all the packets this append will touch up front.
+        allocMissingPackets(messageLength / PACKET_DATA_LENGTH,
+                            (messageLength + _count - 1) / PACKET_DATA_LENGTH);
+    }
+
+    const char* sourceBytes = static_cast<const char*>(source);
+    while (bytesAdded < _count) {
+        int bytesToAdd =
+            std::min(_count - bytesAdded, PACKET_DATA_LENGTH - packetOffset);
+        Driver::Packet* packet = getOrAllocPacket(packetIndex);
+        // A packet can reference at most one external region; see
+        // Homa::OutMessage::appendExternal().
+        assert(packet->extData == nullptr);
+        assert(packet->length == TRANSPORT_HEADER_LENGTH + packetOffset);
+        packet->extData = sourceBytes + bytesAdded;
+        packet->extLength = bytesToAdd;
+        bytesAdded += bytesToAdd;
+        packetIndex++;
+        packetOffset = 0;
+    }
+
+    messageLength += _count;
+    externalBlocks.push_back({done, arg});
+
+    if ((options & OutMessage::Options::STREAM) &&
+        state.load() == OutMessage::Status::IN_PROGRESS) {
+        // Streamed send: make any newly completed packets transmittable.
+        sender->publishStreamData(this);
+    }
 }
 
 /**
@@ -589,6 +851,15 @@ Sender::Message::cancel()
     sender->cancelMessage(this);
 }
 
+/**
+ * @copydoc Homa::OutMessage::close()
+ */
+void
+Sender::Message::close()
+{
+    sender->closeMessage(this);
+}
+
 /**
  * @copydoc Homa::OutMessage::getStatus()
  */
@@ -646,6 +917,15 @@ Sender::Message::release()
     sender->dropMessage(this);
 }
 
+/**
+ * @copydoc Homa::OutMessage::reset()
+ */
+void
+Sender::Message::reset()
+{
+    sender->resetMessage(this);
+}
+
 /**
  * @copydoc Homa::OutMessage::reserve()
  */
@@ -707,10 +987,7 @@ Sender::Message::send(SocketAddress destination,
 Driver::Packet*
 Sender::Message::getPacket(size_t index) const
 {
-    if (occupied.test(index)) {
-        return packets[index];
-    }
-    return nullptr;
+    return packets.get(index);
 }
 
 /**
@@ -726,15 +1003,62 @@ Sender::Message::getPacket(size_t index) const
 Driver::Packet*
 Sender::Message::getOrAllocPacket(size_t index)
 {
-    if (!occupied.test(index)) {
-        packets[index] = driver->allocPacket();
-        occupied.set(index);
-        numPackets++;
+    Driver::Packet* packet = packets.get(index);
+    if (packet == nullptr) {
+        packet = driver->allocPacket();
+        packets.set(index, packet);
+        numAllocatedPackets++;
         // TODO(cstlee): A Message probably shouldn't be in charge of setting
         //               the packet length.
-        packets[index]->length = TRANSPORT_HEADER_LENGTH;
+        packet->length = TRANSPORT_HEADER_LENGTH;
+    }
+    if (static_cast<size_t>(numPackets) <= index) {
+        // The slot may hold a buffer left allocated by reset(); either way
+        // the packet now belongs to this message's contents.
+        numPackets = Util::downCast<int>(index + 1);
+    }
+    return packet;
+}
+
+/**
+ * Ensure that every Packet the caller is about to touch has been allocated.
+ *
+ * Missing packets are requested from the Driver in bulk, which is much
+ * cheaper than allocating them one at a time during a large append.  Slots
+ * that already hold a buffer (a partially filled tail packet, or buffers
+ * left allocated by reset()) are skipped; claiming them as message contents
+ * is left to getOrAllocPacket().
+ *
+ * @param firstIndex
+ *      Index of the first Packet that is needed.
+ * @param lastIndex
+ *      Index of the last Packet that is needed.
+ */
+void
+Sender::Message::allocMissingPackets(size_t firstIndex, size_t lastIndex)
+{
+    static const uint16_t ALLOC_BURST = 64;
+    size_t index = firstIndex;
+    while (index <= lastIndex) {
+        if (packets.get(index) != nullptr) {
+            index++;
+            continue;
+        }
+        // Sender messages are contiguous, so every slot from the first
+        // missing one up to lastIndex is missing.
+        uint16_t needed = Util::downCast<uint16_t>(
+            std::min<size_t>(lastIndex + 1 - index, ALLOC_BURST));
+        Driver::Packet* newPackets[ALLOC_BURST];
+        driver->allocPackets(needed, newPackets);
+        for (uint16_t i = 0; i < needed; ++i) {
+            // TODO(cstlee): A Message probably shouldn't be in charge of
+            //               setting the packet length.
+            newPackets[i]->length = TRANSPORT_HEADER_LENGTH;
+            packets.set(index, newPackets[i]);
+            index++;
+            numAllocatedPackets++;
+        }
     }
-    return packets[index];
 }
 
 /**
@@ -767,26 +1091,73 @@ Sender::sendMessage(Sender::Message* message, SocketAddress destination,
     message->id = id;
     message->destination = destination;
     message->options = options;
+    message->policyVersion = policy.version;
+    message->unscheduledIndexLimit = unscheduledPacketLimit;
     message->state.store(OutMessage::Status::IN_PROGRESS);
 
+    // Option: STREAM messages always use the queued multi-packet path (the
+    // application will keep appending) and only their full packets are
+    // published for transmission; the last partial packet is published when
+    // more data arrives or the message is closed.
+    const bool stream = options & OutMessage::Options::STREAM;
+
     int actualMessageLen = 0;
     // fill out metadata.
-    for (int i = 0; i < message->numPackets; ++i) {
-        Driver::Packet* packet = message->getPacket(i);
+    if (message->numPackets == 1 && !stream) {
+        // Single-packet messages use the compact DATA_SINGLE format; the
+        // omitted header fields are implied for a message that fits in one
+        // packet.  Move the data down to follow the shorter header.
+        Driver::Packet* packet = message->getPacket(0);
         if (packet == nullptr) {
             PANIC(
                 "Incomplete message with id (%lu:%lu); missing packet "
-                "at offset %d; this shouldn't happen.",
-                message->id.transportId, message->id.sequence,
-                i * message->PACKET_DATA_LENGTH);
+                "at offset 0; this shouldn't happen.",
+                message->id.transportId, message->id.sequence);
         }
-
-        new (packet->payload) Protocol::Packet::DataHeader(
+        const int headerShrinkage =
+            message->TRANSPORT_HEADER_LENGTH -
+            Util::downCast<int>(sizeof(Protocol::Packet::DataHeaderSingle));
+        char* payload = static_cast<char*>(packet->payload);
+        std::memmove(payload + sizeof(Protocol::Packet::DataHeaderSingle),
+                     payload + message->TRANSPORT_HEADER_LENGTH,
+                     packet->length - message->TRANSPORT_HEADER_LENGTH);
+        packet->length -= headerShrinkage;
+        new (packet->payload) Protocol::Packet::DataHeaderSingle(
+            message->source.port, destination.port, message->id,
+            policy.version);
+        actualMessageLen =
+            packet->length -
+            Util::downCast<int>(sizeof(Protocol::Packet::DataHeaderSingle)) +
+            packet->extLength;
+    } else {
+        // Build the header once and blit it into every packet; only the
+        // packet index differs between packets, so patching it into the
+        // template replaces per-field stores with a single small copy per
+        // packet.
+        Protocol::Packet::DataHeader headerTemplate(
             message->source.port, destination.port, message->id,
             Util::downCast<uint32_t>(message->messageLength), policy.version,
-            Util::downCast<uint16_t>(unscheduledPacketLimit),
-            Util::downCast<uint16_t>(i));
-        actualMessageLen += (packet->length - message->TRANSPORT_HEADER_LENGTH);
+            Util::downCast<uint16_t>(unscheduledPacketLimit), 0);
+        if (stream) {
+            headerTemplate.flags |= Protocol::Packet::DataHeader::FLAG_STREAM_OPEN;
+        }
+        for (int i = 0; i < message->numPackets; ++i) {
+            Driver::Packet* packet = message->getPacket(i);
+            if (packet == nullptr) {
+                PANIC(
+                    "Incomplete message with id (%lu:%lu); missing packet "
+                    "at offset %d; this shouldn't happen.",
+                    message->id.transportId, message->id.sequence,
+                    i * message->PACKET_DATA_LENGTH);
+            }
+
+            headerTemplate.index = Util::downCast<uint16_t>(i);
+            std::memcpy(packet->payload, &headerTemplate,
+                        sizeof(headerTemplate));
+            actualMessageLen +=
+                (packet->length - message->TRANSPORT_HEADER_LENGTH +
+                 packet->extLength);
+        }
     }
 
     // perform sanity checks.
@@ -795,50 +1166,146 @@ Sender::sendMessage(Sender::Message* message, SocketAddress destination,
     assert(message->TRANSPORT_HEADER_LENGTH ==
            sizeof(Protocol::Packet::DataHeader));
 
-    // Track message
-    MessageBucket* bucket = messageBuckets.getBucket(message->id);
-    SpinLock::Lock lock(bucket->mutex);
-    assert(!bucket->messages.contains(&message->bucketNode));
-    bucket->messages.push_back(&message->bucketNode);
-    bucket->messageTimeouts.setTimeout(&message->messageTimeout);
-    bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+    assert(message->numPackets > 0 || stream);
+    if (message->numPackets > 1 || stream) {
+        // Initialize the sendQueue metadata before the message becomes
+        // findable in its bucket so that incoming GRANTs for this message
+        // cannot race with this initialization.
+        QueuedMessageInfo* info = &message->queuedMessageInfo;
+        info->id = id;
+        info->destination = message->destination;
+        info->shard = getSendShardIndex(message->destination.ip);
+        info->packets = message;
+        if (stream) {
+            // Only full packets are published while the stream is open; the
+            // sender cannot transmit a partial packet whose tail is still
+            // being filled.
+            int published = message->messageLength / message->PACKET_DATA_LENGTH;
+            info->packetsPublished = published;
+            info->publishedBytes = published * message->PACKET_DATA_LENGTH;
+            info->unsentBytes = info->publishedBytes;
+            info->packetsGranted = std::min(unscheduledPacketLimit, published);
+            info->open = true;
+        } else {
+            info->packetsPublished = message->numPackets;
+            info->publishedBytes = message->messageLength;
+            info->unsentBytes = message->messageLength;
+            info->packetsGranted =
+                std::min(unscheduledPacketLimit, message->numPackets);
+            info->open = false;
+        }
+        info->priority = policy.priority;
+        info->packetsSent = 0;
+    }
 
-    assert(message->numPackets > 0);
-    if (message->numPackets == 1) {
-        // If there is only one packet in the message, send it right away.
+    MessageBucket* bucket = messageBuckets.getBucket(message->id);
+    if (message->numPackets == 1 && !stream) {
+        // Fast path: a single-packet message is entirely unscheduled, so it
+        // never needs the sendQueue or grants; hand the packet straight to
+        // the driver and only touch the bucket if the message must remain
+        // findable for DONE/UNKNOWN/PING handling afterwards.
         Driver::Packet* packet = message->getPacket(0);
         assert(packet != nullptr);
-        Perf::counters.tx_data_pkts.add(1);
-        Perf::counters.tx_bytes.add(packet->length);
-        driver->sendPacket(packet, message->destination.ip, policy.priority);
-        message->state.store(OutMessage::Status::SENT);
         // By definition, this message must be still be held by the application
         // the send() call is since the progress. Assuming the message is still
         // held, we can skip the auto removal of SENT and !held messages.
         assert(message->held);
-        if (message->options & OutMessage::Options::NO_KEEP_ALIVE) {
-            // No timeouts need to be checked after sending the message when
-            // the NO_KEEP_ALIVE option is enabled.
-            bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
-            bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
+        message->transmitStartCycles = PerfUtils::Cycles::rdtsc();
+        message->sendStartCycles = message->transmitStartCycles;
+        if (!(message->options & OutMessage::Options::NO_COMPLETION)) {
+            // Option: NO_COMPLETION messages are done as far as the transport
+            // is concerned the moment the packet leaves; they are never
+            // tracked at all.  Everything else is inserted into its bucket so
+            // that control packets can find it.
+            SpinLock::Lock lock(bucket->mutex);
+            assert(!bucket->messages.contains(&message->bucketNode));
+            bucket->addMessage(message, lock);
+            if (!(message->options & OutMessage::Options::NO_KEEP_ALIVE)) {
+                bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+                bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+            }
         }
+        // Mark the message SENT before the packet leaves; no DONE reply can
+        // exist until the packet is on the wire, so the transition cannot be
+        // raced, and the driver call runs without holding the bucket mutex.
+        message->state.store(OutMessage::Status::SENT);
+        Perf::counters.tx_data_pkts.add(1);
+        Perf::counters.tx_bytes.add(packet->length + packet->extLength);
+        if (Perf::perPeerStatsEnabled()) {
+            Perf::PeerCounters* peerCounters =
+                Perf::getPeerCounters(message->destination.ip);
+            peerCounters->tx_data_pkts.add(1);
+            peerCounters->tx_bytes.add(packet->length + packet->extLength);
+        }
+        driver->sendPacket(packet, message->destination.ip, policy.priority);
+        Perf::counters
+            .tx_sent_latency[Perf::messageSizeClass(
+                Util::downCast<uint32_t>(message->messageLength))]
+            .record(PerfUtils::Cycles::rdtsc() - message->sendStartCycles);
     } else {
-        // Otherwise, queue the message to be sent in SRPT order.
-        SpinLock::Lock lock_queue(queueMutex);
+        // Track message
+        {
+            SpinLock::Lock lock(bucket->mutex);
+            assert(!bucket->messages.contains(&message->bucketNode));
+            bucket->addMessage(message, lock);
+            message->transmitStartCycles = PerfUtils::Cycles::rdtsc();
+            message->sendStartCycles = message->transmitStartCycles;
+            bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+            bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+        }
+        // Stage the message to be merged into its shard's SRPT-ordered
+        // sendQueue; staging is lock-free so the send hot path never contends
+        // on a shard's queueMutex.
+        stageMessage(message);
+    }
+}
+
+/**
+ * Push a message onto its shard's lock-free stack of messages waiting to be
+ * merged into the shard's sendQueue.
+ *
+ * This method is thread-safe and does not take any queueMutex; the message's
+ * QueuedMessageInfo (including its shard assignment) must be fully
+ * initialized before this call.
+ *
+ * @param message
+ *      Message that is ready to be sent and should be enqueued.
+ */
+void
+Sender::stageMessage(Sender::Message* message)
+{
+    QueuedMessageInfo* info = &message->queuedMessageInfo;
+    SendShard* shard = &sendShards[info->shard];
+    Message* head = shard->stagedMessages.load(std::memory_order_relaxed);
+    do {
+        info->stagedNext = head;
+    } while (!shard->stagedMessages.compare_exchange_weak(
+        head, message, std::memory_order_release, std::memory_order_relaxed));
+    shard->sendReady.store(true);
+}
+
+/**
+ * Merge any staged messages of a shard into the shard's SRPT-ordered
+ * sendQueue.
+ *
+ * The caller must hold the shard's queueMutex; the shard's sendQueue is only
+ * guaranteed to contain every message queued to the shard after this call.
+ *
+ * @param shard
+ *      The shard whose staged messages should be merged.
+ */
+void
+Sender::mergeStagedMessages(SendShard* shard)
+{
+    Message* message =
+        shard->stagedMessages.exchange(nullptr, std::memory_order_acquire);
+    while (message != nullptr) {
         QueuedMessageInfo* info = &message->queuedMessageInfo;
-        info->id = id;
-        info->destination = message->destination;
-        info->packets = message;
-        info->unsentBytes = message->messageLength;
-        info->packetsGranted =
-            std::min(unscheduledPacketLimit, message->numPackets);
-        info->priority = policy.priority;
-        info->packetsSent = 0;
-        // Insert and move message into the correct order in the priority queue.
-        sendQueue.push_front(&info->sendQueueNode);
-        Intrusive::deprioritize<Message>(&sendQueue, &info->sendQueueNode,
-                                         QueuedMessageInfo::ComparePriority());
-        sendReady.store(true);
+        Message* next = info->stagedNext;
+        info->stagedNext = nullptr;
+        // Insert the message at its position in the priority queue.
+        shard->sendQueue.insert(&info->sendQueueNode);
+        message = next;
     }
 }
 
@@ -857,21 +1324,236 @@ Sender::cancelMessage(Sender::Message* message)
     if (bucket->messages.contains(&message->bucketNode)) {
         bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
         bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
-        if (message->numPackets > 1 &&
+        if ((message->numPackets > 1 ||
+             (message->options & OutMessage::Options::STREAM)) &&
             message->state == OutMessage::Status::IN_PROGRESS) {
             // Check to see if the message needs to be dequeued.
-            SpinLock::Lock lock_queue(queueMutex);
+            QueuedMessageInfo* info = &message->queuedMessageInfo;
+            SendShard* shard = &sendShards[info->shard];
+            SpinLock::Lock lock_queue(shard->queueMutex);
+            mergeStagedMessages(shard);
             // Recheck state with lock in case it change right before this.
             if (message->state == OutMessage::Status::IN_PROGRESS) {
-                QueuedMessageInfo* info = &message->queuedMessageInfo;
-                assert(sendQueue.contains(&info->sendQueueNode));
-                sendQueue.remove(&info->sendQueueNode);
+                assert(shard->sendQueue.contains(&info->sendQueueNode));
+                shard->sendQueue.remove(&info->sendQueueNode);
             }
         }
         message->state.store(OutMessage::Status::CANCELED);
     }
 }
 
+/**
+ * Make any newly completed packets of an open streamed message available for
+ * transmission.
+ *
+ * Called on the application's thread when data is appended to a message that
+ * was sent with OutMessage::Options::STREAM.  Only full packets are published
+ * while the stream is open: every non-final packet's data offset is implied
+ * by its index, so a partial packet cannot be transmitted and then extended.
+ * The trailing partial packet (if any) stays private to the application until
+ * more data arrives or the message is closed.
+ *
+ * @param message
+ *      Message whose appended data should be published.
+ */
+void
+Sender::publishStreamData(Sender::Message* message)
+{
+    QueuedMessageInfo* info = &message->queuedMessageInfo;
+    int target = message->messageLength / message->PACKET_DATA_LENGTH;
+    int published = info->packetsPublished.load(std::memory_order_relaxed);
+    if (target <= published) {
+        // No newly completed packet; nothing to publish.
+        return;
+    }
+
+    // Write the transport header for each newly completed packet.  The
+    // carried totalLength is only the number of bytes produced so far;
+    // FLAG_STREAM_OPEN tells the receiver that the length may still grow.
+    Protocol::Packet::DataHeader headerTemplate(
+        message->source.port, message->destination.port, message->id,
+        Util::downCast<uint32_t>(message->messageLength),
+        message->policyVersion,
+        Util::downCast<uint16_t>(message->unscheduledIndexLimit), 0);
+    headerTemplate.flags |= Protocol::Packet::DataHeader::FLAG_STREAM_OPEN;
+    for (int i = published; i < target; ++i) {
+        Driver::Packet* packet = message->getPacket(i);
+        assert(packet != nullptr);
+        headerTemplate.index = Util::downCast<uint16_t>(i);
+        std::memcpy(packet->payload, &headerTemplate, sizeof(headerTemplate));
+    }
+
+    SendShard* shard = &sendShards[info->shard];
+    SpinLock::Lock lock_queue(shard->queueMutex);
+    if (!info->open) {
+        // The message was concurrently closed or canceled; the closing path
+        // took care of publication.
+        return;
+    }
+    int newBytes = (target - published) * message->PACKET_DATA_LENGTH;
+    info->unsentBytes += newBytes;
+    info->publishedBytes += newBytes;
+    // The release pairs with the acquire in applyGrant() so that a grant
+    // raised against the new watermark cannot expose a packet whose header
+    // write is not yet visible to the transmitting thread.
+    info->packetsPublished.store(target, std::memory_order_release);
+    // The unscheduled allowance may extend into the newly published packets.
+    int newGrant = std::min(message->unscheduledIndexLimit, target);
+    int prevGrant = info->packetsGranted.load(std::memory_order_relaxed);
+    while (prevGrant < newGrant &&
+           !info->packetsGranted.compare_exchange_weak(
+               prevGrant, newGrant, std::memory_order_release)) {
+    }
+    // Keep the SRPT order: unsentBytes grew, so the message can only move
+    // down in the queue.  The message may still be staged rather than queued.
+    if (shard->sendQueue.contains(&info->sendQueueNode)) {
+        shard->sendQueue.update(&info->sendQueueNode);
+    }
+    shard->sendReady.store(true);
+}
+
+/**
+ * Finalize the length of a streamed message; see Homa::OutMessage::close().
+ *
+ * Publishes the message's remaining bytes (including a trailing partial
+ * packet) with headers that carry the final message length, after which the
+ * message finishes like an ordinary send.  If every packet had already been
+ * transmitted, the last packet is retransmitted so the receiver learns the
+ * final length.
+ *
+ * @param message
+ *      Message whose length should be finalized.
+ */
+void
+Sender::closeMessage(Sender::Message* message)
+{
+    MessageBucket* bucket = messageBuckets.getBucket(message->id);
+    SpinLock::Lock lock(bucket->mutex);
+    if (!(message->options & OutMessage::Options::STREAM)) {
+        WARNING(
+            "Ignoring close of message (%lu, %lu) that was not sent with "
+            "the STREAM option",
+            message->id.transportId, message->id.sequence);
+        return;
+    }
+    if (message->state.load() != OutMessage::Status::IN_PROGRESS) {
+        // The message was canceled, failed, or already closed; nothing to do.
+        return;
+    }
+    if (message->messageLength == 0) {
+        WARNING(
+            "Ignoring close of streamed message (%lu, %lu) that contains no "
+            "data; a streamed message must contain at least one byte",
+            message->id.transportId, message->id.sequence);
+        return;
+    }
+
+    QueuedMessageInfo* info = &message->queuedMessageInfo;
+    int target = (message->messageLength + message->PACKET_DATA_LENGTH - 1) /
+                 message->PACKET_DATA_LENGTH;
+    int published = info->packetsPublished.load(std::memory_order_relaxed);
+
+    // Write the final headers for any packets that were never published; no
+    // FLAG_STREAM_OPEN and the definitive total length.
+    Protocol::Packet::DataHeader headerTemplate(
+        message->source.port, message->destination.port, message->id,
+        Util::downCast<uint32_t>(message->messageLength),
+        message->policyVersion,
+        Util::downCast<uint16_t>(message->unscheduledIndexLimit), 0);
+    for (int i = published; i < target; ++i) {
+        Driver::Packet* packet = message->getPacket(i);
+        assert(packet != nullptr);
+        headerTemplate.index = Util::downCast<uint16_t>(i);
+        std::memcpy(packet->payload, &headerTemplate, sizeof(headerTemplate));
+    }
+
+    bool sentNow = false;
+    Driver::Packet* finalPacket = nullptr;
+    int finalPriority = 0;
+    {
+        SendShard* shard = &sendShards[info->shard];
+        SpinLock::Lock lock_queue(shard->queueMutex);
+        mergeStagedMessages(shard);
+        info->open = false;
+        info->unsentBytes += message->messageLength - info->publishedBytes;
+        info->publishedBytes = message->messageLength;
+        info->packetsPublished.store(target, std::memory_order_release);
+        int newGrant = std::min(message->unscheduledIndexLimit, target);
+        int prevGrant = info->packetsGranted.load(std::memory_order_relaxed);
+        while (prevGrant < newGrant &&
+               !info->packetsGranted.compare_exchange_weak(
+                   prevGrant, newGrant, std::memory_order_release)) {
+        }
+        // Packets that were published while the stream was open but have not
+        // been transmitted yet can carry the final length as well.
+        for (int i = info->packetsSent; i < published; ++i) {
+            Driver::Packet* packet = message->getPacket(i);
+            assert(packet != nullptr);
+            Protocol::Packet::DataHeader* header =
+                static_cast<Protocol::Packet::DataHeader*>(packet->payload);
+            header->totalLength =
+                Util::downCast<uint32_t>(message->messageLength);
+            header->flags = Util::downCast<uint8_t>(
+                header->flags &
+                ~Protocol::Packet::DataHeader::FLAG_STREAM_OPEN);
+        }
+        if (info->packetsSent == target) {
+            // Every packet was already transmitted; retransmit the last one
+            // so the receiver learns the final length, and finish the send
+            // here since trySend() has nothing left to do for this message.
+            finalPacket = message->getPacket(target - 1);
+            assert(finalPacket != nullptr);
+            Protocol::Packet::DataHeader* header =
+                static_cast<Protocol::Packet::DataHeader*>(
+                    finalPacket->payload);
+            header->totalLength =
+                Util::downCast<uint32_t>(message->messageLength);
+            header->flags = Util::downCast<uint8_t>(
+                header->flags &
+                ~Protocol::Packet::DataHeader::FLAG_STREAM_OPEN);
+            finalPriority = info->priority.load(std::memory_order_relaxed);
+            assert(shard->sendQueue.contains(&info->sendQueueNode));
+            shard->sendQueue.remove(&info->sendQueueNode);
+            message->state.store(OutMessage::Status::SENT);
+            sentNow = true;
+        } else {
+            if (shard->sendQueue.contains(&info->sendQueueNode)) {
+                shard->sendQueue.update(&info->sendQueueNode);
+            }
+            shard->sendReady.store(true);
+        }
+    }
+    if (sentNow) {
+        Perf::counters.tx_data_pkts.add(1);
+        Perf::counters.tx_bytes.add(finalPacket->length +
+                                    finalPacket->extLength);
+        if (Perf::perPeerStatsEnabled()) {
+            Perf::PeerCounters* peerCounters =
+                Perf::getPeerCounters(message->destination.ip);
+            peerCounters->tx_data_pkts.add(1);
+            peerCounters->tx_bytes.add(finalPacket->length +
+                                       finalPacket->extLength);
+        }
+        driver->sendPacket(finalPacket, message->destination.ip,
+                           finalPriority);
+        Perf::counters
+            .tx_sent_latency[Perf::messageSizeClass(
+                Util::downCast<uint32_t>(message->messageLength))]
+            .record(PerfUtils::Cycles::rdtsc() - message->sendStartCycles);
+        // The application is calling close(), so it must still hold the
+        // message; mirror the completion bookkeeping in trySendShard().
+        assert(message->held);
+        if (message->options & OutMessage::Options::NO_COMPLETION) {
+            bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
+            bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
+            bucket->removeMessage(message, lock);
+        } else if (message->options & OutMessage::Options::NO_KEEP_ALIVE) {
+            bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
+            bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
+        }
+    }
+}
+
 /**
  * Inform the Sender that a Message is no longer needed.
  *
@@ -891,15 +1573,84 @@ Sender::dropMessage(Sender::Message* message)
         // to be sent.
         bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
         bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
-        bucket->messages.remove(&message->bucketNode);
-        SpinLock::Lock lock_allocator(messageAllocator.mutex);
-        messageAllocator.pool.destroy(message);
-        Perf::counters.destroyed_tx_messages.add(1);
+        if (bucket->messages.contains(&message->bucketNode)) {
+            // NO_COMPLETION messages are removed from their bucket as soon
+            // as they are SENT.
+            bucket->removeMessage(message, lock);
+        }
+        // Defer the actual reclamation (packet release and destruction) to
+        // reclaimMessages() so that releasing a large message does not stall
+        // this call or the bucket.
+        SpinLock::Lock lock_reclaim(reclaimList.mutex);
+        reclaimList.list.push_back(&message->bucketNode);
     } else {
         // Defer deletion and wait for the message to be SENT.
     }
 }
 
+/**
+ * Return a Message to the empty NOT_STARTED state so it can be refilled and
+ * sent again, keeping the packet buffers the message has already accumulated.
+ *
+ * Only quiescent messages can be reset; a message that is IN_PROGRESS, or
+ * that is SENT and still awaiting acknowledgment, is left unchanged.
+ *
+ * @param message
+ *      The Sender::Message to be recycled.
+ */
+void
+Sender::resetMessage(Sender::Message* message)
+{
+    Protocol::MessageId msgId = message->id;
+    MessageBucket* bucket = messageBuckets.getBucket(msgId);
+    {
+        SpinLock::Lock lock(bucket->mutex);
+        OutMessage::Status status = message->state.load();
+        if (status == OutMessage::Status::IN_PROGRESS) {
+            WARNING("Ignoring reset of message (%lu, %lu) that is still being "
+                    "transmitted",
+                    msgId.transportId, msgId.sequence);
+            return;
+        } else if (status == OutMessage::Status::SENT &&
+                   bucket->messages.contains(&message->bucketNode)) {
+            // NO_COMPLETION messages leave their bucket when they are SENT;
+            // any other SENT message is still awaiting acknowledgment.
+            WARNING("Ignoring reset of message (%lu, %lu) that is still "
+                    "awaiting acknowledgment",
+                    msgId.transportId, msgId.sequence);
+            return;
+        }
+        bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
+        bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
+        if (bucket->messages.contains(&message->bucketNode)) {
+            bucket->removeMessage(message, lock);
+        }
+        message->state.store(OutMessage::Status::NOT_STARTED);
+    }
+    // The message is now invisible to the Sender's handlers and timeouts, so
+    // its contents can be cleared without holding the bucket mutex.  The
+    // packet buffers themselves are kept (numAllocatedPackets is unchanged)
+    // so that refilling the message performs no allocation work.
+    for (Message::ExternalBlock& block : message->externalBlocks) {
+        if (block.done != nullptr) {
+            block.done(block.arg);
+        }
+    }
+    message->externalBlocks.clear();
+    for (int i = 0; i < message->numAllocatedPackets; ++i) {
+        Driver::Packet* packet = message->packets.get(i);
+        assert(packet != nullptr);
+        packet->length = message->TRANSPORT_HEADER_LENGTH;
+        packet->extData = nullptr;
+        packet->extLength = 0;
+    }
+    message->start = 0;
+    message->messageLength = 0;
+    message->numPackets = 0;
+    message->transmitStartCycles = 0;
+    message->sendStartCycles = 0;
+}
+
 /**
  * Process any outbound messages in a given bucket that have timed out due to
  * lack of activity from the Receiver.
@@ -933,12 +1684,14 @@ Sender::checkMessageTimeouts(uint64_t now, MessageBucket* bucket)
         if (message->state != OutMessage::Status::COMPLETED) {
             if (message->state == OutMessage::Status::IN_PROGRESS) {
                 // Check to see if the message needs to be dequeued.
-                SpinLock::Lock lock_queue(queueMutex);
+                QueuedMessageInfo* info = &message->queuedMessageInfo;
+                SendShard* shard = &sendShards[info->shard];
+                SpinLock::Lock lock_queue(shard->queueMutex);
+                mergeStagedMessages(shard);
                 // Recheck state with lock in case it change right before this.
                 if (message->state == OutMessage::Status::IN_PROGRESS) {
-                    QueuedMessageInfo* info = &message->queuedMessageInfo;
-                    assert(sendQueue.contains(&info->sendQueueNode));
-                    sendQueue.remove(&info->sendQueueNode);
+                    assert(shard->sendQueue.contains(&info->sendQueueNode));
+                    shard->sendQueue.remove(&info->sendQueueNode);
                 }
             }
             message->state.store(OutMessage::Status::FAILED);
@@ -993,8 +1746,8 @@ Sender::checkPingTimeouts(uint64_t now, MessageBucket* bucket)
 
         // Check if sender still has packets to send
         if (message->state.load() == OutMessage::Status::IN_PROGRESS) {
-            SpinLock::Lock lock_queue(queueMutex);
             QueuedMessageInfo* info = &message->queuedMessageInfo;
+            SpinLock::Lock lock_queue(sendShards[info->shard].queueMutex);
             if (info->packetsSent < info->packetsGranted) {
                 // Sender is blocked on itself, no need to send ping
                 continue;
@@ -1012,88 +1765,186 @@ Sender::checkPingTimeouts(uint64_t now, MessageBucket* bucket)
 /**
  * Send out packets for any messages with unscheduled/granted bytes.
  *
+ * Sweeps every send queue shard, starting with the shard matched to the
+ * calling thread's identity; concurrent polling threads therefore start on
+ * different shards and only drain another thread's shard when their own has
+ * no work (work stealing).
+ *
  * Pulled out of poll() for ease of testing.
  */
-void
+uint32_t
 Sender::trySend()
+{
+    static thread_local const int preferredShard = static_cast<int>(
+        std::hash<std::thread::id>()(std::this_thread::get_id()) &
+        SEND_SHARD_MASK);
+    uint32_t packetsSent = 0;
+    for (int i = 0; i < NUM_SEND_SHARDS; ++i) {
+        packetsSent +=
+            trySendShard(&sendShards[(preferredShard + i) & SEND_SHARD_MASK]);
+    }
+    return packetsSent;
+}
+
+/**
+ * Send out packets for any messages in a single send queue shard with
+ * unscheduled/granted bytes.
+ *
+ * Pulled out of trySend() for ease of testing.
+ *
+ * @param shard
+ *      The shard whose sendQueue should be drained.
+ * @return
+ *      Number of data packets sent from this shard during this call.
+ */
+uint32_t
+Sender::trySendShard(SendShard* shard)
 {
     Perf::Timer timer;
     bool idle = true;
+    uint32_t packetsReleased = 0;
 
     // Skip when there are no messages to send.
-    if (!sendReady) {
-        return;
+    if (!shard->sendReady) {
+        return 0;
     }
 
-    // Skip sending if another thread is already working on it.
-    if (sending.test_and_set()) {
-        return;
+    // Skip sending if another thread is already working on this shard.
+    if (shard->sending.test_and_set()) {
+        return 0;
     }
 
+    TIME_TRACE("Sender::trySend: start", 0);
+
     /* The goal is to send out packets for messages that have bytes that have
      * been "granted" (both scheduled and unscheduled grants).  Messages with
      * the fewest remaining bytes to send (unsentBytes) are sent first (SRPT).
-     * Each time this method is called we will try to send enough packet to keep
-     * the NIC busy but not too many as to cause excessive queue in the NIC.
+     * Each time this method is called we will release as many packets as the
+     * pacer allows; the pacer spaces packet release times to the network's
+     * bandwidth so that the NIC queue stays shallow.
      */
-    SpinLock::UniqueLock lock_queue(queueMutex);
-    uint32_t queuedBytesEstimate = driver->getQueuedBytes();
+    SpinLock::UniqueLock lock_queue(shard->queueMutex);
+    // Clear the ready hint _before_ draining the staged stack (the standard
+    // MPSC drain order): a stageMessage() that pushes after the drain below
+    // will set the hint again, so a concurrent producer can never have both
+    // its message and its hint wiped out.  We will also set the hint again
+    // ourselves if we don't finish sending every granted packet this round.
+    shard->sendReady = false;
+    mergeStagedMessages(shard);
+    // Keep the driver corked for the whole drain so that the released DATA
+    // packets leave the NIC in hardware-sized bursts rather than one
+    // transmit call each.
+    ControlPacket::Corked corked(driver);
     std::vector<Protocol::MessageId> sentMessageIds;
     sentMessageIds.reserve(32);
-    // Optimistically assume we will finish sending every granted packet this
-    // round; we will set again sendReady if it turns out we don't finish.
-    sendReady = false;
-    auto it = sendQueue.begin();
-    while (it != sendQueue.end()) {
+    auto it = shard->sendQueue.begin();
+    while (it != shard->sendQueue.end()) {
         Message& message = *it;
         assert(message.state.load() == OutMessage::Status::IN_PROGRESS);
         QueuedMessageInfo* info = &message.queuedMessageInfo;
-        assert(info->packetsGranted <= info->packets->numPackets);
+        assert(info->packetsGranted <= info->packetsPublished);
+        const int packetsSentBefore = info->packetsSent;
+        // Collect the released packets and hand them to the driver a burst
+        // at a time; every packet of a message shares the same destination
+        // and priority.
+        Driver::Packet* burst[TX_BURST_SIZE];
+        uint16_t burstCount = 0;
         while (info->packetsSent < info->packetsGranted) {
             // There are packets to send
             idle = false;
             Driver::Packet* packet =
                 info->packets->getPacket(info->packetsSent);
             assert(packet != nullptr);
-            queuedBytesEstimate += packet->length;
-            // Check if the send limit would be reached...
-            if (queuedBytesEstimate > DRIVER_QUEUED_BYTE_LIMIT) {
+            // Check if the packet can be released without exceeding the
+            // network's bandwidth...
+            if (!pacer.tryReleasePacket(Util::downCast<uint32_t>(
+                    packet->length + packet->extLength))) {
                 break;
             }
-            // ... if not, send away!
+            // ... if so, send away!
+            if (grantSource != nullptr) {
+                // If the destination peer is owed a grant for a message
+                // inbound to our Receiver, fold it into this DATA packet
+                // instead of sending a standalone GRANT.
+                Protocol::Packet::DataHeader* dataHeader =
+                    static_cast<Protocol::Packet::DataHeader*>(packet->payload);
+                Protocol::MessageId grantId(0, 0);
+                uint32_t grantByteLimit = 0;
+                uint8_t grantPriority = 0;
+                if (grantSource->claimPiggybackGrant(message.destination.ip,
+                                                     &grantId, &grantByteLimit,
+                                                     &grantPriority)) {
+                    dataHeader->piggybackGrant = 1;
+                    dataHeader->grantId = grantId;
+                    dataHeader->grantByteLimit = grantByteLimit;
+                    dataHeader->grantPriority = grantPriority;
+                } else {
+                    // Clear any grant carried by a previous transmission of
+                    // this packet (e.g. a retransmit).
+                    dataHeader->piggybackGrant = 0;
+                }
+            }
             Perf::counters.tx_data_pkts.add(1);
-            Perf::counters.tx_bytes.add(packet->length);
-            driver->sendPacket(packet, message.destination.ip, info->priority);
-            int packetDataBytes =
-                packet->length - info->packets->TRANSPORT_HEADER_LENGTH;
+            Perf::counters.tx_bytes.add(packet->length + packet->extLength);
+            if (Perf::perPeerStatsEnabled()) {
+                Perf::PeerCounters* peerCounters =
+                    Perf::getPeerCounters(message.destination.ip);
+                peerCounters->tx_data_pkts.add(1);
+                peerCounters->tx_bytes.add(packet->length + packet->extLength);
+            }
+            burst[burstCount++] = packet;
+            ++packetsReleased;
+            if (burstCount == TX_BURST_SIZE) {
+                driver->sendPackets(burstCount, burst, message.destination.ip,
+                                    info->priority);
+                burstCount = 0;
+            }
+            int packetDataBytes = packet->length + packet->extLength -
+                                  info->packets->TRANSPORT_HEADER_LENGTH;
             assert(info->unsentBytes >= packetDataBytes);
             info->unsentBytes -= packetDataBytes;
             // The Message's unsentBytes only ever decreases.  See if the
             // updated Message should move up in the queue.
-            Intrusive::prioritize<Message>(
-                &sendQueue, &info->sendQueueNode,
-                QueuedMessageInfo::ComparePriority());
+            shard->sendQueue.update(&info->sendQueueNode);
             ++info->packetsSent;
         }
-        if (info->packetsSent >= info->packets->numPackets) {
+        if (burstCount > 0) {
+            driver->sendPackets(burstCount, burst, message.destination.ip,
+                                info->priority);
+        }
+        if (info->packetsSent >= info->packetsPublished && !info->open) {
             // We have finished sending the message.
             sentMessageIds.push_back(info->id);
             message.state.store(OutMessage::Status::SENT);
-            it = sendQueue.remove(it);
+            Perf::counters
+                .tx_sent_latency[Perf::messageSizeClass(
+                    Util::downCast<uint32_t>(message.messageLength))]
+                .record(PerfUtils::Cycles::rdtsc() - message.sendStartCycles);
+            it = shard->sendQueue.remove(it);
         } else if (info->packetsSent >= info->packetsGranted) {
-            // We have sent every granted packet.
+            // We have sent every granted packet; the message is now stalled
+            // until the receiver issues more grants.  Count the stall once,
+            // when it begins, rather than on every pass over the queue.
+            if (info->packetsSent > packetsSentBefore &&
+                Perf::perPeerStatsEnabled()) {
+                Perf::getPeerCounters(message.destination.ip)
+                    ->grant_stalls.add(1);
+            }
             ++it;
         } else {
-            // We hit the DRIVER_QUEUED_BYTES_LIMIT; stop sending for now.
-            // We didn't finish sending all granted packets.
-            sendReady = true;
+            // The pacer says it is not yet time to release the next packet;
+            // stop sending for now.  We didn't finish sending all granted
+            // packets.
+            shard->sendReady = true;
             break;
         }
     }
-    sending.clear();
+    shard->sending.clear();
+    TIME_TRACE("Sender::trySend: finished; messages fully sent",
+               sentMessageIds.size());
 
     // Unlock the queueMutex to process any SENT messages to ensure any bucket
-    // mutex is always acquired before the send queueMutex.
+    // mutex is always acquired before a shard's queueMutex.
     lock_queue.unlock();
     for (Protocol::MessageId& msgId : sentMessageIds) {
         MessageBucket* bucket = messageBuckets.getBucket(msgId);
@@ -1105,13 +1956,23 @@ Sender::trySend()
         }
 
         if (!message->held) {
-            // Ok to delete now that the message has been sent.
+            // Ok to delete now that the message has been sent; defer the
+            // actual reclamation so a large message does not stall the
+            // transmit loop.
+            bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
+            bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
+            bucket->removeMessage(message, lock);
+            SpinLock::Lock lock_reclaim(reclaimList.mutex);
+            reclaimList.list.push_back(&message->bucketNode);
+        } else if (message->options & OutMessage::Options::NO_COMPLETION) {
+            // Option: NO_COMPLETION
+            // The message is done as far as the transport is concerned; stop
+            // tracking it so no DONE confirmation, pings, or timeouts follow.
+            // The application still holds the message, so it is destroyed
+            // when released.
             bucket->messageTimeouts.cancelTimeout(&message->messageTimeout);
             bucket->pingTimeouts.cancelTimeout(&message->pingTimeout);
-            bucket->messages.remove(&message->bucketNode);
-            SpinLock::Lock lock_allocator(messageAllocator.mutex);
-            messageAllocator.pool.destroy(message);
-            Perf::counters.destroyed_tx_messages.add(1);
+            bucket->removeMessage(message, lock);
         } else if (message->options & OutMessage::Options::NO_KEEP_ALIVE) {
             // No timeouts need to be checked after sending the message when
             // the NO_KEEP_ALIVE option is enabled.
@@ -1123,6 +1984,7 @@ Sender::trySend()
     if (!idle) {
         Perf::counters.active_cycles.add(timer.split());
     }
+    return packetsReleased;
 }
 
 }  // namespace Core
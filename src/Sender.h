@@ -22,18 +22,35 @@
 
 #include <array>
 #include <atomic>
+#include <functional>
 #include <unordered_map>
+#include <vector>
 
+#include "FlatMap.h"
 #include "Intrusive.h"
+#include "Pacer.h"
+#include "PacketArray.h"
 #include "ObjectPool.h"
 #include "Policy.h"
 #include "Protocol.h"
 #include "SpinLock.h"
 #include "Timeout.h"
 
+/// Number of buckets in the Sender's and Receiver's MessageBucketMaps; must
+/// be a power of 2.  Overridable at build time (see the CMake variable of
+/// the same name) so large deployments can size the maps to their number of
+/// in-flight messages.
+#ifndef HOMA_MESSAGE_BUCKET_COUNT
+#define HOMA_MESSAGE_BUCKET_COUNT 256
+#endif
+
 namespace Homa {
 namespace Core {
 
+// Forward declaration; grants for inbound messages can be piggybacked on
+// outbound DATA packets (see Sender::setGrantSource()).
+class Receiver;
+
 /**
  * The Sender manages the sending of outbound messages based on the policy set
  * by the destination Transport's Receiver.  There is one Sender per Transport.
@@ -53,8 +70,33 @@ class Sender {
     virtual void handleGrantPacket(Driver::Packet* packet);
     virtual void handleUnknownPacket(Driver::Packet* packet);
     virtual void handleErrorPacket(Driver::Packet* packet);
-    virtual void poll();
+    virtual void applyGrant(Protocol::MessageId msgId, uint32_t byteLimit,
+                            uint8_t priority);
+    virtual uint32_t poll();
     virtual void checkTimeouts();
+    virtual void reclaimMessages();
+
+    /**
+     * Set the Receiver from which pending grants can be claimed and
+     * piggybacked on outgoing DATA packets.  A nullptr (the default)
+     * disables piggybacking.
+     */
+    void setGrantSource(Receiver* receiver)
+    {
+        grantSource = receiver;
+    }
+
+    /**
+     * Set the callback invoked when an outbound message reaches COMPLETED
+     * (see Homa::Transport::setWakeupCallback()).
+     *
+     * Called by the Transport that owns this Sender before packets start
+     * flowing.
+     */
+    void setWakeupCallback(std::function<void()> callback)
+    {
+        wakeupCallback = std::move(callback);
+    }
 
   private:
     /// Forward declarations
@@ -90,6 +132,11 @@ class Sender {
             , packetsGranted(0)
             , priority(0)
             , packetsSent(0)
+            , packetsPublished(0)
+            , publishedBytes(0)
+            , open(false)
+            , shard(0)
+            , stagedNext(nullptr)
             , sendQueueNode(message)
         {}
 
@@ -107,18 +154,53 @@ class Sender {
         /// The number of bytes that still need to be sent for a queued Message.
         int unsentBytes;
 
-        /// The number of packets that can be sent for this Message.
-        int packetsGranted;
+        /// The number of packets that can be sent for this Message.  This
+        /// watermark only ever increases while the message is queued, so the
+        /// GRANT handler raises it without taking the queueMutex and trySend()
+        /// reads it as an atomic.
+        std::atomic<int> packetsGranted;
 
         /// The network priority at which this Message should be sent.
-        int priority;
+        /// Updated alongside packetsGranted; readers may briefly see a new
+        /// watermark with the old priority, which only affects the priority
+        /// of a single packet.
+        std::atomic<int> priority;
 
         /// The number of packets that have been sent for this Message.
         int packetsSent;
 
+        /// The number of packets of this Message that carry transport headers
+        /// and may be transmitted.  Equal to the message's packet count for an
+        /// ordinary send; for a message sent with Options::STREAM it trails
+        /// the packets the application is still filling and advances as
+        /// appended data is published (see Sender::publishStreamData()).
+        /// Raised under the queueMutex but read as an atomic by the GRANT
+        /// handler.
+        std::atomic<int> packetsPublished;
+
+        /// The number of message bytes contained in the published packets;
+        /// used to rebuild unsentBytes when a message restarts.  Equal to the
+        /// message's length for an ordinary send.
+        int publishedBytes;
+
+        /// True while the application may still append to this Message (sent
+        /// with Options::STREAM and not yet closed); the Message cannot
+        /// transition to SENT while open.
+        bool open;
+
+        /// Index of the SendShard that holds this Message while it is queued;
+        /// assigned (by hashing the destination address) when the message is
+        /// first queued and stable for the lifetime of the send.
+        int shard;
+
+        /// Link to the next Message in the Sender's lock-free stagedMessages
+        /// stack.  Only valid while the Message is staged (i.e. between a
+        /// call to stageMessage() and the next mergeStagedMessages()).
+        Message* stagedNext;
+
         /// Intrusive structure used to enqueue the associated Message into
         /// the sendQueue.
-        Intrusive::List<Message>::Node sendQueueNode;
+        Intrusive::SkipList<Message, ComparePriority>::Node sendQueueNode;
     };
 
     /**
@@ -142,14 +224,18 @@ class Sender {
             , source{driver->getLocalAddress(), sourcePort}
             , destination()
             , options(Options::NONE)
+            , policyVersion(0)
+            , unscheduledIndexLimit(0)
             , held(true)
             , start(0)
             , messageLength(0)
             , numPackets(0)
-            , occupied()
-            // packets is not initialized to reduce the work done during
-            // construction. See Message::occupied.
+            , numAllocatedPackets(0)
+            , packets()
+            , externalBlocks()
             , state(Status::NOT_STARTED)
+            , transmitStartCycles(0)
+            , sendStartCycles(0)
             , bucketNode(this)
             , messageTimeout(this)
             , pingTimeout(this)
@@ -158,21 +244,43 @@ class Sender {
 
         virtual ~Message();
         virtual void append(const void* source, size_t count);
+        virtual void appendExternal(const void* source, size_t count,
+                                    void (*done)(void* arg), void* arg);
         virtual void cancel();
+        virtual void close();
         virtual Status getStatus() const;
         virtual size_t length() const;
         virtual void prepend(const void* source, size_t count);
         virtual void release();
+        virtual void reset();
         virtual void reserve(size_t count);
         virtual void send(SocketAddress destination,
                           Options options = Options::NONE);
 
       private:
         /// Define the maximum number of packets that a message can hold.
-        static const size_t MAX_MESSAGE_PACKETS = 1024;
+        /// Packet indexes are carried in 16-bit protocol fields (e.g.
+        /// Protocol::Packet::DataHeader::index), so this is the protocol's
+        /// ceiling; the PacketArray only allocates storage for the packets a
+        /// message actually contains.
+        static const size_t MAX_MESSAGE_PACKETS = 65536;
+
+        /**
+         * Describes an externally-owned buffer that was added to this message
+         * via appendExternal().
+         */
+        struct ExternalBlock {
+            /// Callback that should be invoked when the transport no longer
+            /// needs the buffer; nullptr if no notification was requested.
+            void (*done)(void* arg);
+
+            /// Argument passed verbatim to the done callback.
+            void* arg;
+        };
 
         Driver::Packet* getPacket(size_t index) const;
         Driver::Packet* getOrAllocPacket(size_t index);
+        void allocMissingPackets(size_t firstIndex, size_t lastIndex);
 
         /// The Sender responsible for sending this message.
         Sender* const sender;
@@ -200,6 +308,15 @@ class Sender {
         /// Contains flags for any requested optional send behavior.
         Options options;
 
+        /// Version of the network priority policy captured when this message
+        /// was sent; packets published after send() (Options::STREAM) carry
+        /// the same version as the packets sent with them.
+        uint8_t policyVersion;
+
+        /// The unscheduled packet limit captured when this message was sent;
+        /// see policyVersion.
+        int unscheduledIndexLimit;
+
         /// True if a pointer to this message is accessible by the application
         /// (e.g. the message has been allocated via allocMessage() but has not
         /// been release via dropMessage()); false, otherwise.
@@ -214,17 +331,38 @@ class Sender {
         /// Number of packets currently contained in this message.
         int numPackets;
 
-        /// Bit array representing which entires in the _packets_ array are set.
-        /// Used to avoid having to zero out the entire _packets_ array.
-        std::bitset<MAX_MESSAGE_PACKETS> occupied;
+        /// Number of packets currently allocated to this message; always at
+        /// least numPackets.  reset() keeps a recycled message's packets
+        /// allocated so they can be reused, so the two counts differ until
+        /// the message is refilled.
+        int numAllocatedPackets;
 
         /// Collection of Packet objects that make up this context's Message.
         /// These Packets will be released when this context is destroyed.
-        Driver::Packet* packets[MAX_MESSAGE_PACKETS];
+        /// Small messages use only the inline slots; larger messages allocate
+        /// overflow extents on demand.
+        PacketArray<MAX_MESSAGE_PACKETS> packets;
+
+        /// Externally-owned buffers pinned into this message by
+        /// appendExternal().  The done callbacks are invoked when this message
+        /// is destroyed.
+        std::vector<ExternalBlock> externalBlocks;
 
         /// This message's current state.
         std::atomic<Status> state;
 
+        /// Cycle time at which this message's initial packet burst was
+        /// transmitted; used to take an RTT sample when the first GRANT
+        /// arrives.  Reset to 0 once a sample has been taken.  Access to this
+        /// member is protected by the associated MessageBucket::mutex.
+        uint64_t transmitStartCycles;
+
+        /// Cycle time at which the application called send() on this message;
+        /// used to record latency distributions when the message reaches the
+        /// SENT and COMPLETED states.  Unlike transmitStartCycles, this member
+        /// is never reset.
+        uint64_t sendStartCycles;
+
         /// Intrusive structure used by the Sender to hold on to this Message
         /// in one of the Sender's MessageBuckets.  Access to this structure
         /// is protected by the associated MessageBucket::mutex;
@@ -243,7 +381,7 @@ class Sender {
 
         /// Intrusive structure used by the Sender to keep track of this Message
         /// if it has been queued to be sent.  Access to this structure is
-        /// protected by the Sender::queueMutex.
+        /// protected by the owning SendShard's queueMutex.
         QueuedMessageInfo queuedMessageInfo;
 
         friend class Sender;
@@ -265,13 +403,18 @@ class Sender {
          * @param pingIntervalCycles
          *      Number of cycles of inactivity to wait between checking on the
          *      liveness of a Message.
+         * @param earliestTimeout
+         *      Pointer to the Sender's cached earliest timeout expiration
+         *      time; shared by the timeout managers of all buckets.
          */
         explicit MessageBucket(uint64_t messageTimeoutCycles,
-                               uint64_t pingIntervalCycles)
-            : mutex()
+                               uint64_t pingIntervalCycles,
+                               std::atomic<uint64_t>* earliestTimeout)
+            : mutex("Sender::MessageBucket::mutex")
             , messages()
-            , messageTimeouts(messageTimeoutCycles)
-            , pingTimeouts(pingIntervalCycles)
+            , messageIndex()
+            , messageTimeouts(messageTimeoutCycles, earliestTimeout)
+            , pingTimeouts(pingIntervalCycles, earliestTimeout)
         {}
 
         /**
@@ -289,14 +432,40 @@ class Sender {
                              const SpinLock::Lock& lock)
         {
             (void)lock;
-            Message* message = nullptr;
-            for (auto it = messages.begin(); it != messages.end(); ++it) {
-                if (it->id == msgId) {
-                    message = &(*it);
-                    break;
-                }
-            }
-            return message;
+            Message** message = messageIndex.find(msgId);
+            return message != nullptr ? *message : nullptr;
+        }
+
+        /**
+         * Add a Message to this bucket, making it findable by its MessageId.
+         *
+         * @param message
+         *      Message to be added; must not already be in the bucket.
+         * @param lock
+         *      Reminder to hold the MessageBucket::mutex during this call. (Not
+         *      used)
+         */
+        void addMessage(Message* message, const SpinLock::Lock& lock)
+        {
+            (void)lock;
+            messages.push_back(&message->bucketNode);
+            messageIndex.insert(message->id, message);
+        }
+
+        /**
+         * Remove a Message from this bucket.
+         *
+         * @param message
+         *      Message to be removed.
+         * @param lock
+         *      Reminder to hold the MessageBucket::mutex during this call. (Not
+         *      used)
+         */
+        void removeMessage(Message* message, const SpinLock::Lock& lock)
+        {
+            (void)lock;
+            messageIndex.remove(message->id);
+            messages.remove(&message->bucketNode);
         }
 
         /// Mutex protecting the contents of this bucket.
@@ -305,6 +474,12 @@ class Sender {
         /// Collection of outbound messages
         Intrusive::List<Message> messages;
 
+        /// Hash index mapping a MessageId to the corresponding Message in
+        /// _messages_; used so inbound control packets can resolve their
+        /// Message in O(1) instead of scanning the list.
+        FlatMap<Protocol::MessageId, Message*, Protocol::MessageId::Hasher>
+            messageIndex;
+
         /// Maintains Message objects in increasing order of timeout.
         TimeoutManager<Message> messageTimeouts;
 
@@ -319,9 +494,12 @@ class Sender {
     struct MessageBucketMap {
         /**
          * The number of buckets in a MessageBuckets in this map.  This must be
-         * a power of 2.
+         * a power of 2.  Large deployments with many in-flight messages can
+         * raise the default (256) at build time by defining
+         * HOMA_MESSAGE_BUCKET_COUNT (see the CMake variable of the same
+         * name).
          */
-        static const int NUM_BUCKETS = 256;
+        static const int NUM_BUCKETS = HOMA_MESSAGE_BUCKET_COUNT;
 
         // Make sure the number of buckets is a power of 2.
         static_assert(Util::isPowerOfTwo(NUM_BUCKETS));
@@ -329,10 +507,7 @@ class Sender {
         /**
          * Bit mask used to map from a hashed key to the bucket index.
          */
-        static const uint HASH_KEY_MASK = 0xFF;
-
-        // Make sure bit mask correctly matches the number of buckets.
-        static_assert(NUM_BUCKETS == HASH_KEY_MASK + 1);
+        static const uint HASH_KEY_MASK = NUM_BUCKETS - 1;
 
         /**
          * Helper method to create the set of buckets.
@@ -343,14 +518,18 @@ class Sender {
          * @param pingIntervalCycles
          *      Number of cycles of inactivity to wait between checking on the
          *      liveness of a Message.
+         * @param earliestTimeout
+         *      Pointer to the Sender's cached earliest timeout expiration
+         *      time; shared by the timeout managers of all buckets.
          */
         static std::array<MessageBucket*, NUM_BUCKETS> makeBuckets(
-            uint64_t messageTimeoutCycles, uint64_t pingIntervalCycles)
+            uint64_t messageTimeoutCycles, uint64_t pingIntervalCycles,
+            std::atomic<uint64_t>* earliestTimeout)
         {
             std::array<MessageBucket*, NUM_BUCKETS> buckets;
             for (int i = 0; i < NUM_BUCKETS; ++i) {
-                buckets[i] =
-                    new MessageBucket(messageTimeoutCycles, pingIntervalCycles);
+                buckets[i] = new MessageBucket(
+                    messageTimeoutCycles, pingIntervalCycles, earliestTimeout);
             }
             return buckets;
         }
@@ -364,10 +543,15 @@ class Sender {
          * @param pingIntervalCycles
          *      Number of cycles of inactivity to wait between checking on the
          *      liveness of a Message.
+         * @param earliestTimeout
+         *      Pointer to the Sender's cached earliest timeout expiration
+         *      time; shared by the timeout managers of all buckets.
          */
         explicit MessageBucketMap(uint64_t messageTimeoutCycles,
-                                  uint64_t pingIntervalCycles)
-            : buckets(makeBuckets(messageTimeoutCycles, pingIntervalCycles))
+                                  uint64_t pingIntervalCycles,
+                                  std::atomic<uint64_t>* earliestTimeout)
+            : buckets(makeBuckets(messageTimeoutCycles, pingIntervalCycles,
+                                  earliestTimeout))
             , hasher()
         {}
 
@@ -398,13 +582,82 @@ class Sender {
         Protocol::MessageId::Hasher hasher;
     };
 
+    /**
+     * A single shard of the send queue.
+     *
+     * Messages are assigned to a shard by hashing their destination address,
+     * so all messages bound for the same peer share a shard and retain their
+     * SRPT order relative to each other.  Each shard is an independent copy
+     * of the former global send queue state and is drained independently; a
+     * polling thread starts with the shard matched to its identity and sweeps
+     * the remaining shards afterwards, stealing their work when the owners
+     * are not sending.  SRPT is thus approximated globally without a single
+     * global ordering point on the TX path.
+     */
+    struct SendShard {
+        /**
+         * SendShard constructor.
+         */
+        SendShard()
+            : queueMutex("Sender::SendShard::queueMutex")
+            , sendQueue()
+            , stagedMessages(nullptr)
+            , sending()
+            , sendReady(false)
+        {}
+
+        /// Protects this shard's sendQueue.
+        SpinLock queueMutex;
+
+        /// Outbound messages that have unsent packets, kept in order of
+        /// priority (fewest unsentBytes first).  A skiplist so that
+        /// insertions and grant-driven repositions stay O(log n) under
+        /// congestion instead of walking a sorted list.
+        Intrusive::SkipList<Message, QueuedMessageInfo::ComparePriority>
+            sendQueue;
+
+        /// Head of a lock-free MPSC stack of newly queued messages waiting to
+        /// be merged into this shard's sendQueue.  Producers (e.g.
+        /// sendMessage()) push onto this stack without taking the queueMutex;
+        /// the staged messages are merged into the sorted sendQueue in
+        /// batches by holders of the queueMutex (see mergeStagedMessages()).
+        std::atomic<Message*> stagedMessages;
+
+        /// True if some thread is currently draining this shard; used so a
+        /// sweeping thread skips shards that are already being serviced
+        /// instead of blocking on them.
+        std::atomic_flag sending = ATOMIC_FLAG_INIT;
+
+        /// Hint whether this shard holds messages ready to be sent (i.e.
+        /// there are granted messages in the sendQueue).  Encoded into a
+        /// single bool so that checking if there is work to do is more
+        /// efficient.
+        std::atomic<bool> sendReady;
+    };
+
     void sendMessage(Sender::Message* message, SocketAddress destination,
                      Message::Options options = Message::Options::NONE);
     void cancelMessage(Sender::Message* message);
+    void closeMessage(Sender::Message* message);
+    void publishStreamData(Sender::Message* message);
     void dropMessage(Sender::Message* message);
+    void resetMessage(Sender::Message* message);
     void checkMessageTimeouts(uint64_t now, MessageBucket* bucket);
     void checkPingTimeouts(uint64_t now, MessageBucket* bucket);
-    void trySend();
+    void stageMessage(Sender::Message* message);
+    void mergeStagedMessages(SendShard* shard);
+    uint32_t trySend();
+    uint32_t trySendShard(SendShard* shard);
+
+    /**
+     * Return the index of the SendShard that should hold messages bound for
+     * the given destination.
+     */
+    static int getSendShardIndex(IpAddress destination)
+    {
+        return static_cast<int>(IpAddress::Hasher()(destination) &
+                                SEND_SHARD_MASK);
+    }
 
     /// Transport identifier.
     const uint64_t transportId;
@@ -416,44 +669,69 @@ class Sender {
     /// Provider of network packet priority decisions.
     Policy::Manager* const policyManager;
 
+    /// Receiver from which pending grants are claimed so they can be
+    /// piggybacked on outgoing DATA packets; nullptr disables piggybacking.
+    /// Set once by the owning Transport before packets start flowing.
+    Receiver* grantSource;
+
+    /// Invoked, outside any Sender lock, when a message reaches COMPLETED;
+    /// empty if no callback is registered.  Set once by the owning Transport
+    /// before packets start flowing (see setWakeupCallback()).
+    std::function<void()> wakeupCallback;
+
     /// The sequence number to be used for the next Message.
     std::atomic<uint64_t> nextMessageSequenceNumber;
 
-    /// The maximum number of bytes that should be queued in the Driver.
-    const uint32_t DRIVER_QUEUED_BYTE_LIMIT;
+    /// Cached lower bound on the earliest expiration time of any timeout in
+    /// any bucket; lowered by TimeoutManager::setTimeout().  Lets
+    /// checkTimeouts() return in O(1) when no timeout is near.
+    std::atomic<uint64_t> earliestTimeout;
 
     /// Tracks all outbound messages being sent by the Sender.
     MessageBucketMap messageBuckets;
 
-    /// Protects the readyQueue.
-    SpinLock queueMutex;
+    /// The largest number of DATA packets handed to the Driver in a single
+    /// Driver::sendPackets() burst; sized to a typical NIC transmit burst
+    /// (e.g. Drivers::DPDK::MAX_PKT_BURST).
+    static const uint16_t TX_BURST_SIZE = 32;
 
-    /// A list of outbound messages that have unsent packets.  Messages are kept
-    /// in order of priority.
-    Intrusive::List<Message> sendQueue;
+    /// The number of independent send queue shards.  This must be a power
+    /// of 2.
+    static const int NUM_SEND_SHARDS = 4;
 
-    /// True if the Sender is currently executing trySend(); false, otherwise.
-    /// Use to prevent concurrent trySend() calls from blocking on each other.
-    std::atomic_flag sending = ATOMIC_FLAG_INIT;
+    // Make sure the number of shards is a power of 2.
+    static_assert(Util::isPowerOfTwo(NUM_SEND_SHARDS));
 
-    /// Hint whether there are messages ready to be sent (i.e. there are granted
-    /// messages in the sendQueue. Encoded into a single bool so that checking
-    /// if there is work to do is more efficient.
-    std::atomic<bool> sendReady;
+    /// Bit mask used to map a hashed destination address to a shard index.
+    static const uint SEND_SHARD_MASK = NUM_SEND_SHARDS - 1;
 
-    /// The index of the next bucket in the messageBuckets::buckets array to
-    /// process in the poll loop. The index is held in the lower order bits of
-    /// this variable; the higher order bits should be masked off using the
-    /// MessageBucketMap::HASH_KEY_MASK bit mask.
-    std::atomic<uint> nextBucketIndex;
+    /// The send queue, split into independently locked and drained shards to
+    /// remove the global ordering point on the TX path (see SendShard).
+    SendShard sendShards[NUM_SEND_SHARDS];
 
-    /// Used to allocate Message objects.
+    /// Paces the release of outbound DATA packets to the network's bandwidth;
+    /// shared by all send queue shards so the aggregate transmit rate stays
+    /// within the network's bandwidth.
+    Pacer pacer;
+
+    /// Used to allocate Message objects; thread-safe with per-thread magazine
+    /// caches so allocation does not serialize all app threads on one lock.
+    MagazineObjectPool<Message> messageAllocator;
+
+    /// Messages that have been removed from all tracking structures but whose
+    /// packets and memory have not yet been returned.  Reclaimed in bounded
+    /// batches by reclaimMessages() so that releasing a large message never
+    /// stalls a single poll iteration.
     struct {
-        /// Protects the messageAllocator.pool
+        /// Protects access to reclaimList.list.
         SpinLock mutex;
-        /// Pool allocator for Message objects.
-        ObjectPool<Message> pool;
-    } messageAllocator;
+        /// The messages awaiting reclamation, linked by their bucketNode.
+        Intrusive::List<Message> list;
+    } reclaimList;
+
+    /// TransportImpl's pipelined mode drives trySend() directly from a
+    /// dedicated stage thread.
+    friend class TransportImpl;
 };
 
 }  // namespace Core
@@ -17,20 +17,27 @@
 #include <Homa/Debug.h>
 #include <gtest/gtest.h>
 
+#include <cstdint>
+#include <cstring>
+
 #include "Mock/MockDriver.h"
 #include "Mock/MockPolicy.h"
+#include "Mock/MockReceiver.h"
 #include "Sender.h"
+#include "StringUtil.h"
 
 namespace Homa {
 namespace Core {
 namespace {
 
 using ::testing::_;
+using ::testing::DoAll;
 using ::testing::Eq;
 using ::testing::Mock;
 using ::testing::NiceMock;
 using ::testing::Pointee;
 using ::testing::Return;
+using ::testing::SetArgPointee;
 
 class SenderTest : public ::testing::Test {
   public:
@@ -42,7 +49,12 @@ class SenderTest : public ::testing::Test {
         , savedLogPolicy(Debug::getLogPolicy())
     {
         ON_CALL(mockDriver, getBandwidth).WillByDefault(Return(8000));
-        ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1031));
+        // Mock packets hold exactly 1000 payload bytes after the DATA
+        // header so the arithmetic in these tests stays round no matter how
+        // the header grows.
+        ON_CALL(mockDriver, getMaxPayloadSize)
+            .WillByDefault(
+                Return(1000 + sizeof(Protocol::Packet::DataHeader)));
         ON_CALL(mockDriver, getQueuedBytes).WillByDefault(Return(0));
         Debug::setLogPolicy(
             Debug::logPolicyFromString("src/ObjectPool@SILENT"));
@@ -75,9 +87,11 @@ class SenderTest : public ::testing::Test {
     {
         message->id = id;
         Sender::MessageBucket* bucket = sender->messageBuckets.getBucket(id);
-        bucket->messages.push_back(&message->bucketNode);
+        {
+            SpinLock::Lock lock_bucket(bucket->mutex);
+            bucket->addMessage(message, lock_bucket);
+        }
         if (queue) {
-            Sender::QueuedMessageInfo::ComparePriority comp;
             Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
             info->id = id;
             info->destination = message->destination;
@@ -85,12 +99,10 @@ class SenderTest : public ::testing::Test {
             info->unsentBytes = message->messageLength;
             info->packetsGranted = packetsGranted;
             info->packetsSent = 0;
-            // Insert and move message into the correct order in the priority
-            // queue.
-            sender->sendQueue.push_front(&info->sendQueueNode);
-            Intrusive::deprioritize<Sender::Message>(
-                &sender->sendQueue, &info->sendQueueNode,
-                Sender::QueuedMessageInfo::ComparePriority());
+            info->packetsPublished = message->numPackets;
+            info->publishedBytes = message->messageLength;
+            // Insert the message at its position in the priority queue.
+            sender->sendShards[0].sendQueue.insert(&info->sendQueueNode);
         }
         return message;
     }
@@ -98,12 +110,17 @@ class SenderTest : public ::testing::Test {
     static bool setMessagePacket(Sender::Message* message, int index,
                                  Driver::Packet* packet)
     {
-        if (message->occupied.test(index)) {
+        if (message->packets.get(index) != nullptr) {
             return false;
         }
-        message->packets[index] = packet;
-        message->occupied.set(index);
+        // A null packet grows the message without populating the slot,
+        // simulating a granted-but-not-yet-allocated packet.
+        if (packet != nullptr) {
+            message->packets.set(index, packet);
+            message->numAllocatedPackets++;
+        }
         message->numPackets++;
+        message->queuedMessageInfo.packetsPublished = message->numPackets;
         return true;
     }
 };
@@ -122,10 +139,10 @@ struct VectorHandler {
 
 TEST_F(SenderTest, allocMessage)
 {
-    EXPECT_EQ(0U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(0U, sender->messageAllocator.outstandingObjects);
     Sender::Message* message =
         dynamic_cast<Sender::Message*>(sender->allocMessage(0));
-    EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
 }
 
 TEST_F(SenderTest, handleDonePacket_basic)
@@ -158,6 +175,34 @@ TEST_F(SenderTest, handleDonePacket_basic)
     EXPECT_EQ(Homa::OutMessage::Status::COMPLETED, message->state);
 }
 
+TEST_F(SenderTest, handleDonePacket_wakeupCallback)
+{
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    addMessage(sender, id, message);
+    message->state = Homa::OutMessage::Status::SENT;
+
+    int wakeups = 0;
+    sender->setWakeupCallback([&wakeups] { ++wakeups; });
+
+    Protocol::Packet::DoneHeader* header =
+        static_cast<Protocol::Packet::DoneHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(2);
+
+    // The transition to COMPLETED invokes the callback once.
+    sender->handleDonePacket(&mockPacket);
+    EXPECT_EQ(Homa::OutMessage::Status::COMPLETED, message->state);
+    EXPECT_EQ(1, wakeups);
+
+    // A duplicate DONE causes no further wakeups.
+    sender->handleDonePacket(&mockPacket);
+    EXPECT_EQ(1, wakeups);
+}
+
 TEST_F(SenderTest, handleDonePacket_CANCELED)
 {
     Protocol::MessageId id = {42, 1};
@@ -331,6 +376,8 @@ TEST_F(SenderTest, handleResendPacket_basic)
     resendHdr->index = 3;
     resendHdr->num = 5;
     resendHdr->priority = 4;
+    memset(resendHdr->resendMask, 0xFF,
+           Protocol::Packet::ResendHeader::RESEND_MASK_BYTES);
 
     EXPECT_CALL(mockPolicyManager, getResendPriority).WillOnce(Return(7));
     EXPECT_CALL(mockDriver, sendPacket(Eq(packets[3]), _, _))
@@ -353,7 +400,52 @@ TEST_F(SenderTest, handleResendPacket_basic)
     EXPECT_EQ(7, priorities[3]);
     EXPECT_EQ(7, priorities[4]);
     EXPECT_EQ(0, priorities[5]);
-    EXPECT_TRUE(sender->sendReady.load());
+    EXPECT_TRUE(sender->sendShards[0].sendReady.load());
+
+    for (int i = 0; i < 10; ++i) {
+        delete packets[i];
+    }
+}
+
+TEST_F(SenderTest, handleResendPacket_selectiveMask)
+{
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    std::vector<Homa::Mock::MockDriver::MockPacket*> packets;
+    for (int i = 0; i < 10; ++i) {
+        packets.push_back(new Homa::Mock::MockDriver::MockPacket{payload});
+        setMessagePacket(message, i, packets[i]);
+    }
+    SenderTest::addMessage(sender, id, message, true, 5);
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    info->packetsSent = 5;
+    info->priority = 6;
+    EXPECT_EQ(5, info->packetsGranted);
+    EXPECT_EQ(10U, message->numPackets);
+
+    // The bitmap marks only packets 2 and 4 as missing; packet 3 arrived out
+    // of order and should not be retransmitted.
+    Protocol::Packet::ResendHeader* resendHdr =
+        static_cast<Protocol::Packet::ResendHeader*>(mockPacket.payload);
+    resendHdr->common.messageId = id;
+    resendHdr->index = 2;
+    resendHdr->num = 3;
+    resendHdr->priority = 4;
+    memset(resendHdr->resendMask, 0,
+           Protocol::Packet::ResendHeader::RESEND_MASK_BYTES);
+    resendHdr->resendMask[0] = 0x05;
+
+    EXPECT_CALL(mockPolicyManager, getResendPriority).WillOnce(Return(7));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packets[2]), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packets[3]), _, _)).Times(0);
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packets[4]), _, _)).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    sender->handleResendPacket(&mockPacket);
+
+    EXPECT_EQ(5U, info->packetsSent);
 
     for (int i = 0; i < 10; ++i) {
         delete packets[i];
@@ -520,6 +612,7 @@ TEST_F(SenderTest, handleGrantPacket_basic)
         dynamic_cast<Sender::Message*>(sender->allocMessage(0));
     SenderTest::addMessage(sender, id, message, true, 5);
     message->numPackets = 10;
+    message->queuedMessageInfo.packetsPublished = 10;
     message->state = Homa::OutMessage::Status::IN_PROGRESS;
     Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
     info->priority = 2;
@@ -542,7 +635,40 @@ TEST_F(SenderTest, handleGrantPacket_basic)
     EXPECT_EQ(6, info->priority);
     EXPECT_EQ(11000U, message->messageTimeout.expirationCycleTime);
     EXPECT_EQ(10100U, message->pingTimeout.expirationCycleTime);
-    EXPECT_TRUE(sender->sendReady.load());
+    EXPECT_TRUE(sender->sendShards[0].sendReady.load());
+}
+
+TEST_F(SenderTest, handleGrantPacket_rttSample)
+{
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    SenderTest::addMessage(sender, id, message, true, 5);
+    message->numPackets = 10;
+    message->queuedMessageInfo.packetsPublished = 10;
+    message->destination = SocketAddress{22, 60001};
+    message->state = Homa::OutMessage::Status::IN_PROGRESS;
+    message->transmitStartCycles = 4000;
+
+    Protocol::Packet::GrantHeader* header =
+        static_cast<Protocol::Packet::GrantHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+    header->byteLimit = 7000;
+    header->priority = 6;
+
+    // The first GRANT closes the loop on the initial packet burst; expect an
+    // RTT sample for the destination.  Later GRANTs should not sample again.
+    EXPECT_CALL(mockPolicyManager,
+                signalRttSample(Eq(message->destination.ip), Eq(6000)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(2);
+
+    sender->handleGrantPacket(&mockPacket);
+
+    EXPECT_EQ(0U, message->transmitStartCycles);
+
+    sender->handleGrantPacket(&mockPacket);
 }
 
 TEST_F(SenderTest, handleGrantPacket_excessiveGrant)
@@ -552,6 +678,7 @@ TEST_F(SenderTest, handleGrantPacket_excessiveGrant)
         dynamic_cast<Sender::Message*>(sender->allocMessage(0));
     SenderTest::addMessage(sender, id, message, true, 5);
     message->numPackets = 10;
+    message->queuedMessageInfo.packetsPublished = 10;
     message->state = Homa::OutMessage::Status::IN_PROGRESS;
     Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
     info->priority = 2;
@@ -576,7 +703,7 @@ TEST_F(SenderTest, handleGrantPacket_excessiveGrant)
     EXPECT_EQ(1U, handler.messages.size());
     const Debug::DebugMessage& m = handler.messages.at(0);
     EXPECT_STREQ("src/Sender.cc", m.filename);
-    EXPECT_STREQ("handleGrantPacket", m.function);
+    EXPECT_STREQ("applyGrant", m.function);
     EXPECT_EQ(int(Debug::LogLevel::WARNING), m.logLevel);
     EXPECT_EQ(
         "Message (42, 1) GRANT exceeds message length; granted packets: 11, "
@@ -589,7 +716,7 @@ TEST_F(SenderTest, handleGrantPacket_excessiveGrant)
     EXPECT_EQ(6, info->priority);
     EXPECT_EQ(11000U, message->messageTimeout.expirationCycleTime);
     EXPECT_EQ(10100U, message->pingTimeout.expirationCycleTime);
-    EXPECT_TRUE(sender->sendReady.load());
+    EXPECT_TRUE(sender->sendShards[0].sendReady.load());
 }
 
 TEST_F(SenderTest, handleGrantPacket_staleGrant)
@@ -599,6 +726,7 @@ TEST_F(SenderTest, handleGrantPacket_staleGrant)
         dynamic_cast<Sender::Message*>(sender->allocMessage(0));
     SenderTest::addMessage(sender, id, message, true, 5);
     message->numPackets = 10;
+    message->queuedMessageInfo.packetsPublished = 10;
     Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
     info->priority = 2;
     EXPECT_EQ(5, info->packetsGranted);
@@ -620,7 +748,7 @@ TEST_F(SenderTest, handleGrantPacket_staleGrant)
     EXPECT_EQ(2, info->priority);
     EXPECT_EQ(11000U, message->messageTimeout.expirationCycleTime);
     EXPECT_EQ(10100U, message->pingTimeout.expirationCycleTime);
-    EXPECT_FALSE(sender->sendReady.load());
+    EXPECT_FALSE(sender->sendShards[0].sendReady.load());
 }
 
 TEST_F(SenderTest, handleGrantPacket_dropGrant)
@@ -670,7 +798,7 @@ TEST_F(SenderTest, handleUnknownPacket_basic)
     info->packetsGranted = 4;
     info->priority = policyOld.priority;
     info->packetsSent = 4;
-    EXPECT_TRUE(sender->sendQueue.contains(&info->sendQueueNode));
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.contains(&info->sendQueueNode));
     EXPECT_EQ(0U, message->messageTimeout.expirationCycleTime);
     EXPECT_EQ(0U, message->pingTimeout.expirationCycleTime);
 
@@ -701,8 +829,8 @@ TEST_F(SenderTest, handleUnknownPacket_basic)
     EXPECT_EQ(3U, info->packetsGranted);
     EXPECT_EQ(policyNew.priority, info->priority);
     EXPECT_EQ(0U, info->packetsSent);
-    EXPECT_TRUE(sender->sendQueue.contains(&info->sendQueueNode));
-    EXPECT_TRUE(sender->sendReady.load());
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.contains(&info->sendQueueNode));
+    EXPECT_TRUE(sender->sendShards[0].sendReady.load());
 
     for (int i = 0; i < 5; ++i) {
         delete packets[i];
@@ -719,17 +847,19 @@ TEST_F(SenderTest, handleUnknownPacket_singlePacketMessage)
     Sender::Message* message =
         dynamic_cast<Sender::Message*>(sender->allocMessage(0));
     Homa::Mock::MockDriver::MockPacket dataPacket{payload};
-    Protocol::Packet::DataHeader* dataHeader =
-        static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload);
+    // Single-packet messages carry the compact DATA_SINGLE header.
+    Protocol::Packet::DataHeaderSingle* dataHeader =
+        static_cast<Protocol::Packet::DataHeaderSingle*>(dataPacket.payload);
     dataHeader->policyVersion = policyOld.version;
-    dataHeader->unscheduledIndexLimit = 2;
+    message->policyVersion = policyOld.version;
+    message->unscheduledIndexLimit = 2;
     setMessagePacket(message, 0, &dataPacket);
     message->destination = destination;
     message->messageLength = 500;
     message->state.store(Homa::OutMessage::Status::SENT);
     SenderTest::addMessage(sender, id, message);
     EXPECT_FALSE(
-        sender->sendQueue.contains(&message->queuedMessageInfo.sendQueueNode));
+        sender->sendShards[0].sendQueue.contains(&message->queuedMessageInfo.sendQueueNode));
     EXPECT_EQ(0U, message->messageTimeout.expirationCycleTime);
     EXPECT_EQ(0U, message->pingTimeout.expirationCycleTime);
 
@@ -749,12 +879,13 @@ TEST_F(SenderTest, handleUnknownPacket_singlePacketMessage)
 
     EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
     EXPECT_EQ(policyNew.version, dataHeader->policyVersion);
-    EXPECT_EQ(3U, dataHeader->unscheduledIndexLimit);
+    EXPECT_EQ(policyNew.version, message->policyVersion);
+    EXPECT_EQ(3, message->unscheduledIndexLimit);
     EXPECT_EQ(11000U, message->messageTimeout.expirationCycleTime);
     EXPECT_EQ(10100U, message->pingTimeout.expirationCycleTime);
     EXPECT_FALSE(
-        sender->sendQueue.contains(&message->queuedMessageInfo.sendQueueNode));
-    EXPECT_FALSE(sender->sendReady.load());
+        sender->sendShards[0].sendQueue.contains(&message->queuedMessageInfo.sendQueueNode));
+    EXPECT_FALSE(sender->sendShards[0].sendReady.load());
 }
 
 TEST_F(SenderTest, handleUnknownPacket_NO_KEEP_ALIVE)
@@ -824,7 +955,7 @@ TEST_F(SenderTest, handleUnknownPacket_NO_RETRY)
     bucket->messageTimeouts.setTimeout(&message->messageTimeout);
     bucket->pingTimeouts.setTimeout(&message->pingTimeout);
     EXPECT_TRUE(
-        sender->sendQueue.contains(&message->queuedMessageInfo.sendQueueNode));
+        sender->sendShards[0].sendQueue.contains(&message->queuedMessageInfo.sendQueueNode));
 
     Protocol::Packet::UnknownHeader* header =
         static_cast<Protocol::Packet::UnknownHeader*>(mockPacket.payload);
@@ -836,12 +967,12 @@ TEST_F(SenderTest, handleUnknownPacket_NO_RETRY)
     sender->handleUnknownPacket(&mockPacket);
 
     EXPECT_FALSE(
-        sender->sendQueue.contains(&message->queuedMessageInfo.sendQueueNode));
+        sender->sendShards[0].sendQueue.contains(&message->queuedMessageInfo.sendQueueNode));
     EXPECT_EQ(nullptr, message->messageTimeout.node.list);
     EXPECT_EQ(nullptr, message->pingTimeout.node.list);
     EXPECT_EQ(Homa::OutMessage::Status::FAILED, message->state);
     EXPECT_EQ(Homa::OutMessage::Status::FAILED, message->state);
-    EXPECT_FALSE(sender->sendReady.load());
+    EXPECT_FALSE(sender->sendShards[0].sendReady.load());
 }
 
 TEST_F(SenderTest, handleUnknownPacket_no_message)
@@ -1090,12 +1221,35 @@ TEST_F(SenderTest, poll)
 TEST_F(SenderTest, checkTimeouts)
 {
     Sender::MessageBucket* bucket = sender->messageBuckets.buckets.at(0);
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    message->state = Homa::OutMessage::Status::SENT;
 
-    EXPECT_EQ(0, sender->nextBucketIndex.load());
-
+    // No timeout scheduled; fast path out.
+    EXPECT_EQ(UINT64_MAX, sender->earliestTimeout.load());
     sender->checkTimeouts();
 
-    EXPECT_EQ(1, sender->nextBucketIndex.load());
+    // Scheduling a timeout lowers the cached expiration time.
+    bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+    EXPECT_EQ(message->messageTimeout.expirationCycleTime,
+              sender->earliestTimeout.load());
+
+    // Timeout not yet elapsed; fast path leaves the cached time alone.
+    sender->checkTimeouts();
+    EXPECT_EQ(&bucket->messageTimeouts.list,
+              message->messageTimeout.node.list);
+    EXPECT_EQ(message->messageTimeout.expirationCycleTime,
+              sender->earliestTimeout.load());
+
+    // Advance the clock past the timeout; the sweep processes it and resets
+    // the cached expiration time.
+    PerfUtils::Cycles::mockTscValue =
+        message->messageTimeout.expirationCycleTime;
+    sender->checkTimeouts();
+    EXPECT_EQ(Homa::OutMessage::Status::FAILED, message->getStatus());
+    EXPECT_EQ(nullptr, message->messageTimeout.node.list);
+    EXPECT_EQ(UINT64_MAX, sender->earliestTimeout.load());
+    PerfUtils::Cycles::mockTscValue = 10000;
 }
 
 TEST_F(SenderTest, Message_destructor)
@@ -1108,11 +1262,41 @@ TEST_F(SenderTest, Message_destructor)
     const uint16_t NUM_PKTS = 5;
 
     msg->numPackets = NUM_PKTS;
+    msg->numAllocatedPackets = NUM_PKTS;
     for (int i = 0; i < NUM_PKTS; ++i) {
-        msg->occupied.set(i);
+        msg->packets.set(i, reinterpret_cast<Driver::Packet*>(
+                static_cast<uintptr_t>(42 + i)));
     }
 
-    EXPECT_CALL(mockDriver, releasePackets(Eq(msg->packets), Eq(NUM_PKTS)))
+    EXPECT_CALL(mockDriver,
+                releasePackets(Eq(msg->packets.inlineSlots), Eq(NUM_PKTS)))
+        .Times(1);
+
+    delete msg;
+}
+
+TEST_F(SenderTest, Message_destructor_extents)
+{
+    const int MAX_RAW_PACKET_LENGTH = 2000;
+    ON_CALL(mockDriver, getMaxPayloadSize)
+        .WillByDefault(Return(MAX_RAW_PACKET_LENGTH));
+    Sender::Message* msg = new Sender::Message(sender, 0);
+
+    // Enough packets to spill out of the inline slots into the first
+    // overflow extent.
+    const uint16_t NUM_PKTS = 12;
+
+    msg->numPackets = NUM_PKTS;
+    msg->numAllocatedPackets = NUM_PKTS;
+    for (int i = 0; i < NUM_PKTS; ++i) {
+        msg->packets.set(i, reinterpret_cast<Driver::Packet*>(
+                static_cast<uintptr_t>(42 + i)));
+    }
+
+    EXPECT_CALL(mockDriver,
+                releasePackets(Eq(msg->packets.inlineSlots), Eq(8)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Eq(msg->packets.extents[0]), Eq(4)))
         .Times(1);
 
     delete msg;
@@ -1146,7 +1330,7 @@ TEST_F(SenderTest, Message_append_basic)
 
     EXPECT_EQ(PACKET_DATA_LENGTH + 7, msg.messageLength);
     EXPECT_EQ(2U, msg.numPackets);
-    EXPECT_TRUE(msg.packets[1] == &packet1);
+    EXPECT_TRUE(msg.packets.get(1) == &packet1);
     EXPECT_EQ(MAX_RAW_PACKET_LENGTH, packet0.length);
     EXPECT_EQ(TRANSPORT_HEADER_LENGTH + 7, packet1.length);
     EXPECT_TRUE(std::memcmp(buf + MAX_RAW_PACKET_LENGTH - 7, source, 7) == 0);
@@ -1182,7 +1366,10 @@ TEST_F(SenderTest, Message_append_truncated)
 
     EXPECT_EQ(msg.PACKET_DATA_LENGTH * msg.MAX_MESSAGE_PACKETS,
               msg.messageLength);
-    EXPECT_EQ(1U, msg.numPackets);
+    // The append claims every packet up to the one it touched; only the
+    // preinstalled tail buffer was ever allocated.
+    EXPECT_EQ(static_cast<int>(msg.MAX_MESSAGE_PACKETS), msg.numPackets);
+    EXPECT_EQ(1, msg.numAllocatedPackets);
     EXPECT_EQ(msg.TRANSPORT_HEADER_LENGTH + msg.PACKET_DATA_LENGTH,
               packet0.length);
     EXPECT_TRUE(std::memcmp(buf + MAX_RAW_PACKET_LENGTH - 7, source, 7) == 0);
@@ -1192,13 +1379,86 @@ TEST_F(SenderTest, Message_append_truncated)
     EXPECT_STREQ("src/Sender.cc", m.filename);
     EXPECT_STREQ("append", m.function);
     EXPECT_EQ(int(Debug::LogLevel::WARNING), m.logLevel);
-    EXPECT_EQ(
-        "Max message size limit (2016256B) reached; 7 of 14 bytes appended",
-        m.message);
+    EXPECT_EQ(StringUtil::format("Max message size limit (%dB) reached; "
+                                 "7 of 14 bytes appended",
+                                 msg.PACKET_DATA_LENGTH *
+                                     static_cast<int>(msg.MAX_MESSAGE_PACKETS)),
+              m.message);
 
     Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
 }
 
+/// Helper for the appendExternal tests; counts done callback invocations.
+void
+externalBufferDone(void* arg)
+{
+    ++(*static_cast<int*>(arg));
+}
+
+TEST_F(SenderTest, Message_appendExternal)
+{
+    const int MAX_RAW_PACKET_LENGTH = 2000;
+
+    ON_CALL(mockDriver, getMaxPayloadSize)
+        .WillByDefault(Return(MAX_RAW_PACKET_LENGTH));
+    Sender::Message msg(sender, 0);
+    char buf[2 * MAX_RAW_PACKET_LENGTH];
+    Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
+    Homa::Mock::MockDriver::MockPacket packet1{buf + MAX_RAW_PACKET_LENGTH};
+
+    const int TRANSPORT_HEADER_LENGTH = msg.TRANSPORT_HEADER_LENGTH;
+    const int PACKET_DATA_LENGTH = msg.PACKET_DATA_LENGTH;
+
+    char external[2 * MAX_RAW_PACKET_LENGTH];
+    int doneCount = 0;
+
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packet0))
+        .WillOnce(Return(&packet1));
+
+    msg.appendExternal(external, PACKET_DATA_LENGTH + 42, externalBufferDone,
+                       &doneCount);
+
+    EXPECT_EQ(PACKET_DATA_LENGTH + 42, msg.messageLength);
+    EXPECT_EQ(2U, msg.numPackets);
+    // No bytes are copied; the packets reference the application's buffer.
+    EXPECT_EQ(TRANSPORT_HEADER_LENGTH, packet0.length);
+    EXPECT_EQ(static_cast<const void*>(external), packet0.extData);
+    EXPECT_EQ(PACKET_DATA_LENGTH, packet0.extLength);
+    EXPECT_EQ(TRANSPORT_HEADER_LENGTH, packet1.length);
+    EXPECT_EQ(static_cast<const void*>(external + PACKET_DATA_LENGTH),
+              packet1.extData);
+    EXPECT_EQ(42, packet1.extLength);
+    EXPECT_EQ(1U, msg.externalBlocks.size());
+    // The buffer is still pinned; the done callback must not have run yet.
+    EXPECT_EQ(0, doneCount);
+}
+
+TEST_F(SenderTest, Message_destructor_externalBlocks)
+{
+    const int MAX_RAW_PACKET_LENGTH = 2000;
+    ON_CALL(mockDriver, getMaxPayloadSize)
+        .WillByDefault(Return(MAX_RAW_PACKET_LENGTH));
+    Sender::Message* msg = new Sender::Message(sender, 0);
+    char buf[MAX_RAW_PACKET_LENGTH];
+    Homa::Mock::MockDriver::MockPacket packet0{buf};
+
+    char external[64];
+    int doneCount = 0;
+
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet0));
+
+    msg->appendExternal(external, sizeof(external), externalBufferDone,
+                        &doneCount);
+
+    EXPECT_CALL(mockDriver, releasePackets(Eq(msg->packets.inlineSlots), Eq(1)))
+        .Times(1);
+
+    delete msg;
+
+    EXPECT_EQ(1, doneCount);
+}
+
 TEST_F(SenderTest, Message_cancel)
 {
     // Nothing to test
@@ -1299,11 +1559,10 @@ TEST_F(SenderTest, Message_getPacket)
 {
     Sender::Message msg(sender, 0);
     Driver::Packet* packet = (Driver::Packet*)42;
-    msg.packets[0] = packet;
 
     EXPECT_EQ(nullptr, msg.getPacket(0));
 
-    msg.occupied.set(0);
+    msg.packets.set(0, packet);
 
     EXPECT_EQ(packet, msg.getPacket(0));
 }
@@ -1316,21 +1575,53 @@ TEST_F(SenderTest, Message_getOrAllocPacket)
     Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
     Homa::Mock::MockDriver::MockPacket packet1{buf + 2048};
 
-    EXPECT_FALSE(msg.occupied.test(0));
+    EXPECT_EQ(nullptr, msg.packets.get(0));
     EXPECT_EQ(0U, msg.numPackets);
     EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet0));
 
     EXPECT_TRUE(&packet0 == msg.getOrAllocPacket(0));
 
-    EXPECT_TRUE(msg.occupied.test(0));
+    EXPECT_EQ(&packet0, msg.packets.get(0));
     EXPECT_EQ(1U, msg.numPackets);
 
     EXPECT_TRUE(&packet0 == msg.getOrAllocPacket(0));
 
-    EXPECT_TRUE(msg.occupied.test(0));
+    EXPECT_EQ(&packet0, msg.packets.get(0));
     EXPECT_EQ(1U, msg.numPackets);
 }
 
+TEST_F(SenderTest, Message_allocMissingPackets)
+{
+    Sender::Message msg(sender, 0);
+    char buf[8192];
+    Homa::Mock::MockDriver::MockPacket packet0{buf + 0};
+    Homa::Mock::MockDriver::MockPacket packet1{buf + 2048};
+    Homa::Mock::MockDriver::MockPacket packet2{buf + 4096};
+
+    msg.packets.set(0, &packet0);
+    msg.numPackets = 1;
+    msg.numAllocatedPackets = 1;
+
+    // MockDriver does not override allocPackets(), so the default
+    // implementation satisfies the bulk request with allocPacket() calls.
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packet1))
+        .WillOnce(Return(&packet2));
+
+    msg.allocMissingPackets(0, 2);
+
+    EXPECT_EQ(3, msg.numAllocatedPackets);
+    EXPECT_EQ(&packet1, msg.packets.get(1));
+    EXPECT_EQ(&packet2, msg.packets.get(2));
+    EXPECT_EQ(msg.TRANSPORT_HEADER_LENGTH, packet1.length);
+    EXPECT_EQ(msg.TRANSPORT_HEADER_LENGTH, packet2.length);
+
+    // Already-populated slots are left alone.
+    msg.allocMissingPackets(0, 2);
+
+    EXPECT_EQ(3, msg.numAllocatedPackets);
+}
+
 TEST_F(SenderTest, MessageBucket_findMessage)
 {
     Sender::MessageBucket* bucket = sender->messageBuckets.buckets.at(0);
@@ -1343,8 +1634,11 @@ TEST_F(SenderTest, MessageBucket_findMessage)
     msg1->id = {42, 1};
     Protocol::MessageId id_none = {42, 42};
 
-    bucket->messages.push_back(&msg0->bucketNode);
-    bucket->messages.push_back(&msg1->bucketNode);
+    {
+        SpinLock::Lock lock_bucket(bucket->mutex);
+        bucket->addMessage(msg0, lock_bucket);
+        bucket->addMessage(msg1, lock_bucket);
+    }
 
     SpinLock::Lock lock_bucket(bucket->mutex);
     EXPECT_EQ(msg0, bucket->findMessage(msg0->id, lock_bucket));
@@ -1399,16 +1693,17 @@ TEST_F(SenderTest, sendMessage_basic)
     EXPECT_EQ(destination.port, message->destination.port);
     EXPECT_EQ(Sender::Message::Options::NO_RETRY, message->options);
 
-    // Check packet metadata
-    Protocol::Packet::DataHeader* header =
-        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    // Check packet metadata; single-packet messages go out with the compact
+    // DATA_SINGLE header and the data moved down to follow it.
+    Protocol::Packet::DataHeaderSingle* header =
+        static_cast<Protocol::Packet::DataHeaderSingle*>(mockPacket.payload);
+    EXPECT_EQ(Protocol::Packet::DATA_SINGLE, header->common.opcode);
     EXPECT_EQ(htobe16(sport), header->common.prefix.sport);
     EXPECT_EQ(htobe16(dport), header->common.prefix.dport);
     EXPECT_EQ(id, header->common.messageId);
-    EXPECT_EQ(420U, header->totalLength);
     EXPECT_EQ(policy.version, header->policyVersion);
-    EXPECT_EQ(3U, header->unscheduledIndexLimit);
-    EXPECT_EQ(0U, header->index);
+    EXPECT_EQ(420 + sizeof(Protocol::Packet::DataHeaderSingle),
+              static_cast<size_t>(mockPacket.length));
 
     // Check Sender metadata
     EXPECT_TRUE(bucket->messages.contains(&message->bucketNode));
@@ -1419,13 +1714,13 @@ TEST_F(SenderTest, sendMessage_basic)
     EXPECT_EQ(policy.priority, mockPriority);
 
     EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
-    EXPECT_FALSE(sender->sendReady.load());
+    EXPECT_FALSE(sender->sendShards[0].sendReady.load());
 }
 
 TEST_F(SenderTest, sendMessage_multipacket)
 {
-    char payload0[1027];
-    char payload1[1027];
+    char payload0[1000 + sizeof(Protocol::Packet::DataHeader)];
+    char payload1[1000 + sizeof(Protocol::Packet::DataHeader)];
     Homa::Mock::MockDriver::MockPacket packet0{payload0};
     Homa::Mock::MockDriver::MockPacket packet1{payload1};
     Protocol::MessageId id = {sender->transportId,
@@ -1437,12 +1732,11 @@ TEST_F(SenderTest, sendMessage_multipacket)
     setMessagePacket(message, 0, &packet0);
     setMessagePacket(message, 1, &packet1);
     message->messageLength = 1420;
-    packet0.length = 1000 + 31;
-    packet1.length = 420 + 31;
+    packet0.length = 1000 + sizeof(Protocol::Packet::DataHeader);
+    packet1.length = 420 + sizeof(Protocol::Packet::DataHeader);
     SocketAddress destination = {22, 60001};
     Core::Policy::Unscheduled policy = {1, 1000, 2};
 
-    EXPECT_EQ(31U, sizeof(Protocol::Packet::DataHeader));
     EXPECT_EQ(1000U, message->PACKET_DATA_LENGTH);
     EXPECT_CALL(mockPolicyManager,
                 getUnscheduledPolicy(Eq(destination.ip), Eq(1420)))
@@ -1475,10 +1769,112 @@ TEST_F(SenderTest, sendMessage_multipacket)
     EXPECT_EQ(11000U, message->messageTimeout.expirationCycleTime);
     EXPECT_EQ(10100U, message->pingTimeout.expirationCycleTime);
 
-    // Check sendQueue metadata
+    // Check sendQueue metadata; the message should be staged in its
+    // destination's shard but not yet merged into the shard's sendQueue.
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    EXPECT_EQ(Sender::getSendShardIndex(destination.ip), info->shard);
+    Sender::SendShard* shard = &sender->sendShards[info->shard];
+    EXPECT_EQ(message, shard->stagedMessages.load());
+    EXPECT_FALSE(shard->sendQueue.contains(&info->sendQueueNode));
+    EXPECT_TRUE(shard->sendReady.load());
+    {
+        SpinLock::Lock lock_queue(shard->queueMutex);
+        sender->mergeStagedMessages(shard);
+    }
+    EXPECT_EQ(nullptr, shard->stagedMessages.load());
+    EXPECT_TRUE(shard->sendQueue.contains(&info->sendQueueNode));
+}
+
+TEST_F(SenderTest, sendMessage_stream)
+{
+    char payload0[1000 + sizeof(Protocol::Packet::DataHeader)];
+    char payload1[1000 + sizeof(Protocol::Packet::DataHeader)];
+    char payload2[1000 + sizeof(Protocol::Packet::DataHeader)];
+    Homa::Mock::MockDriver::MockPacket packet0{payload0};
+    Homa::Mock::MockDriver::MockPacket packet1{payload1};
+    Homa::Mock::MockDriver::MockPacket packet2{payload2};
+    Protocol::MessageId id = {sender->transportId,
+                              sender->nextMessageSequenceNumber};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Sender::MessageBucket* bucket = sender->messageBuckets.getBucket(id);
+
+    setMessagePacket(message, 0, &packet0);
+    setMessagePacket(message, 1, &packet1);
+    setMessagePacket(message, 2, &packet2);
+    message->messageLength = 2420;
+    packet0.length = 1000 + sizeof(Protocol::Packet::DataHeader);
+    packet1.length = 1000 + sizeof(Protocol::Packet::DataHeader);
+    packet2.length = 420 + sizeof(Protocol::Packet::DataHeader);
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {1, 1000, 2};
+
+    EXPECT_CALL(mockPolicyManager,
+                getUnscheduledPolicy(Eq(destination.ip), Eq(2420)))
+        .WillOnce(Return(policy));
+
+    sender->sendMessage(message, destination,
+                        Sender::Message::Options::STREAM);
+
+    EXPECT_EQ(id, message->id);
+    EXPECT_EQ(Homa::OutMessage::Status::IN_PROGRESS, message->state);
+    EXPECT_TRUE(bucket->messages.contains(&message->bucketNode));
+
+    // Every allocated packet carries the stream-open flag and the number of
+    // bytes produced so far.
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(packet0.payload);
+    EXPECT_EQ(2420U, header->totalLength);
+    EXPECT_TRUE(header->flags & Protocol::Packet::DataHeader::FLAG_STREAM_OPEN);
+
+    // Only the full packets are published; the trailing partial packet stays
+    // private to the application until close().
     Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
-    EXPECT_TRUE(sender->sendQueue.contains(&info->sendQueueNode));
-    EXPECT_TRUE(sender->sendReady.load());
+    EXPECT_EQ(2, info->packetsPublished.load());
+    EXPECT_EQ(2000, info->publishedBytes);
+    EXPECT_EQ(2000, info->unsentBytes);
+    EXPECT_EQ(1, info->packetsGranted);
+    EXPECT_TRUE(info->open);
+    EXPECT_EQ(message, sender->sendShards[info->shard].stagedMessages.load());
+}
+
+TEST_F(SenderTest, mergeStagedMessages)
+{
+    Sender::Message* message[3];
+    for (uint64_t i = 0; i < 3; ++i) {
+        Protocol::MessageId id = {22, 10 + i};
+        message[i] =
+            dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+        message[i]->id = id;
+        message[i]->messageLength = 1000 * (3 - i);
+        Sender::QueuedMessageInfo* info = &message[i]->queuedMessageInfo;
+        info->id = id;
+        info->packets = message[i];
+        info->unsentBytes = message[i]->messageLength;
+        sender->stageMessage(message[i]);
+    }
+    EXPECT_TRUE(sender->sendShards[0].sendReady.load());
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.empty());
+
+    {
+        SpinLock::Lock lock_queue(sender->sendShards[0].queueMutex);
+        sender->mergeStagedMessages(&sender->sendShards[0]);
+    }
+
+    // Messages should be merged in SRPT order (fewest unsentBytes first).
+    EXPECT_EQ(nullptr, sender->sendShards[0].stagedMessages.load());
+    EXPECT_EQ(3U, sender->sendShards[0].sendQueue.size());
+    auto it = sender->sendShards[0].sendQueue.begin();
+    EXPECT_EQ(message[2], &(*it));
+    ++it;
+    EXPECT_EQ(message[1], &(*it));
+    ++it;
+    EXPECT_EQ(message[0], &(*it));
+    for (uint64_t i = 0; i < 3; ++i) {
+        sender->sendShards[0].sendQueue.remove(
+            &message[i]->queuedMessageInfo.sendQueueNode);
+        sender->dropMessage(message[i]);
+    }
 }
 
 TEST_F(SenderTest, sendMessage_NO_KEEP_ALIVE)
@@ -1512,6 +1908,50 @@ TEST_F(SenderTest, sendMessage_NO_KEEP_ALIVE)
     EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
 }
 
+TEST_F(SenderTest, sendMessage_NO_COMPLETION)
+{
+    Protocol::MessageId id = {sender->transportId,
+                              sender->nextMessageSequenceNumber};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Sender::MessageBucket* bucket = sender->messageBuckets.getBucket(id);
+
+    setMessagePacket(message, 0, &mockPacket);
+    message->messageLength = 420;
+    mockPacket.length =
+        message->messageLength + message->TRANSPORT_HEADER_LENGTH;
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {1, 3000, 2};
+
+    EXPECT_CALL(mockPolicyManager,
+                getUnscheduledPolicy(Eq(destination.ip), Eq(420)))
+        .WillOnce(Return(policy));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(&mockPacket), Eq(destination.ip), _))
+        .Times(1);
+
+    sender->sendMessage(message, destination,
+                        Sender::Message::Options::NO_COMPLETION);
+
+    // The message is untracked as soon as it is SENT; only the application's
+    // hold keeps the object alive.
+    EXPECT_EQ(Sender::Message::Options::NO_COMPLETION, message->options);
+    EXPECT_FALSE(bucket->messages.contains(&message->bucketNode));
+    EXPECT_TRUE(bucket->messageTimeouts.empty());
+    EXPECT_TRUE(bucket->pingTimeouts.empty());
+    EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
+
+    // Releasing the untracked message queues it for deferred reclamation.
+    message->release();
+
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
+    EXPECT_FALSE(sender->reclaimList.list.empty());
+
+    sender->reclaimMessages();
+
+    EXPECT_EQ(0U, sender->messageAllocator.outstandingObjects);
+}
+
 TEST_F(SenderTest, sendMessage_missingPacket)
 {
     Protocol::MessageId id = {sender->transportId,
@@ -1564,30 +2004,222 @@ TEST_F(SenderTest, cancelMessage)
     bucket->messageTimeouts.setTimeout(&message->messageTimeout);
     message->messageLength = 9000;
     message->numPackets = 9;
+    message->queuedMessageInfo.packetsPublished = 9;
     message->state = Homa::OutMessage::Status::IN_PROGRESS;
     EXPECT_FALSE(bucket->messageTimeouts.list.empty());
     EXPECT_FALSE(bucket->pingTimeouts.list.empty());
-    EXPECT_FALSE(sender->sendQueue.empty());
+    EXPECT_FALSE(sender->sendShards[0].sendQueue.empty());
 
     sender->cancelMessage(message);
 
     EXPECT_TRUE(bucket->messageTimeouts.list.empty());
     EXPECT_TRUE(bucket->pingTimeouts.list.empty());
-    EXPECT_TRUE(sender->sendQueue.empty());
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.empty());
     EXPECT_EQ(Homa::OutMessage::Status::CANCELED, message->state.load());
 }
 
-TEST_F(SenderTest, dropMessage_basic)
+TEST_F(SenderTest, publishStreamData)
 {
+    char payload0[1000 + sizeof(Protocol::Packet::DataHeader)];
+    char payload1[1000 + sizeof(Protocol::Packet::DataHeader)];
+    Homa::Mock::MockDriver::MockPacket packet0{payload0};
+    Homa::Mock::MockDriver::MockPacket packet1{payload1};
     Sender::Message* message =
         dynamic_cast<Sender::Message*>(sender->allocMessage(0));
-    EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
-    EXPECT_TRUE(message->held);
-    EXPECT_EQ(OutMessage::Status::NOT_STARTED, message->state);
+
+    setMessagePacket(message, 0, &packet0);
+    message->messageLength = 1000;
+    packet0.length = 1000 + sizeof(Protocol::Packet::DataHeader);
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {1, 1000, 2};
+    EXPECT_CALL(mockPolicyManager, getUnscheduledPolicy(_, _))
+        .WillOnce(Return(policy));
+    sender->sendMessage(message, destination,
+                        Sender::Message::Options::STREAM);
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    Sender::SendShard* shard = &sender->sendShards[info->shard];
+    {
+        SpinLock::Lock lock_queue(shard->queueMutex);
+        sender->mergeStagedMessages(shard);
+    }
+    shard->sendReady.store(false);
+    EXPECT_EQ(1, info->packetsPublished.load());
+
+    // Simulate the application appending another full packet of data.
+    setMessagePacket(message, 1, &packet1);
+    message->messageLength = 2000;
+    packet1.length = 1000 + sizeof(Protocol::Packet::DataHeader);
+    info->packetsPublished = 1;
+
+    sender->publishStreamData(message);
+
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(packet1.payload);
+    EXPECT_EQ(message->id, header->common.messageId);
+    EXPECT_EQ(2000U, header->totalLength);
+    EXPECT_EQ(1U, header->index);
+    EXPECT_TRUE(header->flags & Protocol::Packet::DataHeader::FLAG_STREAM_OPEN);
+    EXPECT_EQ(2, info->packetsPublished.load());
+    EXPECT_EQ(2000, info->publishedBytes);
+    EXPECT_EQ(2000, info->unsentBytes);
+    EXPECT_TRUE(shard->sendReady.load());
+
+    // Appending less than a full packet publishes nothing.
+    message->messageLength = 2420;
+    shard->sendReady.store(false);
+
+    sender->publishStreamData(message);
+
+    EXPECT_EQ(2, info->packetsPublished.load());
+    EXPECT_EQ(2000, info->publishedBytes);
+    EXPECT_FALSE(shard->sendReady.load());
+}
+
+TEST_F(SenderTest, closeMessage_basic)
+{
+    char payload0[1000 + sizeof(Protocol::Packet::DataHeader)];
+    char payload1[1000 + sizeof(Protocol::Packet::DataHeader)];
+    Homa::Mock::MockDriver::MockPacket packet0{payload0};
+    Homa::Mock::MockDriver::MockPacket packet1{payload1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+
+    setMessagePacket(message, 0, &packet0);
+    setMessagePacket(message, 1, &packet1);
+    message->messageLength = 1420;
+    packet0.length = 1000 + sizeof(Protocol::Packet::DataHeader);
+    packet1.length = 420 + sizeof(Protocol::Packet::DataHeader);
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {1, 1000, 2};
+    EXPECT_CALL(mockPolicyManager, getUnscheduledPolicy(_, _))
+        .WillOnce(Return(policy));
+    sender->sendMessage(message, destination,
+                        Sender::Message::Options::STREAM);
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    Sender::SendShard* shard = &sender->sendShards[info->shard];
+    {
+        SpinLock::Lock lock_queue(shard->queueMutex);
+        sender->mergeStagedMessages(shard);
+    }
+    shard->sendReady.store(false);
+    EXPECT_EQ(1, info->packetsPublished.load());
+    EXPECT_TRUE(info->open);
+
+    message->close();
+
+    // The trailing partial packet is published with the final length and the
+    // headers of the unsent full packets are rewritten to match.
+    EXPECT_FALSE(info->open);
+    EXPECT_EQ(2, info->packetsPublished.load());
+    EXPECT_EQ(1420, info->publishedBytes);
+    EXPECT_EQ(1420, info->unsentBytes);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(packet0.payload);
+    EXPECT_EQ(1420U, header->totalLength);
+    EXPECT_FALSE(header->flags &
+                 Protocol::Packet::DataHeader::FLAG_STREAM_OPEN);
+    header = static_cast<Protocol::Packet::DataHeader*>(packet1.payload);
+    EXPECT_EQ(1420U, header->totalLength);
+    EXPECT_EQ(1U, header->index);
+    EXPECT_FALSE(header->flags &
+                 Protocol::Packet::DataHeader::FLAG_STREAM_OPEN);
+    EXPECT_EQ(Homa::OutMessage::Status::IN_PROGRESS, message->state);
+    EXPECT_TRUE(shard->sendReady.load());
+
+    // Closing again is a no-op once the message finishes.
+    message->state.store(Homa::OutMessage::Status::SENT);
+    message->close();
+    EXPECT_EQ(2, info->packetsPublished.load());
+}
+
+TEST_F(SenderTest, closeMessage_allPacketsSent)
+{
+    char payload0[1000 + sizeof(Protocol::Packet::DataHeader)];
+    char payload1[1000 + sizeof(Protocol::Packet::DataHeader)];
+    Homa::Mock::MockDriver::MockPacket packet0{payload0};
+    Homa::Mock::MockDriver::MockPacket packet1{payload1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+
+    setMessagePacket(message, 0, &packet0);
+    setMessagePacket(message, 1, &packet1);
+    message->messageLength = 2000;
+    packet0.length = 1000 + sizeof(Protocol::Packet::DataHeader);
+    packet1.length = 1000 + sizeof(Protocol::Packet::DataHeader);
+    SocketAddress destination = {22, 60001};
+    Core::Policy::Unscheduled policy = {1, 3000, 2};
+    EXPECT_CALL(mockPolicyManager, getUnscheduledPolicy(_, _))
+        .WillOnce(Return(policy));
+    sender->sendMessage(message, destination,
+                        Sender::Message::Options::STREAM);
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    Sender::SendShard* shard = &sender->sendShards[info->shard];
+    {
+        SpinLock::Lock lock_queue(shard->queueMutex);
+        sender->mergeStagedMessages(shard);
+    }
+    // Simulate trySend() having transmitted every published packet while the
+    // stream was still open.
+    info->packetsSent = 2;
+    info->unsentBytes = 0;
+    info->priority.store(2);
+
+    EXPECT_CALL(mockDriver,
+                sendPacket(Eq(&packet1), Eq(destination.ip), Eq(2)))
+        .Times(1);
+
+    message->close();
+
+    // The last packet is retransmitted with the final length so the receiver
+    // learns that the stream ended, and the message finishes immediately.
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(packet1.payload);
+    EXPECT_EQ(2000U, header->totalLength);
+    EXPECT_FALSE(header->flags &
+                 Protocol::Packet::DataHeader::FLAG_STREAM_OPEN);
+    EXPECT_FALSE(info->open);
+    EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
+    EXPECT_FALSE(shard->sendQueue.contains(&info->sendQueueNode));
+}
+
+TEST_F(SenderTest, closeMessage_notStream)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    message->id = {42, 1};
+
+    VectorHandler handler;
+    Debug::setLogHandler(std::ref(handler));
+
+    sender->closeMessage(message);
+
+    EXPECT_EQ(1U, handler.messages.size());
+    const Debug::DebugMessage& m = handler.messages.at(0);
+    EXPECT_STREQ("src/Sender.cc", m.filename);
+    EXPECT_STREQ("closeMessage", m.function);
+    EXPECT_EQ(int(Debug::LogLevel::WARNING), m.logLevel);
+
+    Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
+}
+
+TEST_F(SenderTest, dropMessage_basic)
+{
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
+    EXPECT_TRUE(message->held);
+    EXPECT_EQ(OutMessage::Status::NOT_STARTED, message->state);
 
     sender->dropMessage(message);
 
-    EXPECT_EQ(0U, sender->messageAllocator.pool.outstandingObjects);
+    // Reclamation is deferred to reclaimMessages().
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
+    EXPECT_FALSE(sender->reclaimList.list.empty());
+
+    sender->reclaimMessages();
+
+    EXPECT_EQ(0U, sender->messageAllocator.outstandingObjects);
+    EXPECT_TRUE(sender->reclaimList.list.empty());
 }
 
 TEST_F(SenderTest, dropMessage_IN_PROGRESS)
@@ -1595,15 +2227,126 @@ TEST_F(SenderTest, dropMessage_IN_PROGRESS)
     Sender::Message* message =
         dynamic_cast<Sender::Message*>(sender->allocMessage(0));
     message->state = OutMessage::Status::IN_PROGRESS;
-    EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
     EXPECT_TRUE(message->held);
 
     sender->dropMessage(message);
 
-    EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
     EXPECT_FALSE(message->held);
 }
 
+TEST_F(SenderTest, resetMessage)
+{
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    char buf[2048];
+    Homa::Mock::MockDriver::MockPacket packet0{buf};
+    int doneCount = 0;
+
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet0));
+    message->append("Hello, world!", 14);
+    message->appendExternal(buf + 1024, 64, externalBufferDone, &doneCount);
+    SenderTest::addMessage(sender, id, message);
+    Sender::MessageBucket* bucket = sender->messageBuckets.getBucket(id);
+    bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+    bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+    message->state = OutMessage::Status::COMPLETED;
+
+    message->reset();
+
+    EXPECT_EQ(OutMessage::Status::NOT_STARTED, message->state);
+    EXPECT_FALSE(bucket->messages.contains(&message->bucketNode));
+    EXPECT_EQ(nullptr, message->messageTimeout.node.list);
+    EXPECT_EQ(nullptr, message->pingTimeout.node.list);
+    EXPECT_EQ(0, message->messageLength);
+    EXPECT_EQ(0, message->numPackets);
+    EXPECT_EQ(1, message->numAllocatedPackets);
+    EXPECT_EQ(&packet0, message->packets.get(0));
+    EXPECT_EQ(message->TRANSPORT_HEADER_LENGTH, packet0.length);
+    EXPECT_EQ(nullptr, packet0.extData);
+    EXPECT_EQ(1, doneCount);
+    EXPECT_TRUE(message->externalBlocks.empty());
+    EXPECT_TRUE(message->held);
+
+    // Refilling the recycled message reuses the retained buffer without
+    // going back to the Driver.
+    message->append("Hello, again!", 14);
+
+    EXPECT_EQ(14, message->messageLength);
+    EXPECT_EQ(1, message->numPackets);
+    EXPECT_EQ(message->TRANSPORT_HEADER_LENGTH + 14, packet0.length);
+}
+
+TEST_F(SenderTest, resetMessage_IN_PROGRESS)
+{
+    VectorHandler handler;
+    Debug::setLogHandler(std::ref(handler));
+
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    SenderTest::addMessage(sender, id, message);
+    Sender::MessageBucket* bucket = sender->messageBuckets.getBucket(id);
+    message->messageLength = 9000;
+    message->state = OutMessage::Status::IN_PROGRESS;
+
+    sender->resetMessage(message);
+
+    EXPECT_EQ(OutMessage::Status::IN_PROGRESS, message->state);
+    EXPECT_TRUE(bucket->messages.contains(&message->bucketNode));
+    EXPECT_EQ(9000, message->messageLength);
+
+    EXPECT_EQ(1U, handler.messages.size());
+    const Debug::DebugMessage& m = handler.messages.at(0);
+    EXPECT_STREQ("src/Sender.cc", m.filename);
+    EXPECT_STREQ("resetMessage", m.function);
+    EXPECT_EQ(int(Debug::LogLevel::WARNING), m.logLevel);
+    EXPECT_EQ(
+        "Ignoring reset of message (42, 1) that is still being transmitted",
+        m.message);
+
+    Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
+}
+
+TEST_F(SenderTest, resetMessage_SENT)
+{
+    VectorHandler handler;
+    Debug::setLogHandler(std::ref(handler));
+
+    Protocol::MessageId id = {42, 1};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    SenderTest::addMessage(sender, id, message);
+    Sender::MessageBucket* bucket = sender->messageBuckets.getBucket(id);
+    message->messageLength = 9000;
+    message->state = OutMessage::Status::SENT;
+
+    // A SENT message that is still in its bucket is awaiting acknowledgment
+    // and cannot be reset.
+    sender->resetMessage(message);
+
+    EXPECT_EQ(OutMessage::Status::SENT, message->state);
+    EXPECT_TRUE(bucket->messages.contains(&message->bucketNode));
+    EXPECT_EQ(1U, handler.messages.size());
+
+    // A SENT message that has left its bucket (i.e. sent with NO_COMPLETION)
+    // is quiescent and can be reset.
+    {
+        SpinLock::Lock lock(bucket->mutex);
+        bucket->removeMessage(message, lock);
+    }
+
+    sender->resetMessage(message);
+
+    EXPECT_EQ(OutMessage::Status::NOT_STARTED, message->state);
+    EXPECT_EQ(0, message->messageLength);
+    EXPECT_EQ(1U, handler.messages.size());
+
+    Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
+}
+
 TEST_F(SenderTest, checkMessageTimeouts)
 {
     Sender::Message* message[4];
@@ -1617,7 +2360,7 @@ TEST_F(SenderTest, checkMessageTimeouts)
     // Message[0]: Normal timeout: IN_PROGRESS
     message[0]->messageTimeout.expirationCycleTime = 9998;
     message[0]->state = Homa::OutMessage::Status::IN_PROGRESS;
-    sender->sendQueue.push_front(&message[0]->queuedMessageInfo.sendQueueNode);
+    sender->sendShards[0].sendQueue.insert(&message[0]->queuedMessageInfo.sendQueueNode);
     // Message[1]: Normal timeout: SENT
     message[1]->messageTimeout.expirationCycleTime = 9999;
     message[1]->state = Homa::OutMessage::Status::SENT;
@@ -1638,7 +2381,7 @@ TEST_F(SenderTest, checkMessageTimeouts)
     EXPECT_EQ(nullptr, message[0]->messageTimeout.node.list);
     EXPECT_EQ(nullptr, message[0]->pingTimeout.node.list);
     EXPECT_EQ(Homa::OutMessage::Status::FAILED, message[0]->getStatus());
-    EXPECT_TRUE(sender->sendQueue.empty());
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.empty());
     // Message[1]: Normal timeout: SENT
     EXPECT_EQ(nullptr, message[1]->messageTimeout.node.list);
     EXPECT_EQ(nullptr, message[1]->pingTimeout.node.list);
@@ -1732,70 +2475,66 @@ TEST_F(SenderTest, trySend_basic)
     }
     message->state = Homa::OutMessage::Status::IN_PROGRESS;
     message->held = false;
-    sender->sendReady = true;
+    sender->sendShards[0].sendReady = true;
+    // Pacing is exercised by trySend_paced; disable it here so the frozen
+    // mock clock never throttles the sends this test expects.
+    sender->pacer.cyclesPerByte = 0.0;
     EXPECT_EQ(5U, message->numPackets);
     EXPECT_EQ(3U, info->packetsGranted);
     EXPECT_EQ(0U, info->packetsSent);
     EXPECT_EQ(5 * PACKET_DATA_SIZE, info->unsentBytes);
     EXPECT_NE(Homa::OutMessage::Status::SENT, message->state);
-    EXPECT_TRUE(sender->sendQueue.contains(&info->sendQueueNode));
-    EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.contains(&info->sendQueueNode));
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
 
-    // 3 granted packets; 2 will send; queue limit reached.
+    // 3 granted packets; all will send; grant limit reached.  The drain is
+    // corked so the driver can batch the released packets.
+    EXPECT_CALL(mockDriver, cork()).Times(1);
     EXPECT_CALL(mockDriver, sendPacket(Eq(packet[0]), _, _));
     EXPECT_CALL(mockDriver, sendPacket(Eq(packet[1]), _, _));
-    sender->trySend();  // < test call
-    EXPECT_TRUE(sender->sendReady);
-    EXPECT_EQ(Homa::OutMessage::Status::IN_PROGRESS, message->state);
-    EXPECT_EQ(3U, info->packetsGranted);
-    EXPECT_EQ(2U, info->packetsSent);
-    EXPECT_EQ(3 * PACKET_DATA_SIZE, info->unsentBytes);
-    EXPECT_NE(Homa::OutMessage::Status::SENT, message->state);
-    EXPECT_TRUE(sender->sendQueue.contains(&info->sendQueueNode));
-    EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
-    Mock::VerifyAndClearExpectations(&mockDriver);
-
-    // 1 packet to be sent; grant limit reached.
     EXPECT_CALL(mockDriver, sendPacket(Eq(packet[2]), _, _));
+    EXPECT_CALL(mockDriver, uncork()).Times(1);
     sender->trySend();  // < test call
-    EXPECT_FALSE(sender->sendReady);
+    EXPECT_FALSE(sender->sendShards[0].sendReady);
     EXPECT_EQ(Homa::OutMessage::Status::IN_PROGRESS, message->state);
     EXPECT_EQ(3U, info->packetsGranted);
     EXPECT_EQ(3U, info->packetsSent);
     EXPECT_EQ(2 * PACKET_DATA_SIZE, info->unsentBytes);
     EXPECT_NE(Homa::OutMessage::Status::SENT, message->state);
-    EXPECT_TRUE(sender->sendQueue.contains(&info->sendQueueNode));
-    EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.contains(&info->sendQueueNode));
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
     Mock::VerifyAndClearExpectations(&mockDriver);
 
     // No additional grants; spurious ready hint.
     EXPECT_CALL(mockDriver, sendPacket).Times(0);
-    sender->sendReady = true;
+    sender->sendShards[0].sendReady = true;
     sender->trySend();  // < test call
-    EXPECT_FALSE(sender->sendReady);
+    EXPECT_FALSE(sender->sendShards[0].sendReady);
     EXPECT_EQ(Homa::OutMessage::Status::IN_PROGRESS, message->state);
     EXPECT_EQ(3U, info->packetsGranted);
     EXPECT_EQ(3U, info->packetsSent);
     EXPECT_EQ(2 * PACKET_DATA_SIZE, info->unsentBytes);
     EXPECT_NE(Homa::OutMessage::Status::SENT, message->state);
-    EXPECT_TRUE(sender->sendQueue.contains(&info->sendQueueNode));
-    EXPECT_EQ(1U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.contains(&info->sendQueueNode));
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
     Mock::VerifyAndClearExpectations(&mockDriver);
 
     // 2 more granted packets; will finish.
     info->packetsGranted = 5;
-    sender->sendReady = true;
+    sender->sendShards[0].sendReady = true;
     EXPECT_CALL(mockDriver, sendPacket(Eq(packet[3]), _, _));
     EXPECT_CALL(mockDriver, sendPacket(Eq(packet[4]), _, _));
     sender->trySend();  // < test call
-    EXPECT_FALSE(sender->sendReady);
+    EXPECT_FALSE(sender->sendShards[0].sendReady);
     EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
     EXPECT_EQ(5U, info->packetsGranted);
     EXPECT_EQ(5U, info->packetsSent);
     EXPECT_EQ(0 * PACKET_DATA_SIZE, info->unsentBytes);
     EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
-    EXPECT_FALSE(sender->sendQueue.contains(&info->sendQueueNode));
-    EXPECT_EQ(0U, sender->messageAllocator.pool.outstandingObjects);
+    EXPECT_FALSE(sender->sendShards[0].sendQueue.contains(&info->sendQueueNode));
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
+    sender->reclaimMessages();
+    EXPECT_EQ(0U, sender->messageAllocator.outstandingObjects);
     Mock::VerifyAndClearExpectations(&mockDriver);
 
     for (int i = 0; i < 5; ++i) {
@@ -1803,6 +2542,60 @@ TEST_F(SenderTest, trySend_basic)
     }
 }
 
+TEST_F(SenderTest, trySend_paced)
+{
+    Protocol::MessageId id = {42, 10};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    SenderTest::addMessage(sender, id, message, true, 3);
+    Homa::Mock::MockDriver::MockPacket* packet[3];
+    const uint32_t PACKET_SIZE = sender->driver->getMaxPayloadSize();
+    const uint32_t PACKET_DATA_SIZE =
+        PACKET_SIZE - message->TRANSPORT_HEADER_LENGTH;
+    for (int i = 0; i < 3; ++i) {
+        packet[i] = new Homa::Mock::MockDriver::MockPacket{payload};
+        packet[i]->length = PACKET_SIZE;
+        setMessagePacket(message, i, packet[i]);
+        info->unsentBytes += PACKET_DATA_SIZE;
+    }
+    message->state = Homa::OutMessage::Status::IN_PROGRESS;
+    sender->sendShards[0].sendReady = true;
+
+    // One cycle per byte with a one-packet burst allowance.
+    sender->pacer.cyclesPerByte = 1.0;
+    sender->pacer.maxBurstCycles = PACKET_SIZE;
+    sender->pacer.nextReleaseTime = 0;
+    PerfUtils::Cycles::mockTscValue = 10000;
+
+    // The burst allowance covers the first two packets; the third must wait.
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packet[0]), _, _));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packet[1]), _, _));
+    sender->trySend();  // < test call
+    EXPECT_TRUE(sender->sendShards[0].sendReady);
+    EXPECT_EQ(2U, info->packetsSent);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Nothing more can be released until the virtual clock catches up.
+    EXPECT_CALL(mockDriver, sendPacket).Times(0);
+    sender->trySend();  // < test call
+    EXPECT_TRUE(sender->sendShards[0].sendReady);
+    EXPECT_EQ(2U, info->packetsSent);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Once the release time arrives, the remaining packet is sent.
+    PerfUtils::Cycles::mockTscValue = 10000 + PACKET_SIZE;
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packet[2]), _, _));
+    sender->trySend();  // < test call
+    EXPECT_FALSE(sender->sendShards[0].sendReady);
+    EXPECT_EQ(3U, info->packetsSent);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    for (int i = 0; i < 3; ++i) {
+        delete packet[i];
+    }
+}
+
 TEST_F(SenderTest, trySend_multipleMessages)
 {
     Protocol::MessageId id[3];
@@ -1823,7 +2616,7 @@ TEST_F(SenderTest, trySend_multipleMessages)
             (packet[i]->length - message[i]->TRANSPORT_HEADER_LENGTH);
         message[i]->state = Homa::OutMessage::Status::IN_PROGRESS;
     }
-    sender->sendReady = true;
+    sender->sendShards[0].sendReady = true;
 
     // Message 0: Will finish, !held
     EXPECT_EQ(1, info[0]->packetsGranted);
@@ -1849,15 +2642,15 @@ TEST_F(SenderTest, trySend_multipleMessages)
 
     EXPECT_EQ(1U, info[0]->packetsSent);
     EXPECT_EQ(Homa::OutMessage::Status::SENT, message[0]->state);
-    EXPECT_FALSE(sender->sendQueue.contains(&info[0]->sendQueueNode));
+    EXPECT_FALSE(sender->sendShards[0].sendQueue.contains(&info[0]->sendQueueNode));
     EXPECT_EQ(nullptr,
               bucket[0]->findMessage(id[0], SpinLock::Lock(bucket[0]->mutex)));
     EXPECT_EQ(1U, info[1]->packetsSent);
     EXPECT_NE(Homa::OutMessage::Status::SENT, message[1]->state);
-    EXPECT_TRUE(sender->sendQueue.contains(&info[1]->sendQueueNode));
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.contains(&info[1]->sendQueueNode));
     EXPECT_EQ(1U, info[2]->packetsSent);
     EXPECT_EQ(Homa::OutMessage::Status::SENT, message[2]->state);
-    EXPECT_FALSE(sender->sendQueue.contains(&info[2]->sendQueueNode));
+    EXPECT_FALSE(sender->sendShards[0].sendQueue.contains(&info[2]->sendQueueNode));
     EXPECT_FALSE(bucket[2]->messageTimeouts.list.contains(
         &message[2]->messageTimeout.node));
     EXPECT_FALSE(
@@ -1877,7 +2670,7 @@ TEST_F(SenderTest, trySend_alreadyRunning)
     EXPECT_EQ(1, info->packetsGranted);
     EXPECT_EQ(0, info->packetsSent);
 
-    sender->sending.test_and_set();
+    sender->sendShards[0].sending.test_and_set();
 
     EXPECT_CALL(mockDriver, sendPacket).Times(0);
 
@@ -1888,11 +2681,118 @@ TEST_F(SenderTest, trySend_alreadyRunning)
 
 TEST_F(SenderTest, trySend_nothingToSend)
 {
-    EXPECT_TRUE(sender->sendQueue.empty());
+    EXPECT_TRUE(sender->sendShards[0].sendQueue.empty());
     EXPECT_CALL(mockDriver, sendPacket).Times(0);
     sender->trySend();
 }
 
+TEST_F(SenderTest, trySend_piggybackGrant)
+{
+    NiceMock<Homa::Mock::MockReceiver> mockReceiver(&mockDriver, 0, 0);
+    sender->setGrantSource(&mockReceiver);
+    Protocol::MessageId id = {42, 10};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    SenderTest::addMessage(sender, id, message, true, 1);
+    Homa::Mock::MockDriver::MockPacket* packet[2];
+    const uint32_t PACKET_SIZE = sender->driver->getMaxPayloadSize();
+    const uint32_t PACKET_DATA_SIZE =
+        PACKET_SIZE - message->TRANSPORT_HEADER_LENGTH;
+    for (int i = 0; i < 2; ++i) {
+        packet[i] = new Homa::Mock::MockDriver::MockPacket{payload};
+        packet[i]->length = PACKET_SIZE;
+        setMessagePacket(message, i, packet[i]);
+        info->unsentBytes += PACKET_DATA_SIZE;
+    }
+    message->state = Homa::OutMessage::Status::IN_PROGRESS;
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(packet[0]->payload);
+    header->piggybackGrant = 0;
+
+    // The Receiver has a pending grant for the destination peer; it should
+    // be folded into the outgoing DATA packet.
+    Protocol::MessageId grantId = {22, 99};
+    sender->sendShards[0].sendReady = true;
+    EXPECT_CALL(mockReceiver, claimPiggybackGrant(_, _, _, _))
+        .WillOnce(DoAll(SetArgPointee<1>(grantId), SetArgPointee<2>(8000),
+                        SetArgPointee<3>(3), Return(true)));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packet[0]), _, _));
+
+    sender->trySend();  // < test call
+
+    EXPECT_EQ(1, info->packetsSent);
+    EXPECT_EQ(1U, header->piggybackGrant);
+    EXPECT_EQ(grantId, header->grantId);
+    EXPECT_EQ(8000U, header->grantByteLimit);
+    EXPECT_EQ(3U, header->grantPriority);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // No grant pending; a stale piggybacked grant left over from an earlier
+    // transmission must be cleared.
+    header->piggybackGrant = 1;
+    info->packetsGranted = 2;
+    sender->sendShards[0].sendReady = true;
+    EXPECT_CALL(mockReceiver, claimPiggybackGrant(_, _, _, _))
+        .WillOnce(Return(false));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packet[1]), _, _));
+
+    sender->trySend();  // < test call
+
+    EXPECT_EQ(0U, header->piggybackGrant);
+
+    for (int i = 0; i < 2; ++i) {
+        delete packet[i];
+    }
+}
+
+TEST_F(SenderTest, trySend_NO_COMPLETION)
+{
+    Protocol::MessageId id = {42, 10};
+    Sender::Message* message =
+        dynamic_cast<Sender::Message*>(sender->allocMessage(0));
+    Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    SenderTest::addMessage(sender, id, message, true, 2);
+    Sender::MessageBucket* bucket = sender->messageBuckets.getBucket(id);
+    Homa::Mock::MockDriver::MockPacket* packet[2];
+    const uint32_t PACKET_SIZE = sender->driver->getMaxPayloadSize();
+    const uint32_t PACKET_DATA_SIZE =
+        PACKET_SIZE - message->TRANSPORT_HEADER_LENGTH;
+    for (int i = 0; i < 2; ++i) {
+        packet[i] = new Homa::Mock::MockDriver::MockPacket{payload};
+        packet[i]->length = PACKET_SIZE;
+        setMessagePacket(message, i, packet[i]);
+        info->unsentBytes += PACKET_DATA_SIZE;
+    }
+    message->state = Homa::OutMessage::Status::IN_PROGRESS;
+    message->options = OutMessage::Options::NO_COMPLETION;
+    bucket->messageTimeouts.setTimeout(&message->messageTimeout);
+    bucket->pingTimeouts.setTimeout(&message->pingTimeout);
+    sender->sendShards[0].sendReady = true;
+
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packet[0]), _, _));
+    EXPECT_CALL(mockDriver, sendPacket(Eq(packet[1]), _, _));
+
+    sender->trySend();  // < test call
+
+    // The message is untracked as soon as it is SENT but not destroyed,
+    // since the application still holds it.
+    EXPECT_EQ(Homa::OutMessage::Status::SENT, message->state);
+    EXPECT_FALSE(bucket->messages.contains(&message->bucketNode));
+    EXPECT_TRUE(bucket->messageTimeouts.empty());
+    EXPECT_TRUE(bucket->pingTimeouts.empty());
+    EXPECT_EQ(1U, sender->messageAllocator.outstandingObjects);
+
+    message->release();
+    sender->reclaimMessages();
+
+    EXPECT_EQ(0U, sender->messageAllocator.outstandingObjects);
+
+    for (int i = 0; i < 2; ++i) {
+        delete packet[i];
+    }
+}
+
 }  // namespace
 }  // namespace Core
 }  // namespace Homa
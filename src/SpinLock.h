@@ -17,8 +17,13 @@
 #define HOMA_SPINLOCK_H
 
 #include <atomic>
+#include <cstdint>
 #include <mutex>
 
+#ifdef HOMA_LOCK_STATS
+#include <Cycles.h>
+#endif
+
 namespace Homa {
 
 /**
@@ -40,6 +45,77 @@ class SpinLock {
     std::atomic_flag flag = ATOMIC_FLAG_INIT;
 
   public:
+    /**
+     * Aggregated contention counters for one named group of SpinLocks (a
+     * "lock site", e.g. all of the Receiver's message bucket mutexes).
+     *
+     * Instances are created on first use of a name, kept in a global list,
+     * and never destroyed, so readers may walk the list without
+     * synchronization; see Perf::getLockStats().  Counters only accumulate
+     * in builds compiled with HOMA_LOCK_STATS.
+     */
+    struct Metrics {
+        /**
+         * Construct the counters for the named lock site.
+         */
+        explicit Metrics(const char* name)
+            : name(name)
+            , contendedAcquisitions(0)
+            , failedSpins(0)
+            , waitCycles(0)
+            , next(nullptr)
+        {}
+
+        /// Name of the lock site.
+        const char* const name;
+
+        /// Number of lock() calls that found the lock held and had to spin.
+        std::atomic<uint64_t> contendedAcquisitions;
+
+        /// Total number of failed acquisition attempts across all contended
+        /// lock() calls.
+        std::atomic<uint64_t> failedSpins;
+
+        /// Total CPU time, in cycles, spent spinning for locks at this site.
+        std::atomic<uint64_t> waitCycles;
+
+        /// Next entry in the global list of lock sites.
+        Metrics* next;
+
+        /**
+         * Return the head of the global list of lock sites.
+         */
+        static std::atomic<Metrics*>& registry()
+        {
+            static std::atomic<Metrics*> head(nullptr);
+            return head;
+        }
+
+        /**
+         * Return the Metrics instance for the given lock site name,
+         * creating and registering it on first use.  Names are normally
+         * string literals and are compared by pointer; concurrent first
+         * uses of the same name can create duplicate entries, which
+         * Perf::getLockStats() merges when reporting.
+         */
+        static Metrics* forName(const char* name)
+        {
+            std::atomic<Metrics*>& head = registry();
+            for (Metrics* metrics = head.load(std::memory_order_acquire);
+                 metrics != nullptr; metrics = metrics->next) {
+                if (metrics->name == name) {
+                    return metrics;
+                }
+            }
+            Metrics* metrics = new Metrics(name);
+            metrics->next = head.load(std::memory_order_relaxed);
+            while (!head.compare_exchange_weak(metrics->next, metrics,
+                                               std::memory_order_release)) {
+            }
+            return metrics;
+        }
+    };
+
     /**
      * Create a new unlocked SpinLock.
      */
@@ -50,6 +126,21 @@ class SpinLock {
         flag.clear();
     }
 
+    /**
+     * Create a new unlocked SpinLock attributed to the named lock site for
+     * contention statistics (see Perf::getLockStats()).  Locks sharing a
+     * name aggregate into a single set of counters.  The name should be a
+     * string literal; in builds without HOMA_LOCK_STATS it is ignored.
+     */
+    explicit SpinLock(const char* name)
+#ifdef HOMA_LOCK_STATS
+        : metrics(Metrics::forName(name))
+#endif
+    {
+        (void)name;
+        flag.clear();
+    }
+
     /**
      * Destroy the SpinLock regardless of its current state.
      */
@@ -63,8 +154,15 @@ class SpinLock {
     {
         // test_and_set sets the flag to true and returns the previous value;
         // if it's True, someone else is owning the lock.
+        if (!flag.test_and_set(std::memory_order_acquire)) {
+            return;
+        }
+#ifdef HOMA_LOCK_STATS
+        lockContended();
+#else
         while (flag.test_and_set(std::memory_order_acquire))
             ;
+#endif
     }
 
     /**
@@ -102,6 +200,33 @@ class SpinLock {
     using UniqueLock = std::unique_lock<SpinLock>;
 
   private:
+#ifdef HOMA_LOCK_STATS
+    /**
+     * Slow path of lock(): spin until the lock is acquired, then charge the
+     * failed spins and wait cycles to this lock's site (if it has one).
+     */
+    void lockContended()
+    {
+        uint64_t start = PerfUtils::Cycles::rdtsc();
+        // The caller's failed test_and_set counts as the first spin.
+        uint64_t spins = 1;
+        while (flag.test_and_set(std::memory_order_acquire)) {
+            ++spins;
+        }
+        if (metrics != nullptr) {
+            metrics->contendedAcquisitions.fetch_add(1,
+                                                     std::memory_order_relaxed);
+            metrics->failedSpins.fetch_add(spins, std::memory_order_relaxed);
+            metrics->waitCycles.fetch_add(PerfUtils::Cycles::rdtsc() - start,
+                                          std::memory_order_relaxed);
+        }
+    }
+
+    /// Contention counters of the lock site this lock belongs to; nullptr
+    /// for unnamed locks.
+    Metrics* metrics = nullptr;
+#endif
+
     // Disable copy and assign
     SpinLock(const SpinLock&) = delete;
     SpinLock& operator=(const SpinLock&) = delete;
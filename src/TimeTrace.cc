@@ -0,0 +1,119 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "TimeTrace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include "StringUtil.h"
+
+namespace Homa {
+namespace TimeTrace {
+
+namespace Internal {
+
+/**
+ * Protects access to buffers.
+ */
+std::mutex mutex;
+
+/**
+ * Set of all trace buffers for all live threads.
+ */
+std::unordered_set<Buffer*> buffers;
+
+}  // namespace Internal
+
+// Init thread local trace buffer.
+thread_local Buffer buffer;
+
+/**
+ * Construct and register a new per thread trace buffer.
+ */
+Buffer::Buffer()
+    : events()
+    , nextIndex(0)
+{
+    std::lock_guard<std::mutex> lock(Internal::mutex);
+    Internal::buffers.insert(this);
+}
+
+/**
+ * Deregister and destruct a per thread trace buffer.  Events recorded by a
+ * thread are discarded when the thread exits.
+ */
+Buffer::~Buffer()
+{
+    std::lock_guard<std::mutex> lock(Internal::mutex);
+    Internal::buffers.erase(this);
+}
+
+/**
+ * @sa dump()
+ */
+void
+dump(std::string* output)
+{
+    std::vector<Event> events;
+    {
+        std::lock_guard<std::mutex> lock(Internal::mutex);
+        for (Buffer* buf : Internal::buffers) {
+            for (uint32_t i = 0; i < NUM_EVENTS; ++i) {
+                if (buf->events[i].tsc != 0) {
+                    events.push_back(buf->events[i]);
+                }
+            }
+        }
+    }
+    if (events.empty()) {
+        return;
+    }
+    std::sort(events.begin(), events.end(),
+              [](const Event& a, const Event& b) { return a.tsc < b.tsc; });
+
+    double cyclesPerSecond = PerfUtils::Cycles::perSecond();
+    uint64_t startTsc = events.front().tsc;
+    uint64_t prevTsc = startTsc;
+    for (const Event& event : events) {
+        double ns =
+            1e9 * static_cast<double>(event.tsc - startTsc) / cyclesPerSecond;
+        double deltaNs =
+            1e9 * static_cast<double>(event.tsc - prevTsc) / cyclesPerSecond;
+        prevTsc = event.tsc;
+        output->append(StringUtil::format("%8.1f ns (+%6.1f ns): %s (%lu)\n",
+                                          ns, deltaNs, event.message,
+                                          event.arg));
+    }
+}
+
+/**
+ * @sa reset()
+ */
+void
+reset()
+{
+    std::lock_guard<std::mutex> lock(Internal::mutex);
+    for (Buffer* buf : Internal::buffers) {
+        std::memset(buf->events, 0, sizeof(buf->events));
+        buf->nextIndex = 0;
+    }
+}
+
+}  // namespace TimeTrace
+}  // namespace Homa
@@ -0,0 +1,134 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_TIMETRACE_H
+#define HOMA_TIMETRACE_H
+
+#include <Cycles.h>
+
+#include <cstdint>
+#include <string>
+
+namespace Homa {
+
+/**
+ * TimeTrace provides a lightweight mechanism for recording timestamped
+ * events on the transport's hot paths.  Each thread records into its own
+ * fixed-size ring buffer, so recording an event costs an rdtsc and a few
+ * stores with no synchronization; the rings can be merged and formatted on
+ * demand to reconstruct where time went when chasing a latency regression.
+ *
+ * Trace points are only compiled in when HOMA_TIME_TRACE is defined (see
+ * the HOMA_ENABLE_TIME_TRACE build option); in normal builds the TIME_TRACE
+ * macro expands to nothing.
+ */
+namespace TimeTrace {
+
+/// Number of events each thread's ring buffer can hold; must be a power of
+/// two.  Older events are overwritten once the ring wraps.
+const uint32_t NUM_EVENTS = 8192;
+
+/**
+ * A single recorded trace event.
+ */
+struct Event {
+    /// Cycle time at which the event was recorded; 0 if this slot has never
+    /// been used.
+    uint64_t tsc;
+
+    /// Static string identifying the trace point.  Must have static storage
+    /// duration; only the pointer is stored.
+    const char* message;
+
+    /// Trace-point-specific argument (e.g. an opcode or sequence number).
+    uint64_t arg;
+};
+
+/**
+ * Per-thread ring of trace events.
+ */
+struct Buffer {
+    Buffer();
+    ~Buffer();
+
+    /**
+     * Record an event in this buffer, overwriting the oldest event if the
+     * ring is full.
+     */
+    inline void record(const char* message, uint64_t arg)
+    {
+        Event* event = &events[nextIndex & (NUM_EVENTS - 1)];
+        nextIndex++;
+        event->tsc = PerfUtils::Cycles::rdtsc();
+        event->message = message;
+        event->arg = arg;
+    }
+
+    /// Ring of recorded events.
+    Event events[NUM_EVENTS];
+
+    /// Index at which the next event will be recorded (not yet wrapped).
+    uint32_t nextIndex;
+};
+
+/// Per thread trace event buffer.
+extern thread_local Buffer buffer;
+
+/**
+ * Record a trace event in the calling thread's buffer.
+ *
+ * Prefer the TIME_TRACE macro so that the call is compiled out when tracing
+ * is disabled.
+ *
+ * @param message
+ *      Static string identifying the trace point.
+ * @param arg
+ *      Trace-point-specific argument.
+ */
+inline void
+record(const char* message, uint64_t arg = 0)
+{
+    buffer.record(message, arg);
+}
+
+/**
+ * Format the events recorded by all threads, in timestamp order, and append
+ * them to the given string; one line per event with times in nanoseconds
+ * relative to the earliest recorded event.
+ *
+ * Events recorded concurrently with this call may be formatted from a torn
+ * slot; this is a debugging facility, not a precise log.
+ */
+void dump(std::string* output);
+
+/**
+ * Discard all events recorded so far by the calling process.
+ */
+void reset();
+
+}  // namespace TimeTrace
+}  // namespace Homa
+
+/**
+ * Record a trace event; compiled out entirely unless HOMA_TIME_TRACE is
+ * defined.
+ */
+#ifdef HOMA_TIME_TRACE
+#define TIME_TRACE(message, arg) Homa::TimeTrace::record(message, arg)
+#else
+#define TIME_TRACE(message, arg)
+#endif
+
+#endif  // HOMA_TIMETRACE_H
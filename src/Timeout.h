@@ -29,6 +29,28 @@ namespace Core {
 template <typename ElementType>
 class TimeoutManager;
 
+/**
+ * Atomically lower a cached earliest-expiration time to the given timestamp.
+ *
+ * The cached value is a conservative lower bound: lowering it may cause a
+ * harmless extra sweep of the TimeoutManagers it summarizes, but it must
+ * never be raised past a live timeout's expiration time.
+ *
+ * @param earliestTimeout
+ *      Cached expiration time to lower.
+ * @param time
+ *      Cycle timestamp of a newly scheduled timeout.
+ */
+inline void
+lowerEarliestTimeout(std::atomic<uint64_t>* earliestTimeout, uint64_t time)
+{
+    uint64_t cached = earliestTimeout->load(std::memory_order_relaxed);
+    while (cached > time &&
+           !earliestTimeout->compare_exchange_weak(cached, time,
+                                                   std::memory_order_relaxed)) {
+    }
+}
+
 /**
  * Intrusive structure to keep track of a per object timeout.
  *
@@ -87,10 +109,18 @@ class TimeoutManager {
      * Construct a new TimeoutManager with a particular timeout interval.  All
      * timeouts tracked by this manager will have the same timeout interval.
      *
+     * @param timeoutIntervalCycles
+     *      Number of cycles a newly scheduled timeout waits before it elapses.
+     * @param earliestTimeoutHint
+     *      Optional pointer to a cached expiration time shared by several
+     *      TimeoutManagers; setTimeout() will lower it so the owner can skip
+     *      checking any of the managers until the earliest timeout is near.
      */
-    explicit TimeoutManager(uint64_t timeoutIntervalCycles)
+    explicit TimeoutManager(uint64_t timeoutIntervalCycles,
+                            std::atomic<uint64_t>* earliestTimeoutHint = nullptr)
         : timeoutIntervalCycles(timeoutIntervalCycles)
         , nextTimeout(UINT64_MAX)
+        , earliestTimeoutHint(earliestTimeoutHint)
         , list()
     {}
 
@@ -109,6 +139,10 @@ class TimeoutManager {
         list.push_back(&timeout->node);
         nextTimeout.store(list.front().expirationCycleTime,
                           std::memory_order_relaxed);
+        if (earliestTimeoutHint != nullptr) {
+            lowerEarliestTimeout(earliestTimeoutHint,
+                                 timeout->expirationCycleTime);
+        }
     }
 
     /**
@@ -146,6 +180,16 @@ class TimeoutManager {
         return now >= nextTimeout.load(std::memory_order_relaxed);
     }
 
+    /**
+     * Return the expiration time of the earliest managed Timeout; UINT64_MAX
+     * if no Timeouts are being managed.  This method is thread-safe with the
+     * same caveats as anyElapsed().
+     */
+    inline uint64_t getNextTimeout() const
+    {
+        return nextTimeout.load(std::memory_order_relaxed);
+    }
+
     /**
      * Check if the TimeoutManager manages no Timeouts.
      *
@@ -187,6 +231,10 @@ class TimeoutManager {
     /// management. Accessing this value is thread-safe.
     std::atomic<uint64_t> nextTimeout;
 
+    /// Optional cached expiration time shared with other TimeoutManagers;
+    /// see the constructor. nullptr if unused.
+    std::atomic<uint64_t>* earliestTimeoutHint;
+
     /// Used to keep track of all timeouts under management.
     Intrusive::List<Timeout<ElementType>> list;
 };
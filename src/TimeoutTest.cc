@@ -96,6 +96,32 @@ TEST(TimeoutManagerTest, setTimeout_reset)
     PerfUtils::Cycles::mockTscValue = 0;
 }
 
+TEST(TimeoutManagerTest, setTimeout_earliestTimeoutHint)
+{
+    PerfUtils::Cycles::mockTscValue = 10000;
+    std::atomic<uint64_t> hint(UINT64_MAX);
+    TimeoutManager<char> manager(100, &hint);
+    char owner;
+    Timeout<char> t(&owner);
+
+    manager.setTimeout(&t);
+
+    EXPECT_EQ(10100U, t.expirationCycleTime);
+    EXPECT_EQ(10100U, hint.load());
+
+    // An earlier cached time is left alone.
+    hint.store(9000);
+    manager.setTimeout(&t);
+    EXPECT_EQ(9000U, hint.load());
+
+    // Canceling does not raise the cached time; it is a lower bound.
+    manager.cancelTimeout(&t);
+    EXPECT_EQ(9000U, hint.load());
+    EXPECT_EQ(UINT64_MAX, manager.getNextTimeout());
+
+    PerfUtils::Cycles::mockTscValue = 0;
+}
+
 TEST(TimeoutManagerTest, cancelTimeout)
 {
     TimeoutManager<char> manager(100);
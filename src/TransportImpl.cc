@@ -15,13 +15,23 @@
 
 #include "TransportImpl.h"
 
+#include <pthread.h>
+#include <sched.h>
+
 #include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <limits>
 #include <memory>
+#include <string>
 #include <utility>
 
+#include "ControlPacket.h"
 #include "Cycles.h"
+#include "Debug.h"
 #include "Perf.h"
 #include "Protocol.h"
+#include "TimeTrace.h"
 
 namespace Homa {
 namespace Core {
@@ -34,6 +44,97 @@ const uint64_t MESSAGE_TIMEOUT_US = 40 * BASE_TIMEOUT_US;
 const uint64_t PING_INTERVAL_US = 3 * BASE_TIMEOUT_US;
 /// Microseconds to wait before performing retires on inbound messages.
 const uint64_t RESEND_INTERVAL_US = BASE_TIMEOUT_US;
+/// Microseconds the housekeeping thread sleeps between timeout sweeps; a
+/// small fraction of the shortest timeout interval so the sleep adds no
+/// meaningful delay to timeout detection.  See
+/// Transport::setBackgroundTimeouts().
+const uint64_t HOUSEKEEPING_INTERVAL_US = 100;
+
+// Definition for TransportImpl's in-class initialized constant; std::min
+// binds it to a reference (an ODR-use), so it needs an out-of-line
+// definition to link under C++11/14.
+const uint64_t TransportImpl::MAX_POLL_PAUSE_EXPONENT;
+
+namespace {
+
+/**
+ * Pin the calling thread to the CPUs of the given NUMA node so that the
+ * memory it first-touches (per-thread pool caches, packet bookkeeping) is
+ * allocated on that node.
+ *
+ * A no-op when numaNode is negative; logs a warning and leaves the thread
+ * unpinned if the node's CPU list cannot be read or applied.
+ *
+ * @param numaNode
+ *      The NUMA node whose CPUs the calling thread should run on.
+ */
+void
+pinThreadToNumaNode(int numaNode)
+{
+    if (numaNode < 0) {
+        return;
+    }
+    std::ifstream cpulist("/sys/devices/system/node/node" +
+                          std::to_string(numaNode) + "/cpulist");
+    if (!cpulist) {
+        WARNING("No such NUMA node %d; thread left unpinned", numaNode);
+        return;
+    }
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    int numCpus = 0;
+    // The cpulist file holds comma-separated CPU ranges (e.g. "0-7,16-23").
+    std::string range;
+    while (std::getline(cpulist, range, ',')) {
+        int first = -1;
+        int last = -1;
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) < 1) {
+            continue;
+        }
+        if (last < first) {
+            last = first;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, &cpuset);
+            numCpus++;
+        }
+    }
+    if (numCpus == 0 ||
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+        WARNING("Failed to pin thread to NUMA node %d", numaNode);
+    }
+}
+
+/**
+ * Drop the calling thread to the lowest scheduling priority so that it only
+ * runs on cycles the data-path threads leave unused.
+ *
+ * Logs a warning and leaves the priority unchanged if the scheduler refuses.
+ */
+void
+setThreadIdlePriority()
+{
+    struct sched_param param = {};
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0) {
+        WARNING("Failed to lower housekeeping thread priority");
+    }
+}
+
+/**
+ * Hint to the processor that the calling thread is spin-waiting so it can
+ * yield pipeline resources (e.g. to a hyper-twin) and save power.
+ */
+inline void
+cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    asm volatile("pause" ::: "memory");
+#else
+    std::this_thread::yield();
+#endif
+}
+
+}  // namespace
 
 /**
  * Construct an instances of a Homa-based transport.
@@ -45,6 +146,70 @@ const uint64_t RESEND_INTERVAL_US = BASE_TIMEOUT_US;
  *      which this transport will communicate.
  */
 TransportImpl::TransportImpl(Driver* driver, uint64_t transportId)
+    : TransportImpl(driver, transportId, 0)
+{}
+
+/**
+ * Construct an instance of a Homa-based transport bound to a particular
+ * Driver receive queue.
+ *
+ * @param driver
+ *      Driver with which this transport should send and receive packets.
+ * @param transportId
+ *      This transport's unique identifier in the group of transports among
+ *      which this transport will communicate.
+ * @param rxQueueId
+ *      The Driver receive queue this transport should poll; must be in the
+ *      range [0, Driver::getRxQueueCount()).
+ */
+TransportImpl::TransportImpl(Driver* driver, uint64_t transportId,
+                             int rxQueueId)
+    : TransportImpl(driver, transportId, rxQueueId, Mode::POLLED)
+{}
+
+/**
+ * Construct an instance of a Homa-based transport running in a particular
+ * execution mode.
+ *
+ * @param driver
+ *      Driver with which this transport should send and receive packets.
+ * @param transportId
+ *      This transport's unique identifier in the group of transports among
+ *      which this transport will communicate.
+ * @param rxQueueId
+ *      The Driver receive queue this transport should poll; must be in the
+ *      range [0, Driver::getRxQueueCount()).
+ * @param mode
+ *      The execution mode in which this transport should run (see
+ *      Transport::Mode).  In PIPELINED mode, the constructor spawns the
+ *      pipeline stage threads and the application need not call poll().
+ */
+TransportImpl::TransportImpl(Driver* driver, uint64_t transportId,
+                             int rxQueueId, Mode mode)
+    : TransportImpl(driver, transportId, rxQueueId, mode, -1)
+{}
+
+/**
+ * Construct an instance of a Homa-based transport placed on a particular
+ * NUMA node.
+ *
+ * @param driver
+ *      Driver with which this transport should send and receive packets.
+ * @param transportId
+ *      This transport's unique identifier in the group of transports among
+ *      which this transport will communicate.
+ * @param rxQueueId
+ *      The Driver receive queue this transport should poll; must be in the
+ *      range [0, Driver::getRxQueueCount()).
+ * @param mode
+ *      The execution mode in which this transport should run (see
+ *      Transport::Mode).
+ * @param numaNode
+ *      The NUMA node to which the pipeline stage threads (and the memory
+ *      they first-touch) should be bound; -1 disables NUMA placement.
+ */
+TransportImpl::TransportImpl(Driver* driver, uint64_t transportId,
+                             int rxQueueId, Mode mode, int numaNode)
     : transportId(transportId)
     , driver(driver)
     , policyManager(new Policy::Manager(driver))
@@ -56,51 +221,241 @@ TransportImpl::TransportImpl(Driver* driver, uint64_t transportId)
                        PerfUtils::Cycles::fromMicroseconds(MESSAGE_TIMEOUT_US),
                        PerfUtils::Cycles::fromMicroseconds(RESEND_INTERVAL_US)))
     , nextTimeoutCycles(0)
-{}
+    , rxQueueId(rxQueueId)
+    , mode(mode)
+    , numaNode(numaNode)
+    , adaptivePolling(false)
+    , idlePollCount(0)
+    , pipelineRunning(false)
+    , senderIngress()
+    , receiverIngress()
+    , pipeline()
+    , housekeepingRunning(false)
+    , housekeeper()
+{
+    assert(rxQueueId >= 0 && rxQueueId < driver->getRxQueueCount());
+    // Allow the Sender to piggyback pending grants on outgoing DATA packets.
+    sender->setGrantSource(receiver.get());
+    if (mode == Mode::PIPELINED) {
+        pipelineRunning.store(true, std::memory_order_release);
+        pipeline.emplace_back(&TransportImpl::rxMain, this);
+        pipeline.emplace_back(&TransportImpl::senderMain, this);
+        pipeline.emplace_back(&TransportImpl::receiverMain, this);
+        pipeline.emplace_back(&TransportImpl::timeoutMain, this);
+    }
+}
 
 /**
  * TransportImpl Destructor.
  */
-TransportImpl::~TransportImpl() = default;
+TransportImpl::~TransportImpl()
+{
+    if (housekeeper.joinable()) {
+        housekeepingRunning.store(false, std::memory_order_release);
+        housekeeper.join();
+    }
+    if (mode == Mode::PIPELINED) {
+        pipelineRunning.store(false, std::memory_order_release);
+        for (std::thread& stage : pipeline) {
+            stage.join();
+        }
+        // Release any packets still in flight between stages.
+        PacketEnvelope envelope;
+        while (senderIngress.tryPop(&envelope)) {
+            driver->releasePackets(&envelope.packet, 1);
+        }
+        while (receiverIngress.tryPop(&envelope)) {
+            driver->releasePackets(&envelope.packet, 1);
+        }
+    }
+}
+
+/// See Homa::Transport::open()
+std::unique_ptr<Homa::Socket>
+TransportImpl::open(uint16_t port)
+{
+    Receiver::DeliveryQueue* queue = receiver->openPort(port);
+    if (queue == nullptr) {
+        // The port already has a socket open.
+        return nullptr;
+    }
+    return std::unique_ptr<Homa::Socket>(new SocketImpl(this, port, queue));
+}
+
+/**
+ * SocketImpl constructor.
+ *
+ * @param transport
+ *      The transport on which the socket is being opened.
+ * @param port
+ *      The port to which the new socket is bound; the caller must have
+ *      opened the port against the transport's Receiver.
+ * @param queue
+ *      The delivery queue returned by Receiver::openPort() for the port.
+ */
+SocketImpl::SocketImpl(TransportImpl* transport, uint16_t port,
+                       Receiver::DeliveryQueue* queue)
+    : transport(transport)
+    , port(port)
+    , queue(queue)
+{}
+
+/**
+ * SocketImpl destructor.  Closes the socket's port.
+ */
+SocketImpl::~SocketImpl()
+{
+    transport->receiver->closePort(port);
+}
+
+/// See Homa::Socket::alloc()
+Homa::unique_ptr<Homa::OutMessage>
+SocketImpl::alloc()
+{
+    return transport->alloc(port);
+}
+
+/// See Homa::Socket::receive()
+Homa::unique_ptr<Homa::InMessage>
+SocketImpl::receive()
+{
+    return Homa::unique_ptr<Homa::InMessage>(
+        transport->receiver->receiveMessage(queue));
+}
 
 /// See Homa::Transport::poll()
 void
 TransportImpl::poll()
 {
+    poll(std::numeric_limits<uint32_t>::max());
+}
+
+/// See Homa::Transport::poll()
+uint32_t
+TransportImpl::poll(uint32_t budget)
+{
+    if (mode == Mode::PIPELINED) {
+        // The pipeline stage threads make progress on their own.
+        return 0;
+    }
+    if (budget == 0) {
+        return 0;
+    }
+
+    // Attribute this thread's counters to this transport so per-transport
+    // statistics collection (see Perf::StatsMonitor) can scope to it.
+    Perf::setThreadTransportId(transportId);
+
     Perf::Timer timer;
 
     // Receive and dispatch incoming packets.
-    processPackets();
+    uint32_t numPackets = processPackets(budget);
+    uint32_t itemsHandled = numPackets;
 
     // Allow sender and receiver to make incremental progress.
-    sender->poll();
-    receiver->poll();
+    if (housekeepingRunning.load(std::memory_order_relaxed)) {
+        // The timeout and reclamation sweeps belong to the housekeeping
+        // thread; keep this thread on the data fast path.  See
+        // Transport::setBackgroundTimeouts().
+        itemsHandled += sender->trySend();
+        itemsHandled += receiver->trySendGrants();
+    } else {
+        itemsHandled += sender->poll();
+        itemsHandled += receiver->poll();
+    }
+
+    // Allow the policy manager to update the priority policy.
+    policyManager->poll();
 
     Perf::counters.total_cycles.add(timer.split());
+
+    if (adaptivePolling.load(std::memory_order_relaxed)) {
+        if (numPackets > 0) {
+            idlePollCount = 0;
+        } else {
+            ++idlePollCount;
+            pollBackoff();
+        }
+    }
+    return itemsHandled;
 }
 
 /**
  * Helper method which receives a burst of incoming packets and process them
  * through the transport protocol.  Pulled out of TransportImpl::poll() to
  * simplify unit testing.
+ *
+ * @param maxPackets
+ *      Maximum number of incoming packets to receive and process; clamped
+ *      to the burst size.
+ * @return
+ *      Number of incoming packets received and processed.
  */
-void
-TransportImpl::processPackets()
+uint32_t
+TransportImpl::processPackets(uint32_t maxPackets)
 {
     // Keep track of time spent doing active processing versus idle.
     Perf::Timer timer;
 
-    const int MAX_BURST = 32;
+    const uint32_t MAX_BURST = 32;
     Driver::Packet* packets[MAX_BURST];
     IpAddress srcAddrs[MAX_BURST];
-    int numPackets = driver->receivePackets(MAX_BURST, packets, srcAddrs);
-    for (int i = 0; i < numPackets; ++i) {
-        processPacket(packets[i], srcAddrs[i]);
+    int numPackets = driver->receivePackets(std::min(maxPackets, MAX_BURST),
+                                            packets, srcAddrs, rxQueueId);
+    if (numPackets > 0) {
+        // Batch any control packets (GRANT/DONE/BUSY/...) emitted while
+        // handling this RX burst into one TX burst.
+        ControlPacket::Corked corked(driver);
+        for (int i = 0; i < numPackets; ++i) {
+            if (i + PREFETCH_DISTANCE < numPackets) {
+                // Pull the transport header of an upcoming packet into the
+                // cache while this one is dispatched; the first payload
+                // access would otherwise be a cold miss.  Two lines cover
+                // the largest header (Protocol::Packet::DataHeader).
+                const char* payload = static_cast<const char*>(
+                    packets[i + PREFETCH_DISTANCE]->payload);
+                Util::prefetch(payload);
+                Util::prefetch(payload + 64);
+            }
+            processPacket(packets[i], srcAddrs[i]);
+        }
     }
 
     if (numPackets > 0) {
         Perf::counters.active_cycles.add(timer.split());
     }
+    return Util::downCast<uint32_t>(numPackets);
+}
+
+/**
+ * Pause the calling thread according to the adaptive poll backoff ladder;
+ * see Transport::setAdaptivePolling().
+ *
+ * The first IDLE_POLLS_BEFORE_BACKOFF empty iterations run hot.  After
+ * that, each additional empty iteration doubles a PAUSE-instruction spin,
+ * capped at 2^MAX_POLL_PAUSE_EXPONENT pauses per iteration.  Once the
+ * transport has been idle long enough to reach IDLE_POLLS_BEFORE_SLEEP, it
+ * asks the Driver to sleep until a receive event; Drivers without receive
+ * event support simply keep the transport on the capped pause ladder.
+ */
+void
+TransportImpl::pollBackoff()
+{
+    if (idlePollCount < IDLE_POLLS_BEFORE_BACKOFF) {
+        // Stay hot; traffic was seen recently and may resume immediately.
+        return;
+    }
+    if (idlePollCount >= IDLE_POLLS_BEFORE_SLEEP &&
+        driver->waitForPackets(rxQueueId, MAX_IDLE_SLEEP_MICROS)) {
+        return;
+    }
+    uint64_t exponent =
+        std::min(idlePollCount - IDLE_POLLS_BEFORE_BACKOFF,
+                 MAX_POLL_PAUSE_EXPONENT);
+    uint64_t numPauses = uint64_t(1) << exponent;
+    for (uint64_t i = 0; i < numPauses; ++i) {
+        cpuRelax();
+    }
 }
 
 void
@@ -111,8 +466,34 @@ TransportImpl::processPacket(Driver::Packet* packet, IpAddress sourceIp)
     Perf::counters.rx_bytes.add(packet->length);
     Protocol::Packet::CommonHeader* header =
         static_cast<Protocol::Packet::CommonHeader*>(packet->payload);
+    TIME_TRACE("TransportImpl::processPacket: start", header->opcode);
+    Perf::PeerCounters* peerCounters =
+        Perf::perPeerStatsEnabled() ? Perf::getPeerCounters(sourceIp) : nullptr;
+    if (peerCounters != nullptr) {
+        peerCounters->rx_bytes.add(packet->length);
+        if (header->opcode == Protocol::Packet::DATA ||
+            header->opcode == Protocol::Packet::DATA_SINGLE) {
+            peerCounters->rx_data_pkts.add(1);
+        }
+    }
     switch (header->opcode) {
-        case Protocol::Packet::DATA:
+        case Protocol::Packet::DATA: {
+            Perf::counters.rx_data_pkts.add(1);
+            // Copy out any piggybacked grant before the Receiver takes
+            // ownership of the packet.
+            Protocol::Packet::DataHeader* dataHeader =
+                static_cast<Protocol::Packet::DataHeader*>(packet->payload);
+            const bool hasPiggybackGrant = (dataHeader->piggybackGrant != 0);
+            const Protocol::MessageId grantId = dataHeader->grantId;
+            const uint32_t grantByteLimit = dataHeader->grantByteLimit;
+            const uint8_t grantPriority = dataHeader->grantPriority;
+            receiver->handleDataPacket(packet, sourceIp);
+            if (hasPiggybackGrant) {
+                sender->applyGrant(grantId, grantByteLimit, grantPriority);
+            }
+            break;
+        }
+        case Protocol::Packet::DATA_SINGLE:
             Perf::counters.rx_data_pkts.add(1);
             receiver->handleDataPacket(packet, sourceIp);
             break;
@@ -147,5 +528,185 @@ TransportImpl::processPacket(Driver::Packet* packet, IpAddress sourceIp)
     }
 }
 
+/**
+ * Helper method which receives a burst of incoming packets and hands each
+ * packet to the pipeline stage that will process it.  Packets that the Sender
+ * handles (GRANT/DONE/RESEND/UNKNOWN/ERROR) go to the sender stage's ingress
+ * ring; packets that the Receiver handles (DATA/BUSY/PING) go to the receiver
+ * stage's ring.  Only used in PIPELINED mode.
+ */
+void
+TransportImpl::dispatchPackets()
+{
+    // Keep track of time spent doing active processing versus idle.
+    Perf::Timer timer;
+
+    const int MAX_BURST = 32;
+    Driver::Packet* packets[MAX_BURST];
+    IpAddress srcAddrs[MAX_BURST];
+    int numPackets =
+        driver->receivePackets(MAX_BURST, packets, srcAddrs, rxQueueId);
+    for (int i = 0; i < numPackets; ++i) {
+        if (i + PREFETCH_DISTANCE < numPackets) {
+            // See processPackets().
+            const char* payload = static_cast<const char*>(
+                packets[i + PREFETCH_DISTANCE]->payload);
+            Util::prefetch(payload);
+            Util::prefetch(payload + 64);
+        }
+        assert(packets[i]->length >=
+               Util::downCast<int>(sizeof(Protocol::Packet::CommonHeader)));
+        Protocol::Packet::CommonHeader* header =
+            static_cast<Protocol::Packet::CommonHeader*>(packets[i]->payload);
+        MpmcRing<PacketEnvelope, STAGE_RING_SIZE>* ring;
+        switch (header->opcode) {
+            case Protocol::Packet::GRANT:
+            case Protocol::Packet::DONE:
+            case Protocol::Packet::RESEND:
+            case Protocol::Packet::UNKNOWN:
+            case Protocol::Packet::ERROR:
+                ring = &senderIngress;
+                break;
+            default:
+                ring = &receiverIngress;
+                break;
+        }
+        PacketEnvelope envelope = {packets[i], srcAddrs[i]};
+        // Wait for the downstream stage rather than dropping the packet; the
+        // stall propagates backpressure to the NIC's receive queue.
+        while (!ring->tryPush(envelope)) {
+            if (!pipelineRunning.load(std::memory_order_acquire)) {
+                driver->releasePackets(&packets[i], 1);
+                break;
+            }
+        }
+    }
+
+    if (numPackets > 0) {
+        Perf::counters.active_cycles.add(timer.split());
+    }
+}
+
+/**
+ * Main loop of the RX dispatch pipeline stage: receives packet bursts from
+ * the driver and routes each packet to the stage that will process it.
+ */
+void
+TransportImpl::rxMain()
+{
+    pinThreadToNumaNode(numaNode);
+    Perf::setThreadTransportId(transportId);
+    while (pipelineRunning.load(std::memory_order_acquire)) {
+        dispatchPackets();
+    }
+}
+
+/**
+ * Main loop of the sender pipeline stage: processes Sender-bound packets and
+ * makes progress sending outbound messages.
+ */
+void
+TransportImpl::senderMain()
+{
+    pinThreadToNumaNode(numaNode);
+    Perf::setThreadTransportId(transportId);
+    while (pipelineRunning.load(std::memory_order_acquire)) {
+        PacketEnvelope envelope;
+        if (senderIngress.tryPop(&envelope)) {
+            // Batch any control packets emitted while handling this RX burst
+            // into one TX burst.
+            ControlPacket::Corked corked(driver);
+            do {
+                processPacket(envelope.packet, envelope.source);
+            } while (senderIngress.tryPop(&envelope));
+        }
+        sender->trySend();
+    }
+}
+
+/**
+ * Main loop of the receiver pipeline stage: processes Receiver-bound packets
+ * and makes progress granting inbound messages.
+ */
+void
+TransportImpl::receiverMain()
+{
+    pinThreadToNumaNode(numaNode);
+    Perf::setThreadTransportId(transportId);
+    while (pipelineRunning.load(std::memory_order_acquire)) {
+        PacketEnvelope envelope;
+        if (receiverIngress.tryPop(&envelope)) {
+            // Batch any control packets emitted while handling this RX burst
+            // into one TX burst.
+            ControlPacket::Corked corked(driver);
+            do {
+                processPacket(envelope.packet, envelope.source);
+            } while (receiverIngress.tryPop(&envelope));
+        }
+        receiver->trySendGrants();
+    }
+}
+
+/**
+ * Main loop of the timeout pipeline stage: checks for expired Sender and
+ * Receiver timeouts and reclaims released messages.  The timeout checks
+ * return in O(1) when no timeout is near, so this stage mostly spins on a
+ * pair of cached expiration times.
+ */
+void
+TransportImpl::timeoutMain()
+{
+    pinThreadToNumaNode(numaNode);
+    Perf::setThreadTransportId(transportId);
+    while (pipelineRunning.load(std::memory_order_acquire)) {
+        sender->checkTimeouts();
+        receiver->checkTimeouts();
+        sender->reclaimMessages();
+        receiver->reclaimMessages();
+        policyManager->poll();
+    }
+}
+
+/// See Homa::Transport::setBackgroundTimeouts()
+void
+TransportImpl::setBackgroundTimeouts(bool enabled)
+{
+    if (mode == Mode::PIPELINED) {
+        // The timeout pipeline stage already owns this work.
+        return;
+    }
+    if (enabled && !housekeeper.joinable()) {
+        housekeepingRunning.store(true, std::memory_order_release);
+        housekeeper = std::thread(&TransportImpl::housekeepingMain, this);
+    } else if (!enabled && housekeeper.joinable()) {
+        housekeepingRunning.store(false, std::memory_order_release);
+        housekeeper.join();
+        housekeeper = std::thread();
+    }
+}
+
+/**
+ * Main loop of the housekeeping thread: periodically sweeps for expired
+ * Sender and Receiver timeouts and reclaims released messages; see
+ * Transport::setBackgroundTimeouts().  The sweeps return in O(1) when no
+ * timeout is near, so each pass is cheap and the thread sleeps in between
+ * rather than spinning.
+ */
+void
+TransportImpl::housekeepingMain()
+{
+    pinThreadToNumaNode(numaNode);
+    setThreadIdlePriority();
+    Perf::setThreadTransportId(transportId);
+    while (housekeepingRunning.load(std::memory_order_acquire)) {
+        sender->checkTimeouts();
+        receiver->checkTimeouts();
+        sender->reclaimMessages();
+        receiver->reclaimMessages();
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(HOUSEKEEPING_INTERVAL_US));
+    }
+}
+
 }  // namespace Core
 }  // namespace Homa
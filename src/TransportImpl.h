@@ -18,13 +18,16 @@
 
 #include <Homa/Homa.h>
 
+#include <algorithm>
 #include <atomic>
 #include <bitset>
 #include <deque>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "MpmcRing.h"
 #include "ObjectPool.h"
 #include "Policy.h"
 #include "Receiver.h"
@@ -44,6 +47,12 @@ namespace Core {
 class TransportImpl : public Transport {
   public:
     explicit TransportImpl(Driver* driver, uint64_t transportId);
+    explicit TransportImpl(Driver* driver, uint64_t transportId,
+                           int rxQueueId);
+    explicit TransportImpl(Driver* driver, uint64_t transportId, int rxQueueId,
+                           Mode mode);
+    explicit TransportImpl(Driver* driver, uint64_t transportId, int rxQueueId,
+                           Mode mode, int numaNode);
     ~TransportImpl();
 
     /// See Homa::Transport::alloc()
@@ -53,13 +62,83 @@ class TransportImpl : public Transport {
         return Homa::unique_ptr<Homa::OutMessage>(outMessage);
     }
 
+    virtual std::unique_ptr<Homa::Socket> open(uint16_t port);
+
     /// See Homa::Transport::receive()
     virtual Homa::unique_ptr<Homa::InMessage> receive()
     {
         return Homa::unique_ptr<Homa::InMessage>(receiver->receiveMessage());
     }
 
+    /// See Homa::Transport::receiveBatch()
+    virtual uint32_t receiveBatch(Homa::unique_ptr<Homa::InMessage> messages[],
+                                  uint32_t maxMessages)
+    {
+        const uint32_t MAX_CHUNK = 32;
+        Homa::InMessage* chunk[MAX_CHUNK];
+        uint32_t numMessages = 0;
+        while (numMessages < maxMessages) {
+            uint32_t request =
+                std::min(maxMessages - numMessages, MAX_CHUNK);
+            uint32_t count = receiver->receiveMessages(chunk, request);
+            for (uint32_t i = 0; i < count; ++i) {
+                messages[numMessages++] =
+                    Homa::unique_ptr<Homa::InMessage>(chunk[i]);
+            }
+            if (count < request) {
+                break;
+            }
+        }
+        return numMessages;
+    }
+
+    /// See Homa::Transport::setStreamingThreshold()
+    virtual void setStreamingThreshold(size_t lengthBytes)
+    {
+        receiver->setStreamingThreshold(lengthBytes);
+    }
+
+    /// See Homa::Transport::setCompactionThreshold()
+    virtual void setCompactionThreshold(size_t lengthBytes)
+    {
+        receiver->setCompactionThreshold(lengthBytes);
+    }
+
+    /// See Homa::Transport::setAdaptivePolling()
+    virtual void setAdaptivePolling(bool enabled)
+    {
+        adaptivePolling.store(enabled);
+    }
+
+    virtual void setBackgroundTimeouts(bool enabled);
+
+    /// See Homa::Transport::setGrantQuantum()
+    virtual void setGrantQuantum(size_t bytes)
+    {
+        receiver->setGrantQuantum(bytes);
+    }
+
+    /// See Homa::Transport::setGrantCoordinator()
+    virtual void setGrantCoordinator(GrantCoordinator* coordinator)
+    {
+        receiver->setGrantCoordinator(coordinator);
+    }
+
+    /// See Homa::Transport::setOverloadThreshold()
+    virtual void setOverloadThreshold(size_t messages)
+    {
+        receiver->setOverloadThreshold(messages);
+    }
+
+    /// See Homa::Transport::setWakeupCallback()
+    virtual void setWakeupCallback(std::function<void()> callback)
+    {
+        sender->setWakeupCallback(callback);
+        receiver->setWakeupCallback(std::move(callback));
+    }
+
     virtual void poll();
+    virtual uint32_t poll(uint32_t budget);
 
     /// See Homa::Transport::getDriver()
     virtual Driver* getDriver()
@@ -74,8 +153,54 @@ class TransportImpl : public Transport {
     }
 
   private:
-    void processPackets();
+    /// A received packet in flight between pipeline stages.
+    struct PacketEnvelope {
+        /// The received packet.
+        Driver::Packet* packet;
+        /// IpAddress of the packet's sender.
+        IpAddress source;
+    };
+
+    /// Number of packets each inter-stage ring can hold; bounds the number of
+    /// packets in flight between the RX dispatch stage and a handler stage.
+    static const std::size_t STAGE_RING_SIZE = 1024;
+
+    /// Number of packets ahead of the one being processed whose transport
+    /// headers the RX loops prefetch; far enough ahead to hide the miss
+    /// latency behind the processing of the intervening packets, close
+    /// enough that the lines are still cached when reached.
+    static const int PREFETCH_DISTANCE = 2;
+
+    /// Number of consecutive empty poll() iterations to tolerate before the
+    /// adaptive backoff ladder starts pausing; keeps the transport hot
+    /// through the short gaps within a burst of traffic.
+    static const uint64_t IDLE_POLLS_BEFORE_BACKOFF = 64;
+
+    /// Deepest rung of the pause ladder: an idle poll() iteration pauses for
+    /// at most 2^MAX_POLL_PAUSE_EXPONENT PAUSE instructions (roughly tens of
+    /// microseconds); this bounds the latency added to the first packet that
+    /// arrives while the transport is backed off.
+    static const uint64_t MAX_POLL_PAUSE_EXPONENT = 10;
+
+    /// Number of backoff iterations at full pause depth to complete before
+    /// poll() asks the Driver to sleep on a receive event.
+    static const uint64_t IDLE_POLLS_BEFORE_SLEEP =
+        IDLE_POLLS_BEFORE_BACKOFF + 256;
+
+    /// Upper bound on a single Driver receive-event sleep, in microseconds;
+    /// bounds how long timeout processing can be delayed while the transport
+    /// sleeps.
+    static const uint64_t MAX_IDLE_SLEEP_MICROS = 1000;
+
+    uint32_t processPackets(uint32_t maxPackets);
     void processPacket(Driver::Packet* packet, IpAddress source);
+    void dispatchPackets();
+    void pollBackoff();
+    void rxMain();
+    void senderMain();
+    void receiverMain();
+    void timeoutMain();
+    void housekeepingMain();
 
     /// Unique identifier for this transport.
     const std::atomic<uint64_t> transportId;
@@ -94,6 +219,89 @@ class TransportImpl : public Transport {
 
     /// Caches the next cycle time that timeouts will need to rechecked.
     std::atomic<uint64_t> nextTimeoutCycles;
+
+    /// The Driver receive queue that this transport polls; 0 unless this
+    /// transport was bound to a particular queue at creation.
+    const int rxQueueId;
+
+    /// The execution mode in which this transport runs (see Transport::Mode).
+    const Mode mode;
+
+    /// The NUMA node to which this transport's pipeline stage threads are
+    /// pinned; -1 disables NUMA placement.  Only meaningful in PIPELINED
+    /// mode.
+    const int numaNode;
+
+    /// True if poll() should back off when the transport is idle; see
+    /// Transport::setAdaptivePolling().
+    std::atomic<bool> adaptivePolling;
+
+    /// Number of consecutive poll() iterations that found no incoming
+    /// packets; drives the adaptive backoff ladder.  Only accessed by the
+    /// polling thread.
+    uint64_t idlePollCount;
+
+    /// True while the pipeline stage threads should keep running; cleared by
+    /// the destructor to shut the stages down.  Unused in POLLED mode.
+    std::atomic<bool> pipelineRunning;
+
+    /// Packets bound for the Sender (GRANT/DONE/RESEND/UNKNOWN/ERROR),
+    /// handed from the RX dispatch stage to the sender stage.  Single
+    /// producer and single consumer in practice.  Unused in POLLED mode.
+    MpmcRing<PacketEnvelope, STAGE_RING_SIZE> senderIngress;
+
+    /// Packets bound for the Receiver (DATA/BUSY/PING), handed from the RX
+    /// dispatch stage to the receiver stage.  Single producer and single
+    /// consumer in practice.  Unused in POLLED mode.
+    MpmcRing<PacketEnvelope, STAGE_RING_SIZE> receiverIngress;
+
+    /// The pipeline stage threads; empty in POLLED mode.
+    std::vector<std::thread> pipeline;
+
+    /// True while the housekeeping thread should keep running; also read by
+    /// poll() to skip the timeout sweeps that the housekeeping thread owns.
+    /// See Transport::setBackgroundTimeouts().
+    std::atomic<bool> housekeepingRunning;
+
+    /// The background timeout-processing thread; only joinable while
+    /// background timeouts are enabled.  Unused in PIPELINED mode.
+    std::thread housekeeper;
+
+    /// SocketImpl sends through TransportImpl::alloc() and closes its port
+    /// against the TransportImpl's Receiver when destroyed.
+    friend class SocketImpl;
+};
+
+/**
+ * Internal implementation of Homa::Socket.
+ *
+ * Holds the per-port delivery queue opened against the transport's Receiver
+ * (see Receiver::openPort()) and drains it on receive().
+ */
+class SocketImpl : public Homa::Socket {
+  public:
+    explicit SocketImpl(TransportImpl* transport, uint16_t port,
+                        Receiver::DeliveryQueue* queue);
+    virtual ~SocketImpl();
+    virtual Homa::unique_ptr<Homa::OutMessage> alloc();
+    virtual Homa::unique_ptr<Homa::InMessage> receive();
+
+    /// See Homa::Socket::getPort()
+    virtual uint16_t getPort() const
+    {
+        return port;
+    }
+
+  private:
+    /// The transport on which this socket was opened.
+    TransportImpl* const transport;
+
+    /// The port to which this socket is bound.
+    const uint16_t port;
+
+    /// Delivery queue holding the completed inbound messages sent to _port_;
+    /// owned by the transport's Receiver and freed when the port is closed.
+    Receiver::DeliveryQueue* const queue;
 };
 
 }  // namespace Core
@@ -63,6 +63,23 @@ class TransportImplTest : public ::testing::Test {
     NiceMock<Homa::Mock::MockReceiver>* mockReceiver;
 };
 
+TEST_F(TransportImplTest, open)
+{
+    std::unique_ptr<Homa::Socket> socket = transport->open(60001);
+    ASSERT_TRUE(socket);
+    EXPECT_EQ(60001, socket->getPort());
+    EXPECT_EQ(1, mockReceiver->portQueues.openPorts.load());
+
+    // The port already has a socket open.
+    EXPECT_FALSE(transport->open(60001));
+
+    // Destroying the socket closes its port.
+    socket.reset();
+    EXPECT_EQ(0, mockReceiver->portQueues.openPorts.load());
+    socket = transport->open(60001);
+    EXPECT_TRUE(socket);
+}
+
 TEST_F(TransportImplTest, poll)
 {
     EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
@@ -84,6 +101,90 @@ TEST_F(TransportImplTest, poll)
     transport->poll();
 }
 
+TEST_F(TransportImplTest, poll_budget)
+{
+    // A zero budget does no work at all.
+    EXPECT_CALL(mockDriver, receivePackets).Times(0);
+    EXPECT_CALL(*mockSender, poll).Times(0);
+    EXPECT_CALL(*mockReceiver, poll).Times(0);
+    EXPECT_EQ(0U, transport->poll(0));
+
+    // The budget bounds the RX burst; the return value totals the packets
+    // processed with the work the sender and receiver report.
+    char payload[1024];
+    Homa::Mock::MockDriver::MockPacket dataPacket{payload, 1024};
+    static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload)
+        ->common.opcode = Protocol::Packet::DATA;
+    static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload)
+        ->piggybackGrant = 0;
+    Homa::Driver::Packet* packets[1] = {&dataPacket};
+    EXPECT_CALL(*mockReceiver, handleDataPacket(Eq(&dataPacket), _));
+    EXPECT_CALL(mockDriver, receivePackets(Eq(3), _, _))
+        .WillOnce(DoAll(SetArrayArgument<1>(packets, packets + 1), Return(1)));
+    EXPECT_CALL(*mockSender, poll).WillOnce(Return(2));
+    EXPECT_CALL(*mockReceiver, poll).WillOnce(Return(1));
+    EXPECT_EQ(4U, transport->poll(3));
+}
+
+TEST_F(TransportImplTest, poll_adaptiveBackoff)
+{
+    transport->setAdaptivePolling(true);
+
+    // Empty iterations count toward the backoff ladder.
+    EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
+    transport->poll();
+    EXPECT_EQ(1U, transport->idlePollCount);
+
+    // Once deeply idle, poll() tries to sleep on a driver receive event.
+    transport->idlePollCount = TransportImpl::IDLE_POLLS_BEFORE_SLEEP;
+    EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
+    EXPECT_CALL(mockDriver,
+                waitForPackets(Eq(0),
+                               Eq(TransportImpl::MAX_IDLE_SLEEP_MICROS)))
+        .WillOnce(Return(true));
+    transport->poll();
+    EXPECT_EQ(TransportImpl::IDLE_POLLS_BEFORE_SLEEP + 1,
+              transport->idlePollCount);
+
+    // An iteration that finds traffic resets the ladder.
+    char payload[1024];
+    Homa::Mock::MockDriver::MockPacket dataPacket{payload, 1024};
+    static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload)
+        ->common.opcode = Protocol::Packet::DATA;
+    static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload)
+        ->piggybackGrant = 0;
+    Homa::Driver::Packet* packets[1] = {&dataPacket};
+    EXPECT_CALL(*mockReceiver, handleDataPacket(Eq(&dataPacket), _));
+    EXPECT_CALL(mockDriver, receivePackets)
+        .WillOnce(DoAll(SetArrayArgument<1>(packets, packets + 1), Return(1)));
+    transport->poll();
+    EXPECT_EQ(0U, transport->idlePollCount);
+}
+
+TEST_F(TransportImplTest, poll_backgroundTimeouts)
+{
+    transport->setBackgroundTimeouts(true);
+    EXPECT_TRUE(transport->housekeeper.joinable());
+    EXPECT_TRUE(transport->housekeepingRunning.load());
+
+    // The timeout sweeps belong to the housekeeping thread; poll() makes
+    // send and grant progress directly instead of going through the modules'
+    // poll() entry points.
+    EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
+    EXPECT_CALL(*mockSender, poll).Times(0);
+    EXPECT_CALL(*mockReceiver, poll).Times(0);
+    transport->poll();
+
+    transport->setBackgroundTimeouts(false);
+    EXPECT_FALSE(transport->housekeeper.joinable());
+    EXPECT_FALSE(transport->housekeepingRunning.load());
+
+    EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
+    EXPECT_CALL(*mockSender, poll).Times(1);
+    EXPECT_CALL(*mockReceiver, poll).Times(1);
+    transport->poll();
+}
+
 TEST_F(TransportImplTest, processPackets)
 {
     char payload[8][1024];
@@ -93,8 +194,11 @@ TEST_F(TransportImplTest, processPackets)
     Homa::Mock::MockDriver::MockPacket dataPacket{payload[0], 1024};
     static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload)
         ->common.opcode = Protocol::Packet::DATA;
+    static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload)
+        ->piggybackGrant = 0;
     packets[0] = &dataPacket;
     EXPECT_CALL(*mockReceiver, handleDataPacket(Eq(&dataPacket), _));
+    EXPECT_CALL(*mockSender, applyGrant).Times(0);
 
     // Set GRANT packet
     Homa::Mock::MockDriver::MockPacket grantPacket{payload[1], 1024};
@@ -145,10 +249,92 @@ TEST_F(TransportImplTest, processPackets)
     packets[7] = &errorPacket;
     EXPECT_CALL(*mockSender, handleErrorPacket(Eq(&errorPacket)));
 
+    // The driver is corked while the RX burst is processed so that any
+    // control packets sent in response go out in one TX burst.
+    EXPECT_CALL(mockDriver, cork).Times(1);
+    EXPECT_CALL(mockDriver, uncork).Times(1);
+
     EXPECT_CALL(mockDriver, receivePackets)
         .WillOnce(DoAll(SetArrayArgument<1>(packets, packets + 8), Return(8)));
 
-    transport->processPackets();
+    transport->processPackets(32);
+}
+
+TEST_F(TransportImplTest, processPackets_piggybackGrant)
+{
+    char payload[1024];
+    Homa::Driver::Packet* packets[1];
+
+    // Set DATA packet carrying a piggybacked grant.
+    Protocol::MessageId grantId(42, 33);
+    Homa::Mock::MockDriver::MockPacket dataPacket{payload, 1024};
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload);
+    header->common.opcode = Protocol::Packet::DATA;
+    header->piggybackGrant = 1;
+    header->grantId = grantId;
+    header->grantByteLimit = 5000;
+    header->grantPriority = 2;
+    packets[0] = &dataPacket;
+    EXPECT_CALL(*mockReceiver, handleDataPacket(Eq(&dataPacket), _));
+    EXPECT_CALL(*mockSender, applyGrant(Eq(grantId), Eq(5000), Eq(2)));
+
+    EXPECT_CALL(mockDriver, receivePackets)
+        .WillOnce(DoAll(SetArrayArgument<1>(packets, packets + 1), Return(1)));
+
+    transport->processPackets(32);
+}
+
+TEST_F(TransportImplTest, dispatchPackets)
+{
+    char payload[4][1024];
+    Homa::Driver::Packet* packets[4];
+
+    // Set DATA packet
+    Homa::Mock::MockDriver::MockPacket dataPacket{payload[0], 1024};
+    static_cast<Protocol::Packet::DataHeader*>(dataPacket.payload)
+        ->common.opcode = Protocol::Packet::DATA;
+    packets[0] = &dataPacket;
+
+    // Set GRANT packet
+    Homa::Mock::MockDriver::MockPacket grantPacket{payload[1], 1024};
+    static_cast<Protocol::Packet::GrantHeader*>(grantPacket.payload)
+        ->common.opcode = Protocol::Packet::GRANT;
+    packets[1] = &grantPacket;
+
+    // Set BUSY packet
+    Homa::Mock::MockDriver::MockPacket busyPacket{payload[2], 1024};
+    static_cast<Protocol::Packet::PingHeader*>(busyPacket.payload)
+        ->common.opcode = Protocol::Packet::BUSY;
+    packets[2] = &busyPacket;
+
+    // Set ERROR packet
+    Homa::Mock::MockDriver::MockPacket errorPacket{payload[3], 1024};
+    static_cast<Protocol::Packet::ErrorHeader*>(errorPacket.payload)
+        ->common.opcode = Protocol::Packet::ERROR;
+    packets[3] = &errorPacket;
+
+    // No packets are handled during dispatch; the stage threads do that.
+    EXPECT_CALL(*mockReceiver, handleDataPacket).Times(0);
+    EXPECT_CALL(*mockSender, handleGrantPacket).Times(0);
+
+    EXPECT_CALL(mockDriver, receivePackets)
+        .WillOnce(DoAll(SetArrayArgument<1>(packets, packets + 4), Return(4)));
+
+    transport->dispatchPackets();
+
+    TransportImpl::PacketEnvelope envelope;
+    EXPECT_TRUE(transport->senderIngress.tryPop(&envelope));
+    EXPECT_EQ(&grantPacket, envelope.packet);
+    EXPECT_TRUE(transport->senderIngress.tryPop(&envelope));
+    EXPECT_EQ(&errorPacket, envelope.packet);
+    EXPECT_FALSE(transport->senderIngress.tryPop(&envelope));
+
+    EXPECT_TRUE(transport->receiverIngress.tryPop(&envelope));
+    EXPECT_EQ(&dataPacket, envelope.packet);
+    EXPECT_TRUE(transport->receiverIngress.tryPop(&envelope));
+    EXPECT_EQ(&busyPacket, envelope.packet);
+    EXPECT_FALSE(transport->receiverIngress.tryPop(&envelope));
 }
 
 }  // namespace
@@ -72,8 +72,8 @@ basicHeader()
     return "median       min       p90       p99      p999     description";
 }
 
-std::string
-basic(std::vector<Latency>& times, const std::string description)
+TimeDist
+getTimeDist(std::vector<Latency>& times)
 {
     int count = times.size();
     std::sort(times.begin(), times.end());
@@ -106,6 +106,14 @@ basic(std::vector<Latency>& times, const std::string description)
         dist.p999 = dist.p99;
     }
 
+    return dist;
+}
+
+std::string
+basic(std::vector<Latency>& times, const std::string description)
+{
+    TimeDist dist = getTimeDist(times);
+
     std::string output = "";
     output += format("%9s", formatTime(dist.p50).c_str());
     output += format(" %9s", formatTime(dist.min).c_str());
@@ -117,4 +125,19 @@ basic(std::vector<Latency>& times, const std::string description)
     return output;
 }
 
+std::string
+csvHeader()
+{
+    return "min_s,p50_s,p90_s,p99_s,p999_s";
+}
+
+std::string
+csv(std::vector<Latency>& times)
+{
+    TimeDist dist = getTimeDist(times);
+    return format("%.9f,%.9f,%.9f,%.9f,%.9f", dist.min.count(),
+                  dist.p50.count(), dist.p90.count(), dist.p99.count(),
+                  dist.p999.count());
+}
+
 }  // namespace Output
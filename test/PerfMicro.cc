@@ -0,0 +1,381 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Cycles.h"
+#include "Homa/Debug.h"
+#include "Mock/MockDriver.h"
+#include "Mock/MockPolicy.h"
+#include "Receiver.h"
+#include "Sender.h"
+#include "SpinLock.h"
+#include "TransportImpl.h"
+#include "docopt.h"
+
+using ::testing::NiceMock;
+using ::testing::Return;
+
+static const char USAGE[] = R"(Transport Hot-Path Micro-Benchmark
+
+Measures individual transport hot-path functions in isolation (driver calls
+are mocked out) so that optimization work on these paths has a stable
+baseline that doesn't depend on end-to-end test behavior.  This binary is
+compiled with -fno-access-control so that benchmarks can set up internal
+Sender/Receiver state directly, the same way the unit tests do.
+
+Usage:
+    perf_micro run [TEST ...]
+    perf_micro list
+    perf_micro info TEST ...
+
+Arguments:
+    TEST
+
+Commands:
+    run     Execute a set of benchmark tests
+    list    Print the available benchmark tests
+    info    Show the long description of a test
+
+Options:
+    -h --help       Show this screen
+)";
+
+// This struct contains information about a particular test that can be
+// displayed to the user.
+struct TestInfo {
+    const char* name;         // Name of the performance test; this is what gets
+                              // typed on the command line to run the test.
+    const char* description;  // Short description of this test (not more than
+                              // about 40 characters, so the entire test output
+                              // fits on a single line).
+    const char* docs;         // Longer more detailed documentation for this
+                              // test (can contain multiple lines but each line
+                              // should be less than 72 characters long).
+};
+
+TestInfo spinLockTestInfo = {
+    "spinLock", "Acquire and release an uncontended SpinLock",
+    R"(Measure the cost of a SpinLock lock()/unlock() pair with no other
+thread contending for the lock.  This bounds the overhead every
+MessageBucket and sendQueue access pays on the fast path.)"};
+double
+spinLockTest()
+{
+    int count = 1000000;
+    Homa::SpinLock lock;
+    uint64_t start = PerfUtils::Cycles::rdtscp();
+    for (int i = 0; i < count; i++) {
+        lock.lock();
+        lock.unlock();
+    }
+    uint64_t stop = PerfUtils::Cycles::rdtscp();
+    return PerfUtils::Cycles::toSeconds(stop - start) / count;
+}
+
+TestInfo senderTrySendTestInfo = {
+    "senderTrySend", "One Sender::trySend() pass sending 4 packets",
+    R"(Measure the cost of a Sender::trySend() call that releases 4 granted
+packets of a queued multi-packet message.  The driver is mocked (packet
+transmission is free) and its reported bandwidth is set high enough
+that the pacer never throttles, so the number reflects the sender's
+own queue, pacer, and bookkeeping overhead per pass.)"};
+double
+senderTrySendTest()
+{
+    const int count = 100000;
+    const int NUM_PACKETS = 8;
+    const int PACKETS_GRANTED = 4;
+
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    NiceMock<Homa::Mock::MockPolicyManager> mockPolicyManager(&mockDriver);
+    // Report a very high link bandwidth so the pacer always releases.
+    ON_CALL(mockDriver, getBandwidth).WillByDefault(Return(10000000));
+    ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1031));
+    ON_CALL(mockDriver, getQueuedBytes).WillByDefault(Return(0));
+    Homa::Core::Sender sender(22, &mockDriver, &mockPolicyManager, 1000, 100);
+
+    // Queue a message with more packets than will ever be granted so that
+    // the message stays in the sendQueue for the whole measurement.
+    Homa::Protocol::MessageId id(42, 1);
+    Homa::Core::Sender::Message* message =
+        dynamic_cast<Homa::Core::Sender::Message*>(sender.allocMessage(0));
+    message->id = id;
+    message->state = Homa::OutMessage::Status::IN_PROGRESS;
+    {
+        Homa::Core::Sender::MessageBucket* bucket =
+            sender.messageBuckets.getBucket(id);
+        Homa::SpinLock::Lock lock_bucket(bucket->mutex);
+        bucket->addMessage(message, lock_bucket);
+    }
+    const uint32_t PACKET_SIZE = mockDriver.getMaxPayloadSize();
+    const uint32_t PACKET_DATA_SIZE =
+        PACKET_SIZE - message->TRANSPORT_HEADER_LENGTH;
+    char payload[PACKET_SIZE];
+    Homa::Mock::MockDriver::MockPacket* packets[NUM_PACKETS];
+    for (int i = 0; i < NUM_PACKETS; ++i) {
+        packets[i] = new Homa::Mock::MockDriver::MockPacket{payload};
+        packets[i]->length = PACKET_SIZE;
+        message->packets.set(i, packets[i]);
+        message->numPackets++;
+    }
+    Homa::Core::Sender::QueuedMessageInfo* info = &message->queuedMessageInfo;
+    info->id = id;
+    info->destination = message->destination;
+    info->packets = message;
+    info->unsentBytes = NUM_PACKETS * PACKET_DATA_SIZE;
+    info->packetsGranted = PACKETS_GRANTED;
+    info->packetsSent = 0;
+    {
+        Homa::SpinLock::Lock lock_queue(sender.sendShards[0].queueMutex);
+        sender.sendShards[0].sendQueue.insert(&info->sendQueueNode);
+    }
+
+    uint64_t start = PerfUtils::Cycles::rdtscp();
+    for (int i = 0; i < count; i++) {
+        info->packetsSent = 0;
+        info->unsentBytes = NUM_PACKETS * PACKET_DATA_SIZE;
+        sender.sendShards[0].sendReady = true;
+        sender.trySend();
+    }
+    uint64_t stop = PerfUtils::Cycles::rdtscp();
+
+    {
+        Homa::SpinLock::Lock lock_queue(sender.sendShards[0].queueMutex);
+        sender.sendShards[0].sendQueue.remove(&info->sendQueueNode);
+    }
+    message->release();
+    for (int i = 0; i < NUM_PACKETS; ++i) {
+        delete packets[i];
+    }
+    return PerfUtils::Cycles::toSeconds(stop - start) / count;
+}
+
+TestInfo receiverHandleDataPacketTestInfo = {
+    "receiverHandleDataPacket", "Receive one single-packet message",
+    R"(Measure the cost of Receiver::handleDataPacket() ingesting a fresh
+single-packet (unscheduled) message, plus popping the completed message
+with receiveMessage() and dropping it.  The driver is mocked, so the
+number reflects the receiver's bucket insertion, completion, and
+message construction/destruction overhead.)"};
+double
+receiverHandleDataPacketTest()
+{
+    const int count = 100000;
+
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    NiceMock<Homa::Mock::MockPolicyManager> mockPolicyManager(&mockDriver);
+    ON_CALL(mockDriver, getBandwidth).WillByDefault(Return(10000000));
+    ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1027));
+    ON_CALL(mockDriver, getQueuedBytes).WillByDefault(Return(0));
+    Homa::Core::Receiver receiver(&mockDriver, &mockPolicyManager, 1000, 100);
+
+    const uint16_t HEADER_SIZE = sizeof(Homa::Protocol::Packet::DataHeader);
+    const uint32_t MESSAGE_LENGTH = 1000;
+    char payload[1028];
+    Homa::Mock::MockDriver::MockPacket packet{payload};
+    Homa::Protocol::Packet::DataHeader* header =
+        static_cast<Homa::Protocol::Packet::DataHeader*>(packet.payload);
+    header->common.opcode = Homa::Protocol::Packet::DATA;
+    header->totalLength = MESSAGE_LENGTH;
+    header->policyVersion = 1;
+    header->unscheduledIndexLimit = 1;
+    header->index = 0;
+    packet.length = HEADER_SIZE + MESSAGE_LENGTH;
+    Homa::IpAddress sourceIp{22};
+
+    uint64_t start = PerfUtils::Cycles::rdtscp();
+    for (int i = 0; i < count; i++) {
+        header->common.messageId = Homa::Protocol::MessageId(42, i);
+        receiver.handleDataPacket(&packet, sourceIp);
+        Homa::unique_ptr<Homa::InMessage> message(receiver.receiveMessage());
+    }
+    uint64_t stop = PerfUtils::Cycles::rdtscp();
+    return PerfUtils::Cycles::toSeconds(stop - start) / count;
+}
+
+TestInfo pollBackoffPauseTestInfo = {
+    "pollBackoffPause", "Deepest adaptive poll backoff pause",
+    R"(Measure one TransportImpl::pollBackoff() call at the deepest rung of
+the adaptive poll pause ladder (see Transport::setAdaptivePolling()).
+This is the worst-case latency the pause ladder adds before an idle
+transport notices newly arrived traffic.  The mocked driver reports no
+receive-event support, so every call runs the full pause spin; with a
+driver that can sleep on RX interrupts the wake-up cost is instead the
+NIC interrupt plus epoll wake-up path, which a mocked driver cannot
+measure.)"};
+double
+pollBackoffPauseTest()
+{
+    const int count = 10000;
+
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    ON_CALL(mockDriver, getBandwidth).WillByDefault(Return(10000));
+    ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1027));
+    ON_CALL(mockDriver, getQueuedBytes).WillByDefault(Return(0));
+    Homa::Core::TransportImpl transport(&mockDriver, 42);
+
+    transport.setAdaptivePolling(true);
+    // Park the backoff ladder at its deepest rung.
+    transport.idlePollCount =
+        Homa::Core::TransportImpl::IDLE_POLLS_BEFORE_SLEEP + 1;
+
+    uint64_t start = PerfUtils::Cycles::rdtscp();
+    for (int i = 0; i < count; i++) {
+        transport.pollBackoff();
+    }
+    uint64_t stop = PerfUtils::Cycles::rdtscp();
+    return PerfUtils::Cycles::toSeconds(stop - start) / count;
+}
+
+/**
+ * This struct holds static information about a test as well as the function
+ * that will run the test.
+ */
+struct TestCase {
+    double (*func)();  // Runs a test and returns the average time per op.
+    TestInfo* info;    // Information about the test.
+};
+
+TestCase tests[] = {
+    {spinLockTest, &spinLockTestInfo},
+    {senderTrySendTest, &senderTrySendTestInfo},
+    {receiverHandleDataPacketTest, &receiverHandleDataPacketTestInfo},
+    {pollBackoffPauseTest, &pollBackoffPauseTestInfo},
+};
+
+/**
+ * Runs a particular test and prints a one-line result message.
+ *
+ * @param test
+ *      Describes the test to run.
+ */
+void
+runTest(TestCase& test)
+{
+    double secs = test.func();
+    std::cout << std::left << std::setw(26) << test.info->name;
+    std::cout << std::right << std::setw(8) << std::setprecision(2)
+              << std::fixed;
+    if (secs < 1.0e-06) {
+        std::cout << 1e09 * secs << "ns";
+    } else if (secs < 1.0e-03) {
+        std::cout << 1e06 * secs << "us";
+    } else if (secs < 1.0) {
+        std::cout << 1e03 * secs << "ms";
+    } else {
+        std::cout << secs << "s ";
+    }
+    std::cout << std::setw(13) << "" << test.info->description;
+    std::cout << std::endl;
+}
+
+/**
+ * Print short listing of a particular test.
+ *
+ * @param test
+ *      Describes the test to list.
+ */
+void
+listTest(TestCase& test)
+{
+    std::cout << std::left << std::setw(29) << test.info->name
+              << test.info->description << std::endl;
+}
+
+/**
+ * Print the documentation of a particular test.
+ *
+ * @param test
+ *      Describes the test whose documentation should be printed.
+ */
+void
+infoTest(TestCase& test)
+{
+    std::cout << "Test Name: " << test.info->name << std::endl << std::endl;
+    std::cout << "    " << test.info->description << std::endl << std::endl;
+    std::istringstream docs(test.info->docs);
+    std::string docLine;
+    while (std::getline(docs, docLine)) {
+        std::cout << "    " << docLine << std::endl;
+    }
+    std::cout << std::endl;
+}
+
+int
+main(int argc, char* argv[])
+{
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(USAGE, {argv + 1, argv + argc},
+                       true,  // show help if requested
+                       "perf_micro (Transport Micro-Benchmark)");
+
+    // The benchmarks exercise internal error paths on purpose; keep the log
+    // quiet so timing loops aren't dominated by logging.
+    Homa::Debug::setLogPolicy(Homa::Debug::logPolicyFromString("ERROR"));
+
+    if (args["run"].asBool()) {
+        if (args["TEST"].asStringList().empty()) {
+            // Run all tests if no TEST is specified.
+            for (TestCase& test : tests) {
+                runTest(test);
+            }
+        } else {
+            // Look for and run only the specified TESTs.
+            bool foundTest = false;
+            for (TestCase& test : tests) {
+                for (auto const& testName : args["TEST"].asStringList()) {
+                    if (std::strstr(test.info->name, testName.c_str()) !=
+                        NULL) {
+                        foundTest = true;
+                        runTest(test);
+                        break;
+                    }
+                }
+            }
+            if (!foundTest) {
+                std::cout << "No test found matching the given arguments"
+                          << std::endl;
+            }
+        }
+    } else if (args["list"].asBool()) {
+        for (TestCase& test : tests) {
+            listTest(test);
+        }
+    } else if (args["info"].asBool()) {
+        bool foundTest = false;
+        for (TestCase& test : tests) {
+            for (auto const& testName : args["TEST"].asStringList()) {
+                if (std::strstr(test.info->name, testName.c_str()) != NULL) {
+                    foundTest = true;
+                    infoTest(test);
+                    break;
+                }
+            }
+        }
+        if (!foundTest) {
+            std::cout << "No test found matching the given arguments"
+                      << std::endl;
+        }
+    }
+
+    return 0;
+}
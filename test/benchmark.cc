@@ -0,0 +1,397 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Homa/Debug.h>
+#include <Homa/Drivers/Fake/FakeDriver.h>
+#include <Homa/Homa.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Output.h"
+#include "docopt.h"
+
+static const char USAGE[] = R"(Homa Transport Benchmark.
+
+    Measures end-to-end message latency and goodput over the FakeDriver so
+    that transport-level performance regressions can be caught without real
+    NICs.  Latency is measured from OutMessage::send() until the message
+    reaches Status::COMPLETED (i.e. the full delivery/acknowledgment
+    round-trip).
+
+    Usage:
+        benchmark sweep [options]
+        benchmark load [options]
+        benchmark incast [options]
+        benchmark (-h | --help)
+        benchmark --version
+
+    Commands:
+        sweep    Closed-loop latency measurement across a range of message
+                 sizes (each client keeps exactly one message outstanding).
+        load     Open-loop measurement; each client sends messages of a fixed
+                 size with Poisson arrivals at a configured offered load.
+        incast   Every client bursts all of its messages at a single server
+                 at once, stressing the receive-side grant scheduler.
+
+    Options:
+        -h --help        Show this screen.
+        --version        Show version.
+        --minSize=<n>    Smallest payload for the size sweep [default: 64].
+        --maxSize=<n>    Largest payload for the size sweep [default: 1048576].
+        --size=<n>       Payload in bytes for load and incast [default: 1024].
+        --count=<n>      Messages measured per client [default: 1000].
+        --clients=<n>    Number of client (sender) threads [default: 1].
+        --servers=<n>    Number of virtual servers [default: 1].
+        --load=<f>       Total offered load in Gbit/s for load [default: 1.0].
+        --lossRate=<f>   Rate at which packets are lost [default: 0.0].
+        --csv            Emit results as CSV instead of a table.
+)";
+
+struct MessageHeader {
+    uint64_t id;
+    uint64_t length;
+} __attribute__((packed));
+
+struct Node {
+    explicit Node(uint64_t id)
+        : id(id)
+        , driver()
+        , transport(Homa::Transport::create(&driver, id))
+        , thread()
+        , run(false)
+    {}
+
+    const uint64_t id;
+    Homa::Drivers::Fake::FakeDriver driver;
+    Homa::Transport* transport;
+    std::thread thread;
+    std::atomic<bool> run;
+};
+
+/**
+ * Everything a single client thread measured.
+ */
+struct ClientResult {
+    /// Per-message completion latencies.
+    std::vector<Output::Latency> times;
+    /// Payload bytes successfully delivered.
+    uint64_t bytesDelivered = 0;
+    /// Number of messages that reached Status::FAILED.
+    int numFailed = 0;
+};
+
+/// Barrier used to release all client threads at the same time so that
+/// goodput is measured over a window where every client is active.
+static std::atomic<int> clientsReady(0);
+static std::atomic<bool> clientsGo(false);
+
+void
+serverMain(Node* server)
+{
+    while (true) {
+        if (server->run.load() == false) {
+            break;
+        }
+
+        Homa::unique_ptr<Homa::InMessage> message =
+            server->transport->receive();
+
+        if (message) {
+            MessageHeader header;
+            message->get(0, &header, sizeof(MessageHeader));
+            char buf[header.length];
+            message->get(sizeof(MessageHeader), &buf, header.length);
+            message->acknowledge();
+        }
+        server->transport->poll();
+    }
+}
+
+/**
+ * Send and time a batch of messages from a single client.
+ *
+ * @param client
+ *      The node from which messages should be sent.
+ * @param addresses
+ *      Addresses of the available servers; destinations are chosen uniformly
+ *      at random.
+ * @param count
+ *      Number of messages to send.
+ * @param size
+ *      Payload bytes per message (excluding the MessageHeader).
+ * @param arrivalRate
+ *      Open-loop message arrival rate in messages per second; successive
+ *      sends are separated by exponentially distributed (Poisson) gaps.  A
+ *      negative rate means closed-loop: wait for each message to complete
+ *      before sending the next.  A rate of zero means burst: send everything
+ *      back-to-back and then drain.
+ * @param[out] result
+ *      Filled with the latencies and counts this client measured.
+ */
+void
+clientMain(Node* client, std::vector<Homa::IpAddress> addresses, int count,
+           int size, double arrivalRate, ClientResult* result)
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_int_distribution<> randAddr(0, addresses.size() - 1);
+    std::uniform_int_distribution<char> randData(0);
+    std::exponential_distribution<double> randGap(
+        arrivalRate > 0 ? arrivalRate : 1.0);
+
+    std::vector<char> payload(size);
+    for (int i = 0; i < size; ++i) {
+        payload[i] = randData(gen);
+    }
+
+    result->times.reserve(count);
+
+    // In-flight messages, oldest first.
+    struct Pending {
+        Homa::unique_ptr<Homa::OutMessage> message;
+        Clock::time_point start;
+    };
+    std::deque<Pending> pending;
+
+    // Reaps completed and failed messages off the pending queue.
+    auto reap = [&]() {
+        for (auto it = pending.begin(); it != pending.end();) {
+            Homa::OutMessage::Status status = it->message->getStatus();
+            if (status == Homa::OutMessage::Status::COMPLETED) {
+                result->times.emplace_back(Clock::now() - it->start);
+                result->bytesDelivered += size;
+                it = pending.erase(it);
+            } else if (status == Homa::OutMessage::Status::FAILED) {
+                result->numFailed++;
+                it = pending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    };
+
+    // Wait until every client thread is constructed and ready to send.
+    clientsReady.fetch_add(1);
+    while (!clientsGo.load()) {
+        std::this_thread::yield();
+    }
+
+    uint64_t nextId = 0;
+    Clock::time_point nextSend = Clock::now();
+    for (int i = 0; i < count; ++i) {
+        while (arrivalRate > 0 && Clock::now() < nextSend) {
+            client->transport->poll();
+            reap();
+        }
+
+        Homa::IpAddress destAddress = addresses[randAddr(gen)];
+        Homa::unique_ptr<Homa::OutMessage> message = client->transport->alloc(0);
+        {
+            MessageHeader header;
+            header.id = nextId++;
+            header.length = size;
+            message->append(&header, sizeof(MessageHeader));
+            message->append(payload.data(), size);
+        }
+        message->send(Homa::SocketAddress{destAddress, 60001});
+        pending.push_back({std::move(message), Clock::now()});
+        if (arrivalRate > 0) {
+            nextSend += std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(randGap(gen)));
+        }
+
+        while (arrivalRate < 0 && !pending.empty()) {
+            client->transport->poll();
+            reap();
+        }
+    }
+
+    // Drain any messages still in flight.
+    while (!pending.empty()) {
+        client->transport->poll();
+        reap();
+    }
+}
+
+/**
+ * Run one benchmark data point and print its result line.
+ *
+ * @param pattern
+ *      Name of the traffic pattern being run ("sweep", "load", or "incast").
+ * @param numClients
+ *      Number of concurrent client threads.
+ * @param addresses
+ *      Addresses of the running servers.
+ * @param count
+ *      Messages sent per client.
+ * @param size
+ *      Payload bytes per message.
+ * @param offeredGbps
+ *      Total offered load in Gbit/s across all clients; 0 for closed-loop
+ *      and burst patterns.
+ * @param csv
+ *      True means emit a CSV record; false means a human-readable line.
+ * @return
+ *      Number of messages that failed.
+ */
+int
+runDataPoint(const char* pattern, int numClients,
+             std::vector<Homa::IpAddress> addresses, int count, int size,
+             double offeredGbps, bool csv)
+{
+    using Clock = std::chrono::steady_clock;
+
+    double arrivalRate = -1.0;
+    if (offeredGbps > 0) {
+        // Convert the per-client share of the offered load into an arrival
+        // rate over whole messages.
+        double bitsPerMessage = 8.0 * size;
+        arrivalRate = (offeredGbps * 1.0e9 / numClients) / bitsPerMessage;
+    } else if (std::string(pattern) == "incast") {
+        arrivalRate = 0.0;
+    }
+
+    std::vector<std::unique_ptr<Node>> clients;
+    std::vector<ClientResult> results(numClients);
+    clientsReady.store(0);
+    clientsGo.store(false);
+    for (int i = 0; i < numClients; ++i) {
+        clients.emplace_back(new Node(1 + i));
+    }
+    for (int i = 0; i < numClients; ++i) {
+        clients[i]->thread =
+            std::thread(&clientMain, clients[i].get(), addresses, count, size,
+                        arrivalRate, &results[i]);
+    }
+    while (clientsReady.load() < numClients) {
+        std::this_thread::yield();
+    }
+    Clock::time_point start = Clock::now();
+    clientsGo.store(true);
+    for (int i = 0; i < numClients; ++i) {
+        clients[i]->thread.join();
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    std::vector<Output::Latency> times;
+    uint64_t bytesDelivered = 0;
+    int numFailed = 0;
+    for (ClientResult& result : results) {
+        times.insert(times.end(), result.times.begin(), result.times.end());
+        bytesDelivered += result.bytesDelivered;
+        numFailed += result.numFailed;
+    }
+    double goodputGbps = 8.0 * bytesDelivered / 1.0e9 / elapsed.count();
+
+    if (times.empty()) {
+        std::cerr << "No messages completed (" << numFailed << " failed)"
+                  << std::endl;
+        return numFailed;
+    }
+
+    if (csv) {
+        std::cout << Output::format("%s,%d,%lu,%d,%d,%.3f,%.3f,", pattern,
+                                    numClients, addresses.size(), size, count,
+                                    offeredGbps, goodputGbps)
+                  << Output::csv(times) << std::endl;
+    } else {
+        std::cout << Output::basic(
+                         times,
+                         Output::format("%s: %d B, %d client(s), %.3f Gbps",
+                                        pattern, size, numClients,
+                                        goodputGbps))
+                  << std::endl;
+    }
+    return numFailed;
+}
+
+int
+main(int argc, char* argv[])
+{
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(USAGE, {argv + 1, argv + argc},
+                       true,                       // show help if requested
+                       "Homa Transport Benchmark");  // version string
+
+    int minSize = args["--minSize"].asLong();
+    int maxSize = args["--maxSize"].asLong();
+    int size = args["--size"].asLong();
+    int count = args["--count"].asLong();
+    int numClients = args["--clients"].asLong();
+    int numServers = args["--servers"].asLong();
+    double offeredGbps = atof(args["--load"].asString().c_str());
+    double packetLossRate = atof(args["--lossRate"].asString().c_str());
+    bool csv = args["--csv"].asBool();
+
+    Homa::Debug::setLogPolicy(Homa::Debug::logPolicyFromString("ERROR"));
+    Homa::Drivers::Fake::FakeNetworkConfig::setPacketLossRate(packetLossRate);
+
+    uint64_t nextServerId = 101;
+    std::vector<Homa::IpAddress> addresses;
+    std::vector<std::unique_ptr<Node>> servers;
+    for (int i = 0; i < numServers; ++i) {
+        servers.emplace_back(new Node(nextServerId++));
+        addresses.emplace_back(servers.back()->driver.getLocalAddress());
+    }
+    for (auto& server : servers) {
+        server->run = true;
+        server->thread = std::thread(&serverMain, server.get());
+    }
+
+    if (csv) {
+        std::cout << "pattern,clients,servers,size_bytes,messages_per_client,"
+                     "offered_gbps,goodput_gbps,"
+                  << Output::csvHeader() << std::endl;
+    } else {
+        std::cout << Output::basicHeader() << std::endl;
+    }
+
+    int numFailed = 0;
+    if (args["sweep"].asBool()) {
+        for (int sweepSize = minSize; sweepSize <= maxSize; sweepSize *= 4) {
+            numFailed += runDataPoint("sweep", numClients, addresses, count,
+                                      sweepSize, 0.0, csv);
+        }
+    } else if (args["load"].asBool()) {
+        numFailed += runDataPoint("load", numClients, addresses, count, size,
+                                  offeredGbps, csv);
+    } else if (args["incast"].asBool()) {
+        // All clients target a single server.
+        std::vector<Homa::IpAddress> target(1, addresses.front());
+        numFailed += runDataPoint("incast", numClients, target, count, size,
+                                  0.0, csv);
+    }
+
+    for (auto& server : servers) {
+        server->run = false;
+        server->thread.join();
+    }
+
+    if (numFailed > 0) {
+        std::cerr << numFailed << " messages failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
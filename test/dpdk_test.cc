@@ -13,10 +13,12 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
 #include <Homa/Drivers/DPDK/DpdkDriver.h>
+#include <Homa/Util.h>
 #include <Cycles.h>
 #include <TimeTrace.h>
 #include <docopt.h>
@@ -27,13 +29,115 @@ static const char USAGE[] = R"(DPDK Driver Test.
 
     Usage:
         dpdk_test [options] <iface> (--server | <server_ip>)
+        dpdk_test pktgen [options] <iface> (--sink | <server_ip>)
+
+    Modes:
+        (default)   Ping-pong a single packet and report round-trip latency.
+        pktgen      Saturate TX with pre-built packets (bypassing the
+                    transport) and report the pps/bandwidth ceiling for a
+                    range of burst sizes; run with --sink on the other host
+                    to count received packets and compute the drop rate.
 
     Options:
         -h --help           Show this screen.
         --version           Show version.
         --timetrace         Enable TimeTrace output [default: false].
+        --size=<n>          Payload bytes per pktgen packet [default: 100].
+        --maxBurst=<n>      Largest TX burst size in the sweep [default: 64].
+        --seconds=<f>       Seconds measured per burst size [default: 1.0].
 )";
 
+/**
+ * Blast packets at the given target as fast as the driver will take them,
+ * doubling the TX burst size each round, and report the sustained packet and
+ * bit rates.  Packets carry a sequence number so that a --sink receiver can
+ * compute the drop rate.
+ */
+void
+pktgenTx(Homa::Driver* driver, Homa::IpAddress target, uint32_t size,
+         int maxBurst, double seconds)
+{
+    size = std::max(size, Homa::Util::downCast<uint32_t>(sizeof(uint64_t)));
+    size = std::min(size, driver->getMaxPayloadSize());
+    uint64_t sequence = 0;
+    std::cout << "   burst         pps        Gbps" << std::endl;
+    for (int burst = 1; burst <= maxBurst; burst *= 2) {
+        uint64_t sent = 0;
+        uint64_t startCycles = PerfUtils::Cycles::rdtsc();
+        uint64_t stopCycles =
+            startCycles + PerfUtils::Cycles::fromSeconds(seconds);
+        while (PerfUtils::Cycles::rdtsc() < stopCycles) {
+            driver->cork();
+            for (int i = 0; i < burst; ++i) {
+                Homa::Driver::Packet* packet = driver->allocPacket();
+                *static_cast<uint64_t*>(packet->payload) = sequence++;
+                packet->length = size;
+                driver->sendPacket(packet, target, 0);
+                driver->releasePackets(&packet, 1);
+            }
+            driver->uncork();
+            sent += burst;
+        }
+        double elapsed = PerfUtils::Cycles::toSeconds(
+            PerfUtils::Cycles::rdtsc() - startCycles);
+        std::cout << Output::format("%8d  %10.0f  %10.3f", burst,
+                                    sent / elapsed,
+                                    8.0 * sent * size / elapsed / 1.0e9)
+                  << std::endl;
+    }
+}
+
+/**
+ * Count packets arriving from a pktgen sender and report the receive rate
+ * and drop rate once per second.  The drop rate is computed from the gap
+ * between the highest sequence number seen and the number of packets that
+ * actually arrived.
+ */
+void
+pktgenSink(Homa::Driver* driver)
+{
+    const uint32_t MAX_BURST = 64;
+    uint64_t received = 0;
+    uint64_t rxBytes = 0;
+    uint64_t maxSequence = 0;
+    uint64_t reportCycles =
+        PerfUtils::Cycles::rdtsc() + PerfUtils::Cycles::fromSeconds(1.0);
+    uint64_t lastReceived = 0;
+    uint64_t lastRxBytes = 0;
+    std::cout << "         pps        Gbps    drop rate" << std::endl;
+    while (true) {
+        Homa::Driver::Packet* incoming[MAX_BURST];
+        Homa::IpAddress srcAddrs[MAX_BURST];
+        uint32_t receivedPackets =
+            driver->receivePackets(MAX_BURST, incoming, srcAddrs);
+        for (uint32_t i = 0; i < receivedPackets; ++i) {
+            uint64_t sequence = *static_cast<uint64_t*>(incoming[i]->payload);
+            maxSequence = std::max(maxSequence, sequence);
+            rxBytes += incoming[i]->length;
+        }
+        received += receivedPackets;
+        if (receivedPackets > 0) {
+            driver->releasePackets(incoming, receivedPackets);
+        }
+        if (PerfUtils::Cycles::rdtsc() >= reportCycles) {
+            if (received > lastReceived) {
+                double dropRate =
+                    1.0 - static_cast<double>(received) /
+                              static_cast<double>(maxSequence + 1);
+                std::cout << Output::format("%12lu  %10.3f  %11.6f",
+                                            received - lastReceived,
+                                            8.0 * (rxBytes - lastRxBytes) /
+                                                1.0e9,
+                                            dropRate)
+                          << std::endl;
+            }
+            lastReceived = received;
+            lastRxBytes = rxBytes;
+            reportCycles += PerfUtils::Cycles::fromSeconds(1.0);
+        }
+    }
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -43,14 +147,31 @@ main(int argc, char* argv[])
                     "DPDK Driver Test");        // version string
 
     std::string iface = args["<iface>"].asString();
+    bool isPktgen = args["pktgen"].asBool();
     bool isServer = args["--server"].asBool();
+    bool isSink = args["--sink"].asBool();
     std::string server_ip_string;
-    if (!isServer) {
+    if (!isServer && !isSink) {
         server_ip_string = args["<server_ip>"].asString();
     }
 
     Homa::Drivers::DPDK::DpdkDriver driver(iface.c_str());
 
+    if (isPktgen) {
+        if (isSink) {
+            std::cout << Homa::IpAddress::toString(driver.getLocalAddress())
+                      << std::endl;
+            pktgenSink(&driver);
+        } else {
+            pktgenTx(&driver,
+                     Homa::IpAddress::fromString(server_ip_string.c_str()),
+                     Homa::Util::downCast<uint32_t>(args["--size"].asLong()),
+                     static_cast<int>(args["--maxBurst"].asLong()),
+                     atof(args["--seconds"].asString().c_str()));
+        }
+        return 0;
+    }
+
     if (isServer) {
         std::cout << Homa::IpAddress::toString(driver.getLocalAddress())
                   << std::endl;
@@ -19,6 +19,7 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <chrono>
 #include <iostream>
 #include <memory>
 #include <random>
@@ -26,23 +27,37 @@
 #include <thread>
 #include <vector>
 
+#include "Output.h"
 #include "StringUtil.h"
 #include "docopt.h"
 
 static const char USAGE[] = R"(Homa System Test.
 
+    Exercises the transport end to end over the FakeDriver with configurable
+    loss, reorder, and delay injection, and reports the measured
+    completion-time distribution for each payload size.  Used to vet changes
+    to the retry machinery (e.g. Receiver::checkResendTimeouts(),
+    Sender::handleUnknownPacket()) for correctness and tail-latency impact
+    under adverse network conditions.
+
     Usage:
         system_test <count> [-v | -vv | -vvv | -vvvv] [options]
         system_test (-h | --help)
         system_test --version
 
     Options:
-        -h --help       Show this screen.
-        --version       Show version.
-        -v --verbose    Show verbose output.
-        --servers=<n>   Number of virtual servers [default: 1].
-        --size=<n>      Number of bytes to send as a payload [default: 10].
-        --lossRate=<f>  Rate at which packets are lost [default: 0.0].
+        -h --help           Show this screen.
+        --version           Show version.
+        -v --verbose        Show verbose output.
+        --servers=<n>       Number of virtual servers [default: 1].
+        --sizes=<list>      Comma-separated payload sizes to test
+                            [default: 10].
+        --lossRate=<f>      Rate at which packets are lost [default: 0.0].
+        --reorderRate=<f>   Rate at which packets are transposed with their
+                            successor [default: 0.0].
+        --delay=<n>         One-way propagation delay in microseconds
+                            [default: 0].
+        --csv               Emit results as CSV instead of a table.
 )";
 
 bool _PRINT_CLIENT_ = false;
@@ -97,12 +112,28 @@ serverMain(Node* server, std::vector<Homa::IpAddress> addresses)
 }
 
 /**
+ * Send count messages of the given payload size one at a time, recording the
+ * completion time of each.
+ *
+ * @param count
+ *      Number of messages to send.
+ * @param size
+ *      Payload bytes per message (excluding the MessageHeader).
+ * @param addresses
+ *      Addresses of the available servers; destinations are chosen uniformly
+ *      at random.
+ * @param[out] times
+ *      Appended with the send-to-COMPLETED latency of every message that
+ *      completed.
  * @return
- *      Number of Op that failed.
+ *      Number of messages that failed.
  */
 int
-clientMain(int count, int size, std::vector<Homa::IpAddress> addresses)
+clientMain(int count, int size, std::vector<Homa::IpAddress> addresses,
+           std::vector<Output::Latency>* times)
 {
+    using Clock = std::chrono::steady_clock;
+
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> randAddr(0, addresses.size() - 1);
@@ -133,11 +164,13 @@ clientMain(int count, int size, std::vector<Homa::IpAddress> addresses)
                           << std::endl;
             }
         }
+        Clock::time_point start = Clock::now();
         message->send(Homa::SocketAddress{destAddress, 60001});
 
         while (1) {
             Homa::OutMessage::Status status = message->getStatus();
             if (status == Homa::OutMessage::Status::COMPLETED) {
+                times->emplace_back(Clock::now() - start);
                 break;
             } else if (status == Homa::OutMessage::Status::FAILED) {
                 numFailed++;
@@ -160,9 +193,17 @@ main(int argc, char* argv[])
     // Read in args.
     int numTests = args["<count>"].asLong();
     int numServers = args["--servers"].asLong();
-    int numBytes = args["--size"].asLong();
+    std::string sizeList = args["--sizes"].asString();
     int verboseLevel = args["--verbose"].asLong();
     double packetLossRate = atof(args["--lossRate"].asString().c_str());
+    double packetReorderRate = atof(args["--reorderRate"].asString().c_str());
+    int delayUs = args["--delay"].asLong();
+    bool csv = args["--csv"].asBool();
+
+    std::vector<int> sizes;
+    for (const std::string& token : Homa::StringUtil::split(sizeList, ',')) {
+        sizes.push_back(std::stoi(token));
+    }
 
     // level of verboseness
     bool printSummary = false;
@@ -183,6 +224,9 @@ main(int argc, char* argv[])
     }
 
     Homa::Drivers::Fake::FakeNetworkConfig::setPacketLossRate(packetLossRate);
+    Homa::Drivers::Fake::FakeNetworkConfig::setPacketReorderRate(
+        packetReorderRate);
+    Homa::Drivers::Fake::FakeNetworkConfig::setPropagationDelay(delayUs);
 
     uint64_t nextServerId = 101;
     std::vector<Homa::IpAddress> addresses;
@@ -199,7 +243,43 @@ main(int argc, char* argv[])
         server->thread = std::move(std::thread(&serverMain, server, addresses));
     }
 
-    int numFails = clientMain(numTests, numBytes, addresses);
+    if (csv) {
+        std::cout << "size_bytes,messages,completed,failed,loss_rate,"
+                     "reorder_rate,delay_us,"
+                  << Output::csvHeader() << std::endl;
+    } else {
+        std::cout << Output::basicHeader() << std::endl;
+    }
+
+    int numFails = 0;
+    for (int size : sizes) {
+        std::vector<Output::Latency> times;
+        times.reserve(numTests);
+        int numFailed = clientMain(numTests, size, addresses, &times);
+        numFails += numFailed;
+
+        if (times.empty()) {
+            std::cerr << "size " << size << ": no messages completed ("
+                      << numFailed << " failed)" << std::endl;
+            continue;
+        }
+        if (csv) {
+            std::cout << Output::format("%d,%d,%zu,%d,%g,%g,%d,", size,
+                                        numTests, times.size(), numFailed,
+                                        packetLossRate, packetReorderRate,
+                                        delayUs)
+                      << Output::csv(times) << std::endl;
+        } else {
+            std::cout << Output::basic(
+                             times,
+                             Output::format(
+                                 "%d B, loss %g, reorder %g, delay %d us"
+                                 " (%d failed)",
+                                 size, packetLossRate, packetReorderRate,
+                                 delayUs, numFailed))
+                      << std::endl;
+        }
+    }
 
     for (auto it = servers.begin(); it != servers.end(); ++it) {
         Node* server = *it;
@@ -209,7 +289,8 @@ main(int argc, char* argv[])
     }
 
     if (printSummary) {
-        std::cout << numTests << " Messages tested: " << numTests - numFails
+        std::cout << numTests * sizes.size()
+                  << " Messages tested: " << numTests * sizes.size() - numFails
                   << " completed, " << numFails << " failed" << std::endl;
     }
 